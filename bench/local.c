@@ -0,0 +1,164 @@
+// Compares request latency over loopback TCP and a Unix socket against a
+// running server. Each request is a fresh connection, as sidecars make them.
+//
+//   local [--requests N] [--path PATH] <tcp_port> <unix_path|@name>
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+enum {
+  DEFAULT_REQUESTS = 10000,
+  WARMUP_REQUESTS = 200,
+  RESPONSE_BUFFER = 64 * 1024,
+  REQUEST_MAX = 1024,
+};
+
+typedef struct {
+  struct sockaddr_storage addr;
+  socklen_t length;
+  const char *name;
+} target_t;
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static int compare(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a;
+  uint64_t y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+// Connect, send, read until the server closes. Returns bytes read or -1.
+static long request(const target_t *target, const char *text, size_t length) {
+  static char buffer[RESPONSE_BUFFER];
+  int fd = socket(target->addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  if (target->addr.ss_family == AF_INET) {
+    int one = 1;
+    (void)setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  }
+  long total = -1;
+  if (connect(fd, (const struct sockaddr *)&target->addr, target->length) ==
+          0 &&
+      write(fd, text, length) == (ssize_t)length) {
+    total = 0;
+    ssize_t got;
+    while ((got = read(fd, buffer, sizeof(buffer))) > 0) {
+      total += got;
+    }
+    if (got < 0) {
+      total = -1;
+    }
+  }
+  close(fd);
+  return total;
+}
+
+static int run(const target_t *target, const char *text, size_t length,
+               uint64_t *samples, int count) {
+  for (int i = 0; i < WARMUP_REQUESTS; i++) {
+    (void)request(target, text, length);
+  }
+
+  long bytes = 0;
+  uint64_t start = now_ns();
+  for (int i = 0; i < count; i++) {
+    uint64_t before = now_ns();
+    long got = request(target, text, length);
+    if (got < 0) {
+      fprintf(stderr, "%s: request %d failed: %s\n", target->name, i,
+              strerror(errno));
+      return -1;
+    }
+    bytes += got;
+    samples[i] = now_ns() - before;
+  }
+  double elapsed = (double)(now_ns() - start) / 1e9;
+
+  qsort(samples, (size_t)count, sizeof(*samples), compare);
+  printf("%-6s %9.0f req/s  p50 %7.1f us  p99 %7.1f us  max %8.1f us  "
+         "%ld B/req\n",
+         target->name, count / elapsed, (double)samples[count / 2] / 1e3,
+         (double)samples[count * 99 / 100] / 1e3,
+         (double)samples[count - 1] / 1e3, bytes / count);
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  int count = DEFAULT_REQUESTS;
+  const char *path = "/";
+  int arg = 1;
+  for (; arg + 1 < argc && argv[arg][0] == '-'; arg += 2) {
+    if (strcmp(argv[arg], "--requests") == 0) {
+      count = atoi(argv[arg + 1]);
+    } else if (strcmp(argv[arg], "--path") == 0) {
+      path = argv[arg + 1];
+    } else {
+      break;
+    }
+  }
+  if (argc - arg != 2 || count <= 0) {
+    fprintf(stderr,
+            "Usage: %s [--requests N] [--path PATH] <tcp_port> "
+            "<unix_path|@name>\n",
+            argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  target_t tcp = {.length = sizeof(struct sockaddr_in), .name = "tcp"};
+  struct sockaddr_in *in = (struct sockaddr_in *)&tcp.addr;
+  in->sin_family = AF_INET;
+  in->sin_port = htons((uint16_t)atoi(argv[arg]));
+  in->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  target_t local = {.name = "unix"};
+  struct sockaddr_un *un = (struct sockaddr_un *)&local.addr;
+  const char *name = argv[arg + 1];
+  size_t length = strlen(name);
+  if (length == 0 || length >= sizeof(un->sun_path)) {
+    fprintf(stderr, "Invalid socket path\n");
+    return EXIT_FAILURE;
+  }
+  un->sun_family = AF_UNIX;
+  memcpy(un->sun_path, name, length);
+  bool abstract = name[0] == '@';
+  if (abstract) {
+    un->sun_path[0] = '\0';
+  }
+  local.length =
+      (socklen_t)(offsetof(struct sockaddr_un, sun_path) + length + !abstract);
+
+  char text[REQUEST_MAX];
+  int text_length =
+      snprintf(text, sizeof(text),
+               "GET %s HTTP/1.0\r\nHost: localhost\r\n\r\n", path);
+  if (text_length < 0 || (size_t)text_length >= sizeof(text)) {
+    fprintf(stderr, "Path too long\n");
+    return EXIT_FAILURE;
+  }
+
+  uint64_t *samples = malloc((size_t)count * sizeof(*samples));
+  if (samples == nullptr) {
+    return EXIT_FAILURE;
+  }
+  int rc = run(&tcp, text, (size_t)text_length, samples, count) != 0 ||
+           run(&local, text, (size_t)text_length, samples, count) != 0;
+  free(samples);
+  return rc == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -20,6 +20,9 @@ arena_t *arena_create(size_t size);
 [[nodiscard]]
 void *arena_alloc(arena_t *a, size_t size);
 
+// Arena over caller-owned memory; such an arena is never arena_destroy()ed.
+void arena_init(arena_t *a, void *base, size_t capacity);
+
 void arena_reset(arena_t *a);
 void arena_destroy(arena_t *a);
 
@@ -0,0 +1,32 @@
+#ifndef AUTOINDEX_H
+#define AUTOINDEX_H
+
+#include <stddef.h>
+
+#include "http.h"
+#include "string_utils.h"
+
+enum {
+  AUTOINDEX_SLOTS = 256,
+  AUTOINDEX_CACHE_MAX = 1024 * 1024, // Larger listings are streamed only
+};
+
+// Renders directory listings and caches the HTML per directory and request
+// path. A cached page is reused while the directory's inode and mtime are
+// unchanged.
+typedef struct autoindex autoindex_t;
+
+[[nodiscard]]
+autoindex_t *autoindex_create(void);
+void autoindex_destroy(autoindex_t *index);
+
+// Writes a complete response for dir_path to client. The request path is used
+// to build the links and its version picks the framing: a page rendered on
+// the fly is sent chunked to HTTP/1.1 clients as it is produced, a cached one
+// with its length. buffer bounds the output held at once.
+[[nodiscard]]
+int autoindex_serve(autoindex_t *index, int client, const string_t *dir_path,
+                    const http_request_t *request, char *buffer,
+                    size_t capacity);
+
+#endif // !AUTOINDEX_H
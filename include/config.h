@@ -0,0 +1,66 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+enum {
+  CACHE_DEFAULT_BUDGET = 64 * 1024 * 1024,
+  DRAIN_DEFAULT_TIMEOUT = 30,
+  PROXY_MAX_ROUTES = 8,
+  UPLOAD_MAX_ROUTES = 4,
+  UPLOAD_DEFAULT_LIMIT = 1024 * 1024 * 1024,
+  UNIX_DEFAULT_MODE = 0660,
+  PREFORK_MAX_PROCESSES = 64,
+  COROUTINES_MAX = 4096,
+  IO_THREADS_DEFAULT = 4,
+  IO_THREADS_MAX = 256,
+};
+
+typedef enum {
+  HUGE_PAGES_NONE,
+  HUGE_PAGES_THP,      // madvise(MADV_HUGEPAGE), falls back silently
+  HUGE_PAGES_EXPLICIT, // MAP_HUGETLB from the reserved pool
+} huge_pages_t;
+
+typedef struct {
+  uint16_t port;
+  const char *root_dir;
+  size_t cache_budget;       // Bytes of file data the cache may hold, 0 = off
+  const char *hot_snapshot;  // Hotness snapshot read at start, written at exit
+  bool serve_while_warming;  // Accept before the warm-up finished
+  unsigned drain_timeout;    // Seconds in-flight requests get on shutdown
+  bool pin_workers;          // One allowed CPU per worker, memory on its node
+  huge_pages_t huge_pages;   // Backing of per-worker memory
+  bool autoindex;            // List directories without an index.html
+  // "PREFIX=UPSTREAM[,UPSTREAM...]", upstreams are host:port or unix:PATH
+  const char *proxy_routes[PROXY_MAX_ROUTES];
+  int proxy_route_count;
+  unsigned rate_limit;       // Connections per second per client, 0 = off
+  unsigned rate_burst;       // Bucket size, defaults to rate_limit
+  // "PREFIX=DIR": PUT and POST below PREFIX store the body under DIR
+  const char *upload_routes[UPLOAD_MAX_ROUTES];
+  int upload_route_count;
+  size_t upload_limit;       // Largest accepted request body
+  unsigned min_workers;      // 0 = usable CPUs
+  unsigned max_workers;      // 0 = a multiple of min_workers
+  uint16_t tls_port;         // HTTPS listener, 0 = off
+  const char *tls_cert;      // PEM certificate chain
+  const char *tls_key;       // PEM private key
+  const char *unix_path;     // Unix socket listener, "@name" is abstract
+  unsigned unix_mode;        // Permissions of a filesystem socket
+  unsigned processes;        // Prefork worker processes, 0 = one process
+  unsigned trace_sample;     // Record spans for 1 in N requests, 0 = off
+  unsigned coroutines;       // Connections per worker thread, 0 = one
+  unsigned io_threads;       // Disk readers per process for coroutines
+  const char *routes_file;   // Host and prefix rules, reloaded on SIGHUP
+  // Path answered with the counters and slowest spans, nullptr = none
+  const char *debug_endpoint;
+} server_config_t;
+
+[[nodiscard]]
+int config_parse(server_config_t *cfg, int argc, char *argv[]);
+void config_usage(const char *prog);
+
+#endif // !CONFIG_H
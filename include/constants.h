@@ -1,14 +1,17 @@
 #ifndef CONSTANTS_H
 #define CONSTANTS_H
 
+#include <sys/socket.h>
+
 enum {
   BUFFER_SIZE = 1024,
-  BACKLOG = 1,
+  BACKLOG = SOMAXCONN,
 };
 
 typedef enum {
   MAX_METHOD = 7,
   MAX_URI = 2048,
+  MAX_HEADERS = 32,
 } http_limits_enum;
 
 typedef enum {
@@ -18,6 +21,7 @@ typedef enum {
   STATE_SPACE_BEFORE_VERSION,
   STATE_VERSION,
   STATE_CRLF,
+  STATE_HEADERS,
   STATE_DONE,
   STATE_ERROR,
 } http_state_enum;
@@ -0,0 +1,79 @@
+#ifndef CORO_H
+#define CORO_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+enum {
+  CORO_STACK_SIZE = 128 * 1024, // Usable bytes, a guard page sits below
+  CORO_STACK_CACHE = 256,       // Finished stacks a scheduler keeps mapped
+  CORO_ARG_MAX = 256,           // Bytes scheduler_spawn() copies for fn
+  CORO_IO_TIMEOUT = 30,         // Seconds an I/O call waits for readiness
+  CORO_EVENTS = 64,             // Readiness events taken per epoll_wait()
+  CORO_POLL_MS = 10,            // Queue polling period without a wake fd
+};
+
+// Pointers a coroutine keeps across its switches, one per key. Outside a
+// coroutine they are per thread.
+typedef enum {
+  CORO_LOCAL_TRACE,
+  CORO_LOCALS,
+} coro_local_t;
+
+// Stackful coroutines on one thread. Each runs ordinary blocking-style code
+// on its own small stack; the I/O calls below turn EAGAIN on a non-blocking
+// descriptor into a switch back to the scheduler, which resumes the
+// coroutine once epoll reports the descriptor ready. A switch saves only the
+// callee-saved registers (x86-64) or uses swapcontext() elsewhere, and
+// stacks are recycled instead of mapped per coroutine.
+typedef struct scheduler scheduler_t;
+typedef void (*coro_fn_t)(void *arg);
+
+// At most limit coroutines at once. wake_fd, when not -1, is watched while
+// the caller accepts new work (see scheduler_run()).
+[[nodiscard]]
+scheduler_t *scheduler_create(unsigned limit, int wake_fd);
+// Call once no coroutine is live.
+void scheduler_destroy(scheduler_t *scheduler);
+
+[[nodiscard]]
+unsigned scheduler_live(const scheduler_t *scheduler);
+// Starts fn on a copy of the size bytes at arg, at most CORO_ARG_MAX. It
+// first runs in the next scheduler_run().
+[[nodiscard]]
+int scheduler_spawn(scheduler_t *scheduler, coro_fn_t fn, const void *arg,
+                    size_t size);
+// Runs every runnable coroutine, then sleeps until a descriptor one of them
+// waits for is ready, a wait times out or, with accepting set and room for
+// more coroutines, wake_fd becomes readable.
+void scheduler_run(scheduler_t *scheduler, bool accepting);
+
+// Whether the caller runs on a coroutine, and its sockets are non-blocking.
+[[nodiscard]]
+bool coro_active(void);
+// poll() for one descriptor: 1 when ready, 0 on timeout, -1 on error. On a
+// coroutine only the coroutine waits, not the thread.
+int coro_wait(int fd, short events, int timeout_ms);
+[[nodiscard]]
+void **coro_local(coro_local_t key);
+
+// The system calls, except that on a coroutine EAGAIN waits up to
+// CORO_IO_TIMEOUT for readiness and retries, then fails with ETIMEDOUT.
+ssize_t coro_read(int fd, void *data, size_t length);
+ssize_t coro_write(int fd, const void *data, size_t length);
+ssize_t coro_writev(int fd, const struct iovec *iov, int count);
+ssize_t coro_recv(int fd, void *data, size_t length, int flags);
+ssize_t coro_send(int fd, const void *data, size_t length, int flags);
+ssize_t coro_sendfile(int to, int from, off_t *offset, size_t length);
+// One side of a splice() is a pipe that never blocks: into_pipe says it is
+// to, so EAGAIN waits for from to be readable, else for to to be writable.
+ssize_t coro_splice(int from, int to, size_t length, unsigned flags,
+                    bool into_pipe);
+// On a coroutine fd must be non-blocking; the connect completes before
+// this returns, with the result of SO_ERROR.
+int coro_connect(int fd, const struct sockaddr *addr, socklen_t length);
+
+#endif // !CORO_H
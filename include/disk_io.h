@@ -0,0 +1,41 @@
+#ifndef DISK_IO_H
+#define DISK_IO_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "config.h"
+
+enum {
+  DISK_IO_READAHEAD = 2 * 1024 * 1024, // Bytes hinted ahead of a read
+  DISK_IO_SEND_CHUNK = 512 * 1024,     // Bytes sent per page cache check
+};
+
+// Helper threads for file reads that would wait on the disk. A coroutine
+// first reads with RWF_NOWAIT, which only copies what is already in the page
+// cache; whatever is left goes to a helper thread while the worker keeps
+// running its other coroutines. Plain worker threads read inline: the pool
+// grows when they block.
+typedef struct disk_io disk_io_t;
+
+// nullptr (and no error) without --coroutines or with --io-threads 0.
+[[nodiscard]]
+int disk_io_create(const server_config_t *config, disk_io_t **out);
+void disk_io_destroy(disk_io_t *io);
+
+// Reads length bytes from offset 0 of fd into dst. 0, or -errno (-EIO when
+// the file ends early). io may be nullptr.
+[[nodiscard]]
+int disk_io_read(disk_io_t *io, int fd, void *dst, size_t length);
+
+// socket_sendfile_all() that keeps a coroutine's worker running: a chunk
+// not in the page cache is first read in by a helper thread, so sendfile()
+// never waits on the disk. io may be nullptr.
+[[nodiscard]]
+int disk_io_sendfile(disk_io_t *io, int to, int from, off_t *offset,
+                     size_t length);
+
+// Starts readahead for a file about to be read or sent from its start.
+void disk_io_advise(int fd, size_t length);
+
+#endif // !DISK_IO_H
@@ -11,12 +11,16 @@ typedef struct file_t {
   size_t length;
 } file_t;
 
+// Percent-decodes a URI path into out, NUL terminated. Fails on an embedded
+// NUL or when the result does not fit in capacity bytes.
 [[nodiscard]]
-file_t get_file_contents(arena_t *memory, const string_t *file_path);
+int path_decode(string_view_t in, char *out, size_t capacity);
 
+// root_path must already be resolved. The result lives in resolved, which
+// has room for PATH_MAX bytes; nothing is allocated.
 [[nodiscard]]
-string_t *get_safe_path(arena_t *memory, string_t *root_path,
-                        string_t *file_path);
+int get_safe_path(const string_t *root_path, string_view_t file_path,
+                  char *resolved, string_t *out);
 
 typedef enum {
   PATH_ERROR = -1,
@@ -0,0 +1,53 @@
+#ifndef FILE_CACHE_H
+#define FILE_CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "disk_io.h"
+#include "file.h"
+#include "string_utils.h"
+
+// Cache of whole files keyed by their resolved path. Lookups and inserts
+// are lock-free. Entries found out of date are marked stale; once stale ones
+// hold a quarter of the heap or of the slots, the live entries are compacted
+// into the space. Readers pin an epoch while they use entries, and a
+// compaction waits for the pins from before it began.
+typedef struct file_cache file_cache_t;
+
+// A shared cache lives in a MAP_SHARED mapping: processes forked after
+// creation see one copy and fill it together. A process dying mid-insert
+// only strands the heap bytes it reserved until the next compaction.
+[[nodiscard]]
+file_cache_t *file_cache_create(size_t budget, bool shared);
+void file_cache_destroy(file_cache_t *cache);
+
+// Selects the calling process's reader slot, 0 until called, and clears
+// what a process that had it before left pinned. Worker processes call it
+// with their number, the master with the worker count.
+void file_cache_attach(file_cache_t *cache, int slot);
+
+// Data from file_cache_get() and file_cache_load() stays valid until
+// file_cache_leave() with the pin held while getting it. Call both between
+// the two. nullptr caches are ignored.
+[[nodiscard]]
+uint64_t file_cache_enter(file_cache_t *cache);
+void file_cache_leave(file_cache_t *cache, uint64_t pin);
+
+[[nodiscard]]
+bool file_cache_get(file_cache_t *cache, const string_t *path, file_t *out);
+
+// Reads through io, which may be nullptr. -EBUSY while compacting.
+[[nodiscard]]
+int file_cache_load(file_cache_t *cache, disk_io_t *io, const string_t *path,
+                    file_t *out);
+
+size_t file_cache_used(const file_cache_t *cache);
+size_t file_cache_available(const file_cache_t *cache);
+
+// Writes "<hits>\t<path relative to root>" lines, hottest first.
+int file_cache_snapshot_write(file_cache_t *cache, const string_t *root,
+                              const char *snapshot_path);
+
+#endif // !FILE_CACHE_H
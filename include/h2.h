@@ -0,0 +1,41 @@
+#ifndef H2_H
+#define H2_H
+
+#include <stdbool.h>
+
+#include "arena.h"
+#include "http.h"
+#include "router.h"
+#include "server.h"
+#include "string_utils.h"
+
+enum {
+  H2_MAX_STREAMS = 100,      // SETTINGS_MAX_CONCURRENT_STREAMS
+  H2_FRAME_SIZE = 16384,     // Largest frame we accept
+  H2_HEADER_LIST_MAX = 8192, // SETTINGS_MAX_HEADER_LIST_SIZE
+  H2_IDLE_TIMEOUT = 30,      // Seconds without a frame from the peer
+};
+
+// HTTP/2 over cleartext TCP (h2c), reached either with prior knowledge or
+// through "Upgrade: h2c". Streams are served concurrently: responses go out
+// one DATA frame per stream in turn, within the peer's flow-control windows,
+// straight from the file cache or with sendfile() for uncached files.
+// Proxied routes and directory listings stay HTTP/1 only.
+
+// Whether received starts like the client connection preface.
+[[nodiscard]]
+bool h2_is_preface(string_view_t received);
+
+// Whether an HTTP/1.1 request asks to switch to h2c and carries no body.
+[[nodiscard]]
+bool h2_wants_upgrade(const http_request_t *request);
+
+// Speaks HTTP/2 until the peer leaves, answering from routes. received is
+// everything read so far. For an upgrade it is the upgrading request,
+// answered on stream 1, and whatever followed it; otherwise it starts with
+// the preface.
+void h2_serve(arena_t *memory, int client, const server_t *server,
+              const route_table_t *routes, string_view_t received,
+              const http_request_t *upgrade);
+
+#endif // !H2_H
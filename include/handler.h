@@ -1,9 +1,12 @@
 #ifndef HANDLER_H
 #define HANDLER_H
 
-#include "arena.h"
-#include "string_utils.h"
+#include "queue.h"
+#include "server.h"
+#include "worker_memory.h"
 
-void handle_client(arena_t *memory, int client, string_t *root_dir);
+// Connections from the HTTPS listener (info->tls) are not yet handshaken.
+void handle_client(worker_memory_t *worker, int client,
+                   const job_info_t *info, const server_t *server);
 
 #endif // !HANDLER_H
@@ -0,0 +1,74 @@
+#ifndef HPACK_H
+#define HPACK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "string_utils.h"
+
+enum {
+  HPACK_TABLE_SIZE = 4096, // SETTINGS_HEADER_TABLE_SIZE, the RFC default
+  HPACK_ENTRY_OVERHEAD = 32,
+  HPACK_MAX_ENTRIES = HPACK_TABLE_SIZE / HPACK_ENTRY_OVERHEAD,
+};
+
+// Static table indices the encoder refers to by name.
+typedef enum {
+  HPACK_STATUS = 8, // ":status: 200"
+  HPACK_CACHE_CONTROL = 24,
+  HPACK_CONTENT_ENCODING = 26,
+  HPACK_CONTENT_LENGTH = 28,
+  HPACK_CONTENT_TYPE = 31,
+  HPACK_LOCATION = 46,
+  HPACK_VARY = 59,
+} hpack_static_t;
+
+typedef struct {
+  uint16_t offset;
+  uint16_t name_length;
+  uint16_t value_length;
+} hpack_entry_t;
+
+// Decoder dynamic table (RFC 7541, section 2.3.2). Entries sit back to back
+// in storage, oldest first, so eviction is one memmove of at most
+// HPACK_TABLE_SIZE bytes and nothing is allocated.
+typedef struct {
+  char storage[HPACK_TABLE_SIZE];
+  hpack_entry_t entries[HPACK_MAX_ENTRIES];
+  size_t count;
+  size_t used;     // Bytes of storage in use
+  size_t size;     // Size as the RFC counts it, with the per-entry overhead
+  size_t max_size; // Lowered or raised again by size updates
+} hpack_table_t;
+
+typedef struct {
+  string_view_t name;
+  string_view_t value;
+} hpack_header_t;
+
+void hpack_table_init(hpack_table_t *table);
+
+// Decodes one complete header block. Names and values are copied to scratch
+// first, so they stay valid when a later entry evicts their source. Returns
+// the number of headers, or -1 on a compression error, after which the table
+// is out of sync with the peer and the connection must go.
+[[nodiscard]]
+int hpack_decode(hpack_table_t *table, const uint8_t *block, size_t length,
+                 char *scratch, size_t scratch_size, hpack_header_t *headers,
+                 size_t max_headers);
+
+// The encoder never indexes, so the peer's table size does not matter.
+typedef struct {
+  uint8_t *data;
+  size_t length;
+  size_t capacity;
+} hpack_block_t;
+
+[[nodiscard]]
+int hpack_encode_status(hpack_block_t *block, int status);
+// Literal without indexing, name taken from the static table.
+[[nodiscard]]
+int hpack_encode_header(hpack_block_t *block, hpack_static_t name,
+                        string_view_t value);
+
+#endif // !HPACK_H
@@ -4,14 +4,102 @@
 #include <stddef.h>
 
 #include "arena.h"
+#include "constants.h"
 #include "string_utils.h"
 
+// Interned method and header names. A parsed request points at these
+// entries, so recognising a token is a pointer comparison.
+typedef enum {
+  HTTP_TOKEN_GET,
+  HTTP_TOKEN_HEAD,
+  HTTP_TOKEN_POST,
+  HTTP_TOKEN_PUT,
+  HTTP_TOKEN_DELETE,
+  HTTP_TOKEN_OPTIONS,
+  HTTP_TOKEN_PRI,
+  HTTP_TOKEN_HOST, // First header name
+  HTTP_TOKEN_CONNECTION,
+  HTTP_TOKEN_CONTENT_LENGTH,
+  HTTP_TOKEN_CONTENT_TYPE,
+  HTTP_TOKEN_TRANSFER_ENCODING,
+  HTTP_TOKEN_EXPECT,
+  HTTP_TOKEN_UPGRADE,
+  HTTP_TOKEN_HTTP2_SETTINGS,
+  HTTP_TOKEN_USER_AGENT,
+  HTTP_TOKEN_ACCEPT,
+  HTTP_TOKEN_ACCEPT_ENCODING,
+  HTTP_TOKEN_KEEP_ALIVE,
+  HTTP_TOKEN_COUNT,
+} http_token_t;
+
+extern const string_view_t http_tokens[HTTP_TOKEN_COUNT];
+#define HTTP_TOKEN(name) (&http_tokens[HTTP_TOKEN_##name])
+
+[[nodiscard]]
+const string_view_t *http_intern_method(string_view_t name);
+[[nodiscard]]
+const string_view_t *http_intern_header(string_view_t name);
+
+typedef struct {
+  string_view_t name;
+  string_view_t value;
+  const string_view_t *token; // Interned name, nullptr when not well known
+} http_header_t;
+
+// Every view points into the receive buffer the request was parsed from.
 typedef struct {
-  string_t *method;
-  string_t *uri;
+  const string_view_t *method; // Interned, nullptr for unknown methods
+  string_view_t method_name;
+  string_view_t uri;
+  string_view_t path; // uri up to '?'
+  string_view_t query;
+  string_view_t version;
+  http_header_t headers[MAX_HEADERS];
+  size_t header_count;
+  size_t header_length; // Up to and including the empty line
 } http_request_t;
 
-http_request_t *parse_http(arena_t *memory, string_t *data);
-string_t *http_read_header(arena_t *memory, int sockfd);
+// Status line and headers of a response, as read from an upstream.
+typedef struct {
+  string_view_t version;
+  int status;
+  string_view_t status_line; // Without the line ending
+  http_header_t headers[MAX_HEADERS];
+  size_t header_count;
+  size_t header_length;
+} http_response_t;
+
+// -1 when malformed, -E2BIG with more than MAX_HEADERS headers.
+[[nodiscard]]
+int parse_http(string_view_t data, http_request_t *request);
+[[nodiscard]]
+int parse_http_response(string_view_t data, http_response_t *response);
+
+[[nodiscard]]
+const http_header_t *http_find_header(const http_request_t *request,
+                                      const string_view_t *token);
+[[nodiscard]]
+const http_header_t *http_headers_find(const http_header_t *headers,
+                                       size_t count,
+                                       const string_view_t *token);
+
+// 0 with *length set, 1 when there is no Content-Length, -1 when invalid.
+[[nodiscard]]
+int http_headers_content_length(const http_header_t *headers, size_t count,
+                                size_t *length);
+// Whether an Accept-Encoding value takes coding, say "gzip".
+[[nodiscard]]
+bool http_accepts_coding(string_view_t accept_encoding, string_view_t coding);
+[[nodiscard]]
+bool http_headers_chunked(const http_header_t *headers, size_t count);
+// Whether a Connection header lists the given option, e.g. "close".
+[[nodiscard]]
+bool http_headers_connection_has(const http_header_t *headers, size_t count,
+                                 string_view_t option);
+
+// Reads into the caller's buffer until the end of the header block; the
+// returned string aliases it and may hold the first body bytes as well.
+string_t *http_read_header(arena_t *memory, char *buffer, size_t capacity,
+                           int sockfd);
 
 #endif // !HTTP_H
@@ -0,0 +1,21 @@
+#ifndef PREFORK_H
+#define PREFORK_H
+
+#include "stats.h"
+
+enum {
+  PREFORK_MIN_UPTIME = 1,    // Seconds; a worker dying sooner is crash looping
+  PREFORK_RESPAWN_DELAY = 1, // Seconds to wait before replacing such a worker
+};
+
+// Entry point of a worker process, returning its exit status. slot numbers
+// the worker from 0 and is kept by its replacement.
+typedef int (*prefork_child_t)(int slot, void *arg);
+
+// Master loop: forks count workers and replaces any that die until shutdown
+// is requested, then signals the workers and waits for them to drain. Call
+// with no other threads running, since only the caller survives fork().
+[[nodiscard]]
+int prefork_run(int count, prefork_child_t child, void *arg, stats_t *stats);
+
+#endif // !PREFORK_H
@@ -0,0 +1,44 @@
+#ifndef PROXY_H
+#define PROXY_H
+
+#include "config.h"
+#include "http.h"
+#include "string_utils.h"
+#include "worker_memory.h"
+
+enum {
+  PROXY_MAX_UPSTREAMS = 8,
+  PROXY_IDLE_MAX = 16,       // Idle keep-alive connections per worker
+  PROXY_HEALTH_INTERVAL = 2, // Seconds between active checks
+  PROXY_IO_TIMEOUT = 30,     // Seconds an upstream may stall
+};
+
+// Path-prefix routes forwarded to upstream servers. Each worker keeps its own
+// pool of keep-alive connections; bodies move with splice() in both
+// directions. Upstreams are picked by fewest outstanding requests among the
+// healthy ones, and a background thread re-probes them.
+typedef struct proxy proxy_t;
+typedef struct proxy_route proxy_route_t;
+
+// nullptr (and no error) when no routes are configured.
+[[nodiscard]]
+int proxy_create(const server_config_t *config, proxy_t **out);
+void proxy_destroy(proxy_t *proxy);
+
+// The route configured with exactly this prefix, for the router to refer
+// to; nullptr when there is none.
+[[nodiscard]]
+proxy_route_t *proxy_find(proxy_t *proxy, string_view_t prefix);
+
+// Forwards the request and relays the response. received holds everything
+// read so far, which may include the start of the request body.
+[[nodiscard]]
+int proxy_forward(proxy_route_t *route, worker_memory_t *worker,
+                  int client, const http_request_t *request,
+                  string_view_t received);
+
+// Closes the calling thread's idle upstream connections; run by a worker
+// thread as it exits.
+void proxy_thread_exit(void);
+
+#endif // !PROXY_H
@@ -3,22 +3,57 @@
 
 #include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 #define QUEUE_SIZE 256
 
+// queue_pop() result telling a worker the pool wants one thread fewer.
+#define QUEUE_RETIRE (-2)
+
+// What a worker learns about a connection besides its descriptor.
+typedef struct {
+  bool tls;           // Accepted on the HTTPS listener
+  uint64_t queued_at; // Monotonic ns at push
+} job_info_t;
+
 typedef struct {
-  int sockets[QUEUE_SIZE]; // Circular buffer
+  int sockets[QUEUE_SIZE];       // Circular buffer
+  bool tls[QUEUE_SIZE];          // Accepted on the HTTPS listener
+  uint64_t enqueued[QUEUE_SIZE]; // Monotonic ns at push, for queueing delay
   int head;
   int tail;
   int count;
   bool shutdown;         // Flag to stop workers
+  int retire;            // Workers asked to exit
+  int idle;              // Workers waiting in queue_pop()
+  uint64_t wait_total;   // ns spent queued by connections popped...
+  uint64_t wait_max;     // ...since the last queue_sample()
+  uint64_t popped;
+  bool signalled;        // wake_fd is readable
   pthread_mutex_t lock;  // Protects all fields above
   pthread_cond_t notify; // Signals workers when count > 0
+  int wake_fd; // eventfd for workers busy with coroutines, or -1
 } job_queue_t;
 
-void queue_init(job_queue_t *q);
-int queue_push(job_queue_t *q, int client_fd);
-int queue_pop(job_queue_t *q);
+// Queueing delay and worker occupancy since the previous sample.
+typedef struct {
+  uint64_t popped;
+  uint64_t wait_mean; // ns
+  uint64_t wait_max;  // ns, including connections still queued
+  int depth;
+  int idle;
+} queue_stats_t;
+
+// wake creates wake_fd, for workers that cannot block in queue_pop().
+void queue_init(job_queue_t *q, bool wake);
+int queue_push(job_queue_t *q, int client_fd, bool tls);
+int queue_pop(job_queue_t *q, job_info_t *info);
+// Never blocks: -EAGAIN when empty, -1 once shut down and drained. Workers
+// running coroutines use it and watch wake_fd, which becomes readable when
+// a connection arrives while no worker waits in queue_pop().
+int queue_try_pop(job_queue_t *q, job_info_t *info);
+void queue_retire(job_queue_t *q, int workers);
+void queue_sample(job_queue_t *q, queue_stats_t *out);
 void queue_shutdown(job_queue_t *q);
 void queue_destroy(job_queue_t *q);
 
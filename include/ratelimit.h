@@ -0,0 +1,34 @@
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+enum {
+  RATELIMIT_SHARDS = 64,
+  RATELIMIT_SHARD_SLOTS = 1024, // Power of two
+  RATELIMIT_PROBES = 8,         // Slots searched, two cache lines
+};
+
+// Per-client token buckets, checked when a connection is accepted. Buckets
+// live in a fixed open-addressing table split into independently locked
+// shards and refill lazily from a coarse monotonic clock, so a check is a
+// hash, one or two cache lines and no allocation. A bucket that has refilled
+// completely is no different from a missing one, so when a probe window is
+// full the longest idle entry is reused; idle clients age out on their own.
+typedef struct ratelimit ratelimit_t;
+
+// rate connections per second per client, up to burst at once. A shared
+// table is mapped MAP_SHARED with process-shared locks, so processes forked
+// after creation enforce one limit together.
+[[nodiscard]]
+ratelimit_t *ratelimit_create(unsigned rate, unsigned burst, bool shared);
+void ratelimit_destroy(ratelimit_t *limiter);
+
+// IPv4 clients are keyed by address, IPv6 clients by their /64. Other
+// address families are never limited.
+[[nodiscard]]
+bool ratelimit_allow(ratelimit_t *limiter, const struct sockaddr_storage *peer);
+
+#endif // !RATELIMIT_H
@@ -0,0 +1,47 @@
+#ifndef RESPONSE_H
+#define RESPONSE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "http.h"
+#include "string_utils.h"
+
+// A response whose body is produced while it is sent. HTTP/1.1 clients get
+// "Transfer-Encoding: chunked", one chunk per buffer; HTTP/1.0 clients get
+// the bare bytes and the closing connection ends the body. Memory is the one
+// caller-supplied buffer, and writes block while the socket is full, so a
+// fast producer is paced by a slow client instead of buffering ahead.
+typedef struct {
+  int client;
+  char *buffer;
+  size_t capacity;
+  size_t length; // Bytes in buffer: the unsent head, then body bytes
+  size_t head;
+  bool chunked;
+  bool head_only; // A HEAD request: the body is dropped
+  bool failed;    // The client is gone; later output is dropped
+} response_t;
+
+// Queues the head; it goes out with the first chunk. status is like
+// "200 OK", headers are complete "Name: value\r\n" lines or empty.
+[[nodiscard]]
+int response_begin(response_t *response, int client,
+                   const http_request_t *request, char *buffer,
+                   size_t capacity, string_view_t status,
+                   string_view_t headers);
+
+int response_write(response_t *response, const void *data, size_t length);
+// Sends what is buffered now, for producers about to pause.
+int response_flush(response_t *response);
+// Sends the rest and the terminating chunk. Returns -1 if any write failed.
+int response_end(response_t *response);
+
+// A response whose body is known up front, with Content-Length. Either way
+// only the head goes out for HEAD requests.
+[[nodiscard]]
+int response_send(int client, const http_request_t *request,
+                  string_view_t status, string_view_t headers,
+                  const void *body, size_t length);
+
+#endif // !RESPONSE_H
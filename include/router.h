@@ -0,0 +1,81 @@
+#ifndef ROUTER_H
+#define ROUTER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "config.h"
+#include "proxy.h"
+#include "string_utils.h"
+
+enum {
+  ROUTER_GENERATIONS = 8,   // Tables alive at once, the current one included
+  ROUTER_HOST_MAX = 256,    // Longest Host matched, port excluded
+  ROUTER_STORAGE_MAX = 4096 // Bytes of strings one rule may precompute
+};
+
+typedef enum {
+  ROUTE_STATIC,   // Files below root
+  ROUTE_REDIRECT, // status with Location: location
+  ROUTE_FIXED,    // status with body
+  ROUTE_PROXY,    // Forwarded through upstream
+} route_action_t;
+
+typedef struct {
+  route_action_t action;
+  int code;
+  string_view_t status; // Like "301 Moved Permanently"
+  string_view_t location;
+  string_view_t body;
+  string_t root; // Resolved with realpath()
+  proxy_route_t *upstream;
+  // Policies of static routes.
+  bool nocache;                // Neither read nor fill the file cache
+  bool gzip;                   // Prefer FILE.gz for clients that take gzip
+  string_view_t cache_control; // Like "max-age=60", empty for none
+  // Complete "Name: value\r\n" lines an HTTP/1 response adds.
+  string_view_t headers;
+  char *storage; // Backs the views above
+} route_t;
+
+// Rules mapping a Host and a path prefix to an action, read from the
+// --routes file:
+//
+//   HOST PREFIX static DIR [nocache] [gzip] [max-age=SECONDS]
+//   HOST PREFIX redirect STATUS URL
+//   HOST PREFIX fixed STATUS [BODY...]
+//   HOST PREFIX proxy NAME
+//
+// HOST is a name or "*" for any, NAME the prefix of a --proxy route, and '#'
+// starts a comment. Without a file the table serves the root directory and
+// the --proxy routes. A request takes the longest prefix ending at a '/' of
+// its path among the rules for its Host, and the "*" rules when its Host has
+// none. Rules compile into radix tries laid out in one array, children of a
+// node next to each other, so a match is a walk down a few cache lines and
+// allocates nothing.
+typedef struct router router_t;
+typedef struct route_table route_table_t;
+
+[[nodiscard]]
+int router_create(const server_config_t *config, const string_t *root_dir,
+                  proxy_t *proxy, router_t **out);
+void router_destroy(router_t *router);
+
+// Compiles the file again and swaps the result in; on failure the old rules
+// stay. Tables replaced earlier are freed once no connection holds them,
+// and a reload fails while ROUTER_GENERATIONS of them are still held.
+[[nodiscard]]
+int router_reload(router_t *router);
+
+// Holds the current table until router_leave() with the returned pin, so a
+// connection sees one set of rules throughout.
+[[nodiscard]]
+const route_table_t *router_enter(router_t *router, uint64_t *pin);
+void router_leave(router_t *router, uint64_t pin);
+
+// nullptr when no rule matches. rest receives the path after the prefix.
+[[nodiscard]]
+const route_t *route_match(const route_table_t *table, string_view_t host,
+                           string_view_t path, string_view_t *rest);
+
+#endif // !ROUTER_H
@@ -0,0 +1,34 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include "autoindex.h"
+#include "config.h"
+#include "disk_io.h"
+#include "file_cache.h"
+#include "proxy.h"
+#include "router.h"
+#include "stats.h"
+#include "string_utils.h"
+#include "tls.h"
+#include "trace.h"
+#include "upload.h"
+
+struct thread_pool;
+
+// Process-wide state shared read-only by every worker.
+typedef struct {
+  const server_config_t *config;
+  string_t *root_dir; // Resolved with realpath()
+  file_cache_t *cache;
+  autoindex_t *autoindex; // nullptr unless --autoindex
+  proxy_t *proxy;         // nullptr without --proxy routes
+  uploads_t *uploads;     // nullptr without --upload routes
+  tls_t *tls;             // nullptr without --tls-port
+  stats_t *stats;         // Shared with worker processes
+  trace_t *trace;         // nullptr without --trace-sample
+  disk_io_t *disk_io;     // nullptr without --coroutines
+  router_t *router;
+  struct thread_pool *pool; // This process's workers, while serving
+} server_t;
+
+#endif // !SERVER_H
@@ -5,7 +5,16 @@
 
 // Global flag: 1 = Running, 0 = Stop
 extern volatile sig_atomic_t server_running;
+// Set by SIGUSR2: hand the listeners to a freshly exec'd binary
+extern volatile sig_atomic_t upgrade_requested;
+// Set by SIGHUP: compile the routes file again
+extern volatile sig_atomic_t reload_requested;
 
 void signal_init(void);
 
+// Blocks the signals above in the calling thread, and in the threads it
+// creates afterwards, saving the old mask to previous. Checking a flag and
+// then sleeping in ppoll() with previous cannot miss a signal in between.
+void signal_block(sigset_t *previous);
+
 #endif // !SIG_H
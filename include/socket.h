@@ -1,12 +1,43 @@
 #ifndef SOCKET_H
 #define SOCKET_H
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 
+// reuse_port lets several sockets bind the port, each with its own accept
+// queue; the kernel spreads incoming connections across them.
 [[nodiscard]]
-int open_socket(uint16_t port_number);
+int open_socket(uint16_t port_number, bool reuse_port);
+// A Unix stream listener at path, or in the abstract namespace for "@name",
+// which has no permissions and vanishes with the last descriptor. A stale
+// socket file left by a dead server is replaced; a live one is an error.
 [[nodiscard]]
-int get_client(int sockfd);
+int open_unix_socket(const char *path, unsigned mode);
+// peer receives the client's address; it may be nullptr.
+[[nodiscard]]
+int get_client(int sockfd, struct sockaddr_storage *peer);
+
+// Loops over short writes and EINTR; -1 once the peer is gone.
+[[nodiscard]]
+int socket_write_all(int fd, const void *data, size_t length);
+
+[[nodiscard]]
+int socket_writev_all(int fd, struct iovec *iov, int count);
+
+// Sends length bytes of the file from, starting at and advancing *offset,
+// with sendfile(); -1 once the peer is gone or the file came up short.
+[[nodiscard]]
+int socket_sendfile_all(int to, int from, off_t *offset, size_t length);
+
+// Moves length bytes from one descriptor to another through pipe_fds with
+// splice(), never copying into user space. SIZE_MAX means until EOF.
+// Returns the bytes moved, or -1 with the pipe left in an unknown state.
+[[nodiscard]]
+ssize_t socket_splice(int from, int to, size_t length, const int pipe_fds[2]);
 
 [[nodiscard]]
 int parse_port(const char *str, uint16_t *out_port);
@@ -0,0 +1,31 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+
+typedef enum {
+  STAT_CONNECTIONS, // Handed to a worker
+  STAT_REJECTED,    // Turned away by the rate limiter
+  STAT_CACHE_HITS,
+  STAT_CACHE_MISSES,
+  STAT_RESPAWNS, // Worker processes replaced after dying
+  STAT_COUNT,
+} stat_t;
+
+// Server-wide counters in a shared anonymous mapping, so worker processes
+// forked from one master all count into it. Each process adds to its own
+// cache line of relaxed atomics and readers sum the lines.
+typedef struct stats stats_t;
+
+// slots is the number of processes that will count, one each.
+[[nodiscard]]
+stats_t *stats_create(int slots);
+void stats_destroy(stats_t *stats);
+
+// Selects the calling process's slot; slot 0 until called.
+void stats_attach(int slot);
+// nullptr stats are ignored.
+void stats_add(stats_t *stats, stat_t stat, uint64_t count);
+void stats_total(const stats_t *stats, uint64_t out[STAT_COUNT]);
+
+#endif // !STATS_H
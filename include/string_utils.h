@@ -26,4 +26,42 @@ bool string_starts_with(const string_t *str, const char *prefix);
 [[nodiscard]]
 bool string_starts_with_s(const string_t *str, const string_t *prefix);
 
+// Non-owning slice of someone else's bytes, usually the receive buffer.
+// Views are not NUL terminated.
+typedef struct {
+  const char *data;
+  size_t length;
+} string_view_t;
+
+#define SV_NPOS ((size_t)-1)
+#define SV_LIT(literal)                                                       \
+  ((string_view_t){.data = (literal), .length = sizeof(literal) - 1})
+
+[[nodiscard]]
+string_view_t sv_from_cstr(const char *str);
+[[nodiscard]]
+string_view_t sv_from_string(const string_t *str);
+// Clamps start and length to the view.
+[[nodiscard]]
+string_view_t sv_slice(string_view_t sv, size_t start, size_t length);
+
+[[nodiscard]]
+bool sv_equal(string_view_t a, string_view_t b);
+// ASCII only, which is what HTTP tokens are.
+[[nodiscard]]
+bool sv_equal_nocase(string_view_t a, string_view_t b);
+[[nodiscard]]
+bool sv_starts_with(string_view_t sv, string_view_t prefix);
+
+[[nodiscard]]
+size_t sv_find_char(string_view_t sv, char c);
+[[nodiscard]]
+size_t sv_find(string_view_t sv, string_view_t needle);
+
+// Cuts *rest at the first delim: the part before is returned in *token and
+// *rest keeps what follows. False once *rest is exhausted.
+bool sv_split(string_view_t *rest, char delim, string_view_t *token);
+[[nodiscard]]
+string_view_t sv_trim(string_view_t sv);
+
 #endif
@@ -2,27 +2,79 @@
 #define THREAD_POOL_H
 
 #include "queue.h"
-#include "string_utils.h"
+#include "server.h"
 #include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/types.h>
 
-#define THREAD_POOL_SIZE 4
+enum {
+  THREAD_POOL_HARD_MAX = 256,
+  THREAD_POOL_GROWTH = 8,       // Default max_workers is this times min
+  THREAD_POOL_TICK_MS = 100,    // Controller period
+  THREAD_POOL_GROW_WAIT_MS = 5, // Queueing delay that may call for workers
+  THREAD_POOL_RETIRE_TICKS = 50 // Ticks with spare workers before retiring
+};
+
+typedef enum {
+  WORKER_FREE,
+  WORKER_RUNNING,
+  WORKER_EXITED, // Retired or failed, waiting to be joined
+} worker_state_t;
 
 typedef struct {
   int id;
   job_queue_t *queue;
-  string_t *root_dir;
+  const server_t *server;
+  _Atomic worker_state_t state;
+  _Atomic pid_t tid; // 0 until the thread runs
 } worker_config_t;
 
+// Every decision the controller made, for logs and status pages.
 typedef struct {
-  pthread_t threads[THREAD_POOL_SIZE];
-  worker_config_t configs[THREAD_POOL_SIZE];
+  unsigned workers;
+  unsigned min_workers;
+  unsigned max_workers;
+  uint64_t grown;   // Workers started after init
+  uint64_t retired; // Workers asked to exit
+  queue_stats_t last; // Latest sample the controller acted on
+} thread_pool_stats_t;
+
+// Starts with min_workers threads. A controller samples the queue every tick:
+// when connections wait THREAD_POOL_GROW_WAIT_MS with no worker idle and some
+// workers are asleep in the kernel (stuck on disk or upstreams, not busy on a
+// CPU), it adds up to that many threads, within max_workers; when some
+// workers stayed idle for THREAD_POOL_RETIRE_TICKS in a row, it retires half
+// of the spare ones, never going below min_workers.
+typedef struct thread_pool {
+  job_queue_t *queue;
+  const server_t *server;
+  unsigned min_workers;
+  unsigned max_workers;
+  pthread_t *threads;
+  worker_config_t *configs;
+  pthread_t controller;
+  bool stopping;
+  pthread_cond_t wakeup;
+  pthread_mutex_t lock; // Protects stopping, the slots and stats
+  thread_pool_stats_t stats;
 } thread_pool_t;
 
+// CPUs this process may run on, lowered to a cgroup v2 CPU quota if any.
+unsigned thread_pool_cpu_budget(void);
+// The most workers the pool grows to under config.
+unsigned thread_pool_max_workers(const server_config_t *config);
+
 [[nodiscard]]
 int thread_pool_init(thread_pool_t *pool, job_queue_t *queue,
-                     string_t *root_dir);
+                     const server_t *server);
+
+void thread_pool_stats(thread_pool_t *pool, thread_pool_stats_t *out);
 
 void thread_pool_wait(thread_pool_t *pool);
+// Like thread_pool_wait() but gives up after timeout_sec, returns -ETIMEDOUT.
+[[nodiscard]]
+int thread_pool_wait_for(thread_pool_t *pool, unsigned timeout_sec);
 
 extern pthread_mutex_t log_lock;
 void thread_lock_callback(bool lock, void *udata);
@@ -0,0 +1,41 @@
+#ifndef TLS_H
+#define TLS_H
+
+#include "config.h"
+
+enum {
+  TLS_IO_TIMEOUT = 30,             // Seconds a client may stall
+  TLS_RELAY_BUFFER = 16 * 1024,    // One TLS record of plaintext
+  TLS_TICKET_LIFETIME = 2 * 3600,  // Seconds a resumption ticket is valid
+};
+
+// HTTPS listener support. The handshake runs in user space with OpenSSL,
+// which then installs the session keys into kernel TLS (TCP_ULP "tls") for
+// both directions. From there the socket reads and writes plaintext like any
+// other, so handlers keep using sendfile() and splice() and the kernel does
+// the record encryption. Where kTLS is unavailable (module not loaded,
+// cipher not supported) a relay thread encrypts in user space and the handler
+// is given the other end of a socket pair instead; at most as many relays run
+// as the pool has workers at its largest, and connections beyond that are
+// refused. Stateless TLS 1.3 tickets let returning clients skip the full
+// handshake.
+typedef struct tls tls_t;
+typedef struct tls_session tls_session_t;
+
+// nullptr (and no error) unless an HTTPS port is configured.
+[[nodiscard]]
+int tls_create(const server_config_t *config, tls_t **out);
+// Waits for relays still flushing responses.
+void tls_destroy(tls_t *tls);
+
+// Runs the handshake on client. On success *plain is the descriptor to serve
+// the connection on and the caller closes it when done. Under kTLS that is
+// client itself and *out the session to end with tls_close() first; when
+// relayed, *out is nullptr and the relay owns client. On failure client is
+// left to the caller.
+[[nodiscard]]
+int tls_accept(tls_t *tls, int client, tls_session_t **out, int *plain);
+// Sends close_notify and frees a kTLS session. nullptr is ignored.
+void tls_close(tls_session_t *session);
+
+#endif // !TLS_H
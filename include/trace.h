@@ -0,0 +1,84 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+#include "response.h"
+#include "string_utils.h"
+
+enum {
+  TRACE_RING = 1024, // Sampled requests kept, oldest overwritten
+  TRACE_SLOWEST = 20, // Shown by the debug endpoint
+  TRACE_PATH_MAX = 64,
+};
+
+// Request phases, in the order they normally happen.
+typedef enum {
+  TRACE_ACCEPT,     // Accepted and queued
+  TRACE_DEQUEUE,    // Picked up by a worker
+  TRACE_PARSE,      // Request head read and parsed
+  TRACE_RESOLVE,    // Path resolved inside the root
+  TRACE_OPEN,       // Body located: cache, disk or directory
+  TRACE_FIRST_BYTE, // Response starts going out
+  TRACE_CLOSE,
+  TRACE_PHASES,
+} trace_phase_t;
+
+// Static probes for perf, bpftrace or SystemTap, e.g.
+//   bpftrace -e 'usdt:./server:http_server:parse {
+//     printf("%s\n", str(arg1, arg2)); }'
+// Built from <sys/sdt.h> when available: a nop and a note section entry, no
+// branch or call unless a tracer attaches. Without the header they vanish.
+// Every probe's arg0 is the client socket; the others are:
+//   accept      arg1 listener: 0 HTTP, 1 TLS, 2 Unix
+//   dequeue     arg1 monotonic ns when the connection was queued
+//   parse       arg1 method, not NUL terminated; arg2 its length
+//   resolve     arg1 resolved file path
+//   open        arg1 resolved path; arg2 body length, -1 when not found
+//   first_byte  -
+//   close       -
+#if __has_include(<sys/sdt.h>) && !defined(TRACE_NO_USDT)
+#include <sys/sdt.h>
+#define TRACE_PROBE(name, ...) STAP_PROBEV(http_server, name, __VA_ARGS__)
+#else
+#define TRACE_PROBE(name, ...) ((void)0)
+#endif
+
+// Fires the probe and marks the phase in the current span, if sampled.
+#define TRACE_MARK(name, phase, ...)                                           \
+  do {                                                                         \
+    TRACE_PROBE(name, __VA_ARGS__);                                            \
+    trace_mark(phase);                                                         \
+  } while (0)
+
+// Phase times of one request, monotonic ns, 0 where a phase was skipped.
+typedef struct {
+  uint64_t at[TRACE_PHASES];
+  char path[TRACE_PATH_MAX];
+} trace_span_t;
+
+// Sampled per-request spans. One request in sample gets its phase times
+// recorded in a span owned by whatever serves it, found through a
+// coroutine-local pointer; finished spans go to a ring in a shared mapping,
+// so worker processes forked later all report into it.
+// Writers never block: each ring slot has a sequence number that readers
+// check to skip a slot being rewritten under them.
+typedef struct trace trace_t;
+
+// nullptr when sample is 0.
+[[nodiscard]]
+trace_t *trace_create(unsigned sample);
+void trace_destroy(trace_t *trace);
+
+// Makes span current for a connection queued at queued_at (monotonic ns),
+// if sampled, and marks the accept and dequeue phases.
+void trace_begin(trace_t *trace, trace_span_t *span, uint64_t queued_at);
+void trace_mark(trace_phase_t phase);
+void trace_set_path(string_view_t path);
+// Marks the close phase and publishes the span.
+void trace_end(trace_t *trace);
+
+// Writes the slowest recorded spans as a plain text table.
+int trace_dump(trace_t *trace, response_t *response);
+
+#endif // !TRACE_H
@@ -0,0 +1,35 @@
+#ifndef UPGRADE_H
+#define UPGRADE_H
+
+#include <signal.h>
+#include <sys/types.h>
+
+enum {
+  UPGRADE_MAX_FDS = 8,
+};
+
+// Hot upgrade: the running server execs a new binary, hands it the listening
+// sockets over a Unix socket with SCM_RIGHTS and stops accepting once the new
+// process reports it is warm. The kernel accept queue is shared throughout.
+typedef struct {
+  pid_t pid;
+  int channel; // -1 while no upgrade is in flight
+} upgrade_t;
+
+// unblocked is the signal mask the new binary starts with.
+[[nodiscard]]
+int upgrade_begin(upgrade_t *upgrade, char *argv[], const int *fds,
+                  int count, const sigset_t *unblocked);
+
+// Call once the channel is readable: 0 when the new process took over.
+[[nodiscard]]
+int upgrade_finish(upgrade_t *upgrade);
+
+// In the new process: fills fds with the inherited listeners and returns how
+// many there are, 0 when not started by an upgrade.
+[[nodiscard]]
+int upgrade_inherit(int *fds, int max, int *channel);
+
+void upgrade_ready(int channel);
+
+#endif // !UPGRADE_H
@@ -0,0 +1,37 @@
+#ifndef UPLOAD_H
+#define UPLOAD_H
+
+#include "config.h"
+#include "http.h"
+#include "string_utils.h"
+#include "worker_memory.h"
+
+enum {
+  UPLOAD_IO_TIMEOUT = 30, // Seconds a client may stall mid-body
+  UPLOAD_NAME_MAX = 1024, // Decoded path below the upload directory
+};
+
+// PUT and POST under a configured prefix store the body in a directory.
+// Bodies go from the socket to the file with splice() through a worker pipe,
+// never through user space; chunked framing is parsed from a small buffer
+// and only the chunk data is spliced. Files appear atomically: the body is
+// written under a temporary name and renamed once complete.
+typedef struct uploads uploads_t;
+typedef struct upload_route upload_route_t;
+
+// nullptr (and no error) when no upload directories are configured.
+[[nodiscard]]
+int uploads_create(const server_config_t *config, uploads_t **out);
+void uploads_destroy(uploads_t *uploads);
+
+// Longest matching prefix, nullptr when the path takes no uploads.
+[[nodiscard]]
+upload_route_t *upload_match(uploads_t *uploads, string_view_t path);
+
+// Reads the body and answers the request. received holds everything read so
+// far, which may include the start of the body.
+[[nodiscard]]
+int upload_receive(upload_route_t *route, worker_memory_t *worker, int client,
+                   const http_request_t *request, string_view_t received);
+
+#endif // !UPLOAD_H
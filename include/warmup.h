@@ -0,0 +1,18 @@
+#ifndef WARMUP_H
+#define WARMUP_H
+
+#include "file_cache.h"
+#include "string_utils.h"
+
+// Walks the root directory and preloads files into the cache, hottest first
+// according to the snapshot, until the cache budget is spent.
+typedef struct warmup warmup_t;
+
+[[nodiscard]]
+warmup_t *warmup_start(file_cache_t *cache, const string_t *root,
+                       const char *snapshot_path, int threads);
+
+// Blocks until every loader thread has finished, then frees the warm-up.
+void warmup_wait(warmup_t *warmup);
+
+#endif // !WARMUP_H
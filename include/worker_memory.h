@@ -0,0 +1,47 @@
+#ifndef WORKER_MEMORY_H
+#define WORKER_MEMORY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "arena.h"
+#include "config.h"
+
+enum {
+  WORKER_ARENAS = 8,
+  WORKER_BUFFERS = 16,
+  WORKER_BUFFER_SIZE = 8 * 1024,
+  WORKER_PIPES = 4,
+  WORKER_PIPE_SIZE = 1024 * 1024,
+};
+
+// All memory a worker touches per request, carved from one mapping that is
+// bound to the worker's NUMA node and optionally backed by huge pages.
+// Arenas and I/O buffers are recycled through per-worker free lists, so the
+// owning thread needs no locking. With --coroutines the pools grow to cover
+// every connection a worker multiplexes.
+typedef struct worker_memory worker_memory_t;
+
+// Pins the calling thread first (if configured) so placement is local.
+[[nodiscard]]
+worker_memory_t *worker_memory_create(int worker_id,
+                                      const server_config_t *config);
+void worker_memory_destroy(worker_memory_t *memory);
+
+[[nodiscard]]
+arena_t *worker_memory_arena_get(worker_memory_t *memory);
+void worker_memory_arena_put(worker_memory_t *memory, arena_t *arena);
+
+// Buffers are WORKER_BUFFER_SIZE bytes.
+[[nodiscard]]
+char *worker_memory_buffer_get(worker_memory_t *memory);
+void worker_memory_buffer_put(worker_memory_t *memory, char *buffer);
+
+// Pipes for splice(), created on first use. Return a pipe with clean=false
+// when a transfer failed half way and it may still hold data.
+[[nodiscard]]
+int *worker_memory_pipe_get(worker_memory_t *memory);
+void worker_memory_pipe_put(worker_memory_t *memory, int *pipe_fds,
+                            bool clean);
+
+#endif // !WORKER_MEMORY_H
@@ -66,17 +66,24 @@ void *arena_alloc(arena_t *a, size_t size) {
   return ptr;
 }
 
+void arena_init(arena_t *a, void *base, size_t capacity) {
+  a->base = (unsigned char *)base;
+  a->capacity = capacity;
+  a->offset = 0;
+}
+
 void arena_reset(arena_t *a) {
   if (a == nullptr) {
     log_warn("Cannot reset a null arena.");
     return;
   }
 
-  a->offset = 0;
-
 #ifdef DEBUG
-  memset(a->base, 0, a->capacity);
+  // Only the used prefix can be dirty, the rest is still zero.
+  memset(a->base, 0, a->offset);
 #endif
+
+  a->offset = 0;
 }
 
 void arena_destroy(arena_t *a) {
@@ -0,0 +1,365 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "autoindex.h"
+#include "http.h"
+#include "log.h"
+#include "response.h"
+#include "string_utils.h"
+
+enum {
+  DENTS_BUFFER = 4 * 1024,
+};
+
+// glibc only wraps getdents64 in recent versions, so declare the record.
+struct linux_dirent64 {
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+typedef struct {
+  _Atomic int refs;
+  uint64_t inode;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+  size_t key_length;
+  size_t length;
+  char *html; // Key, NUL, then the rendered page
+} listing_t;
+
+struct autoindex {
+  pthread_mutex_t locks[AUTOINDEX_SLOTS];
+  listing_t *slots[AUTOINDEX_SLOTS];
+};
+
+// Output is streamed to the client as it is rendered and, while the page is
+// small enough, kept in a copy that becomes the cache entry.
+typedef struct {
+  response_t response;
+  char *copy;
+  size_t copy_length;
+  size_t copy_capacity;
+  bool cacheable;
+} page_writer_t;
+
+static const string_view_t status = SV_LIT("200 OK");
+static const string_view_t headers =
+    SV_LIT("Content-Type: text/html; charset=utf-8\r\n");
+
+static void listing_release(listing_t *listing) {
+  if (listing != nullptr && atomic_fetch_sub(&listing->refs, 1) == 1) {
+    free(listing->html);
+    free(listing);
+  }
+}
+
+[[nodiscard]]
+autoindex_t *autoindex_create(void) {
+  autoindex_t *index = calloc(1, sizeof(autoindex_t));
+  if (index == nullptr) {
+    return nullptr;
+  }
+  for (int i = 0; i < AUTOINDEX_SLOTS; i++) {
+    pthread_mutex_init(&index->locks[i], nullptr);
+  }
+  return index;
+}
+
+void autoindex_destroy(autoindex_t *index) {
+  if (index == nullptr) {
+    return;
+  }
+  for (int i = 0; i < AUTOINDEX_SLOTS; i++) {
+    listing_release(index->slots[i]);
+    pthread_mutex_destroy(&index->locks[i]);
+  }
+  free(index);
+}
+
+static size_t slot_of(string_view_t key) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < key.length; i++) {
+    hash ^= (unsigned char)key.data[i];
+    hash *= 1099511628211ULL;
+  }
+  return (size_t)(hash % AUTOINDEX_SLOTS);
+}
+
+static void page_keep(page_writer_t *page, const char *data, size_t length) {
+  if (!page->cacheable) {
+    return;
+  }
+  if (page->copy_length + length > AUTOINDEX_CACHE_MAX) {
+    page->cacheable = false;
+    return;
+  }
+  if (page->copy_length + length > page->copy_capacity) {
+    size_t capacity = page->copy_capacity * 2;
+    while (capacity < page->copy_length + length) {
+      capacity *= 2;
+    }
+    char *copy = realloc(page->copy, capacity);
+    if (copy == nullptr) {
+      page->cacheable = false;
+      return;
+    }
+    page->copy = copy;
+    page->copy_capacity = capacity;
+  }
+  memcpy(page->copy + page->copy_length, data, length);
+  page->copy_length += length;
+}
+
+static void page_append(page_writer_t *page, const char *data, size_t length) {
+  page_keep(page, data, length);
+  (void)response_write(&page->response, data, length);
+}
+
+static void page_append_sv(page_writer_t *page, string_view_t sv) {
+  page_append(page, sv.data, sv.length);
+}
+
+static void page_append_escaped(page_writer_t *page, string_view_t text) {
+  for (const char *c = text.data; c < text.data + text.length; c++) {
+    switch (*c) {
+    case '<':
+      page_append_sv(page, SV_LIT("&lt;"));
+      break;
+    case '>':
+      page_append_sv(page, SV_LIT("&gt;"));
+      break;
+    case '&':
+      page_append_sv(page, SV_LIT("&amp;"));
+      break;
+    case '"':
+      page_append_sv(page, SV_LIT("&quot;"));
+      break;
+    default:
+      page_append(page, c, 1);
+    }
+  }
+}
+
+static void page_append_url(page_writer_t *page, const char *name) {
+  static const char hex[] = "0123456789ABCDEF";
+  for (const unsigned char *c = (const unsigned char *)name; *c != '\0'; c++) {
+    bool plain = (*c >= 'a' && *c <= 'z') || (*c >= 'A' && *c <= 'Z') ||
+                 (*c >= '0' && *c <= '9') || strchr("-._~", *c) != nullptr;
+    if (plain) {
+      page_append(page, (const char *)c, 1);
+    } else {
+      char escaped[3] = {'%', hex[*c >> 4], hex[*c & 0xF]};
+      page_append(page, escaped, sizeof(escaped));
+    }
+  }
+}
+
+// Links are absolute so one cached page serves "/dir" and "/dir/" alike.
+static void page_append_dir(page_writer_t *page, string_view_t uri_path) {
+  page_append_escaped(page, uri_path);
+  if (uri_path.length == 0 || uri_path.data[uri_path.length - 1] != '/') {
+    page_append_sv(page, SV_LIT("/"));
+  }
+}
+
+static void render(page_writer_t *page, int dir_fd, string_view_t uri_path) {
+  while (uri_path.length > 1 && uri_path.data[uri_path.length - 1] == '/') {
+    uri_path.length--;
+  }
+
+  page_append_sv(page,
+                 SV_LIT("<!DOCTYPE html>\n<html>\n<head><title>Index of "));
+  page_append_dir(page, uri_path);
+  page_append_sv(page, SV_LIT("</title></head>\n<body>\n<h1>Index of "));
+  page_append_dir(page, uri_path);
+  page_append_sv(page, SV_LIT("</h1>\n<ul>\n"));
+  if (!sv_equal(uri_path, SV_LIT("/"))) {
+    size_t parent = uri_path.length;
+    while (parent > 0 && uri_path.data[parent - 1] != '/') {
+      parent--;
+    }
+    page_append_sv(page, SV_LIT("<li><a href=\""));
+    page_append_escaped(page, sv_slice(uri_path, 0, parent));
+    page_append_sv(page, SV_LIT("\">../</a></li>\n"));
+  }
+
+  // Entries go out in directory order as they are read, so a huge directory
+  // never needs to be held in memory to be listed.
+  _Alignas(struct linux_dirent64) char dents[DENTS_BUFFER];
+  while (!page->response.failed) {
+    long got = syscall(SYS_getdents64, dir_fd, dents, sizeof(dents));
+    if (got <= 0) {
+      if (got < 0) {
+        log_warn("getdents64 failed: %s", strerror(errno));
+      }
+      break;
+    }
+
+    for (long offset = 0; offset < got;) {
+      struct linux_dirent64 *entry = (struct linux_dirent64 *)(dents + offset);
+      offset += entry->d_reclen;
+
+      const char *name = entry->d_name;
+      if (name[0] == '.') {
+        continue;
+      }
+      bool dir = entry->d_type == DT_DIR;
+      struct stat st;
+      if (entry->d_type == DT_UNKNOWN &&
+          fstatat(dir_fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+        dir = S_ISDIR(st.st_mode);
+      }
+
+      page_append_sv(page, SV_LIT("<li><a href=\""));
+      page_append_dir(page, uri_path);
+      page_append_url(page, name);
+      if (dir) {
+        page_append_sv(page, SV_LIT("/"));
+      }
+      page_append_sv(page, SV_LIT("\">"));
+      page_append_escaped(page, sv_from_cstr(name));
+      if (dir) {
+        page_append_sv(page, SV_LIT("/"));
+      }
+      page_append_sv(page, SV_LIT("</a></li>\n"));
+    }
+  }
+
+  page_append_sv(page, SV_LIT("</ul>\n</body>\n</html>\n"));
+  (void)response_end(&page->response);
+}
+
+// Pages are keyed by the directory and the request path their links are
+// built from, since routes may list one directory under several prefixes.
+static listing_t *lookup(autoindex_t *index, size_t slot, string_view_t key,
+                         const struct stat *st) {
+  pthread_mutex_lock(&index->locks[slot]);
+  listing_t *listing = index->slots[slot];
+  if (listing != nullptr && listing->inode == (uint64_t)st->st_ino &&
+      listing->mtime_sec == (int64_t)st->st_mtim.tv_sec &&
+      listing->mtime_nsec == (int64_t)st->st_mtim.tv_nsec &&
+      listing->key_length == key.length &&
+      memcmp(listing->html, key.data, key.length) == 0) {
+    atomic_fetch_add(&listing->refs, 1);
+  } else {
+    listing = nullptr;
+  }
+  pthread_mutex_unlock(&index->locks[slot]);
+  return listing;
+}
+
+static void store(autoindex_t *index, size_t slot, string_view_t key,
+                  const struct stat *st, page_writer_t *page) {
+  listing_t *listing = calloc(1, sizeof(listing_t));
+  char *html = malloc(key.length + 1 + page->copy_length);
+  if (listing == nullptr || html == nullptr) {
+    free(listing);
+    free(html);
+    return;
+  }
+
+  memcpy(html, key.data, key.length);
+  html[key.length] = '\0';
+  memcpy(html + key.length + 1, page->copy, page->copy_length);
+  atomic_init(&listing->refs, 1);
+  listing->inode = (uint64_t)st->st_ino;
+  listing->mtime_sec = (int64_t)st->st_mtim.tv_sec;
+  listing->mtime_nsec = (int64_t)st->st_mtim.tv_nsec;
+  listing->key_length = key.length;
+  listing->length = page->copy_length;
+  listing->html = html;
+
+  pthread_mutex_lock(&index->locks[slot]);
+  listing_t *old = index->slots[slot];
+  index->slots[slot] = listing;
+  pthread_mutex_unlock(&index->locks[slot]);
+  listing_release(old);
+}
+
+[[nodiscard]]
+int autoindex_serve(autoindex_t *index, int client, const string_t *dir_path,
+                    const http_request_t *request, char *buffer,
+                    size_t capacity) {
+  if (index == nullptr || buffer == nullptr || capacity == 0) {
+    return -EINVAL;
+  }
+
+  int dir_fd = open(dir_path->data, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dir_fd == -1) {
+    log_warn("Cannot open directory \"%s\": %s", dir_path->data,
+             strerror(errno));
+    return -errno;
+  }
+
+  struct stat st;
+  if (fstat(dir_fd, &st) == -1) {
+    (void)close(dir_fd);
+    return -errno;
+  }
+
+  // "<dir_path>\0<request path>"
+  char *key_data = malloc(dir_path->length + 1 + request->path.length);
+  if (key_data == nullptr) {
+    (void)close(dir_fd);
+    return -ENOMEM;
+  }
+  memcpy(key_data, dir_path->data, dir_path->length + 1);
+  memcpy(key_data + dir_path->length + 1, request->path.data,
+         request->path.length);
+  string_view_t key = {key_data,
+                       dir_path->length + 1 + request->path.length};
+
+  size_t slot = slot_of(key);
+  listing_t *cached = lookup(index, slot, key, &st);
+  if (cached != nullptr) {
+    (void)close(dir_fd);
+    free(key_data);
+    // The length is known, so no chunked framing is needed.
+    int rc = response_send(client, request, status, headers,
+                           cached->html + cached->key_length + 1,
+                           cached->length);
+    listing_release(cached);
+    return rc;
+  }
+
+  page_writer_t page = {
+      .copy = malloc(capacity),
+      .copy_capacity = capacity,
+  };
+  page.cacheable = page.copy != nullptr;
+
+  if (response_begin(&page.response, client, request, buffer, capacity,
+                     status, headers) != 0) {
+    (void)close(dir_fd);
+    free(page.copy);
+    free(key_data);
+    return -EINVAL;
+  }
+  render(&page, dir_fd, request->path);
+  (void)close(dir_fd);
+
+  // Listed entries changed under us if the mtime moved; do not cache then.
+  struct stat after;
+  if (!page.response.failed && page.cacheable &&
+      stat(dir_path->data, &after) == 0 &&
+      after.st_mtim.tv_sec == st.st_mtim.tv_sec &&
+      after.st_mtim.tv_nsec == st.st_mtim.tv_nsec) {
+    store(index, slot, key, &st, &page);
+  }
+  free(page.copy);
+  free(key_data);
+
+  return page.response.failed ? -EPIPE : 0;
+}
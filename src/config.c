@@ -0,0 +1,345 @@
+#include <errno.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+#include "log.h"
+#include "socket.h"
+
+enum {
+  OPT_CACHE_BUDGET = 256,
+  OPT_HOT_SNAPSHOT,
+  OPT_SERVE_WHILE_WARMING,
+  OPT_DRAIN_TIMEOUT,
+  OPT_PIN_WORKERS,
+  OPT_HUGE_PAGES,
+  OPT_AUTOINDEX,
+  OPT_PROXY,
+  OPT_RATE_LIMIT,
+  OPT_RATE_BURST,
+  OPT_MIN_WORKERS,
+  OPT_UPLOAD,
+  OPT_UPLOAD_LIMIT,
+  OPT_MAX_WORKERS,
+  OPT_TLS_PORT,
+  OPT_TLS_CERT,
+  OPT_TLS_KEY,
+  OPT_UNIX,
+  OPT_UNIX_MODE,
+  OPT_PROCESSES,
+  OPT_TRACE_SAMPLE,
+  OPT_DEBUG_ENDPOINT,
+  OPT_COROUTINES,
+  OPT_IO_THREADS,
+  OPT_ROUTES,
+};
+
+static const struct option long_options[] = {
+    {"cache-budget", required_argument, nullptr, OPT_CACHE_BUDGET},
+    {"hot-snapshot", required_argument, nullptr, OPT_HOT_SNAPSHOT},
+    {"serve-while-warming", no_argument, nullptr, OPT_SERVE_WHILE_WARMING},
+    {"drain-timeout", required_argument, nullptr, OPT_DRAIN_TIMEOUT},
+    {"pin-workers", no_argument, nullptr, OPT_PIN_WORKERS},
+    {"huge-pages", required_argument, nullptr, OPT_HUGE_PAGES},
+    {"autoindex", no_argument, nullptr, OPT_AUTOINDEX},
+    {"proxy", required_argument, nullptr, OPT_PROXY},
+    {"rate-limit", required_argument, nullptr, OPT_RATE_LIMIT},
+    {"rate-burst", required_argument, nullptr, OPT_RATE_BURST},
+    {"upload", required_argument, nullptr, OPT_UPLOAD},
+    {"upload-limit", required_argument, nullptr, OPT_UPLOAD_LIMIT},
+    {"min-workers", required_argument, nullptr, OPT_MIN_WORKERS},
+    {"max-workers", required_argument, nullptr, OPT_MAX_WORKERS},
+    {"tls-port", required_argument, nullptr, OPT_TLS_PORT},
+    {"tls-cert", required_argument, nullptr, OPT_TLS_CERT},
+    {"tls-key", required_argument, nullptr, OPT_TLS_KEY},
+    {"unix", required_argument, nullptr, OPT_UNIX},
+    {"unix-mode", required_argument, nullptr, OPT_UNIX_MODE},
+    {"processes", required_argument, nullptr, OPT_PROCESSES},
+    {"trace-sample", required_argument, nullptr, OPT_TRACE_SAMPLE},
+    {"debug-endpoint", required_argument, nullptr, OPT_DEBUG_ENDPOINT},
+    {"coroutines", required_argument, nullptr, OPT_COROUTINES},
+    {"io-threads", required_argument, nullptr, OPT_IO_THREADS},
+    {"routes", required_argument, nullptr, OPT_ROUTES},
+    {nullptr, 0, nullptr, 0},
+};
+
+// Accepts a plain byte count or one with a K/M/G suffix.
+static int parse_size(const char *str, size_t *out) {
+  char *endptr;
+  constexpr int base = 10;
+  errno = 0;
+  unsigned long long val = strtoull(str, &endptr, base);
+  if (endptr == str || errno != 0) {
+    return -EINVAL;
+  }
+
+  unsigned shift = 0;
+  switch (*endptr) {
+  case 'G':
+  case 'g':
+    shift = 30;
+    break;
+  case 'M':
+  case 'm':
+    shift = 20;
+    break;
+  case 'K':
+  case 'k':
+    shift = 10;
+    break;
+  case '\0':
+    break;
+  default:
+    return -EINVAL;
+  }
+  if (shift != 0 && endptr[1] != '\0') {
+    return -EINVAL;
+  }
+  if (val > (SIZE_MAX >> shift)) {
+    return -ERANGE;
+  }
+
+  *out = (size_t)val << shift;
+  return 0;
+}
+
+static int parse_unsigned(const char *str, unsigned *out) {
+  char *endptr;
+  constexpr int base = 10;
+  errno = 0;
+  unsigned long val = strtoul(str, &endptr, base);
+  if (endptr == str || *endptr != '\0' || errno != 0 || val > UINT32_MAX) {
+    return -EINVAL;
+  }
+
+  *out = (unsigned)val;
+  return 0;
+}
+
+static int parse_mode(const char *str, unsigned *out) {
+  char *endptr;
+  constexpr int base = 8;
+  errno = 0;
+  unsigned long val = strtoul(str, &endptr, base);
+  if (endptr == str || *endptr != '\0' || errno != 0 || val > 0777) {
+    return -EINVAL;
+  }
+
+  *out = (unsigned)val;
+  return 0;
+}
+
+void config_usage(const char *prog) {
+  log_fatal("Usage: %s [--cache-budget BYTES[K|M|G]] [--hot-snapshot FILE] "
+            "[--serve-while-warming] [--drain-timeout SECONDS] "
+            "[--pin-workers] [--huge-pages none|thp|explicit] [--autoindex] "
+            "[--proxy PREFIX=HOST:PORT|unix:PATH[,...]]... "
+            "[--rate-limit PER_SECOND] [--rate-burst COUNT] "
+            "[--upload PREFIX=DIR]... [--upload-limit BYTES[K|M|G]] "
+            "[--min-workers COUNT] [--max-workers COUNT] "
+            "[--tls-port PORT --tls-cert FILE --tls-key FILE] "
+            "[--unix PATH|@NAME] [--unix-mode OCTAL] [--processes COUNT] "
+            "[--trace-sample N] [--debug-endpoint PATH] [--coroutines COUNT] "
+            "[--io-threads COUNT] [--routes FILE] "
+            "<port_number> <project_dir>",
+            prog);
+}
+
+[[nodiscard]]
+int config_parse(server_config_t *cfg, int argc, char *argv[]) {
+  *cfg = (server_config_t){
+      .port = 0,
+      .root_dir = nullptr,
+      .cache_budget = CACHE_DEFAULT_BUDGET,
+      .hot_snapshot = nullptr,
+      .serve_while_warming = false,
+      .drain_timeout = DRAIN_DEFAULT_TIMEOUT,
+      .pin_workers = false,
+      .huge_pages = HUGE_PAGES_THP,
+      .autoindex = false,
+      .proxy_route_count = 0,
+      .rate_limit = 0,
+      .rate_burst = 0,
+      .upload_route_count = 0,
+      .upload_limit = UPLOAD_DEFAULT_LIMIT,
+      .min_workers = 0,
+      .max_workers = 0,
+      .tls_port = 0,
+      .tls_cert = nullptr,
+      .tls_key = nullptr,
+      .unix_path = nullptr,
+      .unix_mode = UNIX_DEFAULT_MODE,
+      .processes = 0,
+      .trace_sample = 0,
+      .debug_endpoint = nullptr,
+      .coroutines = 0,
+      .io_threads = IO_THREADS_DEFAULT,
+      .routes_file = nullptr,
+  };
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "", long_options, nullptr)) != -1) {
+    switch (opt) {
+    case OPT_CACHE_BUDGET:
+      if (parse_size(optarg, &cfg->cache_budget) != 0) {
+        log_error("Invalid cache budget \"%s\"", optarg);
+        return -1;
+      }
+      break;
+    case OPT_HOT_SNAPSHOT:
+      cfg->hot_snapshot = optarg;
+      break;
+    case OPT_SERVE_WHILE_WARMING:
+      cfg->serve_while_warming = true;
+      break;
+    case OPT_PIN_WORKERS:
+      cfg->pin_workers = true;
+      break;
+    case OPT_HUGE_PAGES:
+      if (strcmp(optarg, "none") == 0) {
+        cfg->huge_pages = HUGE_PAGES_NONE;
+      } else if (strcmp(optarg, "thp") == 0) {
+        cfg->huge_pages = HUGE_PAGES_THP;
+      } else if (strcmp(optarg, "explicit") == 0) {
+        cfg->huge_pages = HUGE_PAGES_EXPLICIT;
+      } else {
+        log_error("Invalid huge page mode \"%s\"", optarg);
+        return -1;
+      }
+      break;
+    case OPT_AUTOINDEX:
+      cfg->autoindex = true;
+      break;
+    case OPT_PROXY:
+      if (cfg->proxy_route_count == PROXY_MAX_ROUTES) {
+        log_error("At most %d proxy routes", PROXY_MAX_ROUTES);
+        return -1;
+      }
+      cfg->proxy_routes[cfg->proxy_route_count++] = optarg;
+      break;
+    case OPT_RATE_LIMIT:
+      if (parse_unsigned(optarg, &cfg->rate_limit) != 0) {
+        log_error("Invalid rate limit \"%s\"", optarg);
+        return -1;
+      }
+      break;
+    case OPT_RATE_BURST:
+      if (parse_unsigned(optarg, &cfg->rate_burst) != 0 ||
+          cfg->rate_burst == 0) {
+        log_error("Invalid rate burst \"%s\"", optarg);
+        return -1;
+      }
+      break;
+    case OPT_UPLOAD:
+      if (cfg->upload_route_count == UPLOAD_MAX_ROUTES) {
+        log_error("At most %d upload routes", UPLOAD_MAX_ROUTES);
+        return -1;
+      }
+      cfg->upload_routes[cfg->upload_route_count++] = optarg;
+      break;
+    case OPT_UPLOAD_LIMIT:
+      if (parse_size(optarg, &cfg->upload_limit) != 0) {
+        log_error("Invalid upload limit \"%s\"", optarg);
+        return -1;
+      }
+      break;
+    case OPT_MIN_WORKERS:
+      if (parse_unsigned(optarg, &cfg->min_workers) != 0 ||
+          cfg->min_workers == 0) {
+        log_error("Invalid worker minimum \"%s\"", optarg);
+        return -1;
+      }
+      break;
+    case OPT_MAX_WORKERS:
+      if (parse_unsigned(optarg, &cfg->max_workers) != 0 ||
+          cfg->max_workers == 0) {
+        log_error("Invalid worker maximum \"%s\"", optarg);
+        return -1;
+      }
+      break;
+    case OPT_TLS_PORT:
+      if (parse_port(optarg, &cfg->tls_port) != 0) {
+        log_error("Invalid TLS port \"%s\"", optarg);
+        return -1;
+      }
+      break;
+    case OPT_TLS_CERT:
+      cfg->tls_cert = optarg;
+      break;
+    case OPT_TLS_KEY:
+      cfg->tls_key = optarg;
+      break;
+    case OPT_UNIX:
+      cfg->unix_path = optarg;
+      break;
+    case OPT_UNIX_MODE:
+      if (parse_mode(optarg, &cfg->unix_mode) != 0) {
+        log_error("Invalid socket mode \"%s\"", optarg);
+        return -1;
+      }
+      break;
+    case OPT_PROCESSES:
+      if (parse_unsigned(optarg, &cfg->processes) != 0 ||
+          cfg->processes > PREFORK_MAX_PROCESSES) {
+        log_error("Invalid process count \"%s\"", optarg);
+        return -1;
+      }
+      break;
+    case OPT_TRACE_SAMPLE:
+      if (parse_unsigned(optarg, &cfg->trace_sample) != 0) {
+        log_error("Invalid trace sample \"%s\"", optarg);
+        return -1;
+      }
+      break;
+    case OPT_DEBUG_ENDPOINT:
+      if (optarg[0] != '/') {
+        log_error("Debug endpoint \"%s\" must start with /", optarg);
+        return -1;
+      }
+      cfg->debug_endpoint = optarg;
+      break;
+    case OPT_COROUTINES:
+      if (parse_unsigned(optarg, &cfg->coroutines) != 0 ||
+          cfg->coroutines > COROUTINES_MAX) {
+        log_error("Invalid coroutine count \"%s\"", optarg);
+        return -1;
+      }
+      break;
+    case OPT_IO_THREADS:
+      if (parse_unsigned(optarg, &cfg->io_threads) != 0 ||
+          cfg->io_threads > IO_THREADS_MAX) {
+        log_error("Invalid I/O thread count \"%s\"", optarg);
+        return -1;
+      }
+      break;
+    case OPT_ROUTES:
+      cfg->routes_file = optarg;
+      break;
+    case OPT_DRAIN_TIMEOUT:
+      if (parse_unsigned(optarg, &cfg->drain_timeout) != 0) {
+        log_error("Invalid drain timeout \"%s\"", optarg);
+        return -1;
+      }
+      break;
+    default:
+      return -1;
+    }
+  }
+
+  if (argc - optind < 2) {
+    return -1;
+  }
+  if (parse_port(argv[optind], &cfg->port) != 0) {
+    log_error("Invalid port \"%s\"", argv[optind]);
+    return -1;
+  }
+  cfg->root_dir = argv[optind + 1];
+  if (cfg->rate_burst == 0) {
+    cfg->rate_burst = cfg->rate_limit;
+  }
+
+  return 0;
+}
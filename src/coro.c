@@ -0,0 +1,550 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "coro.h"
+#include "log.h"
+
+#if defined(__SANITIZE_ADDRESS__)
+#define CORO_ASAN 1
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define CORO_ASAN 1
+#endif
+#endif
+
+#ifdef CORO_ASAN
+#include <sanitizer/common_interface_defs.h>
+#endif
+
+#if !defined(__x86_64__)
+#include <ucontext.h>
+#endif
+
+enum {
+  GUARD_SIZE = 4096,
+  MS_PER_SEC = 1000,
+};
+
+#if defined(__x86_64__)
+// The stack pointer; everything else was pushed onto the stack.
+typedef struct {
+  void *sp;
+} context_t;
+#else
+typedef ucontext_t context_t;
+#endif
+
+typedef struct coro coro_t;
+
+// Lives at the top of its own stack mapping, above the copied argument.
+struct coro {
+  context_t context;
+  scheduler_t *scheduler;
+  unsigned char *stack; // Lowest usable byte, the guard page is below
+  coro_fn_t fn;
+  void *arg;
+  void *locals[CORO_LOCALS];
+  uint64_t deadline;  // Monotonic ms, while in the waiting set
+  int wait_index;     // In scheduler->waiting, -1 when not there
+  int wait_fd;
+  bool timed_out;
+  bool finished;
+  coro_t *next;       // Run queue or free list
+  void *fake_stack;   // AddressSanitizer's per-stack state
+};
+
+struct scheduler {
+  context_t context; // The thread's own stack while a coroutine runs
+  int epoll;
+  int wake_fd;
+  bool wake_armed;
+  unsigned limit;
+  unsigned live;
+  coro_t *running;
+  coro_t *ready_head;
+  coro_t *ready_tail;
+  coro_t **waiting; // Coroutines with a deadline, unordered
+  unsigned waiting_count;
+  uint64_t next_deadline; // Earliest deadline in waiting, or UINT64_MAX
+  coro_t *free;
+  unsigned free_count;
+  const void *thread_stack; // As AddressSanitizer reported it
+  size_t thread_stack_size;
+  void *fake_stack;
+};
+
+static thread_local scheduler_t *current;
+static thread_local void *thread_locals[CORO_LOCALS];
+
+static uint64_t now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * MS_PER_SEC +
+         (uint64_t)ts.tv_nsec / (1000000000 / MS_PER_SEC);
+}
+
+// AddressSanitizer keeps shadow state per stack and must be told about
+// every switch, or it reports the other stack's frames as overflows.
+static void asan_leave(void **fake_stack, const void *bottom, size_t size) {
+#ifdef CORO_ASAN
+  __sanitizer_start_switch_fiber(fake_stack, bottom, size);
+#else
+  (void)fake_stack;
+  (void)bottom;
+  (void)size;
+#endif
+}
+
+static void asan_arrive(void *fake_stack, const void **bottom, size_t *size) {
+#ifdef CORO_ASAN
+  __sanitizer_finish_switch_fiber(fake_stack, bottom, size);
+#else
+  (void)fake_stack;
+  (void)bottom;
+  (void)size;
+#endif
+}
+
+[[gnu::visibility("hidden"), gnu::used]] void coro_main(void);
+
+#if defined(__x86_64__)
+[[gnu::visibility("hidden")]] void coro_switch(void **from, void *to);
+[[gnu::visibility("hidden")]] void coro_start(void);
+
+// The System V ABI leaves rbx, rbp and r12-r15 to the callee; the rest are
+// already saved by the compiler around the call. A new stack starts with
+// zeroed registers and coro_start as the return address.
+__asm__(".text\n"
+        ".p2align 4\n"
+        ".globl coro_switch\n"
+        ".hidden coro_switch\n"
+        ".type coro_switch, @function\n"
+        "coro_switch:\n"
+        "  pushq %rbp\n"
+        "  pushq %rbx\n"
+        "  pushq %r12\n"
+        "  pushq %r13\n"
+        "  pushq %r14\n"
+        "  pushq %r15\n"
+        "  movq %rsp, (%rdi)\n"
+        "  movq %rsi, %rsp\n"
+        "  popq %r15\n"
+        "  popq %r14\n"
+        "  popq %r13\n"
+        "  popq %r12\n"
+        "  popq %rbx\n"
+        "  popq %rbp\n"
+        "  ret\n"
+        ".size coro_switch, .-coro_switch\n"
+        ".p2align 4\n"
+        ".globl coro_start\n"
+        ".hidden coro_start\n"
+        ".type coro_start, @function\n"
+        "coro_start:\n"
+        "  call coro_main\n"
+        "  ud2\n"
+        ".size coro_start, .-coro_start\n");
+
+static void context_switch(context_t *from, context_t *to) {
+  coro_switch(&from->sp, to->sp);
+}
+
+static void context_make(context_t *context, unsigned char *stack,
+                         size_t size) {
+  // 16 byte aligned once coro_start is popped, as a call would leave it.
+  uintptr_t top = ((uintptr_t)stack + size) & ~(uintptr_t)15;
+  uintptr_t *sp = (uintptr_t *)(top - 16) - 7;
+  memset(sp, 0, 7 * sizeof(uintptr_t));
+  sp[6] = (uintptr_t)coro_start;
+  context->sp = sp;
+}
+#else
+static void context_switch(context_t *from, context_t *to) {
+  (void)swapcontext(from, to);
+}
+
+static void context_make(context_t *context, unsigned char *stack,
+                         size_t size) {
+  (void)getcontext(context);
+  context->uc_stack.ss_sp = stack;
+  context->uc_stack.ss_size = size;
+  context->uc_link = nullptr;
+  makecontext(context, coro_main, 0);
+}
+#endif
+
+scheduler_t *scheduler_create(unsigned limit, int wake_fd) {
+  scheduler_t *scheduler = calloc(1, sizeof(scheduler_t));
+  coro_t **waiting = calloc(limit, sizeof(coro_t *));
+  int epoll = epoll_create1(EPOLL_CLOEXEC);
+  if (scheduler == nullptr || waiting == nullptr || epoll == -1) {
+    log_error("Cannot create a coroutine scheduler: %s", strerror(errno));
+    free(scheduler);
+    free(waiting);
+    if (epoll != -1) {
+      (void)close(epoll);
+    }
+    return nullptr;
+  }
+  scheduler->epoll = epoll;
+  scheduler->wake_fd = wake_fd;
+  scheduler->limit = limit;
+  scheduler->waiting = waiting;
+  scheduler->next_deadline = UINT64_MAX;
+  return scheduler;
+}
+
+// guard page | stack | argument | coro_t
+static size_t mapping_size(void) {
+  return GUARD_SIZE + CORO_STACK_SIZE + CORO_ARG_MAX + sizeof(coro_t);
+}
+
+static void unmap(coro_t *coro) {
+  (void)munmap(coro->stack - GUARD_SIZE, mapping_size());
+}
+
+void scheduler_destroy(scheduler_t *scheduler) {
+  if (scheduler == nullptr) {
+    return;
+  }
+  while (scheduler->free != nullptr) {
+    coro_t *coro = scheduler->free;
+    scheduler->free = coro->next;
+    unmap(coro);
+  }
+  (void)close(scheduler->epoll);
+  free(scheduler->waiting);
+  free(scheduler);
+}
+
+unsigned scheduler_live(const scheduler_t *scheduler) {
+  return scheduler->live;
+}
+
+static coro_t *coro_alloc(scheduler_t *scheduler) {
+  coro_t *coro = scheduler->free;
+  if (coro != nullptr) {
+    scheduler->free = coro->next;
+    scheduler->free_count--;
+    return coro;
+  }
+
+  size_t size = mapping_size();
+  unsigned char *region =
+      mmap(nullptr, size, PROT_READ | PROT_WRITE,
+           MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+  if (region == MAP_FAILED) {
+    return nullptr;
+  }
+  // An overflow faults instead of running into the neighbouring stack.
+  (void)mprotect(region, GUARD_SIZE, PROT_NONE);
+  coro = (coro_t *)(region + size - sizeof(coro_t));
+  coro->stack = region + GUARD_SIZE;
+  return coro;
+}
+
+static void make_ready(scheduler_t *scheduler, coro_t *coro) {
+  coro->next = nullptr;
+  if (scheduler->ready_tail != nullptr) {
+    scheduler->ready_tail->next = coro;
+  } else {
+    scheduler->ready_head = coro;
+  }
+  scheduler->ready_tail = coro;
+}
+
+int scheduler_spawn(scheduler_t *scheduler, coro_fn_t fn, const void *arg,
+                    size_t size) {
+  if (size > CORO_ARG_MAX || scheduler->live >= scheduler->limit) {
+    return -EINVAL;
+  }
+  coro_t *coro = coro_alloc(scheduler);
+  if (coro == nullptr) {
+    log_warn("Cannot map a coroutine stack: %s", strerror(errno));
+    return -ENOMEM;
+  }
+
+  unsigned char *stack = coro->stack;
+  *coro = (coro_t){
+      .scheduler = scheduler,
+      .stack = stack,
+      .fn = fn,
+      .arg = stack + CORO_STACK_SIZE,
+      .wait_index = -1,
+      .wait_fd = -1,
+  };
+  memcpy(coro->arg, arg, size);
+  context_make(&coro->context, stack, CORO_STACK_SIZE);
+  scheduler->live++;
+  make_ready(scheduler, coro);
+  return 0;
+}
+
+static void release(scheduler_t *scheduler, coro_t *coro) {
+  scheduler->live--;
+  if (scheduler->free_count >= CORO_STACK_CACHE) {
+    unmap(coro);
+    return;
+  }
+  coro->next = scheduler->free;
+  scheduler->free = coro;
+  scheduler->free_count++;
+}
+
+static void resume(scheduler_t *scheduler, coro_t *coro) {
+  scheduler->running = coro;
+  asan_leave(&scheduler->fake_stack, coro->stack, CORO_STACK_SIZE);
+  context_switch(&scheduler->context, &coro->context);
+  asan_arrive(scheduler->fake_stack, nullptr, nullptr);
+  scheduler->running = nullptr;
+  if (coro->finished) {
+    release(scheduler, coro);
+  }
+}
+
+static void suspend(coro_t *coro) {
+  scheduler_t *scheduler = coro->scheduler;
+  // A finished coroutine's fake frames go with it.
+  asan_leave(coro->finished ? nullptr : &coro->fake_stack,
+             scheduler->thread_stack, scheduler->thread_stack_size);
+  context_switch(&coro->context, &scheduler->context);
+  asan_arrive(coro->fake_stack, nullptr, nullptr);
+}
+
+void coro_main(void) {
+  scheduler_t *scheduler = current;
+  coro_t *coro = scheduler->running;
+  asan_arrive(nullptr, &scheduler->thread_stack,
+              &scheduler->thread_stack_size);
+
+  coro->fn(coro->arg);
+  coro->finished = true;
+  suspend(coro);
+}
+
+static void set_accepting(scheduler_t *scheduler, bool accepting) {
+  if (scheduler->wake_fd == -1 || scheduler->wake_armed == accepting) {
+    return;
+  }
+  // Exclusive, so a connection wakes one busy worker, not all of them.
+  struct epoll_event event = {.events = EPOLLIN | EPOLLEXCLUSIVE,
+                              .data.ptr = scheduler};
+  int rc = accepting ? epoll_ctl(scheduler->epoll, EPOLL_CTL_ADD,
+                                 scheduler->wake_fd, &event)
+                     : epoll_ctl(scheduler->epoll, EPOLL_CTL_DEL,
+                                 scheduler->wake_fd, nullptr);
+  if (rc == 0) {
+    scheduler->wake_armed = accepting;
+  }
+}
+
+static void remove_waiter(scheduler_t *scheduler, coro_t *coro) {
+  if (coro->wait_index < 0) {
+    return;
+  }
+  coro_t *last = scheduler->waiting[--scheduler->waiting_count];
+  scheduler->waiting[coro->wait_index] = last;
+  last->wait_index = coro->wait_index;
+  coro->wait_index = -1;
+}
+
+static void expire(scheduler_t *scheduler, uint64_t now) {
+  if (now < scheduler->next_deadline) {
+    return;
+  }
+  uint64_t next = UINT64_MAX;
+  for (unsigned i = scheduler->waiting_count; i-- > 0;) {
+    coro_t *coro = scheduler->waiting[i];
+    if (coro->deadline > now) {
+      next = coro->deadline < next ? coro->deadline : next;
+      continue;
+    }
+    // Disarmed so a late event cannot resume it somewhere else.
+    (void)epoll_ctl(scheduler->epoll, EPOLL_CTL_DEL, coro->wait_fd, nullptr);
+    coro->timed_out = true;
+    remove_waiter(scheduler, coro);
+    make_ready(scheduler, coro);
+  }
+  scheduler->next_deadline = next;
+}
+
+void scheduler_run(scheduler_t *scheduler, bool accepting) {
+  current = scheduler;
+  while (scheduler->ready_head != nullptr) {
+    coro_t *coro = scheduler->ready_head;
+    scheduler->ready_head = coro->next;
+    if (scheduler->ready_head == nullptr) {
+      scheduler->ready_tail = nullptr;
+    }
+    resume(scheduler, coro);
+  }
+  if (scheduler->live == 0) {
+    return;
+  }
+
+  accepting = accepting && scheduler->live < scheduler->limit;
+  set_accepting(scheduler, accepting);
+  int timeout = -1;
+  if (scheduler->waiting_count > 0) {
+    uint64_t now = now_ms();
+    timeout = scheduler->next_deadline <= now
+                  ? 0
+                  : (int)(scheduler->next_deadline - now);
+  }
+  if (accepting && scheduler->wake_fd == -1 &&
+      (timeout < 0 || timeout > CORO_POLL_MS)) {
+    timeout = CORO_POLL_MS;
+  }
+
+  struct epoll_event events[CORO_EVENTS];
+  int count = epoll_wait(scheduler->epoll, events, CORO_EVENTS, timeout);
+  for (int i = 0; i < count; i++) {
+    if (events[i].data.ptr == scheduler) {
+      continue;
+    }
+    coro_t *coro = events[i].data.ptr;
+    remove_waiter(scheduler, coro);
+    make_ready(scheduler, coro);
+  }
+  expire(scheduler, now_ms());
+}
+
+bool coro_active(void) {
+  return current != nullptr && current->running != nullptr;
+}
+
+int coro_wait(int fd, short events, int timeout_ms) {
+  if (!coro_active()) {
+    struct pollfd pfd = {.fd = fd, .events = events};
+    return poll(&pfd, 1, timeout_ms);
+  }
+
+  scheduler_t *scheduler = current;
+  coro_t *coro = scheduler->running;
+  struct epoll_event event = {.events = (uint32_t)events | EPOLLONESHOT,
+                              .data.ptr = coro};
+  // Descriptors stay registered between waits, disarmed by EPOLLONESHOT.
+  if (epoll_ctl(scheduler->epoll, EPOLL_CTL_MOD, fd, &event) != 0 &&
+      (errno != ENOENT ||
+       epoll_ctl(scheduler->epoll, EPOLL_CTL_ADD, fd, &event) != 0)) {
+    return -1;
+  }
+  coro->wait_fd = fd;
+  coro->timed_out = false;
+  if (timeout_ms >= 0) {
+    coro->deadline = now_ms() + (uint64_t)timeout_ms;
+    coro->wait_index = (int)scheduler->waiting_count;
+    scheduler->waiting[scheduler->waiting_count++] = coro;
+    if (coro->deadline < scheduler->next_deadline) {
+      scheduler->next_deadline = coro->deadline;
+    }
+  }
+  suspend(coro);
+  return coro->timed_out ? 0 : 1;
+}
+
+void **coro_local(coro_local_t key) {
+  if (coro_active()) {
+    return &current->running->locals[key];
+  }
+  return &thread_locals[key];
+}
+
+// Whether to retry a call that failed on fd, after waiting for events.
+static bool await(int fd, short events) {
+  if (errno == EINTR) {
+    return true;
+  }
+  if ((errno != EAGAIN && errno != EWOULDBLOCK) || !coro_active()) {
+    return false;
+  }
+  int rc = coro_wait(fd, events, CORO_IO_TIMEOUT * MS_PER_SEC);
+  if (rc == 0) {
+    errno = ETIMEDOUT;
+  }
+  return rc > 0;
+}
+
+ssize_t coro_read(int fd, void *data, size_t length) {
+  ssize_t rc;
+  while ((rc = read(fd, data, length)) < 0 && await(fd, POLLIN)) {
+  }
+  return rc;
+}
+
+ssize_t coro_write(int fd, const void *data, size_t length) {
+  ssize_t rc;
+  while ((rc = write(fd, data, length)) < 0 && await(fd, POLLOUT)) {
+  }
+  return rc;
+}
+
+ssize_t coro_writev(int fd, const struct iovec *iov, int count) {
+  ssize_t rc;
+  while ((rc = writev(fd, iov, count)) < 0 && await(fd, POLLOUT)) {
+  }
+  return rc;
+}
+
+ssize_t coro_recv(int fd, void *data, size_t length, int flags) {
+  ssize_t rc;
+  while ((rc = recv(fd, data, length, flags)) < 0 && await(fd, POLLIN)) {
+  }
+  return rc;
+}
+
+ssize_t coro_send(int fd, const void *data, size_t length, int flags) {
+  ssize_t rc;
+  while ((rc = send(fd, data, length, flags)) < 0 && await(fd, POLLOUT)) {
+  }
+  return rc;
+}
+
+ssize_t coro_sendfile(int to, int from, off_t *offset, size_t length) {
+  ssize_t rc;
+  while ((rc = sendfile(to, from, offset, length)) < 0 &&
+         await(to, POLLOUT)) {
+  }
+  return rc;
+}
+
+ssize_t coro_splice(int from, int to, size_t length, unsigned flags,
+                    bool into_pipe) {
+  ssize_t rc;
+  while ((rc = splice(from, nullptr, to, nullptr, length, flags)) < 0 &&
+         (into_pipe ? await(from, POLLIN) : await(to, POLLOUT))) {
+  }
+  return rc;
+}
+
+int coro_connect(int fd, const struct sockaddr *addr, socklen_t length) {
+  if (connect(fd, addr, length) == 0) {
+    return 0;
+  }
+  if (errno != EINPROGRESS || !coro_active()) {
+    return -1;
+  }
+  int rc = coro_wait(fd, POLLOUT, CORO_IO_TIMEOUT * MS_PER_SEC);
+  if (rc <= 0) {
+    errno = rc == 0 ? ETIMEDOUT : errno;
+    return -1;
+  }
+  int error = 0;
+  socklen_t error_length = sizeof(error);
+  if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &error_length) != 0) {
+    return -1;
+  }
+  errno = error;
+  return error == 0 ? 0 : -1;
+}
@@ -0,0 +1,303 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "coro.h"
+#include "disk_io.h"
+#include "log.h"
+#include "socket.h"
+
+enum {
+  PAGE_IN_BUFFER = 64 * 1024, // Scratch a helper reads through to page in
+};
+
+typedef struct disk_job {
+  struct disk_job *next;
+  int fd;
+  unsigned char *dst; // nullptr to only bring the range into the page cache
+  size_t length;
+  off_t offset;
+  int result;  // 0 or -errno
+  int done_fd; // eventfd the helper signals
+} disk_job_t;
+
+struct disk_io {
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  disk_job_t *head;
+  disk_job_t *tail;
+  bool stop;
+  unsigned thread_count;
+  pthread_t threads[];
+};
+
+// Set once a filesystem rejects RWF_NOWAIT, after which every read of a
+// coroutine is offloaded.
+static atomic_bool nowait_unsupported;
+
+static int read_range(int fd, unsigned char *dst, size_t length,
+                      off_t offset) {
+  size_t done = 0;
+  while (done < length) {
+    ssize_t got = pread(fd, dst + done, length - done, offset + (off_t)done);
+    if (got < 0 && errno == EINTR) {
+      continue;
+    }
+    if (got < 0) {
+      return -errno;
+    }
+    if (got == 0) {
+      return -EIO;
+    }
+    done += (size_t)got;
+  }
+  return 0;
+}
+
+// Reads the range through a scratch buffer, leaving it in the page cache.
+static int page_in(int fd, size_t length, off_t offset) {
+  unsigned char scratch[PAGE_IN_BUFFER];
+  while (length > 0) {
+    size_t part = length < sizeof(scratch) ? length : sizeof(scratch);
+    int rc = read_range(fd, scratch, part, offset);
+    if (rc != 0) {
+      return rc;
+    }
+    length -= part;
+    offset += (off_t)part;
+  }
+  return 0;
+}
+
+static int run_job(const disk_job_t *job) {
+  return job->dst != nullptr
+             ? read_range(job->fd, job->dst, job->length, job->offset)
+             : page_in(job->fd, job->length, job->offset);
+}
+
+static void *helper_entry(void *arg) {
+  disk_io_t *io = arg;
+  pthread_mutex_lock(&io->lock);
+  for (;;) {
+    while (io->head == nullptr && !io->stop) {
+      pthread_cond_wait(&io->wake, &io->lock);
+    }
+    disk_job_t *job = io->head;
+    if (job == nullptr) {
+      break;
+    }
+    io->head = job->next;
+    if (io->head == nullptr) {
+      io->tail = nullptr;
+    }
+    pthread_mutex_unlock(&io->lock);
+
+    job->result = run_job(job);
+    // The job lives on the waiting coroutine's stack: hands off after this.
+    uint64_t one = 1;
+    (void)write(job->done_fd, &one, sizeof(one));
+
+    pthread_mutex_lock(&io->lock);
+  }
+  pthread_mutex_unlock(&io->lock);
+  return nullptr;
+}
+
+[[nodiscard]]
+int disk_io_create(const server_config_t *config, disk_io_t **out) {
+  *out = nullptr;
+  if (config->coroutines == 0 || config->io_threads == 0) {
+    return 0;
+  }
+
+  disk_io_t *io = calloc(
+      1, sizeof(disk_io_t) + config->io_threads * sizeof(pthread_t));
+  if (io == nullptr) {
+    return -ENOMEM;
+  }
+  pthread_mutex_init(&io->lock, nullptr);
+  pthread_cond_init(&io->wake, nullptr);
+  for (unsigned i = 0; i < config->io_threads; i++) {
+    if (pthread_create(&io->threads[i], nullptr, helper_entry, io) != 0) {
+      log_error("Cannot start disk I/O thread %u", i);
+      disk_io_destroy(io);
+      return -EAGAIN;
+    }
+    io->thread_count++;
+  }
+
+  log_info("Disk I/O: %u helper thread(s)", io->thread_count);
+  *out = io;
+  return 0;
+}
+
+void disk_io_destroy(disk_io_t *io) {
+  if (io == nullptr) {
+    return;
+  }
+  pthread_mutex_lock(&io->lock);
+  io->stop = true;
+  pthread_cond_broadcast(&io->wake);
+  pthread_mutex_unlock(&io->lock);
+  for (unsigned i = 0; i < io->thread_count; i++) {
+    pthread_join(io->threads[i], nullptr);
+  }
+  pthread_mutex_destroy(&io->lock);
+  pthread_cond_destroy(&io->wake);
+  free(io);
+}
+
+// Copies the cached prefix of the range without touching the disk. Returns
+// the bytes read, or -errno when the file ended early.
+static ssize_t read_cached(int fd, unsigned char *dst, size_t length) {
+#ifdef RWF_NOWAIT
+  size_t done = 0;
+  while (done < length &&
+         !atomic_load_explicit(&nowait_unsupported, memory_order_relaxed)) {
+    struct iovec iov = {.iov_base = dst + done, .iov_len = length - done};
+    ssize_t got = preadv2(fd, &iov, 1, (off_t)done, RWF_NOWAIT);
+    if (got > 0) {
+      done += (size_t)got;
+      continue;
+    }
+    if (got == 0) {
+      return -EIO;
+    }
+    if (errno == EINTR) {
+      continue;
+    }
+    if (errno == EOPNOTSUPP || errno == EINVAL) {
+      atomic_store_explicit(&nowait_unsupported, true, memory_order_relaxed);
+    }
+    break; // EAGAIN: the rest is on disk
+  }
+  return (ssize_t)done;
+#else
+  (void)fd;
+  (void)dst;
+  (void)length;
+  return 0;
+#endif
+}
+
+// Runs job on a helper thread while the coroutine waits on an eventfd, or
+// inline when there is none to wait on. Returns the job's result.
+static int offload(disk_io_t *io, disk_job_t *job) {
+  job->done_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (job->done_fd == -1) {
+    return run_job(job);
+  }
+
+  pthread_mutex_lock(&io->lock);
+  if (io->tail != nullptr) {
+    io->tail->next = job;
+  } else {
+    io->head = job;
+  }
+  io->tail = job;
+  pthread_cond_signal(&io->wake);
+  pthread_mutex_unlock(&io->lock);
+
+  // No timeout: the helper writes into the job, so it cannot be abandoned.
+  uint64_t count;
+  while (read(job->done_fd, &count, sizeof(count)) != sizeof(count)) {
+    if (coro_wait(job->done_fd, POLLIN, -1) < 0) {
+      struct pollfd pfd = {.fd = job->done_fd, .events = POLLIN};
+      (void)poll(&pfd, 1, -1);
+    }
+  }
+  (void)close(job->done_fd);
+  return job->result;
+}
+
+[[nodiscard]]
+int disk_io_read(disk_io_t *io, int fd, void *dst, size_t length) {
+  if (io == nullptr || !coro_active()) {
+    return read_range(fd, dst, length, 0);
+  }
+
+  ssize_t cached = read_cached(fd, dst, length);
+  if (cached < 0 || (size_t)cached == length) {
+    return cached < 0 ? (int)cached : 0;
+  }
+
+  disk_job_t job = {
+      .fd = fd,
+      .dst = (unsigned char *)dst + cached,
+      .length = length - (size_t)cached,
+      .offset = (off_t)cached,
+  };
+  return offload(io, &job);
+}
+
+// Whether the first and last byte of the range are in the page cache. Pages
+// come in and go out in readahead windows, so the ends stand for the middle
+// without copying it all out.
+static bool range_cached(int fd, size_t length, off_t offset) {
+#ifdef RWF_NOWAIT
+  if (atomic_load_explicit(&nowait_unsupported, memory_order_relaxed)) {
+    return false;
+  }
+  off_t ends[2] = {offset, offset + (off_t)length - 1};
+  for (int i = 0; i < 2; i++) {
+    char byte;
+    struct iovec iov = {.iov_base = &byte, .iov_len = 1};
+    ssize_t got;
+    do {
+      got = preadv2(fd, &iov, 1, ends[i], RWF_NOWAIT);
+    } while (got < 0 && errno == EINTR);
+    if (got < 0 && (errno == EOPNOTSUPP || errno == EINVAL)) {
+      atomic_store_explicit(&nowait_unsupported, true, memory_order_relaxed);
+    }
+    // 0 means the file shrank: sendfile() finds out and fails.
+    if (got < 0) {
+      return false;
+    }
+  }
+  return true;
+#else
+  (void)fd;
+  (void)length;
+  (void)offset;
+  return false;
+#endif
+}
+
+[[nodiscard]]
+int disk_io_sendfile(disk_io_t *io, int to, int from, off_t *offset,
+                     size_t length) {
+  if (io == nullptr || !coro_active()) {
+    return socket_sendfile_all(to, from, offset, length);
+  }
+
+  while (length > 0) {
+    size_t part = length < DISK_IO_SEND_CHUNK ? length : DISK_IO_SEND_CHUNK;
+    if (!range_cached(from, part, *offset)) {
+      disk_job_t job = {.fd = from, .length = part, .offset = *offset};
+      // A failed page-in is left for sendfile() to report.
+      (void)offload(io, &job);
+    }
+    if (socket_sendfile_all(to, from, offset, part) != 0) {
+      return -1;
+    }
+    length -= part;
+  }
+  return 0;
+}
+
+void disk_io_advise(int fd, size_t length) {
+  size_t ahead = length < DISK_IO_READAHEAD ? length : DISK_IO_READAHEAD;
+  (void)posix_fadvise(fd, 0, (off_t)ahead, POSIX_FADV_WILLNEED);
+  if (length > DISK_IO_READAHEAD) {
+    // Doubles the kernel's readahead window for the rest of the file.
+    (void)posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  }
+}
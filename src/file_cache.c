@@ -0,0 +1,593 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "disk_io.h"
+#include "file.h"
+#include "file_cache.h"
+#include "log.h"
+#include "string_utils.h"
+
+enum {
+  CACHE_MIN_SLOTS = 1024,
+  CACHE_MAX_SLOTS = 1 << 20,
+  CACHE_AVG_FILE = 4096,
+  CACHE_ALIGN = 8,
+  CACHE_LINE = 64,
+  CACHE_STALE_SHARE = 4, // Compact once 1/4 of the heap or slots is stale
+  // One per worker process and one for the master.
+  CACHE_READER_SLOTS = PREFORK_MAX_PROCESSES + 1,
+};
+
+// Key values 0 and 1 are reserved, real hashes are moved above them.
+#define SLOT_EMPTY 0ULL
+#define SLOT_STALE 1ULL
+
+typedef struct {
+  _Atomic uint64_t key;
+  _Atomic bool ready;
+  uint32_t path_length;
+  size_t offset; // Path, NUL, data, NUL inside the heap
+  size_t length;
+  _Atomic uint64_t hits;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+  uint64_t inode;
+} cache_slot_t;
+
+typedef enum {
+  FLUSH_NONE,
+  FLUSH_DRAINING,  // Waiting for readers of the previous epoch
+  FLUSH_COMPACTING // Live entries moving down the heap
+} flush_state_t;
+
+// Readers holding each of the two latest epochs, in one process.
+typedef struct {
+  _Alignas(CACHE_LINE) _Atomic uint64_t count[2];
+} reader_slot_t;
+
+struct file_cache {
+  size_t region_size;
+  size_t slot_mask;
+  size_t heap_capacity;
+  _Atomic size_t heap_used;
+  // Heap bytes and slots held by entries gone stale, lost to a race or
+  // never published: what a compaction gives back.
+  _Atomic size_t stale_bytes;
+  _Atomic size_t stale_slots;
+  _Atomic uint64_t epoch;
+  _Atomic int flush; // flush_state_t
+  cache_slot_t *slots;
+  unsigned char *heap;
+  reader_slot_t readers[CACHE_READER_SLOTS];
+};
+
+// Per process: worker processes take their own with file_cache_attach().
+static int reader_slot;
+
+static uint64_t hash_path(const char *data, size_t length) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < length; i++) {
+    hash ^= (unsigned char)data[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash > SLOT_STALE ? hash : hash + 2;
+}
+
+static size_t align_up(size_t size) {
+  return (size + CACHE_ALIGN - 1) & ~(size_t)(CACHE_ALIGN - 1);
+}
+
+// Heap bytes of an entry: path, NUL, data, NUL.
+static size_t entry_size(size_t path_length, size_t length) {
+  return align_up(path_length + length + 2);
+}
+
+[[nodiscard]]
+file_cache_t *file_cache_create(size_t budget, bool shared) {
+  if (budget == 0) {
+    return nullptr;
+  }
+
+  size_t slots = CACHE_MIN_SLOTS;
+  while (slots < CACHE_MAX_SLOTS && slots * CACHE_AVG_FILE < budget) {
+    slots <<= 1;
+  }
+
+  size_t header = align_up(sizeof(file_cache_t));
+  size_t table = slots * sizeof(cache_slot_t);
+  size_t region_size = header + table + budget;
+
+  // NORESERVE: the budget is an upper bound, pages are only touched on insert.
+  int flags = (shared ? MAP_SHARED : MAP_PRIVATE) | MAP_ANONYMOUS |
+              MAP_NORESERVE;
+  void *region =
+      mmap(nullptr, region_size, PROT_READ | PROT_WRITE, flags, -1, 0);
+  if (region == MAP_FAILED) {
+    log_error("Cannot map file cache of %zu bytes: %s", region_size,
+              strerror(errno));
+    return nullptr;
+  }
+
+  // Fresh anonymous pages are zero: no readers, no flush, epoch 0.
+  file_cache_t *cache = (file_cache_t *)region;
+  cache->region_size = region_size;
+  cache->slot_mask = slots - 1;
+  cache->heap_capacity = budget;
+  atomic_init(&cache->heap_used, 0);
+  cache->slots = (cache_slot_t *)((unsigned char *)region + header);
+  cache->heap = (unsigned char *)region + header + table;
+
+  log_info("File cache: %zu slots, %zu bytes budget%s", slots, budget,
+           shared ? ", shared" : "");
+  return cache;
+}
+
+void file_cache_destroy(file_cache_t *cache) {
+  if (cache == nullptr) {
+    return;
+  }
+  (void)munmap(cache, cache->region_size);
+}
+
+void file_cache_attach(file_cache_t *cache, int slot) {
+  reader_slot = slot < CACHE_READER_SLOTS ? slot : CACHE_READER_SLOTS - 1;
+  if (cache == nullptr) {
+    return;
+  }
+  // Whatever a dead predecessor in this slot held is gone with it.
+  atomic_store(&cache->readers[reader_slot].count[0], 0);
+  atomic_store(&cache->readers[reader_slot].count[1], 0);
+}
+
+uint64_t file_cache_enter(file_cache_t *cache) {
+  if (cache == nullptr) {
+    return 0;
+  }
+  _Atomic uint64_t *count = cache->readers[reader_slot].count;
+  while (true) {
+    uint64_t epoch = atomic_load(&cache->epoch);
+    atomic_fetch_add(&count[epoch & 1], 1);
+    // Counted before a flush bumped the epoch, or retried after it.
+    if (atomic_load(&cache->epoch) == epoch) {
+      return epoch;
+    }
+    atomic_fetch_sub(&count[epoch & 1], 1);
+  }
+}
+
+typedef struct {
+  uint64_t key;
+  uint32_t path_length;
+  size_t offset;
+  size_t length;
+  uint64_t hits;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+  uint64_t inode;
+} live_entry_t;
+
+static int compare_offsets(const void *a, const void *b) {
+  const live_entry_t *lhs = a;
+  const live_entry_t *rhs = b;
+  return (lhs->offset > rhs->offset) - (lhs->offset < rhs->offset);
+}
+
+// Slides the published entries to the start of the heap and rebuilds the
+// table from them. Nothing reads the cache meanwhile. When the list of
+// entries cannot be allocated, all of them are dropped instead.
+static void compact(file_cache_t *cache) {
+  size_t slots = cache->slot_mask + 1;
+  size_t count = 0;
+  live_entry_t *live = malloc(slots * sizeof(live_entry_t));
+  for (size_t i = 0; live != nullptr && i < slots; i++) {
+    cache_slot_t *slot = &cache->slots[i];
+    if (atomic_load(&slot->ready)) {
+      live[count++] = (live_entry_t){
+          .key = atomic_load(&slot->key),
+          .path_length = slot->path_length,
+          .offset = slot->offset,
+          .length = slot->length,
+          .hits = atomic_load(&slot->hits),
+          .mtime_sec = slot->mtime_sec,
+          .mtime_nsec = slot->mtime_nsec,
+          .inode = slot->inode,
+      };
+    }
+  }
+  for (size_t i = 0; i < slots; i++) {
+    atomic_store(&cache->slots[i].key, SLOT_EMPTY);
+    atomic_store(&cache->slots[i].ready, false);
+  }
+
+  // In offset order every move goes down, over bytes already moved from.
+  if (live != nullptr) {
+    qsort(live, count, sizeof(live_entry_t), compare_offsets);
+  }
+  size_t used = 0;
+  for (size_t i = 0; i < count; i++) {
+    size_t size = entry_size(live[i].path_length, live[i].length);
+    memmove(cache->heap + used, cache->heap + live[i].offset, size);
+    cache_slot_t *slot = &cache->slots[live[i].key & cache->slot_mask];
+    while (atomic_load(&slot->key) != SLOT_EMPTY) {
+      slot = slot == &cache->slots[cache->slot_mask] ? cache->slots
+                                                     : slot + 1;
+    }
+    atomic_store(&slot->key, live[i].key);
+    slot->path_length = live[i].path_length;
+    slot->offset = used;
+    slot->length = live[i].length;
+    slot->inode = live[i].inode;
+    slot->mtime_sec = live[i].mtime_sec;
+    slot->mtime_nsec = live[i].mtime_nsec;
+    atomic_store(&slot->hits, live[i].hits);
+    atomic_store(&slot->ready, true);
+    used += size;
+  }
+  free(live);
+
+  size_t freed = atomic_load(&cache->heap_used) - used;
+  atomic_store(&cache->heap_used, used);
+  atomic_store(&cache->stale_bytes, 0);
+  atomic_store(&cache->stale_slots, 0);
+  log_info("File cache compacted: %zu entries kept, %zu bytes freed", count,
+           freed);
+}
+
+// Compacts once no reader holds the epoch before the flush began.
+static void flush_finish(file_cache_t *cache) {
+  if (atomic_load(&cache->flush) != FLUSH_DRAINING) {
+    return;
+  }
+  uint64_t previous = (atomic_load(&cache->epoch) - 1) & 1;
+  for (int i = 0; i < CACHE_READER_SLOTS; i++) {
+    if (atomic_load(&cache->readers[i].count[previous]) != 0) {
+      return;
+    }
+  }
+  int expected = FLUSH_DRAINING;
+  if (!atomic_compare_exchange_strong(&cache->flush, &expected,
+                                      FLUSH_COMPACTING)) {
+    return;
+  }
+  compact(cache);
+  atomic_store(&cache->flush, FLUSH_NONE);
+}
+
+void file_cache_leave(file_cache_t *cache, uint64_t pin) {
+  if (cache == nullptr) {
+    return;
+  }
+  atomic_fetch_sub(&cache->readers[reader_slot].count[pin & 1], 1);
+  flush_finish(cache);
+}
+
+// Starts a compaction when enough of the cache is stale. From here until it
+// is done lookups miss and loads fail, so new readers cannot be holding
+// anything it moves; the epoch bump separates them from those that might.
+static void flush_begin(file_cache_t *cache) {
+  if (atomic_load(&cache->stale_bytes) * CACHE_STALE_SHARE <
+          cache->heap_capacity &&
+      atomic_load(&cache->stale_slots) * CACHE_STALE_SHARE <
+          cache->slot_mask + 1) {
+    return;
+  }
+  int expected = FLUSH_NONE;
+  if (atomic_compare_exchange_strong(&cache->flush, &expected,
+                                     FLUSH_DRAINING)) {
+    atomic_fetch_add(&cache->epoch, 1);
+  }
+}
+
+// Marks slot, found under key, stale. Only the first caller accounts it.
+static void retire_slot(file_cache_t *cache, cache_slot_t *slot,
+                        uint64_t key) {
+  uint64_t expected = key;
+  if (atomic_compare_exchange_strong(&slot->key, &expected, SLOT_STALE)) {
+    atomic_store_explicit(&slot->ready, false, memory_order_release);
+    atomic_fetch_add(&cache->stale_bytes,
+                     entry_size(slot->path_length, slot->length));
+    atomic_fetch_add(&cache->stale_slots, 1);
+  }
+}
+
+size_t file_cache_used(const file_cache_t *cache) {
+  if (cache == nullptr) {
+    return 0;
+  }
+  return atomic_load_explicit(&cache->heap_used, memory_order_relaxed);
+}
+
+size_t file_cache_available(const file_cache_t *cache) {
+  if (cache == nullptr) {
+    return 0;
+  }
+  return cache->heap_capacity - file_cache_used(cache);
+}
+
+static cache_slot_t *find_slot(file_cache_t *cache, const char *path,
+                               size_t path_length, uint64_t key) {
+  for (size_t i = 0; i <= cache->slot_mask; i++) {
+    cache_slot_t *slot = &cache->slots[(key + i) & cache->slot_mask];
+    uint64_t current = atomic_load_explicit(&slot->key, memory_order_acquire);
+
+    if (current == SLOT_EMPTY) {
+      return nullptr;
+    }
+    if (current != key ||
+        !atomic_load_explicit(&slot->ready, memory_order_acquire)) {
+      continue;
+    }
+    if (slot->path_length == path_length &&
+        memcmp(cache->heap + slot->offset, path, path_length) == 0) {
+      return slot;
+    }
+  }
+  return nullptr;
+}
+
+static bool slot_matches(const cache_slot_t *slot, const struct stat *st) {
+  return slot->length == (size_t)st->st_size &&
+         slot->inode == (uint64_t)st->st_ino &&
+         slot->mtime_sec == (int64_t)st->st_mtim.tv_sec &&
+         slot->mtime_nsec == (int64_t)st->st_mtim.tv_nsec;
+}
+
+[[nodiscard]]
+bool file_cache_get(file_cache_t *cache, const string_t *path, file_t *out) {
+  if (cache == nullptr || path == nullptr) {
+    return false;
+  }
+
+  if (atomic_load(&cache->flush) != FLUSH_NONE) {
+    flush_finish(cache);
+    return false;
+  }
+
+  uint64_t key = hash_path(path->data, path->length);
+  cache_slot_t *slot = find_slot(cache, path->data, path->length, key);
+  if (slot == nullptr) {
+    return false;
+  }
+
+  // One stat keeps the cache coherent with the disk without a watcher.
+  struct stat st;
+  if (stat(path->data, &st) == -1 || !slot_matches(slot, &st)) {
+    log_debug("Cache entry for \"%s\" is stale", path->data);
+    retire_slot(cache, slot, key);
+    return false;
+  }
+
+  atomic_fetch_add_explicit(&slot->hits, 1, memory_order_relaxed);
+  out->data = cache->heap + slot->offset + slot->path_length + 1;
+  out->length = slot->length;
+  return true;
+}
+
+static bool heap_reserve(file_cache_t *cache, size_t size, size_t *offset) {
+  size_t used = atomic_load_explicit(&cache->heap_used, memory_order_relaxed);
+  do {
+    if (size > cache->heap_capacity - used) {
+      return false;
+    }
+  } while (!atomic_compare_exchange_weak_explicit(
+      &cache->heap_used, &used, used + size, memory_order_relaxed,
+      memory_order_relaxed));
+
+  *offset = used;
+  return true;
+}
+
+// Takes back a reservation that will not be published: the space itself
+// when nothing was reserved after it, otherwise at the next compaction.
+static void heap_release(file_cache_t *cache, size_t offset, size_t size) {
+  size_t end = offset + size;
+  if (!atomic_compare_exchange_strong(&cache->heap_used, &end, offset)) {
+    atomic_fetch_add(&cache->stale_bytes, size);
+  }
+}
+
+// Another published entry for the path of slot, or nullptr.
+static cache_slot_t *find_twin(file_cache_t *cache, cache_slot_t *slot,
+                               uint64_t key) {
+  for (size_t i = 0; i <= cache->slot_mask; i++) {
+    cache_slot_t *other = &cache->slots[(key + i) & cache->slot_mask];
+    uint64_t current = atomic_load(&other->key);
+    if (current == SLOT_EMPTY) {
+      return nullptr;
+    }
+    if (other != slot && current == key && atomic_load(&other->ready) &&
+        other->path_length == slot->path_length &&
+        memcmp(cache->heap + other->offset, cache->heap + slot->offset,
+               slot->path_length) == 0) {
+      return other;
+    }
+  }
+  return nullptr;
+}
+
+static cache_slot_t *claim_slot(file_cache_t *cache, uint64_t key) {
+  for (size_t i = 0; i <= cache->slot_mask; i++) {
+    cache_slot_t *slot = &cache->slots[(key + i) & cache->slot_mask];
+    uint64_t expected = SLOT_EMPTY;
+    if (atomic_compare_exchange_strong(&slot->key, &expected, key)) {
+      return slot;
+    }
+  }
+  return nullptr;
+}
+
+[[nodiscard]]
+int file_cache_load(file_cache_t *cache, disk_io_t *io, const string_t *path,
+                    file_t *out) {
+  if (cache == nullptr || path == nullptr || path->length > UINT32_MAX) {
+    return -EINVAL;
+  }
+
+  if (atomic_load(&cache->flush) != FLUSH_NONE) {
+    flush_finish(cache);
+    return -EBUSY;
+  }
+
+  uint64_t key = hash_path(path->data, path->length);
+  if (find_slot(cache, path->data, path->length, key) != nullptr) {
+    return -EEXIST;
+  }
+
+  int fd = open(path->data, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    return -errno;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+    (void)close(fd);
+    return -EINVAL;
+  }
+
+  size_t length = (size_t)st.st_size;
+  size_t size = entry_size(path->length, length);
+  size_t offset;
+  if (!heap_reserve(cache, size, &offset)) {
+    (void)close(fd);
+    flush_begin(cache);
+    return -ENOSPC;
+  }
+  disk_io_advise(fd, length);
+
+  unsigned char *dst = cache->heap + offset;
+  memcpy(dst, path->data, path->length);
+  dst[path->length] = '\0';
+  unsigned char *body = dst + path->length + 1;
+  int rc = disk_io_read(io, fd, body, length);
+  (void)close(fd);
+  if (rc != 0) {
+    log_warn("Cache load of \"%s\" failed", path->data);
+    heap_release(cache, offset, size);
+    return -EIO;
+  }
+  body[length] = '\0';
+
+  cache_slot_t *slot = claim_slot(cache, key);
+  if (slot == nullptr) {
+    heap_release(cache, offset, size);
+    flush_begin(cache);
+    return -ENOSPC;
+  }
+  slot->path_length = (uint32_t)path->length;
+  slot->offset = offset;
+  slot->length = length;
+  slot->inode = (uint64_t)st.st_ino;
+  slot->mtime_sec = (int64_t)st.st_mtim.tv_sec;
+  slot->mtime_nsec = (int64_t)st.st_mtim.tv_nsec;
+  atomic_store_explicit(&slot->hits, 1, memory_order_relaxed);
+  atomic_store(&slot->ready, true);
+
+  // A racing loader of the same path may have published too. Each looks
+  // after publishing, so at least one sees the other, and whoever does
+  // retires the later slot of the two: one entry stays. Our bytes remain
+  // valid for the caller either way.
+  cache_slot_t *twin = find_twin(cache, slot, key);
+  if (twin != nullptr) {
+    retire_slot(cache, twin > slot ? twin : slot, key);
+  }
+
+  if (out != nullptr) {
+    out->data = body;
+    out->length = length;
+  }
+  return 0;
+}
+
+typedef struct {
+  uint64_t hits;
+  const char *path;
+} snapshot_entry_t;
+
+static int compare_hits(const void *a, const void *b) {
+  const snapshot_entry_t *lhs = a;
+  const snapshot_entry_t *rhs = b;
+  return (lhs->hits < rhs->hits) - (lhs->hits > rhs->hits);
+}
+
+int file_cache_snapshot_write(file_cache_t *cache, const string_t *root,
+                              const char *snapshot_path) {
+  if (cache == nullptr || root == nullptr || snapshot_path == nullptr) {
+    return -EINVAL;
+  }
+
+  snapshot_entry_t *entries =
+      calloc(cache->slot_mask + 1, sizeof(snapshot_entry_t));
+  if (entries == nullptr) {
+    return -ENOMEM;
+  }
+
+  uint64_t pin = file_cache_enter(cache);
+  if (atomic_load(&cache->flush) != FLUSH_NONE) {
+    file_cache_leave(cache, pin);
+    free(entries);
+    log_warn("Hot snapshot skipped while the file cache compacts");
+    return -EBUSY;
+  }
+  size_t count = 0;
+  for (size_t i = 0; i <= cache->slot_mask; i++) {
+    cache_slot_t *slot = &cache->slots[i];
+    if (!atomic_load_explicit(&slot->ready, memory_order_acquire)) {
+      continue;
+    }
+    const char *path = (const char *)cache->heap + slot->offset;
+    if (slot->path_length <= root->length ||
+        memcmp(path, root->data, root->length) != 0 ||
+        path[root->length] != '/') {
+      continue;
+    }
+    entries[count].hits = atomic_load(&slot->hits);
+    entries[count].path = path + root->length + 1;
+    count++;
+  }
+  qsort(entries, count, sizeof(snapshot_entry_t), compare_hits);
+
+  char tmp_path[PATH_MAX];
+  int n = snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", snapshot_path);
+  if (n < 0 || (size_t)n >= sizeof(tmp_path)) {
+    file_cache_leave(cache, pin);
+    free(entries);
+    return -ENAMETOOLONG;
+  }
+
+  FILE *file = fopen(tmp_path, "w");
+  if (file == nullptr) {
+    int saved = errno;
+    log_warn("Cannot write hot snapshot \"%s\": %s", tmp_path,
+             strerror(saved));
+    file_cache_leave(cache, pin);
+    free(entries);
+    return -saved;
+  }
+  for (size_t i = 0; i < count; i++) {
+    (void)fprintf(file, "%llu\t%s\n", (unsigned long long)entries[i].hits,
+                  entries[i].path);
+  }
+  file_cache_leave(cache, pin);
+  free(entries);
+
+  if (fclose(file) == EOF || rename(tmp_path, snapshot_path) == -1) {
+    log_warn("Cannot write hot snapshot \"%s\": %s", snapshot_path,
+             strerror(errno));
+    return -EIO;
+  }
+
+  log_info("Hot snapshot: %zu entries written to \"%s\"", count,
+           snapshot_path);
+  return 0;
+}
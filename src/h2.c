@@ -0,0 +1,990 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "coro.h"
+#include "disk_io.h"
+#include "file.h"
+#include "file_cache.h"
+#include "h2.h"
+#include "hpack.h"
+#include "http.h"
+#include "log.h"
+#include "router.h"
+#include "server.h"
+#include "sig.h"
+#include "socket.h"
+#include "string_utils.h"
+
+enum {
+  FRAME_HEADER_SIZE = 9,
+  PREFACE_LINE = 18, // "PRI * HTTP/2.0\r\n\r\n", what HTTP/1 framing sees
+  DEFAULT_WINDOW = 65535,
+  MAX_WINDOW = INT32_MAX,
+  MAX_FRAME_LIMIT = (1 << 24) - 1,
+  MAX_FIELDS = 64,       // Decoded fields per header block
+  RESPONSE_HEADERS = 512, // Bytes for an encoded response header block
+  SETTINGS_HEADER_MAX = 64,
+};
+
+typedef enum {
+  FRAME_DATA = 0x0,
+  FRAME_HEADERS = 0x1,
+  FRAME_PRIORITY = 0x2,
+  FRAME_RST_STREAM = 0x3,
+  FRAME_SETTINGS = 0x4,
+  FRAME_PUSH_PROMISE = 0x5,
+  FRAME_PING = 0x6,
+  FRAME_GOAWAY = 0x7,
+  FRAME_WINDOW_UPDATE = 0x8,
+  FRAME_CONTINUATION = 0x9,
+} frame_type_t;
+
+enum {
+  FLAG_END_STREAM = 0x1,
+  FLAG_ACK = 0x1,
+  FLAG_END_HEADERS = 0x4,
+  FLAG_PADDED = 0x8,
+  FLAG_PRIORITY = 0x20,
+};
+
+enum {
+  SETTINGS_HEADER_TABLE_SIZE = 0x1,
+  SETTINGS_ENABLE_PUSH = 0x2,
+  SETTINGS_MAX_CONCURRENT_STREAMS = 0x3,
+  SETTINGS_INITIAL_WINDOW_SIZE = 0x4,
+  SETTINGS_MAX_FRAME_SIZE = 0x5,
+  SETTINGS_MAX_HEADER_LIST_SIZE = 0x6,
+};
+
+typedef enum {
+  H2_NO_ERROR = 0x0,
+  H2_PROTOCOL_ERROR = 0x1,
+  H2_INTERNAL_ERROR = 0x2,
+  H2_FLOW_CONTROL_ERROR = 0x3,
+  H2_STREAM_CLOSED = 0x5,
+  H2_FRAME_SIZE_ERROR = 0x6,
+  H2_REFUSED_STREAM = 0x7,
+  H2_COMPRESSION_ERROR = 0x9,
+  H2_ENHANCE_YOUR_CALM = 0xb,
+} h2_error_t;
+
+static const string_view_t preface = SV_LIT("PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n");
+
+typedef struct {
+  uint32_t id;
+  bool end_stream; // The request is complete
+  bool responding; // HEADERS sent, DATA pending
+  bool head;
+  bool gzipped;
+  int status;
+  const route_t *route; // Whose headers the response carries, if any
+  int64_t window; // Send window, negative after a SETTINGS decrease
+  // The body comes from memory (cache or a constant) or from fd.
+  file_cache_t *cache; // Pinned while data points into it
+  uint64_t pin;
+  const uint8_t *data;
+  int fd;
+  off_t offset;
+  size_t remaining;
+} stream_t;
+
+typedef struct {
+  int client;
+  const server_t *server;
+  const route_table_t *routes;
+
+  uint8_t *in; // Holds at least one whole frame
+  size_t in_length;
+
+  // Header block being reassembled from HEADERS and CONTINUATION frames.
+  uint8_t *block;
+  size_t block_length;
+  uint32_t block_stream; // 0 when none is open
+  bool block_end_stream;
+  char *scratch;
+  hpack_table_t table;
+  hpack_header_t fields[MAX_FIELDS];
+
+  stream_t streams[H2_MAX_STREAMS];
+  size_t stream_count;
+  size_t cursor; // Round-robin position among streams
+  uint32_t last_stream;
+
+  int64_t window; // Connection send window
+  int64_t initial_window;
+  size_t max_frame;
+  bool goaway; // The peer is done opening streams
+} h2_conn_t;
+
+static const uint8_t not_found[] = "File Not Found";
+static const uint8_t not_implemented[] = "Not Implemented";
+
+bool h2_is_preface(string_view_t received) {
+  return sv_starts_with(received, sv_slice(preface, 0, PREFACE_LINE));
+}
+
+bool h2_wants_upgrade(const http_request_t *request) {
+  const http_header_t *upgrade =
+      http_find_header(request, HTTP_TOKEN(UPGRADE));
+  if (upgrade == nullptr ||
+      http_find_header(request, HTTP_TOKEN(HTTP2_SETTINGS)) == nullptr ||
+      !sv_equal(request->version, SV_LIT("HTTP/1.1"))) {
+    return false;
+  }
+
+  // The request becomes stream 1 half-closed, so it cannot carry a body.
+  size_t length = 0;
+  int framing = http_headers_content_length(request->headers,
+                                            request->header_count, &length);
+  if (framing < 0 || length > 0 ||
+      http_headers_chunked(request->headers, request->header_count)) {
+    return false;
+  }
+
+  string_view_t rest = upgrade->value;
+  string_view_t protocol;
+  while (sv_split(&rest, ',', &protocol)) {
+    if (sv_equal_nocase(sv_trim(protocol), SV_LIT("h2c"))) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static uint32_t read_u32(const uint8_t *p) {
+  return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 |
+         p[3];
+}
+
+static void write_u32(uint8_t *p, uint32_t value) {
+  p[0] = (uint8_t)(value >> 24);
+  p[1] = (uint8_t)(value >> 16);
+  p[2] = (uint8_t)(value >> 8);
+  p[3] = (uint8_t)value;
+}
+
+static void frame_header(uint8_t *out, size_t length, frame_type_t type,
+                         uint8_t flags, uint32_t stream) {
+  out[0] = (uint8_t)(length >> 16);
+  out[1] = (uint8_t)(length >> 8);
+  out[2] = (uint8_t)length;
+  out[3] = (uint8_t)type;
+  out[4] = flags;
+  write_u32(out + 5, stream & 0x7fffffff);
+}
+
+static int send_frame(h2_conn_t *conn, frame_type_t type, uint8_t flags,
+                      uint32_t stream, const void *payload, size_t length) {
+  uint8_t header[FRAME_HEADER_SIZE];
+  frame_header(header, length, type, flags, stream);
+  struct iovec iov[2] = {
+      {.iov_base = header, .iov_len = sizeof(header)},
+      {.iov_base = (void *)payload, .iov_len = length},
+  };
+  return socket_writev_all(conn->client, iov, length > 0 ? 2 : 1);
+}
+
+static void send_goaway(h2_conn_t *conn, h2_error_t error) {
+  uint8_t payload[8];
+  write_u32(payload, conn->last_stream);
+  write_u32(payload + 4, error);
+  if (error != H2_NO_ERROR) {
+    log_warn("HTTP/2 connection error 0x%x", (unsigned)error);
+  }
+  (void)send_frame(conn, FRAME_GOAWAY, 0, 0, payload, sizeof(payload));
+}
+
+static h2_error_t send_rst(h2_conn_t *conn, uint32_t stream,
+                           h2_error_t error) {
+  uint8_t payload[4];
+  write_u32(payload, error);
+  return send_frame(conn, FRAME_RST_STREAM, 0, stream, payload,
+                    sizeof(payload)) == 0
+             ? H2_NO_ERROR
+             : H2_INTERNAL_ERROR;
+}
+
+static h2_error_t send_window_update(h2_conn_t *conn, uint32_t stream,
+                                     size_t increment) {
+  uint8_t payload[4];
+  write_u32(payload, (uint32_t)increment);
+  return send_frame(conn, FRAME_WINDOW_UPDATE, 0, stream, payload,
+                    sizeof(payload)) == 0
+             ? H2_NO_ERROR
+             : H2_INTERNAL_ERROR;
+}
+
+static int send_settings(h2_conn_t *conn) {
+  uint8_t payload[12];
+  payload[0] = 0;
+  payload[1] = SETTINGS_MAX_CONCURRENT_STREAMS;
+  write_u32(payload + 2, H2_MAX_STREAMS);
+  payload[6] = 0;
+  payload[7] = SETTINGS_MAX_HEADER_LIST_SIZE;
+  write_u32(payload + 8, H2_HEADER_LIST_MAX);
+  return send_frame(conn, FRAME_SETTINGS, 0, 0, payload, sizeof(payload));
+}
+
+static stream_t *find_stream(h2_conn_t *conn, uint32_t id) {
+  for (size_t i = 0; i < conn->stream_count; i++) {
+    if (conn->streams[i].id == id) {
+      return &conn->streams[i];
+    }
+  }
+  return nullptr;
+}
+
+static void close_stream(h2_conn_t *conn, stream_t *stream) {
+  if (stream->fd >= 0) {
+    close(stream->fd);
+  }
+  file_cache_leave(stream->cache, stream->pin);
+  *stream = conn->streams[--conn->stream_count];
+}
+
+// Looks name up below the route's root for stream, from the cache or, for
+// files too big for it (or when it is full or bypassed), with sendfile().
+static bool open_static(const server_t *server, stream_t *stream,
+                        const route_t *route, string_view_t name) {
+  char resolved[PATH_MAX];
+  string_t filepath;
+  if (get_safe_path(&route->root, name, resolved, &filepath) != 0) {
+    return false;
+  }
+
+  file_cache_t *cache = route->nocache ? nullptr : server->cache;
+  uint64_t pin = file_cache_enter(cache);
+  file_t file;
+  if (file_cache_get(cache, &filepath, &file) ||
+      file_cache_load(cache, server->disk_io, &filepath, &file) == 0) {
+    stream->cache = cache;
+    stream->pin = pin;
+    stream->data = file.data;
+    stream->remaining = file.length;
+    return true;
+  }
+  file_cache_leave(cache, pin);
+
+  int fd = open(filepath.data, O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (fd >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+    disk_io_advise(fd, (size_t)st.st_size);
+    stream->fd = fd;
+    stream->remaining = (size_t)st.st_size;
+    return true;
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+  return false;
+}
+
+// Picks the body for a request. Runs when its headers arrive, so nothing
+// but the outcome is kept for streams whose body is still coming.
+static void resolve(h2_conn_t *conn, stream_t *stream, string_view_t method,
+                    string_view_t authority, string_view_t path,
+                    bool gzip) {
+  stream->head = sv_equal(method, SV_LIT("HEAD"));
+
+  size_t query = sv_find_char(path, '?');
+  if (query != SV_NPOS) {
+    path = sv_slice(path, 0, query);
+  }
+
+  string_view_t rest;
+  const route_t *route = route_match(conn->routes, authority, path, &rest);
+  if (route != nullptr && route->action == ROUTE_PROXY) {
+    stream->status = 501;
+    stream->data = not_implemented;
+    stream->remaining = sizeof(not_implemented) - 1;
+    return;
+  }
+  if (route != nullptr && route->action != ROUTE_STATIC) {
+    stream->status = route->code;
+    stream->route = route;
+    stream->data = (const uint8_t *)route->body.data;
+    stream->remaining = route->body.length;
+    return;
+  }
+
+  if (route != nullptr) {
+    if (rest.length == 0 || sv_equal(rest, SV_LIT("/"))) {
+      rest = SV_LIT("index.html");
+    }
+    char name[PATH_MAX];
+    if (route->gzip && gzip && rest.length + sizeof(".gz") <= sizeof(name)) {
+      memcpy(name, rest.data, rest.length);
+      memcpy(name + rest.length, ".gz", sizeof(".gz"));
+      stream->gzipped = open_static(
+          conn->server, stream, route,
+          (string_view_t){name, rest.length + sizeof(".gz") - 1});
+    }
+    if (stream->gzipped ||
+        open_static(conn->server, stream, route, rest)) {
+      stream->status = 200;
+      stream->route = route;
+      return;
+    }
+  }
+
+  stream->status = 404;
+  stream->data = not_found;
+  stream->remaining = sizeof(not_found) - 1;
+}
+
+static h2_error_t respond(h2_conn_t *conn, stream_t *stream) {
+  uint8_t frame[FRAME_HEADER_SIZE + RESPONSE_HEADERS];
+  hpack_block_t block = {frame + FRAME_HEADER_SIZE, 0, RESPONSE_HEADERS};
+  char length[24];
+  (void)snprintf(length, sizeof(length), "%zu", stream->remaining);
+  if (hpack_encode_status(&block, stream->status) != 0 ||
+      hpack_encode_header(&block, HPACK_CONTENT_LENGTH,
+                          sv_from_cstr(length)) != 0) {
+    return H2_INTERNAL_ERROR;
+  }
+  const route_t *route = stream->route;
+  if (route != nullptr &&
+      ((route->action == ROUTE_REDIRECT &&
+        hpack_encode_header(&block, HPACK_LOCATION, route->location) != 0) ||
+       (route->action == ROUTE_FIXED &&
+        hpack_encode_header(&block, HPACK_CONTENT_TYPE,
+                            SV_LIT("text/plain")) != 0) ||
+       (route->cache_control.length > 0 &&
+        hpack_encode_header(&block, HPACK_CACHE_CONTROL,
+                            route->cache_control) != 0) ||
+       (route->gzip && hpack_encode_header(&block, HPACK_VARY,
+                                           SV_LIT("accept-encoding")) != 0) ||
+       (stream->gzipped &&
+        hpack_encode_header(&block, HPACK_CONTENT_ENCODING,
+                            SV_LIT("gzip")) != 0))) {
+    return H2_INTERNAL_ERROR;
+  }
+
+  bool body = !stream->head && stream->remaining > 0;
+  frame_header(frame, block.length, FRAME_HEADERS,
+               FLAG_END_HEADERS | (body ? 0 : FLAG_END_STREAM), stream->id);
+  if (socket_write_all(conn->client, frame,
+                       FRAME_HEADER_SIZE + block.length) != 0) {
+    return H2_INTERNAL_ERROR;
+  }
+
+  log_debug("HTTP/2 stream %u: %d", stream->id, stream->status);
+  if (body) {
+    stream->responding = true;
+  } else {
+    close_stream(conn, stream);
+  }
+  return H2_NO_ERROR;
+}
+
+static bool sendable(const h2_conn_t *conn, const stream_t *stream) {
+  return stream->responding && stream->window > 0 && conn->window > 0;
+}
+
+// One DATA frame for the next stream in turn, so a large response cannot
+// starve the others. Returns 0 when nothing could be sent.
+static int send_data(h2_conn_t *conn) {
+  stream_t *stream = nullptr;
+  for (size_t i = 0; i < conn->stream_count; i++) {
+    size_t at = (conn->cursor + i) % conn->stream_count;
+    if (sendable(conn, &conn->streams[at])) {
+      stream = &conn->streams[at];
+      conn->cursor = at + 1;
+      break;
+    }
+  }
+  if (stream == nullptr) {
+    return 0;
+  }
+
+  size_t length = stream->remaining;
+  if (length > conn->max_frame) {
+    length = conn->max_frame;
+  }
+  if ((int64_t)length > stream->window) {
+    length = (size_t)stream->window;
+  }
+  if ((int64_t)length > conn->window) {
+    length = (size_t)conn->window;
+  }
+  bool last = length == stream->remaining;
+
+  uint8_t header[FRAME_HEADER_SIZE];
+  frame_header(header, length, FRAME_DATA, last ? FLAG_END_STREAM : 0,
+               stream->id);
+  int result;
+  if (stream->data != nullptr) {
+    struct iovec iov[2] = {
+        {.iov_base = header, .iov_len = sizeof(header)},
+        {.iov_base = (void *)(stream->data + stream->offset),
+         .iov_len = length},
+    };
+    result = socket_writev_all(conn->client, iov, 2);
+    stream->offset += (off_t)length;
+  } else {
+    // MSG_MORE keeps the frame header in the same segment as the data.
+    result = coro_send(conn->client, header, sizeof(header), MSG_MORE) ==
+                     (ssize_t)sizeof(header)
+                 ? disk_io_sendfile(conn->server->disk_io, conn->client,
+                                    stream->fd, &stream->offset, length)
+                 : -1;
+  }
+  if (result != 0) {
+    return -1;
+  }
+
+  stream->remaining -= length;
+  stream->window -= (int64_t)length;
+  conn->window -= (int64_t)length;
+  if (last) {
+    close_stream(conn, stream);
+  }
+  return 1;
+}
+
+static h2_error_t apply_settings(h2_conn_t *conn, const uint8_t *payload,
+                                 size_t length) {
+  if (length % 6 != 0) {
+    return H2_FRAME_SIZE_ERROR;
+  }
+  for (size_t at = 0; at < length; at += 6) {
+    unsigned id = (unsigned)payload[at] << 8 | payload[at + 1];
+    uint32_t value = read_u32(payload + at + 2);
+    switch (id) {
+    case SETTINGS_ENABLE_PUSH:
+      if (value > 1) {
+        return H2_PROTOCOL_ERROR;
+      }
+      break;
+    case SETTINGS_INITIAL_WINDOW_SIZE: {
+      if (value > MAX_WINDOW) {
+        return H2_FLOW_CONTROL_ERROR;
+      }
+      // Applies to open streams too, as a delta (RFC 9113, 6.9.2).
+      int64_t delta = (int64_t)value - conn->initial_window;
+      for (size_t i = 0; i < conn->stream_count; i++) {
+        conn->streams[i].window += delta;
+        if (conn->streams[i].window > MAX_WINDOW) {
+          return H2_FLOW_CONTROL_ERROR;
+        }
+      }
+      conn->initial_window = value;
+      break;
+    }
+    case SETTINGS_MAX_FRAME_SIZE:
+      if (value < H2_FRAME_SIZE || value > MAX_FRAME_LIMIT) {
+        return H2_PROTOCOL_ERROR;
+      }
+      conn->max_frame = value;
+      break;
+    default:
+      // The encoder does not index, so the peer's table size is moot.
+      break;
+    }
+  }
+  return H2_NO_ERROR;
+}
+
+static h2_error_t open_stream(h2_conn_t *conn, uint32_t id, int count) {
+  string_view_t method = {};
+  string_view_t path = {};
+  string_view_t authority = {};
+  bool gzip = false;
+  for (int i = 0; i < count; i++) {
+    string_view_t name = conn->fields[i].name;
+    string_view_t value = conn->fields[i].value;
+    if (sv_equal(name, SV_LIT(":method"))) {
+      method = value;
+    } else if (sv_equal(name, SV_LIT(":path"))) {
+      path = value;
+    } else if (sv_equal(name, SV_LIT(":authority")) ||
+               (authority.length == 0 && sv_equal(name, SV_LIT("host")))) {
+      authority = value;
+    } else if (sv_equal(name, SV_LIT("accept-encoding"))) {
+      gzip = http_accepts_coding(value, SV_LIT("gzip"));
+    }
+  }
+  if (method.length == 0 || path.length == 0) {
+    return send_rst(conn, id, H2_PROTOCOL_ERROR);
+  }
+  if (conn->goaway || conn->stream_count == H2_MAX_STREAMS) {
+    return send_rst(conn, id, H2_REFUSED_STREAM);
+  }
+
+  stream_t *stream = &conn->streams[conn->stream_count++];
+  *stream = (stream_t){.id = id, .window = conn->initial_window, .fd = -1};
+  resolve(conn, stream, method, authority, path, gzip);
+  if (conn->block_end_stream) {
+    stream->end_stream = true;
+    return respond(conn, stream);
+  }
+  return H2_NO_ERROR;
+}
+
+static h2_error_t finish_block(h2_conn_t *conn) {
+  uint32_t id = conn->block_stream;
+  conn->block_stream = 0;
+  // Decoded even for refused streams, to keep the table in sync.
+  int count = hpack_decode(&conn->table, conn->block, conn->block_length,
+                           conn->scratch, H2_HEADER_LIST_MAX, conn->fields,
+                           MAX_FIELDS);
+  if (count < 0) {
+    return H2_COMPRESSION_ERROR;
+  }
+
+  stream_t *stream = find_stream(conn, id);
+  if (stream == nullptr) {
+    return open_stream(conn, id, count);
+  }
+  // Trailers, which have to end the stream.
+  if (!conn->block_end_stream) {
+    return H2_PROTOCOL_ERROR;
+  }
+  stream->end_stream = true;
+  return respond(conn, stream);
+}
+
+static h2_error_t append_block(h2_conn_t *conn, const uint8_t *fragment,
+                               size_t length) {
+  if (length > H2_HEADER_LIST_MAX - conn->block_length) {
+    return H2_ENHANCE_YOUR_CALM;
+  }
+  memcpy(conn->block + conn->block_length, fragment, length);
+  conn->block_length += length;
+  return H2_NO_ERROR;
+}
+
+// Strips the pad length byte and the padding; -1 when it does not fit.
+static int unpad(uint8_t flags, const uint8_t **payload, size_t *length) {
+  if ((flags & FLAG_PADDED) == 0) {
+    return 0;
+  }
+  if (*length == 0 || (*payload)[0] >= *length) {
+    return -1;
+  }
+  *length -= 1 + (size_t)(*payload)[0];
+  (*payload)++;
+  return 0;
+}
+
+static h2_error_t on_headers(h2_conn_t *conn, uint8_t flags, uint32_t id,
+                             const uint8_t *payload, size_t length) {
+  if (id == 0 || id % 2 == 0 || unpad(flags, &payload, &length) != 0) {
+    return H2_PROTOCOL_ERROR;
+  }
+  if (flags & FLAG_PRIORITY) {
+    if (length < 5) {
+      return H2_FRAME_SIZE_ERROR;
+    }
+    payload += 5;
+    length -= 5;
+  }
+
+  stream_t *stream = find_stream(conn, id);
+  if (stream == nullptr && id <= conn->last_stream) {
+    return H2_STREAM_CLOSED;
+  }
+  if (stream != nullptr && stream->end_stream) {
+    return H2_STREAM_CLOSED;
+  }
+  if (id > conn->last_stream) {
+    conn->last_stream = id;
+  }
+
+  conn->block_stream = id;
+  conn->block_end_stream = (flags & FLAG_END_STREAM) != 0;
+  conn->block_length = 0;
+  h2_error_t error = append_block(conn, payload, length);
+  if (error != H2_NO_ERROR || (flags & FLAG_END_HEADERS) == 0) {
+    return error;
+  }
+  return finish_block(conn);
+}
+
+static h2_error_t on_data(h2_conn_t *conn, uint8_t flags, uint32_t id,
+                          const uint8_t *payload, size_t length) {
+  // Padding counts against flow control, so take the length first.
+  size_t flow = length;
+  if (id == 0 || unpad(flags, &payload, &length) != 0) {
+    return H2_PROTOCOL_ERROR;
+  }
+  if (id > conn->last_stream) {
+    return H2_PROTOCOL_ERROR;
+  }
+  // Request bodies are not used; hand the window straight back.
+  if (flow > 0 && send_window_update(conn, 0, flow) != H2_NO_ERROR) {
+    return H2_INTERNAL_ERROR;
+  }
+
+  stream_t *stream = find_stream(conn, id);
+  if (stream == nullptr || stream->end_stream) {
+    return send_rst(conn, id, H2_STREAM_CLOSED);
+  }
+  if (flags & FLAG_END_STREAM) {
+    stream->end_stream = true;
+    return respond(conn, stream);
+  }
+  return flow > 0 ? send_window_update(conn, id, flow) : H2_NO_ERROR;
+}
+
+static h2_error_t on_window_update(h2_conn_t *conn, uint32_t id,
+                                   const uint8_t *payload, size_t length) {
+  if (length != 4) {
+    return H2_FRAME_SIZE_ERROR;
+  }
+  uint32_t increment = read_u32(payload) & 0x7fffffff;
+  if (id == 0) {
+    if (increment == 0) {
+      return H2_PROTOCOL_ERROR;
+    }
+    conn->window += increment;
+    return conn->window > MAX_WINDOW ? H2_FLOW_CONTROL_ERROR : H2_NO_ERROR;
+  }
+
+  stream_t *stream = find_stream(conn, id);
+  if (stream == nullptr) {
+    return H2_NO_ERROR; // Already closed on our side
+  }
+  h2_error_t error = H2_NO_ERROR;
+  stream->window += increment;
+  if (increment == 0) {
+    error = H2_PROTOCOL_ERROR;
+  } else if (stream->window > MAX_WINDOW) {
+    error = H2_FLOW_CONTROL_ERROR;
+  }
+  if (error != H2_NO_ERROR) {
+    close_stream(conn, stream);
+    return send_rst(conn, id, error);
+  }
+  return H2_NO_ERROR;
+}
+
+static h2_error_t on_frame(h2_conn_t *conn, frame_type_t type, uint8_t flags,
+                           uint32_t id, const uint8_t *payload,
+                           size_t length) {
+  // Nothing may interleave with a header block.
+  if (conn->block_stream != 0) {
+    if (type != FRAME_CONTINUATION || id != conn->block_stream) {
+      return H2_PROTOCOL_ERROR;
+    }
+    h2_error_t error = append_block(conn, payload, length);
+    if (error != H2_NO_ERROR || (flags & FLAG_END_HEADERS) == 0) {
+      return error;
+    }
+    return finish_block(conn);
+  }
+
+  switch (type) {
+  case FRAME_DATA:
+    return on_data(conn, flags, id, payload, length);
+  case FRAME_HEADERS:
+    return on_headers(conn, flags, id, payload, length);
+  case FRAME_PRIORITY:
+    if (id == 0) {
+      return H2_PROTOCOL_ERROR;
+    }
+    return length == 5 ? H2_NO_ERROR : H2_FRAME_SIZE_ERROR;
+  case FRAME_RST_STREAM: {
+    if (id == 0 || id > conn->last_stream) {
+      return H2_PROTOCOL_ERROR;
+    }
+    if (length != 4) {
+      return H2_FRAME_SIZE_ERROR;
+    }
+    stream_t *stream = find_stream(conn, id);
+    if (stream != nullptr) {
+      close_stream(conn, stream);
+    }
+    return H2_NO_ERROR;
+  }
+  case FRAME_SETTINGS: {
+    if (id != 0) {
+      return H2_PROTOCOL_ERROR;
+    }
+    if (flags & FLAG_ACK) {
+      return length == 0 ? H2_NO_ERROR : H2_FRAME_SIZE_ERROR;
+    }
+    h2_error_t error = apply_settings(conn, payload, length);
+    if (error != H2_NO_ERROR) {
+      return error;
+    }
+    return send_frame(conn, FRAME_SETTINGS, FLAG_ACK, 0, nullptr, 0) == 0
+               ? H2_NO_ERROR
+               : H2_INTERNAL_ERROR;
+  }
+  case FRAME_PING:
+    if (id != 0) {
+      return H2_PROTOCOL_ERROR;
+    }
+    if (length != 8) {
+      return H2_FRAME_SIZE_ERROR;
+    }
+    if (flags & FLAG_ACK) {
+      return H2_NO_ERROR;
+    }
+    return send_frame(conn, FRAME_PING, FLAG_ACK, 0, payload, length) == 0
+               ? H2_NO_ERROR
+               : H2_INTERNAL_ERROR;
+  case FRAME_GOAWAY:
+    conn->goaway = true;
+    return H2_NO_ERROR;
+  case FRAME_WINDOW_UPDATE:
+    return on_window_update(conn, id, payload, length);
+  case FRAME_PUSH_PROMISE:
+  case FRAME_CONTINUATION:
+    return H2_PROTOCOL_ERROR;
+  default:
+    return H2_NO_ERROR; // Unknown frame types are ignored
+  }
+}
+
+// Handles every complete frame in the receive buffer.
+static h2_error_t process_input(h2_conn_t *conn) {
+  size_t at = 0;
+  h2_error_t error = H2_NO_ERROR;
+  while (error == H2_NO_ERROR && conn->in_length - at >= FRAME_HEADER_SIZE) {
+    const uint8_t *header = conn->in + at;
+    size_t length = (size_t)header[0] << 16 | (size_t)header[1] << 8 |
+                    header[2];
+    if (length > H2_FRAME_SIZE) {
+      return H2_FRAME_SIZE_ERROR;
+    }
+    if (conn->in_length - at < FRAME_HEADER_SIZE + length) {
+      break;
+    }
+    error = on_frame(conn, (frame_type_t)header[3], header[4],
+                     read_u32(header + 5) & 0x7fffffff,
+                     header + FRAME_HEADER_SIZE, length);
+    at += FRAME_HEADER_SIZE + length;
+  }
+
+  conn->in_length -= at;
+  memmove(conn->in, conn->in + at, conn->in_length);
+  return error;
+}
+
+// Reads whatever is available. With wait set, blocks until data arrives or
+// the connection has been idle for H2_IDLE_TIMEOUT. Returns 1 when bytes
+// were read, 0 when none were, -1 once the peer is gone.
+static int fill(h2_conn_t *conn, bool wait) {
+  if (wait) {
+    // One second slices, so a shutdown is noticed and answered with GOAWAY.
+    int idle = 0;
+    while (coro_wait(conn->client, POLLIN, 1000) <= 0) {
+      if (!server_running || ++idle >= H2_IDLE_TIMEOUT) {
+        return 0;
+      }
+    }
+  }
+
+  ssize_t length =
+      recv(conn->client, conn->in + conn->in_length,
+           FRAME_HEADER_SIZE + H2_FRAME_SIZE - conn->in_length, MSG_DONTWAIT);
+  if (length > 0) {
+    conn->in_length += (size_t)length;
+    return 1;
+  }
+  if (length < 0 && (errno == EAGAIN || errno == EINTR)) {
+    return 0;
+  }
+  return -1;
+}
+
+static int read_preface(h2_conn_t *conn) {
+  while (conn->in_length < preface.length) {
+    if (fill(conn, true) <= 0) {
+      return -1;
+    }
+  }
+  if (memcmp(conn->in, preface.data, preface.length) != 0) {
+    return -1;
+  }
+  conn->in_length -= preface.length;
+  memmove(conn->in, conn->in + preface.length, conn->in_length);
+  return 0;
+}
+
+static int base64url_decode(string_view_t in, uint8_t *out, size_t capacity,
+                            size_t *out_length) {
+  uint32_t bits = 0;
+  int count = 0;
+  size_t written = 0;
+  for (size_t i = 0; i < in.length; i++) {
+    char c = in.data[i];
+    uint32_t value;
+    if (c >= 'A' && c <= 'Z') {
+      value = (uint32_t)(c - 'A');
+    } else if (c >= 'a' && c <= 'z') {
+      value = (uint32_t)(c - 'a' + 26);
+    } else if (c >= '0' && c <= '9') {
+      value = (uint32_t)(c - '0' + 52);
+    } else if (c == '-') {
+      value = 62;
+    } else if (c == '_') {
+      value = 63;
+    } else if (c == '=') {
+      break;
+    } else {
+      return -1;
+    }
+    bits = bits << 6 | value;
+    count += 6;
+    if (count >= 8) {
+      count -= 8;
+      if (written == capacity) {
+        return -1;
+      }
+      out[written++] = (uint8_t)(bits >> count);
+    }
+  }
+  *out_length = written;
+  return 0;
+}
+
+// Switches protocols and turns the request into stream 1. Its settings
+// arrive in HTTP2-Settings; the 101 acknowledges them implicitly.
+static h2_error_t upgrade_stream(h2_conn_t *conn,
+                                 const http_request_t *request) {
+  const char *switching = "HTTP/1.1 101 Switching Protocols\r\n"
+                          "Connection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+  if (socket_write_all(conn->client, switching, strlen(switching)) != 0) {
+    return H2_INTERNAL_ERROR;
+  }
+
+  const http_header_t *settings =
+      http_find_header(request, HTTP_TOKEN(HTTP2_SETTINGS));
+  uint8_t payload[SETTINGS_HEADER_MAX];
+  size_t length;
+  if (base64url_decode(sv_trim(settings->value), payload, sizeof(payload),
+                       &length) != 0) {
+    return H2_PROTOCOL_ERROR;
+  }
+  h2_error_t error = apply_settings(conn, payload, length);
+  if (error != H2_NO_ERROR) {
+    return error;
+  }
+
+  stream_t *stream = &conn->streams[conn->stream_count++];
+  *stream = (stream_t){.id = 1,
+                       .end_stream = true,
+                       .window = conn->initial_window,
+                       .fd = -1};
+  conn->last_stream = 1;
+  const http_header_t *host = http_find_header(request, HTTP_TOKEN(HOST));
+  const http_header_t *accept =
+      http_find_header(request, HTTP_TOKEN(ACCEPT_ENCODING));
+  resolve(conn, stream, request->method_name,
+          host != nullptr ? host->value : (string_view_t){}, request->path,
+          accept != nullptr &&
+              http_accepts_coding(accept->value, SV_LIT("gzip")));
+  return H2_NO_ERROR;
+}
+
+static void run(h2_conn_t *conn) {
+  for (;;) {
+    if (conn->goaway && conn->stream_count == 0) {
+      return;
+    }
+    bool pending = false;
+    for (size_t i = 0; i < conn->stream_count && !pending; i++) {
+      pending = sendable(conn, &conn->streams[i]);
+    }
+
+    // Input is checked between DATA frames too, for WINDOW_UPDATE, new
+    // streams and RST_STREAM, without ever blocking while output waits.
+    int got = fill(conn, !pending);
+    if (got < 0) {
+      return;
+    }
+    if (got == 0 && !pending) {
+      send_goaway(conn, H2_NO_ERROR);
+      return;
+    }
+
+    h2_error_t error = process_input(conn);
+    if (error != H2_NO_ERROR) {
+      send_goaway(conn, error);
+      return;
+    }
+    if (send_data(conn) < 0) {
+      return;
+    }
+  }
+}
+
+void h2_serve(arena_t *memory, int client, const server_t *server,
+              const route_table_t *routes, string_view_t received,
+              const http_request_t *upgrade) {
+  h2_conn_t *conn = arena_alloc(memory, sizeof(h2_conn_t));
+  uint8_t *in = arena_alloc(memory, FRAME_HEADER_SIZE + H2_FRAME_SIZE);
+  uint8_t *block = arena_alloc(memory, H2_HEADER_LIST_MAX);
+  char *scratch = arena_alloc(memory, H2_HEADER_LIST_MAX);
+  if (conn == nullptr || in == nullptr || block == nullptr ||
+      scratch == nullptr) {
+    log_error("No memory for an HTTP/2 connection");
+    return;
+  }
+
+  conn->client = client;
+  conn->server = server;
+  conn->routes = routes;
+  conn->in = in;
+  conn->in_length = 0;
+  conn->block = block;
+  conn->block_length = 0;
+  conn->block_stream = 0;
+  conn->scratch = scratch;
+  hpack_table_init(&conn->table);
+  conn->stream_count = 0;
+  conn->cursor = 0;
+  conn->last_stream = 0;
+  conn->window = DEFAULT_WINDOW;
+  conn->initial_window = DEFAULT_WINDOW;
+  conn->max_frame = H2_FRAME_SIZE;
+  conn->goaway = false;
+
+  if (upgrade != nullptr) {
+    received = sv_slice(received, upgrade->header_length, SV_NPOS);
+  }
+  if (received.length > FRAME_HEADER_SIZE + H2_FRAME_SIZE) {
+    return;
+  }
+  memcpy(conn->in, received.data, received.length);
+  conn->in_length = received.length;
+
+  h2_error_t error = H2_NO_ERROR;
+  if (upgrade != nullptr) {
+    error = upgrade_stream(conn, upgrade);
+  }
+  if (error == H2_NO_ERROR && send_settings(conn) != 0) {
+    error = H2_INTERNAL_ERROR;
+  }
+  if (error == H2_NO_ERROR && read_preface(conn) != 0) {
+    log_warn("Bad HTTP/2 connection preface");
+    error = H2_PROTOCOL_ERROR;
+  }
+  if (error == H2_NO_ERROR && conn->stream_count > 0) {
+    error = respond(conn, &conn->streams[0]);
+  }
+  if (error != H2_NO_ERROR) {
+    send_goaway(conn, error);
+  } else {
+    run(conn);
+  }
+
+  while (conn->stream_count > 0) {
+    close_stream(conn, &conn->streams[0]);
+  }
+}
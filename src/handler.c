@@ -1,61 +1,364 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #include "arena.h"
+#include "autoindex.h"
+#include "disk_io.h"
 #include "file.h"
+#include "file_cache.h"
+#include "h2.h"
 #include "handler.h"
 #include "http.h"
 #include "log.h"
+#include "proxy.h"
+#include "response.h"
+#include "router.h"
+#include "server.h"
+#include "socket.h"
+#include "stats.h"
 #include "string_utils.h"
+#include "thread_pool.h"
+#include "tls.h"
+#include "trace.h"
+#include "upload.h"
+#include "worker_memory.h"
 
-#define BUFFER_SIZE 1024
+static void serve_directory(worker_memory_t *worker, int client,
+                            const server_t *server, const string_t *dir_path,
+                            const http_request_t *request) {
+  char *send_buffer = worker_memory_buffer_get(worker);
+  if (send_buffer == nullptr ||
+      autoindex_serve(server->autoindex, client, dir_path, request,
+                      send_buffer, WORKER_BUFFER_SIZE) != 0) {
+    log_warn("Listing \"%s\" failed", dir_path->data);
+  }
+  worker_memory_buffer_put(worker, send_buffer);
+}
 
-void handle_client(arena_t *memory, int client, string_t *root_dir) {
-  if (client < 0) {
+static void serve_debug(worker_memory_t *worker, int client,
+                        const server_t *server,
+                        const http_request_t *request) {
+  static const char *const stat_names[STAT_COUNT] = {
+      "connections", "rejected", "cache_hits", "cache_misses", "respawns",
+  };
+  char *send_buffer = worker_memory_buffer_get(worker);
+  if (send_buffer == nullptr) {
     return;
   }
-  string_t *buffer = http_read_header(memory, client);
-  if (buffer == nullptr) {
-    close(client);
+
+  response_t response;
+  if (response_begin(&response, client, request, send_buffer,
+                     WORKER_BUFFER_SIZE, SV_LIT("200 OK"),
+                     SV_LIT("Content-Type: text/plain\r\n"
+                            "Cache-Control: no-store\r\n")) != 0) {
+    worker_memory_buffer_put(worker, send_buffer);
+    return;
+  }
+  uint64_t total[STAT_COUNT];
+  stats_total(server->stats, total);
+  for (int i = 0; i < STAT_COUNT; i++) {
+    char line[64];
+    int length = snprintf(line, sizeof(line), "%s %llu\n", stat_names[i],
+                          (unsigned long long)total[i]);
+    (void)response_write(&response, line, (size_t)length);
+  }
+  if (server->pool != nullptr) {
+    // The controller's decisions so far and the sample behind the latest.
+    thread_pool_stats_t pool;
+    thread_pool_stats(server->pool, &pool);
+    char line[256];
+    int length = snprintf(
+        line, sizeof(line),
+        "workers %u\nworkers_min %u\nworkers_max %u\nworkers_grown %llu\n"
+        "workers_retired %llu\nqueue_wait_max_us %llu\nqueue_depth %d\n"
+        "workers_idle %d\n",
+        pool.workers, pool.min_workers, pool.max_workers,
+        (unsigned long long)pool.grown, (unsigned long long)pool.retired,
+        (unsigned long long)(pool.last.wait_max / 1000), pool.last.depth,
+        pool.last.idle);
+    (void)response_write(&response, line, (size_t)length);
+  }
+  if (trace_dump(server->trace, &response) != 0) {
+    log_warn("Dumping request spans failed");
+  }
+  (void)response_end(&response);
+  worker_memory_buffer_put(worker, send_buffer);
+}
+
+static void not_found(int client) {
+  log_error("File not found");
+  const char *message = "HTTP/1.0 404 NOT FOUND\n\nFile Not Found";
+  (void)socket_write_all(client, message, strlen(message));
+}
+
+// Resolves name below the route's root into resolved and opens it: 0 with
+// file filled in from the cache, or with *fd set to send it from when the
+// cache cannot hold it; 1 for a directory to list, -1 when there is nothing
+// to send.
+static int open_file([[maybe_unused]] int client, const server_t *server,
+                     const route_t *route, string_view_t name, char *resolved,
+                     file_t *file, int *fd) {
+  string_t filepath;
+  if (get_safe_path(&route->root, name, resolved, &filepath) != 0) {
+    return -1;
+  }
+  log_trace("%s", filepath.data);
+  TRACE_MARK(resolve, TRACE_RESOLVE, client, filepath.data);
+
+  file_cache_t *cache = route->nocache ? nullptr : server->cache;
+  bool cached = file_cache_get(cache, &filepath, file);
+  stats_add(server->stats, cached ? STAT_CACHE_HITS : STAT_CACHE_MISSES, 1);
+  if (cached) {
+    return 0;
+  }
+  if (server->autoindex != nullptr && get_path_type(&filepath) == PATH_DIR) {
+    return 1;
+  }
+  if (file_cache_load(cache, server->disk_io, &filepath, file) == 0) {
+    return 0;
+  }
+
+  // Too big for the cache, or bypassing it: the kernel sends the file, and
+  // under kTLS encrypts it too.
+  *fd = open(filepath.data, O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (*fd >= 0 && fstat(*fd, &st) == 0 && S_ISREG(st.st_mode)) {
+    disk_io_advise(*fd, (size_t)st.st_size);
+    *file = (file_t){.data = nullptr, .length = (size_t)st.st_size};
+    return 0;
+  }
+  if (*fd >= 0) {
+    close(*fd);
+    *fd = -1;
+  }
+  return -1;
+}
+
+// The body of a file opened by open_file(), none for HEAD.
+static void send_body(int client, const server_t *server,
+                      const http_request_t *request, const file_t *file,
+                      int fd) {
+  if (request->method == HTTP_TOKEN(HEAD)) {
+    if (fd != -1) {
+      close(fd);
+    }
+    return;
+  }
+  if (fd == -1) {
+    (void)socket_write_all(client, file->data, file->length);
+    return;
+  }
+  off_t offset = 0;
+  (void)disk_io_sendfile(server->disk_io, client, fd, &offset, file->length);
+  close(fd);
+}
+
+// Serves rest below a static route's root, holding the cache pinned.
+static void send_file(worker_memory_t *worker, int client,
+                      const server_t *server, const route_t *route,
+                      string_view_t rest, const http_request_t *request) {
+  char resolved[PATH_MAX] = "";
+  file_t file = {};
+  int fd = -1;
+  int found = -1;
+  // A precompressed sibling, when the route has them and the client takes
+  // gzip.
+  const http_header_t *accept =
+      http_find_header(request, HTTP_TOKEN(ACCEPT_ENCODING));
+  char name[PATH_MAX];
+  bool gzipped = false;
+  if (route->gzip && accept != nullptr &&
+      rest.length + sizeof(".gz") <= sizeof(name) &&
+      http_accepts_coding(accept->value, SV_LIT("gzip"))) {
+    memcpy(name, rest.data, rest.length);
+    memcpy(name + rest.length, ".gz", sizeof(".gz"));
+    found = open_file(client, server, route,
+                      (string_view_t){name, rest.length + sizeof(".gz") - 1},
+                      resolved, &file, &fd);
+    gzipped = found == 0;
+  }
+  if (!gzipped) {
+    found = open_file(client, server, route, rest, resolved, &file, &fd);
+  }
+
+  TRACE_MARK(open, TRACE_OPEN, client, resolved,
+             found == 0 ? (long long)file.length : -1);
+  if (found == 1) {
+    string_t dir_path = {.data = resolved, .length = strlen(resolved)};
+    serve_directory(worker, client, server, &dir_path, request);
+    return;
+  }
+  TRACE_MARK(first_byte, TRACE_FIRST_BYTE, client);
+  if (found != 0) {
+    not_found(client);
+    return;
+  }
+
+  if (route->headers.length == 0) {
+    char *header = "HTTP/1.0 200 OK\n\n";
+    if (socket_write_all(client, header, strlen(header)) == 0) {
+      send_body(client, server, request, &file, fd);
+    } else if (fd != -1) {
+      close(fd);
+    }
     return;
   }
+  static const char status[] = "HTTP/1.0 200 OK\r\n";
+  static const char encoding[] = "Content-Encoding: gzip\r\n";
+  struct iovec iov[] = {
+      {(void *)status, sizeof(status) - 1},
+      {(void *)route->headers.data, route->headers.length},
+      {(void *)encoding, gzipped ? sizeof(encoding) - 1 : 0},
+      {"\r\n", 2},
+  };
+  if (socket_writev_all(client, iov, 4) == 0) {
+    send_body(client, server, request, &file, fd);
+  } else if (fd != -1) {
+    close(fd);
+  }
+}
+
+static void serve_static(worker_memory_t *worker, int client,
+                         const server_t *server, const route_t *route,
+                         string_view_t rest, const http_request_t *request) {
+  if (rest.length == 0 || sv_equal(rest, SV_LIT("/"))) {
+    rest = SV_LIT("index.html");
+  }
 
-  http_request_t *request = parse_http(memory, buffer);
-  string_t *filename;
-  string_t *filepath;
+  // Cached bodies stay put until sent.
+  file_cache_t *cache = route->nocache ? nullptr : server->cache;
+  uint64_t pin = file_cache_enter(cache);
+  send_file(worker, client, server, route, rest, request);
+  file_cache_leave(cache, pin);
+}
+
+static void serve(worker_memory_t *worker, arena_t *memory, char *recv_buffer,
+                  int client, const server_t *server,
+                  const route_table_t *routes) {
+  string_t *buffer =
+      http_read_header(memory, recv_buffer, WORKER_BUFFER_SIZE, client);
+  if (buffer == nullptr) {
+    return;
+  }
 
-  if (request->uri->length == 1 && request->uri->data[0] == '/') {
-    filename = string_create(memory, "index.html");
-    filepath = get_safe_path(memory, root_dir, filename);
-  } else {
-    filename = request->uri;
-    filepath = get_safe_path(memory, root_dir, filename);
+  if (h2_is_preface(sv_from_string(buffer))) {
+    h2_serve(memory, client, server, routes, sv_from_string(buffer),
+             nullptr);
+    return;
   }
 
   char *message;
-  if (filepath != nullptr) {
-    log_trace(filepath->data);
-    log_trace(filename->data);
-
-    file_t file = get_file_contents(memory, filepath);
-    if (file.data == nullptr) {
-      log_error("File not found");
-      message = "HTTP/1.0 404 NOT FOUND\n\nFile Not Found";
-      (void)write(client, message, strlen(message));
-    } else {
-      char *header = "HTTP/1.0 200 OK\n\n";
-      (void)write(client, header, strlen(header));
-      (void)write(client, file.data, file.length);
+  http_request_t request;
+  int parsed = parse_http(sv_from_string(buffer), &request);
+  if (parsed == -E2BIG) {
+    message = "HTTP/1.0 431 REQUEST HEADER FIELDS TOO LARGE\n\n"
+              "Request Header Fields Too Large";
+    (void)socket_write_all(client, message, strlen(message));
+    return;
+  }
+  if (parsed != 0) {
+    log_warn("Malformed request");
+    message = "HTTP/1.0 400 BAD REQUEST\n\nBad Request";
+    (void)socket_write_all(client, message, strlen(message));
+    return;
+  }
+  TRACE_MARK(parse, TRACE_PARSE, client, request.method_name.data,
+             (int)request.method_name.length);
+  trace_set_path(request.path);
+
+  const char *debug = server->config->debug_endpoint;
+  if (debug != nullptr && sv_equal(request.path, sv_from_cstr(debug))) {
+    serve_debug(worker, client, server, &request);
+    return;
+  }
+
+  const http_header_t *host = http_find_header(&request, HTTP_TOKEN(HOST));
+  string_view_t rest = {};
+  const route_t *route =
+      route_match(routes, host != nullptr ? host->value : (string_view_t){},
+                  request.path, &rest);
+  if (route != nullptr && route->action == ROUTE_PROXY) {
+    (void)proxy_forward(route->upstream, worker, client, &request,
+                        sv_from_string(buffer));
+    return;
+  }
+
+  if (request.method == HTTP_TOKEN(PUT) ||
+      request.method == HTTP_TOKEN(POST)) {
+    upload_route_t *upload = upload_match(server->uploads, request.path);
+    if (upload != nullptr) {
+      (void)upload_receive(upload, worker, client, &request,
+                           sv_from_string(buffer));
+      return;
     }
-  } else {
-    log_error("File not found");
-    message = "HTTP/1.0 404 NOT FOUND\n\nFile Not Found";
-    (void)write(client, message, strlen(message));
   }
 
+  if (h2_wants_upgrade(&request)) {
+    h2_serve(memory, client, server, routes, sv_from_string(buffer),
+             &request);
+    return;
+  }
+
+  if (route == nullptr) {
+    not_found(client);
+    return;
+  }
+  switch (route->action) {
+  case ROUTE_STATIC:
+    serve_static(worker, client, server, route, rest, &request);
+    break;
+  case ROUTE_REDIRECT:
+  case ROUTE_FIXED:
+    TRACE_MARK(first_byte, TRACE_FIRST_BYTE, client);
+    (void)response_send(client, &request, route->status, route->headers,
+                        route->body.data, route->body.length);
+    break;
+  case ROUTE_PROXY:
+    break;
+  }
+}
+
+void handle_client(worker_memory_t *worker, int client,
+                   const job_info_t *info, const server_t *server) {
+  if (client < 0) {
+    return;
+  }
+
+  stats_add(server->stats, STAT_CONNECTIONS, 1);
+  TRACE_PROBE(dequeue, client, info->queued_at);
+  trace_span_t span;
+  trace_begin(server->trace, &span, info->queued_at);
+  tls_session_t *session = nullptr;
+  if (info->tls && tls_accept(server->tls, client, &session, &client) != 0) {
+    TRACE_PROBE(close, client);
+    trace_end(server->trace);
+    close(client);
+    return;
+  }
+
+  arena_t *memory = worker_memory_arena_get(worker);
+  char *recv_buffer = worker_memory_buffer_get(worker);
+  if (memory != nullptr && recv_buffer != nullptr) {
+    uint64_t pin;
+    const route_table_t *routes = router_enter(server->router, &pin);
+    serve(worker, memory, recv_buffer, client, server, routes);
+    router_leave(server->router, pin);
+  }
+  worker_memory_buffer_put(worker, recv_buffer);
+  worker_memory_arena_put(worker, memory);
+
+  tls_close(session);
+  TRACE_PROBE(close, client);
+  trace_end(server->trace);
   close(client);
 }
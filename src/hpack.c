@@ -0,0 +1,447 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "hpack.h"
+#include "log.h"
+#include "string_utils.h"
+
+enum {
+  STATIC_ENTRIES = 61,
+  STATIC_LAST_STATUS = 14, // ":status: 500"
+  HUFFMAN_MAX_BITS = 30,
+  HUFFMAN_EOS = 256,
+  INTEGER_MAX = 1 << 24, // Far above anything a sane peer sends
+};
+
+// RFC 7541, appendix A. Index 0 is unused.
+static const hpack_header_t static_table[STATIC_ENTRIES + 1] = {
+    [1] = {SV_LIT(":authority"), SV_LIT("")},
+    [2] = {SV_LIT(":method"), SV_LIT("GET")},
+    [3] = {SV_LIT(":method"), SV_LIT("POST")},
+    [4] = {SV_LIT(":path"), SV_LIT("/")},
+    [5] = {SV_LIT(":path"), SV_LIT("/index.html")},
+    [6] = {SV_LIT(":scheme"), SV_LIT("http")},
+    [7] = {SV_LIT(":scheme"), SV_LIT("https")},
+    [8] = {SV_LIT(":status"), SV_LIT("200")},
+    [9] = {SV_LIT(":status"), SV_LIT("204")},
+    [10] = {SV_LIT(":status"), SV_LIT("206")},
+    [11] = {SV_LIT(":status"), SV_LIT("304")},
+    [12] = {SV_LIT(":status"), SV_LIT("400")},
+    [13] = {SV_LIT(":status"), SV_LIT("404")},
+    [14] = {SV_LIT(":status"), SV_LIT("500")},
+    [15] = {SV_LIT("accept-charset"), SV_LIT("")},
+    [16] = {SV_LIT("accept-encoding"), SV_LIT("gzip, deflate")},
+    [17] = {SV_LIT("accept-language"), SV_LIT("")},
+    [18] = {SV_LIT("accept-ranges"), SV_LIT("")},
+    [19] = {SV_LIT("accept"), SV_LIT("")},
+    [20] = {SV_LIT("access-control-allow-origin"), SV_LIT("")},
+    [21] = {SV_LIT("age"), SV_LIT("")},
+    [22] = {SV_LIT("allow"), SV_LIT("")},
+    [23] = {SV_LIT("authorization"), SV_LIT("")},
+    [24] = {SV_LIT("cache-control"), SV_LIT("")},
+    [25] = {SV_LIT("content-disposition"), SV_LIT("")},
+    [26] = {SV_LIT("content-encoding"), SV_LIT("")},
+    [27] = {SV_LIT("content-language"), SV_LIT("")},
+    [28] = {SV_LIT("content-length"), SV_LIT("")},
+    [29] = {SV_LIT("content-location"), SV_LIT("")},
+    [30] = {SV_LIT("content-range"), SV_LIT("")},
+    [31] = {SV_LIT("content-type"), SV_LIT("")},
+    [32] = {SV_LIT("cookie"), SV_LIT("")},
+    [33] = {SV_LIT("date"), SV_LIT("")},
+    [34] = {SV_LIT("etag"), SV_LIT("")},
+    [35] = {SV_LIT("expect"), SV_LIT("")},
+    [36] = {SV_LIT("expires"), SV_LIT("")},
+    [37] = {SV_LIT("from"), SV_LIT("")},
+    [38] = {SV_LIT("host"), SV_LIT("")},
+    [39] = {SV_LIT("if-match"), SV_LIT("")},
+    [40] = {SV_LIT("if-modified-since"), SV_LIT("")},
+    [41] = {SV_LIT("if-none-match"), SV_LIT("")},
+    [42] = {SV_LIT("if-range"), SV_LIT("")},
+    [43] = {SV_LIT("if-unmodified-since"), SV_LIT("")},
+    [44] = {SV_LIT("last-modified"), SV_LIT("")},
+    [45] = {SV_LIT("link"), SV_LIT("")},
+    [46] = {SV_LIT("location"), SV_LIT("")},
+    [47] = {SV_LIT("max-forwards"), SV_LIT("")},
+    [48] = {SV_LIT("proxy-authenticate"), SV_LIT("")},
+    [49] = {SV_LIT("proxy-authorization"), SV_LIT("")},
+    [50] = {SV_LIT("range"), SV_LIT("")},
+    [51] = {SV_LIT("referer"), SV_LIT("")},
+    [52] = {SV_LIT("refresh"), SV_LIT("")},
+    [53] = {SV_LIT("retry-after"), SV_LIT("")},
+    [54] = {SV_LIT("server"), SV_LIT("")},
+    [55] = {SV_LIT("set-cookie"), SV_LIT("")},
+    [56] = {SV_LIT("strict-transport-security"), SV_LIT("")},
+    [57] = {SV_LIT("transfer-encoding"), SV_LIT("")},
+    [58] = {SV_LIT("user-agent"), SV_LIT("")},
+    [59] = {SV_LIT("vary"), SV_LIT("")},
+    [60] = {SV_LIT("via"), SV_LIT("")},
+    [61] = {SV_LIT("www-authenticate"), SV_LIT("")},
+};
+
+// The code of appendix B is canonical: within one length, codes are
+// consecutive in symbol order. So a code is decoded from its length, the
+// first code of that length and the symbols sorted by (length, symbol).
+typedef struct {
+  uint32_t first;
+  uint32_t count;
+  uint32_t index;
+} huffman_length_t;
+
+static const uint16_t huffman_symbols[257] = {
+    48, 49, 50, 97, 99, 101, 105, 111, 115, 116, 32, 37, 45, 46, 47, 51, 52, 53,
+    54, 55, 56, 57, 61, 65, 95, 98, 100, 102, 103, 104, 108, 109, 110, 112, 114,
+    117, 58, 66, 67, 68, 69, 70, 71, 72, 73, 74, 75, 76, 77, 78, 79, 80, 81, 82,
+    83, 84, 85, 86, 87, 89, 106, 107, 113, 118, 119, 120, 121, 122, 38, 42, 44,
+    59, 88, 90, 33, 34, 40, 41, 63, 39, 43, 124, 35, 62, 0, 36, 64, 91, 93, 126,
+    94, 125, 60, 96, 123, 92, 195, 208, 128, 130, 131, 162, 184, 194, 224, 226,
+    153, 161, 167, 172, 176, 177, 179, 209, 216, 217, 227, 229, 230, 129, 132,
+    133, 134, 136, 146, 154, 156, 160, 163, 164, 169, 170, 173, 178, 181, 185,
+    186, 187, 189, 190, 196, 198, 228, 232, 233, 1, 135, 137, 138, 139, 140,
+    141, 143, 147, 149, 150, 151, 152, 155, 157, 158, 165, 166, 168, 174, 175,
+    180, 182, 183, 188, 191, 197, 231, 239, 9, 142, 144, 145, 148, 159, 171,
+    206, 215, 225, 236, 237, 199, 207, 234, 235, 192, 193, 200, 201, 202, 205,
+    210, 213, 218, 219, 238, 240, 242, 243, 255, 203, 204, 211, 212, 214, 221,
+    222, 223, 241, 244, 245, 246, 247, 248, 250, 251, 252, 253, 254, 2, 3, 4, 5,
+    6, 7, 8, 11, 12, 14, 15, 16, 17, 18, 19, 20, 21, 23, 24, 25, 26, 27, 28, 29,
+    30, 31, 127, 220, 249, 10, 13, 22, 256,
+};
+
+// Per code length: first code, number of codes, index of the first symbol.
+static const huffman_length_t huffman_lengths[HUFFMAN_MAX_BITS + 1] = {
+    [5] = {0x0, 10, 0},
+    [6] = {0x14, 26, 10},
+    [7] = {0x5c, 32, 36},
+    [8] = {0xf8, 6, 68},
+    [10] = {0x3f8, 5, 74},
+    [11] = {0x7fa, 3, 79},
+    [12] = {0xffa, 2, 82},
+    [13] = {0x1ff8, 6, 84},
+    [14] = {0x3ffc, 2, 90},
+    [15] = {0x7ffc, 3, 92},
+    [19] = {0x7fff0, 3, 95},
+    [20] = {0xfffe6, 8, 98},
+    [21] = {0x1fffdc, 13, 106},
+    [22] = {0x3fffd2, 26, 119},
+    [23] = {0x7fffd8, 29, 145},
+    [24] = {0xffffea, 12, 174},
+    [25] = {0x1ffffec, 4, 186},
+    [26] = {0x3ffffe0, 15, 190},
+    [27] = {0x7ffffde, 19, 205},
+    [28] = {0xfffffe2, 29, 224},
+    [30] = {0x3ffffffc, 4, 253},
+};
+
+void hpack_table_init(hpack_table_t *table) {
+  table->count = 0;
+  table->used = 0;
+  table->size = 0;
+  table->max_size = HPACK_TABLE_SIZE;
+}
+
+static size_t entry_size(size_t name_length, size_t value_length) {
+  return name_length + value_length + HPACK_ENTRY_OVERHEAD;
+}
+
+// Drops the oldest entries until size + incoming fits max_size.
+static void table_evict(hpack_table_t *table, size_t incoming) {
+  size_t evicted = 0;
+  size_t bytes = 0;
+  while (evicted < table->count && table->size + incoming > table->max_size) {
+    const hpack_entry_t *entry = &table->entries[evicted];
+    bytes += (size_t)entry->name_length + entry->value_length;
+    table->size -= entry_size(entry->name_length, entry->value_length);
+    evicted++;
+  }
+  if (evicted == 0) {
+    return;
+  }
+
+  table->count -= evicted;
+  table->used -= bytes;
+  memmove(table->storage, table->storage + bytes, table->used);
+  memmove(table->entries, table->entries + evicted,
+          table->count * sizeof(hpack_entry_t));
+  for (size_t i = 0; i < table->count; i++) {
+    table->entries[i].offset = (uint16_t)(table->entries[i].offset - bytes);
+  }
+}
+
+static void table_insert(hpack_table_t *table, string_view_t name,
+                         string_view_t value) {
+  size_t size = entry_size(name.length, value.length);
+  if (size > table->max_size) {
+    // Not an error: the table just ends up empty (section 4.4).
+    table_evict(table, table->max_size + 1);
+    return;
+  }
+  table_evict(table, size);
+
+  hpack_entry_t *entry = &table->entries[table->count++];
+  entry->offset = (uint16_t)table->used;
+  entry->name_length = (uint16_t)name.length;
+  entry->value_length = (uint16_t)value.length;
+  memcpy(table->storage + table->used, name.data, name.length);
+  memcpy(table->storage + table->used + name.length, value.data,
+         value.length);
+  table->used += name.length + value.length;
+  table->size += size;
+}
+
+static int table_lookup(const hpack_table_t *table, size_t index,
+                        hpack_header_t *out) {
+  if (index == 0) {
+    return -1;
+  }
+  if (index <= STATIC_ENTRIES) {
+    *out = static_table[index];
+    return 0;
+  }
+
+  // Dynamic indices count from the newest entry.
+  size_t age = index - STATIC_ENTRIES - 1;
+  if (age >= table->count) {
+    return -1;
+  }
+  const hpack_entry_t *entry = &table->entries[table->count - 1 - age];
+  out->name = (string_view_t){table->storage + entry->offset,
+                              entry->name_length};
+  out->value = (string_view_t){out->name.data + entry->name_length,
+                               entry->value_length};
+  return 0;
+}
+
+// Prefix-coded integer (section 5.1).
+static int decode_integer(const uint8_t **cursor, const uint8_t *end,
+                          unsigned prefix, size_t *out) {
+  if (*cursor == end) {
+    return -1;
+  }
+  size_t mask = ((size_t)1 << prefix) - 1;
+  size_t value = **cursor & mask;
+  (*cursor)++;
+  if (value < mask) {
+    *out = value;
+    return 0;
+  }
+
+  for (unsigned shift = 0; *cursor < end; shift += 7) {
+    uint8_t byte = **cursor;
+    (*cursor)++;
+    value += (size_t)(byte & 0x7f) << shift;
+    if (value > INTEGER_MAX) {
+      return -1;
+    }
+    if ((byte & 0x80) == 0) {
+      *out = value;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+static int huffman_decode(const uint8_t *data, size_t length, char *out,
+                          size_t capacity, size_t *out_length) {
+  uint32_t code = 0;
+  unsigned bits = 0;
+  size_t written = 0;
+
+  for (size_t i = 0; i < length; i++) {
+    for (int bit = 7; bit >= 0; bit--) {
+      code = (code << 1) | ((uint32_t)(data[i] >> bit) & 1);
+      bits++;
+      const huffman_length_t *row = &huffman_lengths[bits];
+      uint32_t rank = code - row->first;
+      if (rank < row->count) {
+        uint16_t symbol = huffman_symbols[row->index + rank];
+        if (symbol == HUFFMAN_EOS || written == capacity) {
+          return -1;
+        }
+        out[written++] = (char)symbol;
+        code = 0;
+        bits = 0;
+      } else if (bits == HUFFMAN_MAX_BITS) {
+        return -1;
+      }
+    }
+  }
+
+  // Padding is at most 7 bits and must be a prefix of EOS, i.e. all ones.
+  if (bits > 7 || code != ((uint32_t)1 << bits) - 1) {
+    return -1;
+  }
+  *out_length = written;
+  return 0;
+}
+
+typedef struct {
+  char *data;
+  size_t length;
+  size_t capacity;
+} scratch_t;
+
+static int scratch_copy(scratch_t *scratch, string_view_t in,
+                        string_view_t *out) {
+  if (in.length > scratch->capacity - scratch->length) {
+    return -1;
+  }
+  char *dest = scratch->data + scratch->length;
+  memcpy(dest, in.data, in.length);
+  scratch->length += in.length;
+  *out = (string_view_t){dest, in.length};
+  return 0;
+}
+
+// String literal (section 5.2), decoded into scratch.
+static int decode_string(const uint8_t **cursor, const uint8_t *end,
+                         scratch_t *scratch, string_view_t *out) {
+  if (*cursor == end) {
+    return -1;
+  }
+  bool huffman = (**cursor & 0x80) != 0;
+  size_t length;
+  if (decode_integer(cursor, end, 7, &length) != 0 ||
+      length > (size_t)(end - *cursor)) {
+    return -1;
+  }
+  const uint8_t *data = *cursor;
+  *cursor += length;
+
+  if (!huffman) {
+    return scratch_copy(scratch, (string_view_t){(const char *)data, length},
+                        out);
+  }
+  char *dest = scratch->data + scratch->length;
+  size_t decoded;
+  if (huffman_decode(data, length, dest, scratch->capacity - scratch->length,
+                     &decoded) != 0) {
+    return -1;
+  }
+  scratch->length += decoded;
+  *out = (string_view_t){dest, decoded};
+  return 0;
+}
+
+int hpack_decode(hpack_table_t *table, const uint8_t *block, size_t length,
+                 char *scratch_data, size_t scratch_size,
+                 hpack_header_t *headers, size_t max_headers) {
+  scratch_t scratch = {scratch_data, 0, scratch_size};
+  const uint8_t *cursor = block;
+  const uint8_t *end = block + length;
+  size_t count = 0;
+
+  while (cursor < end) {
+    uint8_t first = *cursor;
+    size_t index;
+    hpack_header_t field;
+
+    if ((first & 0xe0) == 0x20) {
+      // Dynamic table size update, only allowed before the first field.
+      if (count > 0 || decode_integer(&cursor, end, 5, &index) != 0 ||
+          index > HPACK_TABLE_SIZE) {
+        return -1;
+      }
+      table->max_size = index;
+      table_evict(table, 0);
+      continue;
+    }
+    if (count == max_headers) {
+      return -1;
+    }
+
+    if (first & 0x80) {
+      // Indexed field.
+      if (decode_integer(&cursor, end, 7, &index) != 0 ||
+          table_lookup(table, index, &field) != 0 ||
+          scratch_copy(&scratch, field.name, &field.name) != 0 ||
+          scratch_copy(&scratch, field.value, &field.value) != 0) {
+        return -1;
+      }
+      headers[count++] = field;
+      continue;
+    }
+
+    // Literal: 01 incremental indexing, 0000 without, 0001 never indexed.
+    bool indexing = (first & 0xc0) == 0x40;
+    unsigned prefix = indexing ? 6 : 4;
+    if (decode_integer(&cursor, end, prefix, &index) != 0) {
+      return -1;
+    }
+    if (index == 0) {
+      if (decode_string(&cursor, end, &scratch, &field.name) != 0) {
+        return -1;
+      }
+    } else if (table_lookup(table, index, &field) != 0 ||
+               scratch_copy(&scratch, field.name, &field.name) != 0) {
+      return -1;
+    }
+    if (decode_string(&cursor, end, &scratch, &field.value) != 0) {
+      return -1;
+    }
+    if (indexing) {
+      table_insert(table, field.name, field.value);
+    }
+    headers[count++] = field;
+  }
+
+  return (int)count;
+}
+
+static int encode_integer(hpack_block_t *block, uint8_t flags,
+                          unsigned prefix, size_t value) {
+  size_t mask = ((size_t)1 << prefix) - 1;
+  if (block->length == block->capacity) {
+    return -1;
+  }
+  if (value < mask) {
+    block->data[block->length++] = (uint8_t)(flags | value);
+    return 0;
+  }
+
+  block->data[block->length++] = (uint8_t)(flags | mask);
+  value -= mask;
+  while (value >= 0x80) {
+    if (block->length == block->capacity) {
+      return -1;
+    }
+    block->data[block->length++] = (uint8_t)(0x80 | (value & 0x7f));
+    value >>= 7;
+  }
+  if (block->length == block->capacity) {
+    return -1;
+  }
+  block->data[block->length++] = (uint8_t)value;
+  return 0;
+}
+
+int hpack_encode_header(hpack_block_t *block, hpack_static_t name,
+                        string_view_t value) {
+  if (encode_integer(block, 0x00, 4, (size_t)name) != 0 ||
+      encode_integer(block, 0x00, 7, value.length) != 0 ||
+      value.length > block->capacity - block->length) {
+    return -1;
+  }
+  memcpy(block->data + block->length, value.data, value.length);
+  block->length += value.length;
+  return 0;
+}
+
+int hpack_encode_status(hpack_block_t *block, int status) {
+  for (size_t i = HPACK_STATUS; i <= STATIC_LAST_STATUS; i++) {
+    const string_view_t code = static_table[i].value;
+    if ((code.data[0] - '0') * 100 + (code.data[1] - '0') * 10 +
+            (code.data[2] - '0') ==
+        status) {
+      return encode_integer(block, 0x80, 7, i);
+    }
+  }
+
+  char digits[4];
+  if (status < 100 || status > 999) {
+    return -1;
+  }
+  (void)snprintf(digits, sizeof(digits), "%d", status);
+  return hpack_encode_header(block, HPACK_STATUS,
+                             (string_view_t){digits, 3});
+}
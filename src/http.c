@@ -7,95 +7,347 @@
 
 #include "arena.h"
 #include "constants.h"
+#include "coro.h"
 #include "http.h"
 #include "log.h"
 #include "string_utils.h"
 
-http_request_t *parse_http(arena_t *memory, string_t *data) {
+const string_view_t http_tokens[HTTP_TOKEN_COUNT] = {
+    [HTTP_TOKEN_GET] = SV_LIT("GET"),
+    [HTTP_TOKEN_HEAD] = SV_LIT("HEAD"),
+    [HTTP_TOKEN_POST] = SV_LIT("POST"),
+    [HTTP_TOKEN_PUT] = SV_LIT("PUT"),
+    [HTTP_TOKEN_DELETE] = SV_LIT("DELETE"),
+    [HTTP_TOKEN_OPTIONS] = SV_LIT("OPTIONS"),
+    [HTTP_TOKEN_PRI] = SV_LIT("PRI"),
+    [HTTP_TOKEN_HOST] = SV_LIT("host"),
+    [HTTP_TOKEN_CONNECTION] = SV_LIT("connection"),
+    [HTTP_TOKEN_CONTENT_LENGTH] = SV_LIT("content-length"),
+    [HTTP_TOKEN_CONTENT_TYPE] = SV_LIT("content-type"),
+    [HTTP_TOKEN_TRANSFER_ENCODING] = SV_LIT("transfer-encoding"),
+    [HTTP_TOKEN_EXPECT] = SV_LIT("expect"),
+    [HTTP_TOKEN_UPGRADE] = SV_LIT("upgrade"),
+    [HTTP_TOKEN_HTTP2_SETTINGS] = SV_LIT("http2-settings"),
+    [HTTP_TOKEN_USER_AGENT] = SV_LIT("user-agent"),
+    [HTTP_TOKEN_ACCEPT] = SV_LIT("accept"),
+    [HTTP_TOKEN_ACCEPT_ENCODING] = SV_LIT("accept-encoding"),
+    [HTTP_TOKEN_KEEP_ALIVE] = SV_LIT("keep-alive"),
+};
+
+[[nodiscard]]
+const string_view_t *http_intern_method(string_view_t name) {
+  for (int i = HTTP_TOKEN_GET; i < HTTP_TOKEN_HOST; i++) {
+    if (sv_equal(name, http_tokens[i])) {
+      return &http_tokens[i];
+    }
+  }
+  return nullptr;
+}
+
+[[nodiscard]]
+const string_view_t *http_intern_header(string_view_t name) {
+  for (int i = HTTP_TOKEN_HOST; i < HTTP_TOKEN_COUNT; i++) {
+    if (sv_equal_nocase(name, http_tokens[i])) {
+      return &http_tokens[i];
+    }
+  }
+  return nullptr;
+}
+
+[[nodiscard]]
+const http_header_t *http_headers_find(const http_header_t *headers,
+                                       size_t count,
+                                       const string_view_t *token) {
+  for (size_t i = 0; i < count; i++) {
+    if (headers[i].token == token) {
+      return &headers[i];
+    }
+  }
+  return nullptr;
+}
+
+[[nodiscard]]
+const http_header_t *http_find_header(const http_request_t *request,
+                                      const string_view_t *token) {
+  return http_headers_find(request->headers, request->header_count, token);
+}
+
+[[nodiscard]]
+int http_headers_content_length(const http_header_t *headers, size_t count,
+                                size_t *length) {
+  const http_header_t *header =
+      http_headers_find(headers, count, HTTP_TOKEN(CONTENT_LENGTH));
+  if (header == nullptr) {
+    return 1;
+  }
+  if (header->value.length == 0 || header->value.length > 19) {
+    return -1;
+  }
+
+  size_t value = 0;
+  for (size_t i = 0; i < header->value.length; i++) {
+    char c = header->value.data[i];
+    if (c < '0' || c > '9') {
+      return -1;
+    }
+    value = value * 10 + (size_t)(c - '0');
+  }
+  *length = value;
+  return 0;
+}
+
+static bool list_has(string_view_t list, string_view_t option) {
+  string_view_t item;
+  while (sv_split(&list, ',', &item)) {
+    if (sv_equal_nocase(sv_trim(item), option)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+[[nodiscard]]
+bool http_accepts_coding(string_view_t accept_encoding, string_view_t coding) {
+  string_view_t item;
+  while (sv_split(&accept_encoding, ',', &item)) {
+    string_view_t name;
+    (void)sv_split(&item, ';', &name);
+    if (!sv_equal_nocase(sv_trim(name), coding)) {
+      continue;
+    }
+    // Refused only with a weight of zero: "q=0", "q=0.0" and so on.
+    size_t q = sv_find(item, SV_LIT("q="));
+    if (q == SV_NPOS) {
+      return true;
+    }
+    for (size_t i = q + 2; i < item.length; i++) {
+      if (item.data[i] != '0' && item.data[i] != '.') {
+        return item.data[i] != ' ' && item.data[i] != ';';
+      }
+    }
+    return false;
+  }
+  return false;
+}
+
+[[nodiscard]]
+bool http_headers_chunked(const http_header_t *headers, size_t count) {
+  const http_header_t *header =
+      http_headers_find(headers, count, HTTP_TOKEN(TRANSFER_ENCODING));
+  return header != nullptr && list_has(header->value, SV_LIT("chunked"));
+}
+
+[[nodiscard]]
+bool http_headers_connection_has(const http_header_t *headers, size_t count,
+                                 string_view_t option) {
+  const http_header_t *header =
+      http_headers_find(headers, count, HTTP_TOKEN(CONNECTION));
+  return header != nullptr && list_has(header->value, option);
+}
+
+static int parse_header_line(string_view_t line, http_header_t *headers,
+                             size_t *count) {
+  // Ignoring the rest could drop the framing or the Host of the request.
+  if (*count == MAX_HEADERS) {
+    log_warn("More than %d headers", MAX_HEADERS);
+    return -E2BIG;
+  }
+
+  size_t colon = sv_find_char(line, ':');
+  if (colon == SV_NPOS || colon == 0) {
+    return -1;
+  }
+
+  http_header_t *header = &headers[(*count)++];
+  header->name = sv_slice(line, 0, colon);
+  header->value = sv_trim(sv_slice(line, colon + 1, SV_NPOS));
+  header->token = http_intern_header(header->name);
+  return 0;
+}
+
+// Parses header lines up to the empty line, returns the bytes consumed.
+static int parse_header_block(string_view_t data, size_t from,
+                              http_header_t *headers, size_t *count,
+                              size_t *header_length) {
+  string_view_t rest = sv_slice(data, from, SV_NPOS);
+  string_view_t line;
+  while (sv_split(&rest, '\n', &line)) {
+    // A last line without its '\n' means the block is cut short.
+    if (rest.data == nullptr) {
+      return -1;
+    }
+    if (line.length > 0 && line.data[line.length - 1] == '\r') {
+      line.length--;
+    }
+    if (line.length == 0) {
+      *header_length = (size_t)(rest.data - data.data);
+      return 0;
+    }
+    int rc = parse_header_line(line, headers, count);
+    if (rc != 0) {
+      return rc;
+    }
+  }
+  return -1;
+}
+
+[[nodiscard]]
+int parse_http(string_view_t data, http_request_t *request) {
   http_state_enum state = STATE_METHOD;
-  http_request_t *request =
-      (http_request_t *)arena_alloc(memory, sizeof(http_request_t));
+  *request = (http_request_t){};
 
-  char *token_start = data->data;
-  for (size_t i = 0; i < data->length; i++) {
-    char current = data->data[i];
+  size_t token_start = 0;
+  size_t i = 0;
+  for (; i < data.length && state != STATE_HEADERS; i++) {
+    char current = data.data[i];
 
     switch (state) {
     case STATE_METHOD:
       if (current == ' ') {
-        if ((size_t)((data->data + i) - token_start) > MAX_METHOD) {
+        if (i - token_start > MAX_METHOD) {
           state = STATE_ERROR;
           break;
         }
-        request->method = string_create_from_len(
-            memory, token_start, (size_t)((data->data + i) - token_start));
+        request->method_name = sv_slice(data, token_start, i - token_start);
+        request->method = http_intern_method(request->method_name);
         state = STATE_SPACE_BEFORE_URI;
       }
       break;
     case STATE_SPACE_BEFORE_URI:
       if (current != ' ') {
-        token_start = data->data + i;
+        token_start = i;
         state = STATE_URI;
       }
       break;
     case STATE_URI:
       if (current == ' ') {
-        if ((size_t)((data->data + i) - token_start) > MAX_URI) {
+        if (i - token_start > MAX_URI) {
           state = STATE_ERROR;
           break;
         }
-        request->uri = string_create_from_len(
-            memory, token_start, (size_t)((data->data + i) - token_start));
+        request->uri = sv_slice(data, token_start, i - token_start);
         state = STATE_SPACE_BEFORE_VERSION;
       }
       break;
 
     case STATE_SPACE_BEFORE_VERSION:
       if (current != ' ') {
+        token_start = i;
         state = STATE_VERSION;
       }
       break;
 
     case STATE_VERSION:
-      if (current == '\r') {
-        state = STATE_CRLF;
+      if (current == '\r' || current == '\n') {
+        request->version = sv_slice(data, token_start, i - token_start);
+        state = current == '\r' ? STATE_CRLF : STATE_HEADERS;
       }
       break;
     case STATE_CRLF:
-      if (current == '\n') {
-        token_start = data->data + i + 1;
-        state = STATE_DONE;
-      }
+      state = current == '\n' ? STATE_HEADERS : STATE_ERROR;
       break;
+    case STATE_HEADERS:
     case STATE_DONE:
-      return request;
+      break;
     case STATE_ERROR:
-      return nullptr;
+      return -1;
     }
   }
+  if (state != STATE_HEADERS || request->uri.length == 0) {
+    return -1;
+  }
 
-  return request;
+  int rc = parse_header_block(data, i, request->headers,
+                              &request->header_count,
+                              &request->header_length);
+  if (rc != 0) {
+    return rc;
+  }
+
+  size_t query = sv_find_char(request->uri, '?');
+  request->path = sv_slice(request->uri, 0, query);
+  if (query != SV_NPOS) {
+    request->query = sv_slice(request->uri, query + 1, SV_NPOS);
+  }
+
+  return 0;
 }
 
-string_t *http_read_header(arena_t *memory, int sockfd) {
-  if (sockfd < 0) {
+[[nodiscard]]
+int parse_http_response(string_view_t data, http_response_t *response) {
+  *response = (http_response_t){};
+
+  size_t line_end = sv_find_char(data, '\n');
+  if (line_end == SV_NPOS) {
+    return -1;
+  }
+  string_view_t line = sv_slice(data, 0, line_end);
+  if (line.length > 0 && line.data[line.length - 1] == '\r') {
+    line.length--;
+  }
+  response->status_line = line;
+
+  // "HTTP/1.1 200 Reason"
+  string_view_t rest = line;
+  string_view_t status;
+  if (!sv_split(&rest, ' ', &response->version) ||
+      !sv_starts_with(response->version, SV_LIT("HTTP/")) ||
+      !sv_split(&rest, ' ', &status) || status.length != 3) {
+    return -1;
+  }
+  for (size_t i = 0; i < status.length; i++) {
+    if (status.data[i] < '0' || status.data[i] > '9') {
+      return -1;
+    }
+    response->status = response->status * 10 + (status.data[i] - '0');
+  }
+
+  return parse_header_block(data, line_end + 1, response->headers,
+                            &response->header_count,
+                            &response->header_length);
+}
+
+static bool header_complete(const char *data, size_t length) {
+  return memmem(data, length, "\r\n\r\n", 4) != nullptr ||
+         memmem(data, length, "\n\n", 2) != nullptr;
+}
+
+string_t *http_read_header(arena_t *memory, char *data, size_t capacity,
+                           int sockfd) {
+  if (sockfd < 0 || data == nullptr || capacity == 0) {
     return nullptr;
   }
-  string_t *buffer = string_create_from_len(memory, nullptr, BUFFER_SIZE);
+  string_t *buffer = (string_t *)arena_alloc(memory, sizeof(string_t));
   if (buffer == nullptr) {
     return nullptr;
   }
+  buffer->data = data;
+  buffer->length = 0;
 
-  ssize_t length = read(sockfd, buffer->data, BUFFER_SIZE - 1);
-  if (length == 0) {
-    log_warn("Read 0 bytes from sockfd.");
-    return nullptr;
-  } else if (length < 0) {
-    log_warn("Cannot read from socket: %s", strerror(errno));
+  while (buffer->length < capacity - 1) {
+    ssize_t length = coro_read(sockfd, buffer->data + buffer->length,
+                               capacity - 1 - buffer->length);
+    if (length == 0) {
+      log_warn("Read 0 bytes from sockfd.");
+      return nullptr;
+    } else if (length < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      log_warn("Cannot read from socket: %s", strerror(errno));
+      return nullptr;
+    }
+
+    // Only the newly read bytes (plus a 3 byte overlap) can complete it.
+    size_t scan_from = buffer->length > 3 ? buffer->length - 3 : 0;
+    buffer->length += (size_t)length;
+    if (header_complete(buffer->data + scan_from,
+                        buffer->length - scan_from)) {
+      break;
+    }
   }
 
-  buffer->data[length] = '\0';
-  buffer->length = (size_t)length;
-  log_info("Message recived: \"\n%s\n\"\n", buffer->data);
+  buffer->data[buffer->length] = '\0';
+  log_debug("Message recived: \"\n%s\n\"\n", buffer->data);
   return buffer;
 }
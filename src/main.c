@@ -1,71 +1,455 @@
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
 #include <pthread.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <sys/socket.h>
 #include <unistd.h>
 
 #include "arena.h"
+#include "autoindex.h"
+#include "config.h"
+#include "constants.h"
 #include "file.h"
+#include "file_cache.h"
 #include "log.h"
 #include "log_config.h"
+#include "prefork.h"
+#include "proxy.h"
 #include "queue.h"
+#include "ratelimit.h"
+#include "router.h"
+#include "server.h"
 #include "sig.h"
 #include "socket.h"
+#include "stats.h"
 #include "string_utils.h"
 #include "thread_pool.h"
+#include "tls.h"
+#include "trace.h"
+#include "upgrade.h"
+#include "upload.h"
+#include "warmup.h"
 
-int setup(int argc, char *argv[], uint16_t *port_number, string_t *root_dir) {
+typedef enum {
+  LISTENER_HTTP,
+  LISTENER_TLS,
+  LISTENER_UNIX,
+  LISTENER_COUNT,
+} listener_kind_t;
+
+// Listening sockets by kind, -1 where disabled.
+typedef struct {
+  int fds[LISTENER_COUNT];
+} listener_set_t;
+
+// Shared by the master with every worker process it forks.
+typedef struct {
+  server_t *server;
+  ratelimit_t *limiter;
+  listener_set_t *sets; // One per worker process
+  int count;
+} prefork_state_t;
+
+int setup(int argc, char *argv[], server_config_t *config, arena_t *memory,
+          string_t **root_dir) {
   log_setup();
-  if (argc < 3) {
-    log_fatal("Usage: %s <port_number> <project_dir>");
+  if (config_parse(config, argc, argv) != 0) {
+    config_usage(argv[0]);
     return -1;
   }
 
-  if (parse_port(argv[1], port_number) != 0) {
-    log_fatal("Usage: %s <port_number> <project_dir>");
+  signal_init();
+
+  char resolved[PATH_MAX];
+  if (realpath(config->root_dir, resolved) == nullptr) {
+    config_usage(argv[0]);
+    return -1;
+  }
+  *root_dir = string_create(memory, resolved);
+  if (*root_dir == nullptr || get_path_type(*root_dir) != PATH_DIR) {
+    config_usage(argv[0]);
     return -1;
   }
 
-  signal_init();
+  return 0;
+}
 
-  if (get_path_type(root_dir) != PATH_DIR) {
-    log_fatal("Usage: %s <port_number> <project_dir>");
-    return -1;
+static bool listener_enabled(const server_config_t *config,
+                             listener_kind_t kind) {
+  switch (kind) {
+  case LISTENER_TLS:
+    return config->tls_port != 0;
+  case LISTENER_UNIX:
+    return config->unix_path != nullptr;
+  default:
+    return true;
+  }
+}
+
+static int listener_open(const server_config_t *config, listener_kind_t kind,
+                         bool reuse_port) {
+  switch (kind) {
+  case LISTENER_TLS:
+    return open_socket(config->tls_port, reuse_port);
+  case LISTENER_UNIX:
+    return open_unix_socket(config->unix_path, config->unix_mode);
+  default:
+    return open_socket(config->port, reuse_port);
   }
+}
+
+// Enabled listeners in kind order, which is also the order they are handed
+// over in; inherited descriptors are used first. A Unix socket path cannot be
+// bound twice, so worker processes share base's.
+static void listeners_open(const server_config_t *config, listener_set_t *set,
+                           const int *inherited, int inherited_count,
+                           const listener_set_t *base) {
+  int next = 0;
+  for (int kind = 0; kind < LISTENER_COUNT; kind++) {
+    if (!listener_enabled(config, (listener_kind_t)kind)) {
+      set->fds[kind] = -1;
+    } else if (next < inherited_count) {
+      set->fds[kind] = inherited[next++];
+    } else if (base != nullptr && kind == LISTENER_UNIX) {
+      set->fds[kind] = base->fds[kind];
+    } else {
+      set->fds[kind] = listener_open(config, (listener_kind_t)kind,
+                                     config->processes > 0);
+    }
+  }
+}
+
+static void listeners_close(listener_set_t *set) {
+  for (int kind = 0; kind < LISTENER_COUNT; kind++) {
+    if (set->fds[kind] != -1) {
+      close(set->fds[kind]);
+      set->fds[kind] = -1;
+    }
+  }
+}
+
+static void unlink_unix_socket(const server_config_t *config) {
+  if (config->unix_path != nullptr && config->unix_path[0] != '@') {
+    (void)unlink(config->unix_path);
+  }
+}
 
+// Parts each serving process builds for itself: they hold locks and
+// threads that do not survive fork().
+static int components_create(server_t *server) {
+  const server_config_t *config = server->config;
+  server->autoindex = config->autoindex ? autoindex_create() : nullptr;
+  if (proxy_create(config, &server->proxy) != 0 ||
+      uploads_create(config, &server->uploads) != 0 ||
+      disk_io_create(config, &server->disk_io) != 0 ||
+      router_create(config, server->root_dir, server->proxy,
+                    &server->router) != 0) {
+    return -1;
+  }
   return 0;
 }
 
-int main(int argc, char *argv[]) {
-  arena_t *main_mem = arena_create(ARENA_MAX_SIZE / 64);
-  string_t *root_dir = string_create(main_mem, argv[2]);
-  uint16_t port_number;
-  setup(argc, argv, &port_number, root_dir);
+static void components_destroy(server_t *server) {
+  autoindex_destroy(server->autoindex);
+  router_destroy(server->router);
+  proxy_destroy(server->proxy);
+  uploads_destroy(server->uploads);
+  disk_io_destroy(server->disk_io);
+}
+
+// Answered on the accepting thread: no worker, no allocation, no blocking.
+static void reject_client(int client) {
+  static const char response[] =
+      "HTTP/1.0 429 TOO MANY REQUESTS\n\nToo Many Requests";
+  // Reading what already arrived lets close() send a FIN instead of a reset
+  // that could destroy the response before the client reads it.
+  char sink[BUFFER_SIZE];
+  (void)recv(client, sink, sizeof(sink), MSG_DONTWAIT);
+  (void)send(client, response, sizeof(response) - 1,
+             MSG_DONTWAIT | MSG_NOSIGNAL);
+  close(client);
+}
+
+static void accept_client(const server_t *server, ratelimit_t *limiter,
+                          job_queue_t *queue, int sockfd,
+                          listener_kind_t kind) {
+  log_trace("Socket_fd: %d", sockfd);
+  struct sockaddr_storage peer;
+  int client = get_client(sockfd, &peer);
+  if (client < 0) {
+    return;
+  }
+  TRACE_PROBE(accept, client, (int)kind);
+  if (!ratelimit_allow(limiter, &peer)) {
+    stats_add(server->stats, STAT_REJECTED, 1);
+    // A TLS client could not read the plaintext answer.
+    if (kind == LISTENER_TLS) {
+      close(client);
+    } else {
+      reject_client(client);
+    }
+  } else if (queue_push(queue, client, kind == LISTENER_TLS) != 0) {
+    log_warn("Queue full, dropping client");
+    close(client);
+  }
+}
+
+// Returns true once the listeners were handed to an upgraded process. argv
+// is nullptr where hot upgrades are not offered.
+static bool accept_loop(const server_t *server, ratelimit_t *limiter,
+                        const listener_set_t *set, job_queue_t *queue,
+                        char *argv[], const sigset_t *unblocked) {
+  struct pollfd fds[LISTENER_COUNT + 1];
+  listener_kind_t kinds[LISTENER_COUNT];
+  int handover[LISTENER_COUNT];
+  int listening = 0;
+  for (int kind = 0; kind < LISTENER_COUNT; kind++) {
+    if (set->fds[kind] != -1) {
+      fds[listening] = (struct pollfd){.fd = set->fds[kind], .events = POLLIN};
+      handover[listening] = set->fds[kind];
+      kinds[listening++] = (listener_kind_t)kind;
+    }
+  }
+
+  upgrade_t upgrade = {.pid = -1, .channel = -1};
+  bool handed_off = false;
+  while (server_running && !handed_off) {
+    if (upgrade_requested) {
+      upgrade_requested = 0;
+      if (argv != nullptr) {
+        if (server->config->hot_snapshot != nullptr) {
+          (void)file_cache_snapshot_write(server->cache, server->root_dir,
+                                          server->config->hot_snapshot);
+        }
+        (void)upgrade_begin(&upgrade, argv, handover, listening,
+                            unblocked);
+      }
+    }
+    if (reload_requested) {
+      reload_requested = 0;
+      (void)router_reload(server->router);
+    }
+
+    fds[listening] = (struct pollfd){.fd = upgrade.channel, .events = POLLIN};
+    nfds_t nfds = (nfds_t)listening + (upgrade.channel == -1 ? 0 : 1);
+    if (ppoll(fds, nfds, nullptr, unblocked) < 0) {
+      continue;
+    }
+
+    if (upgrade.channel != -1 && fds[listening].revents != 0) {
+      handed_off = upgrade_finish(&upgrade) == 0;
+      continue;
+    }
+    for (int i = 0; i < listening; i++) {
+      if (fds[i].revents & POLLIN) {
+        accept_client(server, limiter, queue, fds[i].fd, kinds[i]);
+      }
+    }
+  }
+  return handed_off;
+}
+
+// Accepts into a pool of worker threads until shutdown or hand-off. Returns
+// false when the drain deadline passed with requests still in flight.
+static bool serve(server_t *server, ratelimit_t *limiter, listener_set_t *set,
+                  char *argv[], int upgrade_channel, bool *handed_off) {
+  // Workers inherit the mask and leave signals to the accepting thread.
+  sigset_t unblocked;
+  signal_block(&unblocked);
 
-  int sockfd = open_socket(port_number);
   job_queue_t queue;
-  queue_init(&queue);
+  queue_init(&queue, server->config->coroutines > 0);
 
   thread_pool_t pool;
-  if (thread_pool_init(&pool, &queue, root_dir) != 0) {
-    return EXIT_FAILURE;
+  server->pool = &pool;
+  if (thread_pool_init(&pool, &queue, server) != 0) {
+    exit(EXIT_FAILURE);
   }
 
+  // Only now tell a predecessor it can stop accepting: we are warm.
+  upgrade_ready(upgrade_channel);
+
   log_info("Server accepting connections...");
-  while (server_running) {
-    log_trace("Socket_fd: %d", sockfd);
-    int client = get_client(sockfd);
-    if (client >= 0) {
-      queue_push(&queue, client);
-    }
-  }
+  *handed_off = accept_loop(server, limiter, set, &queue, argv, &unblocked);
 
-  log_info("Stopping server...");
+  // The listeners stay open in the successor, so nothing queued is lost.
+  listeners_close(set);
+  log_info("Stopping server, draining in-flight requests...");
 
   queue_shutdown(&queue);
-  thread_pool_wait(&pool);
+  if (thread_pool_wait_for(&pool, server->config->drain_timeout) != 0) {
+    log_warn("Drain deadline passed, exiting with requests in flight");
+    return false;
+  }
+  server->pool = nullptr;
   queue_destroy(&queue);
-  close(sockfd);
+  return true;
+}
+
+static int worker_process(int slot, void *arg) {
+  prefork_state_t *state = arg;
+  // Other workers' sockets stay with the master; the Unix one is shared.
+  for (int i = 0; i < state->count; i++) {
+    if (i == slot) {
+      continue;
+    }
+    for (int kind = 0; kind < LISTENER_COUNT; kind++) {
+      if (kind != LISTENER_UNIX && state->sets[i].fds[kind] != -1) {
+        close(state->sets[i].fds[kind]);
+      }
+    }
+  }
+
+  server_t *server = state->server;
+  file_cache_attach(server->cache, slot);
+  if (components_create(server) != 0) {
+    return EXIT_FAILURE;
+  }
+  bool handed_off;
+  if (serve(server, state->limiter, &state->sets[slot], nullptr, -1,
+            &handed_off)) {
+    components_destroy(server);
+  }
+  return EXIT_SUCCESS;
+}
+
+// Every worker process gets its own SO_REUSEPORT sockets, opened here so a
+// replacement inherits the accept queue of the worker that died.
+static int run_prefork(server_t *server, ratelimit_t *limiter) {
+  const server_config_t *config = server->config;
+  int count = (int)config->processes;
+  listener_set_t *sets = calloc((size_t)count, sizeof(listener_set_t));
+  if (sets == nullptr) {
+    return -ENOMEM;
+  }
+  for (int i = 0; i < count; i++) {
+    listeners_open(config, &sets[i], nullptr, 0, i > 0 ? &sets[0] : nullptr);
+  }
+
+  // Workers fork from a warm cache and find it already filled.
+  if (server->cache != nullptr) {
+    warmup_wait(warmup_start(server->cache, server->root_dir,
+                             config->hot_snapshot,
+                             (int)thread_pool_cpu_budget()));
+  }
+
+  prefork_state_t state = {
+      .server = server,
+      .limiter = limiter,
+      .sets = sets,
+      .count = count,
+  };
+  stats_attach(count);
+  file_cache_attach(server->cache, count);
+  int rc = prefork_run(count, worker_process, &state, server->stats);
+
+  for (int i = 0; i < count; i++) {
+    if (i > 0) {
+      sets[i].fds[LISTENER_UNIX] = -1;
+    }
+    listeners_close(&sets[i]);
+  }
+  unlink_unix_socket(config);
+  free(sets);
+  return rc;
+}
+
+static void log_stats(const stats_t *stats) {
+  uint64_t total[STAT_COUNT];
+  stats_total(stats, total);
+  log_info("Served %llu connections, %llu rejected; cache %llu hits, %llu "
+           "misses; %llu worker respawns",
+           (unsigned long long)total[STAT_CONNECTIONS],
+           (unsigned long long)total[STAT_REJECTED],
+           (unsigned long long)total[STAT_CACHE_HITS],
+           (unsigned long long)total[STAT_CACHE_MISSES],
+           (unsigned long long)total[STAT_RESPAWNS]);
+}
+
+int main(int argc, char *argv[]) {
+  arena_t *main_mem = arena_create(ARENA_MAX_SIZE / 16);
+  server_config_t config;
+  string_t *root_dir = nullptr;
+  if (setup(argc, argv, &config, main_mem, &root_dir) != 0) {
+    arena_destroy(main_mem);
+    return EXIT_FAILURE;
+  }
+
+  // Worker processes share the cache, the limiter and the counters.
+  bool prefork = config.processes > 0;
+  server_t server = {
+      .config = &config,
+      .root_dir = root_dir,
+      .cache = file_cache_create(config.cache_budget, prefork),
+      .stats = stats_create(prefork ? (int)config.processes + 1 : 1),
+      .trace = trace_create(config.trace_sample),
+  };
+  // Before any fork, so every process encrypts tickets with the same keys.
+  if (tls_create(&config, &server.tls) != 0) {
+    return EXIT_FAILURE;
+  }
+  ratelimit_t *limiter = nullptr;
+  if (config.rate_limit > 0) {
+    limiter = ratelimit_create(config.rate_limit, config.rate_burst, prefork);
+    if (limiter == nullptr) {
+      return EXIT_FAILURE;
+    }
+  }
+
+  bool handed_off = false;
+  warmup_t *warmup = nullptr;
+  if (prefork) {
+    if (run_prefork(&server, limiter) != 0) {
+      return EXIT_FAILURE;
+    }
+  } else {
+    if (components_create(&server) != 0) {
+      return EXIT_FAILURE;
+    }
+
+    int inherited[UPGRADE_MAX_FDS];
+    int upgrade_channel;
+    int inherited_count =
+        upgrade_inherit(inherited, UPGRADE_MAX_FDS, &upgrade_channel);
+    if (inherited_count < 0) {
+      return EXIT_FAILURE;
+    }
+
+    if (server.cache != nullptr) {
+      warmup = warmup_start(server.cache, root_dir, config.hot_snapshot,
+                            (int)thread_pool_cpu_budget());
+      if (!config.serve_while_warming) {
+        warmup_wait(warmup);
+        warmup = nullptr;
+      }
+    }
+
+    listener_set_t set;
+    listeners_open(&config, &set, inherited, inherited_count, nullptr);
+    if (!serve(&server, limiter, &set, argv, upgrade_channel, &handed_off)) {
+      return EXIT_SUCCESS;
+    }
+    if (!handed_off) {
+      unlink_unix_socket(&config);
+    }
+    components_destroy(&server);
+  }
+
+  warmup_wait(warmup);
+  if (config.hot_snapshot != nullptr && !handed_off) {
+    (void)file_cache_snapshot_write(server.cache, root_dir,
+                                    config.hot_snapshot);
+  }
+  log_stats(server.stats);
+  file_cache_destroy(server.cache);
+  tls_destroy(server.tls);
+  ratelimit_destroy(limiter);
+  stats_destroy(server.stats);
+  trace_destroy(server.trace);
   arena_destroy(main_mem);
 
   return EXIT_SUCCESS;
@@ -0,0 +1,188 @@
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "prefork.h"
+#include "sig.h"
+#include "stats.h"
+
+typedef struct {
+  pid_t pid; // -1 while not running
+  time_t started;
+  time_t respawn_at; // When pid is -1
+} worker_process_t;
+
+// Only there to interrupt ppoll(); children are reaped in the loop.
+static void handle_child(int signo) { (void)signo; }
+
+static time_t now_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec;
+}
+
+static int spawn(worker_process_t *worker, int slot, prefork_child_t child,
+                 void *arg, const sigset_t *unblocked) {
+  pid_t master = getpid();
+  pid_t pid = fork();
+  if (pid == -1) {
+    log_error("Cannot fork worker %d: %s", slot, strerror(errno));
+    return -errno;
+  }
+
+  if (pid == 0) {
+    // Never outlive the master, and do not miss it dying before prctl().
+    (void)prctl(PR_SET_PDEATHSIG, SIGTERM);
+    if (getppid() != master) {
+      _exit(EXIT_FAILURE);
+    }
+    pthread_sigmask(SIG_SETMASK, unblocked, nullptr);
+    stats_attach(slot);
+    exit(child(slot, arg));
+  }
+
+  worker->pid = pid;
+  worker->started = now_seconds();
+  log_debug("Worker process %d: pid %d", slot, pid);
+  return 0;
+}
+
+static int find(const worker_process_t *workers, int count, pid_t pid) {
+  for (int i = 0; i < count; i++) {
+    if (workers[i].pid == pid) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static void report(int slot, pid_t pid, int status) {
+  if (WIFSIGNALED(status)) {
+    log_error("Worker process %d (pid %d) killed by signal %d", slot, pid,
+              WTERMSIG(status));
+  } else {
+    log_warn("Worker process %d (pid %d) exited with status %d", slot, pid,
+             WEXITSTATUS(status));
+  }
+}
+
+static void stop_all(worker_process_t *workers, int count) {
+  int running = 0;
+  for (int i = 0; i < count; i++) {
+    if (workers[i].pid > 0) {
+      (void)kill(workers[i].pid, SIGTERM);
+      running++;
+    }
+  }
+
+  // Each worker drains within its own deadline.
+  while (running > 0) {
+    pid_t pid = waitpid(-1, nullptr, 0);
+    if (pid < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+    int slot = find(workers, count, pid);
+    if (slot >= 0) {
+      workers[slot].pid = -1;
+      running--;
+    }
+  }
+}
+
+// Reaps exited workers and schedules their replacement.
+static void reap(worker_process_t *workers, int count, stats_t *stats) {
+  int status;
+  pid_t pid;
+  while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+    int slot = find(workers, count, pid);
+    if (slot < 0) {
+      continue;
+    }
+    workers[slot].pid = -1;
+    if (!server_running) {
+      continue;
+    }
+    report(slot, pid, status);
+    stats_add(stats, STAT_RESPAWNS, 1);
+    time_t now = now_seconds();
+    bool looping = now - workers[slot].started < PREFORK_MIN_UPTIME;
+    workers[slot].respawn_at = looping ? now + PREFORK_RESPAWN_DELAY : now;
+  }
+}
+
+int prefork_run(int count, prefork_child_t child, void *arg, stats_t *stats) {
+  worker_process_t *workers = calloc((size_t)count, sizeof(*workers));
+  if (workers == nullptr) {
+    return -ENOMEM;
+  }
+
+  struct sigaction sa = {.sa_handler = handle_child};
+  sigaction(SIGCHLD, &sa, nullptr);
+  sigset_t unblocked;
+  signal_block(&unblocked);
+
+  for (int i = 0; i < count; i++) {
+    workers[i].pid = -1;
+    if (spawn(&workers[i], i, child, arg, &unblocked) != 0) {
+      stop_all(workers, count);
+      free(workers);
+      return -1;
+    }
+  }
+  log_info("Master %d: %d worker processes", getpid(), count);
+
+  while (server_running) {
+    if (upgrade_requested) {
+      upgrade_requested = 0;
+      log_warn("Hot upgrade is not available with worker processes");
+    }
+    if (reload_requested) {
+      reload_requested = 0;
+      // Each worker compiled its own table and swaps it itself.
+      for (int i = 0; i < count; i++) {
+        if (workers[i].pid > 0) {
+          (void)kill(workers[i].pid, SIGHUP);
+        }
+      }
+    }
+    reap(workers, count, stats);
+
+    time_t now = now_seconds();
+    time_t next = 0;
+    for (int i = 0; i < count && server_running; i++) {
+      if (workers[i].pid != -1) {
+        continue;
+      }
+      if (workers[i].respawn_at <= now &&
+          spawn(&workers[i], i, child, arg, &unblocked) != 0) {
+        workers[i].respawn_at = now + PREFORK_RESPAWN_DELAY;
+      }
+      if (workers[i].pid == -1 &&
+          (next == 0 || workers[i].respawn_at < next)) {
+        next = workers[i].respawn_at;
+      }
+    }
+
+    // Signals are blocked everywhere but here, so none is missed.
+    struct timespec timeout = {.tv_sec = next - now};
+    (void)ppoll(nullptr, 0, next != 0 ? &timeout : nullptr, &unblocked);
+  }
+
+  log_info("Master: stopping worker processes...");
+  stop_all(workers, count);
+  free(workers);
+  return 0;
+}
@@ -0,0 +1,707 @@
+#include <errno.h>
+#include <limits.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "coro.h"
+#include "http.h"
+#include "log.h"
+#include "proxy.h"
+#include "socket.h"
+#include "string_utils.h"
+#include "trace.h"
+#include "worker_memory.h"
+
+enum {
+  PROXY_NAME_MAX = 128,
+  PROXY_PROBE_TIMEOUT_MS = 1000,
+  PROXY_MAX_IOV = 2 * MAX_HEADERS + 8,
+};
+
+typedef struct {
+  char name[PROXY_NAME_MAX];
+  struct sockaddr_storage addr;
+  socklen_t addr_len;
+  _Atomic int outstanding;
+  _Atomic bool healthy;
+} upstream_t;
+
+struct proxy_route {
+  string_view_t prefix;
+  upstream_t upstreams[PROXY_MAX_UPSTREAMS];
+  int upstream_count;
+  _Atomic unsigned next; // Rotates the tie-break between equal loads
+};
+
+struct proxy {
+  proxy_route_t routes[PROXY_MAX_ROUTES];
+  int route_count;
+  pthread_t health;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  bool stop;
+};
+
+typedef struct {
+  const upstream_t *upstream;
+  int fd;
+} idle_conn_t;
+
+// Per worker thread, so taking and returning a connection needs no lock.
+static thread_local idle_conn_t idle_pool[PROXY_IDLE_MAX];
+static thread_local int idle_count;
+
+// Response side of one exchange: bytes read past what was consumed stay in
+// the buffer and are sent before anything is spliced.
+typedef struct {
+  int fd;
+  char *buffer;
+  size_t start;
+  size_t end;
+  size_t capacity;
+  const int *pipe_fds;
+  bool pipe_dirty;
+  bool answered; // Some response bytes arrived
+  bool closed;   // The upstream closed its side
+} relay_t;
+
+static const char bad_gateway[] = "HTTP/1.0 502 BAD GATEWAY\n\nBad Gateway";
+static const char unavailable[] =
+    "HTTP/1.0 503 SERVICE UNAVAILABLE\n\nService Unavailable";
+
+static int parse_upstream(const char *spec, size_t length, upstream_t *up) {
+  if (length == 0 || length >= PROXY_NAME_MAX) {
+    return -1;
+  }
+  memcpy(up->name, spec, length);
+  up->name[length] = '\0';
+  atomic_init(&up->outstanding, 0);
+  atomic_init(&up->healthy, true);
+
+  if (strncmp(up->name, "unix:", 5) == 0) {
+    struct sockaddr_un *sun = (struct sockaddr_un *)&up->addr;
+    const char *path = up->name + 5;
+    if (strlen(path) == 0 || strlen(path) >= sizeof(sun->sun_path)) {
+      return -1;
+    }
+    sun->sun_family = AF_UNIX;
+    strcpy(sun->sun_path, path);
+    up->addr_len = sizeof(*sun);
+    return 0;
+  }
+
+  char host[PROXY_NAME_MAX];
+  strcpy(host, up->name);
+  char *colon = strrchr(host, ':');
+  if (colon == nullptr || colon == host) {
+    return -1;
+  }
+  *colon = '\0';
+
+  struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
+  struct addrinfo *result = nullptr;
+  int rc = getaddrinfo(host, colon + 1, &hints, &result);
+  if (rc != 0 || result == nullptr) {
+    log_error("Cannot resolve upstream \"%s\": %s", up->name,
+              gai_strerror(rc));
+    return -1;
+  }
+  memcpy(&up->addr, result->ai_addr, result->ai_addrlen);
+  up->addr_len = result->ai_addrlen;
+  freeaddrinfo(result);
+  return 0;
+}
+
+static int parse_route(const char *spec, proxy_route_t *route) {
+  const char *equals = strchr(spec, '=');
+  if (equals == nullptr || equals == spec || spec[0] != '/') {
+    return -1;
+  }
+  route->prefix = (string_view_t){.data = spec,
+                                  .length = (size_t)(equals - spec)};
+
+  string_view_t rest = sv_from_cstr(equals + 1);
+  string_view_t item;
+  while (sv_split(&rest, ',', &item)) {
+    if (route->upstream_count == PROXY_MAX_UPSTREAMS ||
+        parse_upstream(item.data, item.length,
+                       &route->upstreams[route->upstream_count]) != 0) {
+      return -1;
+    }
+    route->upstream_count++;
+  }
+  return route->upstream_count > 0 ? 0 : -1;
+}
+
+static int upstream_socket(const upstream_t *up, int extra_flags) {
+  int fd = socket(up->addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC | extra_flags,
+                  0);
+  if (fd == -1) {
+    return -1;
+  }
+  if (up->addr.ss_family != AF_UNIX) {
+    int one = 1;
+    (void)setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  }
+  return fd;
+}
+
+static bool probe(const upstream_t *up) {
+  int fd = upstream_socket(up, SOCK_NONBLOCK);
+  if (fd == -1) {
+    return false;
+  }
+
+  bool ok = connect(fd, (const struct sockaddr *)&up->addr, up->addr_len) == 0;
+  if (!ok && errno == EINPROGRESS) {
+    struct pollfd pfd = {.fd = fd, .events = POLLOUT};
+    int error = 0;
+    socklen_t len = sizeof(error);
+    ok = poll(&pfd, 1, PROXY_PROBE_TIMEOUT_MS) == 1 &&
+         getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) == 0 &&
+         error == 0;
+  }
+  (void)close(fd);
+  return ok;
+}
+
+static void *health_entry(void *arg) {
+  proxy_t *proxy = (proxy_t *)arg;
+
+  pthread_mutex_lock(&proxy->lock);
+  while (!proxy->stop) {
+    pthread_mutex_unlock(&proxy->lock);
+
+    for (int r = 0; r < proxy->route_count; r++) {
+      proxy_route_t *route = &proxy->routes[r];
+      for (int u = 0; u < route->upstream_count; u++) {
+        upstream_t *up = &route->upstreams[u];
+        bool healthy = probe(up);
+        if (atomic_exchange(&up->healthy, healthy) != healthy) {
+          log_warn("Upstream %s is %s", up->name, healthy ? "up" : "down");
+        }
+      }
+    }
+
+    pthread_mutex_lock(&proxy->lock);
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += PROXY_HEALTH_INTERVAL;
+    while (!proxy->stop &&
+           pthread_cond_timedwait(&proxy->wake, &proxy->lock, &deadline) !=
+               ETIMEDOUT) {
+    }
+  }
+  pthread_mutex_unlock(&proxy->lock);
+  return nullptr;
+}
+
+[[nodiscard]]
+int proxy_create(const server_config_t *config, proxy_t **out) {
+  *out = nullptr;
+  if (config->proxy_route_count == 0) {
+    return 0;
+  }
+
+  proxy_t *proxy = calloc(1, sizeof(proxy_t));
+  if (proxy == nullptr) {
+    return -ENOMEM;
+  }
+
+  for (int i = 0; i < config->proxy_route_count; i++) {
+    if (parse_route(config->proxy_routes[i], &proxy->routes[i]) != 0) {
+      log_error("Invalid proxy route \"%s\"", config->proxy_routes[i]);
+      free(proxy);
+      return -EINVAL;
+    }
+    proxy->route_count++;
+    log_info("Proxy: %.*s -> %d upstream(s)",
+             (int)proxy->routes[i].prefix.length, proxy->routes[i].prefix.data,
+             proxy->routes[i].upstream_count);
+  }
+
+  pthread_mutex_init(&proxy->lock, nullptr);
+  pthread_cond_init(&proxy->wake, nullptr);
+  if (pthread_create(&proxy->health, nullptr, health_entry, proxy) != 0) {
+    log_error("Cannot start the upstream health checker");
+    pthread_mutex_destroy(&proxy->lock);
+    pthread_cond_destroy(&proxy->wake);
+    free(proxy);
+    return -EAGAIN;
+  }
+
+  *out = proxy;
+  return 0;
+}
+
+void proxy_destroy(proxy_t *proxy) {
+  if (proxy == nullptr) {
+    return;
+  }
+  pthread_mutex_lock(&proxy->lock);
+  proxy->stop = true;
+  pthread_cond_signal(&proxy->wake);
+  pthread_mutex_unlock(&proxy->lock);
+  pthread_join(proxy->health, nullptr);
+
+  pthread_mutex_destroy(&proxy->lock);
+  pthread_cond_destroy(&proxy->wake);
+  free(proxy);
+}
+
+[[nodiscard]]
+proxy_route_t *proxy_find(proxy_t *proxy, string_view_t prefix) {
+  if (proxy == nullptr) {
+    return nullptr;
+  }
+  for (int i = 0; i < proxy->route_count; i++) {
+    if (sv_equal(proxy->routes[i].prefix, prefix)) {
+      return &proxy->routes[i];
+    }
+  }
+  return nullptr;
+}
+
+// Least outstanding requests; unhealthy upstreams only when all are down.
+static upstream_t *pick(proxy_route_t *route) {
+  unsigned start = atomic_fetch_add_explicit(&route->next, 1,
+                                             memory_order_relaxed);
+  upstream_t *best = nullptr;
+  bool best_healthy = false;
+  int best_load = INT_MAX;
+
+  for (int i = 0; i < route->upstream_count; i++) {
+    unsigned at = (start + (unsigned)i) % (unsigned)route->upstream_count;
+    upstream_t *up = &route->upstreams[at];
+    bool healthy = atomic_load_explicit(&up->healthy, memory_order_relaxed);
+    int load = atomic_load_explicit(&up->outstanding, memory_order_relaxed);
+    if ((healthy && !best_healthy) ||
+        (healthy == best_healthy && load < best_load)) {
+      best = up;
+      best_healthy = healthy;
+      best_load = load;
+    }
+  }
+  return best;
+}
+
+static int upstream_connect(upstream_t *up) {
+  // A coroutine must not block its worker on a slow upstream.
+  int fd = upstream_socket(up, coro_active() ? SOCK_NONBLOCK : 0);
+  if (fd == -1) {
+    return -1;
+  }
+
+  struct timeval timeout = {.tv_sec = PROXY_IO_TIMEOUT};
+  (void)setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  (void)setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+  if (coro_connect(fd, (const struct sockaddr *)&up->addr, up->addr_len) !=
+      0) {
+    log_warn("Cannot connect to upstream %s: %s", up->name, strerror(errno));
+    (void)close(fd);
+    atomic_store(&up->healthy, false);
+    return -1;
+  }
+  return fd;
+}
+
+// An idle connection the upstream closed reads as EOF without blocking.
+static bool still_open(int fd) {
+  char byte;
+  ssize_t got = recv(fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+  return got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+static int acquire(upstream_t *up, bool *reused) {
+  for (int i = idle_count - 1; i >= 0; i--) {
+    if (idle_pool[i].upstream != up) {
+      continue;
+    }
+    int fd = idle_pool[i].fd;
+    idle_pool[i] = idle_pool[--idle_count];
+    if (still_open(fd)) {
+      *reused = true;
+      return fd;
+    }
+    (void)close(fd);
+  }
+
+  *reused = false;
+  return upstream_connect(up);
+}
+
+static void release(const upstream_t *up, int fd) {
+  if (idle_count == PROXY_IDLE_MAX) {
+    (void)close(idle_pool[0].fd);
+    memmove(&idle_pool[0], &idle_pool[1],
+            sizeof(idle_conn_t) * (PROXY_IDLE_MAX - 1));
+    idle_count--;
+  }
+  idle_pool[idle_count++] = (idle_conn_t){.upstream = up, .fd = fd};
+}
+
+void proxy_thread_exit(void) {
+  while (idle_count > 0) {
+    (void)close(idle_pool[--idle_count].fd);
+  }
+}
+
+static void iov_push(struct iovec *iov, int *count, string_view_t sv) {
+  iov[*count].iov_base = (void *)sv.data;
+  iov[*count].iov_len = sv.length;
+  (*count)++;
+}
+
+// Name through value of a header, as it appears in the buffer.
+static string_view_t header_line(const http_header_t *header) {
+  const char *end = header->value.length > 0
+                        ? header->value.data + header->value.length
+                        : header->name.data + header->name.length + 1;
+  return (string_view_t){.data = header->name.data,
+                         .length = (size_t)(end - header->name.data)};
+}
+
+static bool hop_by_hop(const http_header_t *header) {
+  return header->token == HTTP_TOKEN(CONNECTION) ||
+         header->token == HTTP_TOKEN(KEEP_ALIVE) ||
+         header->token == HTTP_TOKEN(EXPECT) ||
+         header->token == HTTP_TOKEN(UPGRADE);
+}
+
+// The request head is gathered straight from the receive buffer.
+static int send_request_head(int fd, const http_request_t *request,
+                             const upstream_t *up) {
+  struct iovec iov[PROXY_MAX_IOV];
+  int count = 0;
+
+  iov_push(iov, &count, request->method_name);
+  iov_push(iov, &count, SV_LIT(" "));
+  iov_push(iov, &count, request->uri);
+  iov_push(iov, &count, SV_LIT(" HTTP/1.1\r\n"));
+  for (size_t i = 0; i < request->header_count; i++) {
+    if (hop_by_hop(&request->headers[i])) {
+      continue;
+    }
+    iov_push(iov, &count, header_line(&request->headers[i]));
+    iov_push(iov, &count, SV_LIT("\r\n"));
+  }
+  if (http_find_header(request, HTTP_TOKEN(HOST)) == nullptr) {
+    iov_push(iov, &count, SV_LIT("Host: "));
+    iov_push(iov, &count, sv_from_cstr(up->name));
+    iov_push(iov, &count, SV_LIT("\r\n"));
+  }
+  iov_push(iov, &count, SV_LIT("Connection: keep-alive\r\n\r\n"));
+
+  return socket_writev_all(fd, iov, count);
+}
+
+static int send_response_head(int client, const http_response_t *response) {
+  struct iovec iov[PROXY_MAX_IOV];
+  int count = 0;
+
+  iov_push(iov, &count, response->status_line);
+  iov_push(iov, &count, SV_LIT("\r\n"));
+  for (size_t i = 0; i < response->header_count; i++) {
+    if (hop_by_hop(&response->headers[i])) {
+      continue;
+    }
+    iov_push(iov, &count, header_line(&response->headers[i]));
+    iov_push(iov, &count, SV_LIT("\r\n"));
+  }
+  iov_push(iov, &count, SV_LIT("Connection: close\r\n\r\n"));
+
+  return socket_writev_all(client, iov, count);
+}
+
+static int relay_fill(relay_t *relay) {
+  if (relay->start > 0) {
+    memmove(relay->buffer, relay->buffer + relay->start,
+            relay->end - relay->start);
+    relay->end -= relay->start;
+    relay->start = 0;
+  }
+  if (relay->end == relay->capacity) {
+    return -1;
+  }
+
+  ssize_t got;
+  do {
+    got = coro_read(relay->fd, relay->buffer + relay->end,
+                    relay->capacity - relay->end);
+  } while (got < 0 && errno == EINTR);
+  if (got <= 0) {
+    relay->closed = got == 0;
+    return -1;
+  }
+  relay->answered = true;
+  relay->end += (size_t)got;
+  return 0;
+}
+
+static int relay_head(relay_t *relay, http_response_t *response) {
+  while (true) {
+    string_view_t data = {.data = relay->buffer + relay->start,
+                          .length = relay->end - relay->start};
+    if (sv_find(data, SV_LIT("\r\n\r\n")) != SV_NPOS ||
+        sv_find(data, SV_LIT("\n\n")) != SV_NPOS) {
+      if (parse_http_response(data, response) != 0) {
+        return -1;
+      }
+      // Interim responses (103 Early Hints...) are not forwarded.
+      if (response->status >= 100 && response->status < 200 &&
+          response->status != 101) {
+        relay->start += response->header_length;
+        continue;
+      }
+      return 0;
+    }
+    if (relay_fill(relay) != 0) {
+      return -1;
+    }
+  }
+}
+
+static int relay_copy(relay_t *relay, int to, size_t length) {
+  size_t buffered = relay->end - relay->start;
+  size_t n = buffered < length ? buffered : length;
+  if (n > 0) {
+    if (socket_write_all(to, relay->buffer + relay->start, n) != 0) {
+      return -1;
+    }
+    relay->start += n;
+    if (length != SIZE_MAX) {
+      length -= n;
+    }
+  }
+  if (length == 0) {
+    return 0;
+  }
+
+  ssize_t moved = socket_splice(relay->fd, to, length, relay->pipe_fds);
+  if (moved < 0) {
+    relay->pipe_dirty = true;
+    return -1;
+  }
+  return length == SIZE_MAX || (size_t)moved == length ? 0 : -1;
+}
+
+// Forwards one line; for chunk headers *chunk_size receives the size.
+static int relay_line(relay_t *relay, int to, size_t *chunk_size,
+                      size_t *line_length) {
+  while (true) {
+    char *start = relay->buffer + relay->start;
+    char *newline = memchr(start, '\n', relay->end - relay->start);
+    if (newline != nullptr) {
+      size_t length = (size_t)(newline - start) + 1;
+      if (chunk_size != nullptr) {
+        char *endptr;
+        errno = 0;
+        unsigned long long size = strtoull(start, &endptr, 16);
+        if (endptr == start || errno != 0 || size > SIZE_MAX / 2) {
+          return -1;
+        }
+        *chunk_size = (size_t)size;
+      }
+      *line_length = length;
+      relay->start += length;
+      return socket_write_all(to, start, length);
+    }
+    if (relay_fill(relay) != 0) {
+      return -1;
+    }
+  }
+}
+
+// Chunk framing is passed through as is; only the sizes are read to find
+// where the response ends, so the upstream connection can be reused.
+static int relay_chunked(relay_t *relay, int to) {
+  size_t length;
+  while (true) {
+    size_t size;
+    if (relay_line(relay, to, &size, &length) != 0) {
+      return -1;
+    }
+    if (size == 0) {
+      break;
+    }
+    if (relay_copy(relay, to, size + 2) != 0) {
+      return -1;
+    }
+  }
+
+  // Trailers, up to the empty line.
+  do {
+    if (relay_line(relay, to, nullptr, &length) != 0) {
+      return -1;
+    }
+  } while (length > 2);
+  return 0;
+}
+
+static bool has_body(const http_request_t *request, int status) {
+  return request->method != HTTP_TOKEN(HEAD) && status >= 200 &&
+         status != 204 && status != 304;
+}
+
+// Requests the upstream may see twice without harm.
+static bool idempotent(const http_request_t *request) {
+  return request->method == HTTP_TOKEN(GET) ||
+         request->method == HTTP_TOKEN(HEAD) ||
+         request->method == HTTP_TOKEN(OPTIONS);
+}
+
+static int exchange(upstream_t *up, relay_t *relay, int client,
+                    const http_request_t *request, string_view_t early,
+                    size_t body_length) {
+  http_response_t response;
+  bool continued = false;
+  int fd = -1;
+
+  for (int attempt = 0;; attempt++) {
+    bool reused = false;
+    fd = acquire(up, &reused);
+    if (fd == -1) {
+      (void)socket_write_all(client, bad_gateway, sizeof(bad_gateway) - 1);
+      return -1;
+    }
+    relay->fd = fd;
+    relay->start = 0;
+    relay->end = 0;
+    relay->answered = false;
+    relay->closed = false;
+
+    bool spliced = false;
+    int rc = send_request_head(fd, request, up);
+    if (rc == 0 && early.length > 0) {
+      rc = socket_write_all(fd, early.data, early.length);
+    }
+    // A pooled connection the upstream closed just now either refuses the
+    // request or ends before any response byte.
+    bool stale = rc != 0 && (errno == EPIPE || errno == ECONNRESET);
+    if (rc == 0 && body_length > early.length) {
+      if (http_find_header(request, HTTP_TOKEN(EXPECT)) != nullptr &&
+          !continued) {
+        static const char go_on[] = "HTTP/1.1 100 Continue\r\n\r\n";
+        (void)socket_write_all(client, go_on, sizeof(go_on) - 1);
+        continued = true;
+      }
+      spliced = true;
+      size_t rest = body_length - early.length;
+      ssize_t moved = socket_splice(client, fd, rest, relay->pipe_fds);
+      if (moved < 0 || (size_t)moved != rest) {
+        relay->pipe_dirty = moved < 0;
+        (void)close(fd);
+        return -1;
+      }
+    }
+    if (rc == 0) {
+      rc = relay_head(relay, &response);
+      stale = rc != 0 && !relay->answered &&
+              (relay->closed || errno == ECONNRESET);
+    }
+    if (rc == 0) {
+      break;
+    }
+
+    (void)close(fd);
+    // Retry once on a fresh connection, unless the upstream may have acted
+    // on the request or the body is already consumed.
+    if (!reused || !stale || spliced || !idempotent(request) ||
+        attempt > 0) {
+      log_warn("Upstream %s failed the exchange", up->name);
+      (void)socket_write_all(client, bad_gateway, sizeof(bad_gateway) - 1);
+      return -1;
+    }
+  }
+
+  TRACE_MARK(first_byte, TRACE_FIRST_BYTE, client);
+  if (send_response_head(client, &response) != 0) {
+    (void)close(fd);
+    return -1;
+  }
+  relay->start += response.header_length;
+
+  bool keep_alive =
+      sv_equal(response.version, SV_LIT("HTTP/1.1")) &&
+      !http_headers_connection_has(response.headers, response.header_count,
+                                   SV_LIT("close"));
+  size_t length = 0;
+  int rc = 0;
+  if (!has_body(request, response.status)) {
+    rc = 0;
+  } else if (http_headers_chunked(response.headers, response.header_count)) {
+    rc = relay_chunked(relay, client);
+  } else if (http_headers_content_length(response.headers,
+                                         response.header_count,
+                                         &length) == 0) {
+    rc = relay_copy(relay, client, length);
+  } else {
+    rc = relay_copy(relay, client, SIZE_MAX);
+    keep_alive = false;
+  }
+
+  if (rc == 0 && keep_alive && relay->start == relay->end) {
+    release(up, fd);
+  } else {
+    (void)close(fd);
+  }
+  return rc;
+}
+
+[[nodiscard]]
+int proxy_forward(proxy_route_t *route, worker_memory_t *worker, int client,
+                  const http_request_t *request, string_view_t received) {
+  size_t body_length = 0;
+  int framing = http_headers_content_length(
+      request->headers, request->header_count, &body_length);
+  if (framing < 0) {
+    static const char bad_request[] =
+        "HTTP/1.0 400 BAD REQUEST\n\nBad Request";
+    return socket_write_all(client, bad_request, sizeof(bad_request) - 1);
+  }
+  if (http_headers_chunked(request->headers, request->header_count)) {
+    static const char length_required[] =
+        "HTTP/1.0 411 LENGTH REQUIRED\n\nLength Required";
+    return socket_write_all(client, length_required,
+                            sizeof(length_required) - 1);
+  }
+  string_view_t early =
+      sv_slice(received, request->header_length, body_length);
+
+  upstream_t *up = pick(route);
+  char *buffer = worker_memory_buffer_get(worker);
+  int *pipe_fds = worker_memory_pipe_get(worker);
+  if (up == nullptr || buffer == nullptr || pipe_fds == nullptr) {
+    worker_memory_buffer_put(worker, buffer);
+    worker_memory_pipe_put(worker, pipe_fds, true);
+    return socket_write_all(client, unavailable, sizeof(unavailable) - 1);
+  }
+
+  relay_t relay = {
+      .buffer = buffer,
+      .capacity = WORKER_BUFFER_SIZE,
+      .pipe_fds = pipe_fds,
+  };
+
+  atomic_fetch_add_explicit(&up->outstanding, 1, memory_order_relaxed);
+  int rc = exchange(up, &relay, client, request, early, body_length);
+  atomic_fetch_sub_explicit(&up->outstanding, 1, memory_order_relaxed);
+
+  worker_memory_pipe_put(worker, pipe_fds, !relay.pipe_dirty);
+  worker_memory_buffer_put(worker, buffer);
+  return rc;
+}
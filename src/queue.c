@@ -1,25 +1,82 @@
 #include "queue.h"
 
+#include <errno.h>
 #include <pthread.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
 
-void queue_init(job_queue_t *q) {
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+void queue_init(job_queue_t *q, bool wake) {
   q->head = 0;
   q->tail = 0;
   q->count = 0;
   q->shutdown = false;
+  q->retire = 0;
+  q->idle = 0;
+  q->wait_total = 0;
+  q->wait_max = 0;
+  q->popped = 0;
+  q->signalled = false;
+  q->wake_fd = wake ? eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC) : -1;
   pthread_mutex_init(&q->lock, nullptr);
   pthread_cond_init(&q->notify, nullptr);
 }
 
-int queue_push(job_queue_t *q, int client_fd) {
+// Lock held.
+static void signal_wake(job_queue_t *q) {
+  if (q->wake_fd != -1 && !q->signalled) {
+    uint64_t one = 1;
+    q->signalled = write(q->wake_fd, &one, sizeof(one)) == sizeof(one);
+  }
+}
+
+// Lock held. Shutdown stays signalled so every worker sees it.
+static void clear_wake(job_queue_t *q) {
+  if (q->signalled && q->count == 0 && !q->shutdown) {
+    uint64_t value;
+    q->signalled = read(q->wake_fd, &value, sizeof(value)) != sizeof(value);
+  }
+}
+
+// Lock held, count > 0.
+static int take(job_queue_t *q, job_info_t *info) {
+  int client_fd = q->sockets[q->head];
+  info->tls = q->tls[q->head];
+  info->queued_at = q->enqueued[q->head];
+  uint64_t waited = now_ns() - q->enqueued[q->head];
+  q->head = (q->head + 1) % QUEUE_SIZE;
+  q->count--;
+  q->wait_total += waited;
+  q->popped++;
+  if (waited > q->wait_max) {
+    q->wait_max = waited;
+  }
+  clear_wake(q);
+  return client_fd;
+}
+
+int queue_push(job_queue_t *q, int client_fd, bool tls) {
+  uint64_t now = now_ns();
   pthread_mutex_lock(&q->lock);
 
   if (q->count < QUEUE_SIZE) {
     q->sockets[q->tail] = client_fd;
+    q->tls[q->tail] = tls;
+    q->enqueued[q->tail] = now;
     q->tail = (q->tail + 1) % QUEUE_SIZE;
     q->count += 1;
 
     pthread_cond_signal(&q->notify);
+    if (q->idle == 0) {
+      signal_wake(q);
+    }
     pthread_mutex_unlock(&q->lock);
     return 0;
   }
@@ -28,32 +85,77 @@ int queue_push(job_queue_t *q, int client_fd) {
   return -1;
 }
 
-int queue_pop(job_queue_t *q) {
+int queue_pop(job_queue_t *q, job_info_t *info) {
   pthread_mutex_lock(&q->lock);
 
-  while (q->count == 0 && !q->shutdown) {
+  q->idle++;
+  while (q->count == 0 && !q->shutdown && q->retire == 0) {
     pthread_cond_wait(&q->notify, &q->lock);
   }
+  q->idle--;
 
-  if (q->shutdown) {
+  // Retiring takes priority so an idle pool shrinks even under trickle
+  // load; the connection stays queued for the next worker.
+  if (q->retire > 0 && !q->shutdown) {
+    q->retire--;
+    pthread_mutex_unlock(&q->lock);
+    return QUEUE_RETIRE;
+  }
+
+  // Already accepted connections are drained before workers stop.
+  if (q->count == 0) {
     pthread_mutex_unlock(&q->lock);
     return -1;
   }
 
-  int client_fd = q->sockets[q->head];
-  q->head = (q->head + 1) % QUEUE_SIZE;
-  q->count--;
+  int client_fd = take(q, info);
+  pthread_mutex_unlock(&q->lock);
+  return client_fd;
+}
 
+int queue_try_pop(job_queue_t *q, job_info_t *info) {
+  pthread_mutex_lock(&q->lock);
+  int client_fd = q->count > 0 ? take(q, info) : q->shutdown ? -1 : -EAGAIN;
+  clear_wake(q);
   pthread_mutex_unlock(&q->lock);
   return client_fd;
 }
 
+void queue_retire(job_queue_t *q, int workers) {
+  pthread_mutex_lock(&q->lock);
+  q->retire += workers;
+  pthread_mutex_unlock(&q->lock);
+
+  pthread_cond_broadcast(&q->notify);
+}
+
+void queue_sample(job_queue_t *q, queue_stats_t *out) {
+  uint64_t now = now_ns();
+  pthread_mutex_lock(&q->lock);
+
+  out->popped = q->popped;
+  out->wait_mean = q->popped > 0 ? q->wait_total / q->popped : 0;
+  out->wait_max = q->wait_max;
+  // A connection nobody has picked up yet is the clearest stall signal.
+  if (q->count > 0 && now - q->enqueued[q->head] > out->wait_max) {
+    out->wait_max = now - q->enqueued[q->head];
+  }
+  out->depth = q->count;
+  out->idle = q->idle;
+  q->wait_total = 0;
+  q->wait_max = 0;
+  q->popped = 0;
+
+  pthread_mutex_unlock(&q->lock);
+}
+
 void queue_shutdown(job_queue_t *q) {
   if (!q) {
     return;
   }
   pthread_mutex_lock(&q->lock);
   q->shutdown = true;
+  signal_wake(q);
   pthread_mutex_unlock(&q->lock);
 
   pthread_cond_broadcast(&q->notify);
@@ -65,4 +167,7 @@ void queue_destroy(job_queue_t *q) {
   }
   pthread_mutex_destroy(&q->lock);
   pthread_cond_destroy(&q->notify);
+  if (q->wake_fd != -1) {
+    (void)close(q->wake_fd);
+  }
 }
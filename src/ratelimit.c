@@ -0,0 +1,184 @@
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#include "log.h"
+#include "ratelimit.h"
+
+enum {
+  CACHE_LINE = 64,
+  TOKEN_SCALE = 1000, // Thousandths of a token, so rate is per millisecond
+  SHARD_BITS = 6,     // log2(RATELIMIT_SHARDS)
+};
+
+typedef struct {
+  uint64_t key;    // 0 = empty
+  uint32_t stamp;  // Millisecond clock at the last refill, wraps harmlessly
+  uint32_t tokens; // Scaled by TOKEN_SCALE
+} bucket_t;
+
+typedef struct {
+  _Alignas(CACHE_LINE) pthread_spinlock_t lock;
+  bucket_t buckets[RATELIMIT_SHARD_SLOTS];
+} shard_t;
+
+struct ratelimit {
+  uint32_t rate;     // Scaled tokens per millisecond
+  uint32_t capacity; // Scaled burst
+  bool shared;
+  shard_t shards[RATELIMIT_SHARDS];
+};
+
+_Static_assert(RATELIMIT_SHARDS == 1 << SHARD_BITS, "shard bits");
+
+ratelimit_t *ratelimit_create(unsigned rate, unsigned burst, bool shared) {
+  if (rate == 0 || burst == 0 || burst > UINT32_MAX / TOKEN_SCALE) {
+    log_error("Invalid rate limit %u/s, burst %u", rate, burst);
+    return nullptr;
+  }
+
+  ratelimit_t *limiter;
+  if (shared) {
+    // Page aligned, and already zero.
+    limiter = mmap(nullptr, sizeof(ratelimit_t), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    limiter = limiter == MAP_FAILED ? nullptr : limiter;
+  } else {
+    limiter = aligned_alloc(CACHE_LINE, sizeof(ratelimit_t));
+    if (limiter != nullptr) {
+      memset(limiter, 0, sizeof(*limiter));
+    }
+  }
+  if (limiter == nullptr) {
+    log_error("OOM allocating the rate limit table");
+    return nullptr;
+  }
+  limiter->rate = rate;
+  limiter->capacity = burst * TOKEN_SCALE;
+  limiter->shared = shared;
+  for (int i = 0; i < RATELIMIT_SHARDS; i++) {
+    pthread_spin_init(&limiter->shards[i].lock,
+                      shared ? PTHREAD_PROCESS_SHARED
+                             : PTHREAD_PROCESS_PRIVATE);
+  }
+
+  log_info("Rate limiting clients to %u/s, burst %u", rate, burst);
+  return limiter;
+}
+
+void ratelimit_destroy(ratelimit_t *limiter) {
+  if (limiter == nullptr) {
+    return;
+  }
+  for (int i = 0; i < RATELIMIT_SHARDS; i++) {
+    pthread_spin_destroy(&limiter->shards[i].lock);
+  }
+  if (limiter->shared) {
+    (void)munmap(limiter, sizeof(ratelimit_t));
+  } else {
+    free(limiter);
+  }
+}
+
+static uint64_t client_key(const struct sockaddr_storage *peer) {
+  if (peer->ss_family == AF_INET) {
+    const struct sockaddr_in *in = (const struct sockaddr_in *)peer;
+    return (uint64_t)1 << 32 | in->sin_addr.s_addr;
+  }
+  if (peer->ss_family == AF_INET6) {
+    const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)peer;
+    const uint8_t *bytes = in6->sin6_addr.s6_addr;
+    if (IN6_IS_ADDR_V4MAPPED(&in6->sin6_addr)) {
+      uint32_t v4;
+      memcpy(&v4, bytes + 12, sizeof(v4));
+      return (uint64_t)1 << 32 | v4;
+    }
+    // One /64 is usually one subscriber.
+    uint64_t prefix;
+    memcpy(&prefix, bytes, sizeof(prefix));
+    return prefix != 0 ? prefix : 2;
+  }
+  return 0;
+}
+
+// splitmix64 finalizer: keys are addresses, not random.
+static uint64_t mix(uint64_t key) {
+  key ^= key >> 30;
+  key *= 0xbf58476d1ce4e5b9ULL;
+  key ^= key >> 27;
+  key *= 0x94d049bb133111ebULL;
+  key ^= key >> 31;
+  return key;
+}
+
+static uint32_t now_ms(void) {
+  // The coarse clock is a vDSO read of the last tick, a few nanoseconds.
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  return (uint32_t)((uint64_t)ts.tv_sec * 1000 +
+                    (uint64_t)ts.tv_nsec / 1000000);
+}
+
+static bool take(const ratelimit_t *limiter, bucket_t *bucket,
+                 uint32_t now) {
+  uint64_t tokens = bucket->tokens +
+                    (uint64_t)(uint32_t)(now - bucket->stamp) * limiter->rate;
+  if (tokens > limiter->capacity) {
+    tokens = limiter->capacity;
+  }
+  bucket->stamp = now;
+
+  bool allowed = tokens >= TOKEN_SCALE;
+  bucket->tokens = (uint32_t)(allowed ? tokens - TOKEN_SCALE : tokens);
+  return allowed;
+}
+
+bool ratelimit_allow(ratelimit_t *limiter,
+                     const struct sockaddr_storage *peer) {
+  if (limiter == nullptr) {
+    return true;
+  }
+  uint64_t key = client_key(peer);
+  if (key == 0) {
+    return true;
+  }
+
+  uint64_t hash = mix(key);
+  shard_t *shard = &limiter->shards[hash >> (64 - SHARD_BITS)];
+  size_t home = hash & (RATELIMIT_SHARD_SLOTS - 1);
+  uint32_t now = now_ms();
+
+  pthread_spin_lock(&shard->lock);
+  bucket_t *victim = nullptr;
+  bool allowed = true;
+  for (size_t i = 0; i < RATELIMIT_PROBES; i++) {
+    bucket_t *bucket =
+        &shard->buckets[(home + i) & (RATELIMIT_SHARD_SLOTS - 1)];
+    if (bucket->key == key) {
+      allowed = take(limiter, bucket, now);
+      victim = nullptr;
+      break;
+    }
+    // Prefer an empty slot, else the one idle the longest.
+    if (victim == nullptr ||
+        (victim->key != 0 &&
+         (bucket->key == 0 || now - bucket->stamp > now - victim->stamp))) {
+      victim = bucket;
+    }
+  }
+  if (victim != nullptr) {
+    // New (or evicted) clients start with a full bucket.
+    *victim = (bucket_t){.key = key,
+                         .stamp = now,
+                         .tokens = limiter->capacity - TOKEN_SCALE};
+  }
+  pthread_spin_unlock(&shard->lock);
+
+  return allowed;
+}
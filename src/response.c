@@ -0,0 +1,146 @@
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/uio.h>
+
+#include "http.h"
+#include "response.h"
+#include "socket.h"
+#include "string_utils.h"
+
+enum {
+  SIZE_LINE_MAX = 24, // Hex chunk size and CRLF
+  HEAD_MAX = 512,     // Head of a fixed-length response
+};
+
+static const string_view_t crlf = SV_LIT("\r\n");
+static const string_view_t last_chunk = SV_LIT("0\r\n\r\n");
+
+static bool keeps_chunks(const http_request_t *request) {
+  return !sv_equal(request->version, SV_LIT("HTTP/1.0"));
+}
+
+int response_begin(response_t *response, int client,
+                   const http_request_t *request, char *buffer,
+                   size_t capacity, string_view_t status,
+                   string_view_t headers) {
+  *response = (response_t){
+      .client = client,
+      .buffer = buffer,
+      .capacity = capacity,
+      .chunked = keeps_chunks(request),
+      .head_only = request->method == HTTP_TOKEN(HEAD),
+  };
+
+  int length = snprintf(buffer, capacity, "%s %.*s\r\n%s%.*s\r\n",
+                        response->chunked ? "HTTP/1.1" : "HTTP/1.0",
+                        (int)status.length, status.data,
+                        response->chunked ? "Transfer-Encoding: chunked\r\n"
+                                            "Connection: close\r\n"
+                                          : "",
+                        (int)headers.length, headers.data);
+  // The head must leave room for body bytes, or nothing could be buffered.
+  if (length < 0 || (size_t)length >= capacity / 2) {
+    response->failed = true;
+    return -1;
+  }
+  response->head = (size_t)length;
+  response->length = (size_t)length;
+  return 0;
+}
+
+// One writev() for the pending head, the buffered body as a chunk and,
+// when ending, the last chunk.
+static int send_buffered(response_t *response, const void *extra,
+                         size_t extra_length, bool last) {
+  if (response->failed) {
+    return -1;
+  }
+
+  struct iovec iov[6];
+  int count = 0;
+  char size_line[SIZE_LINE_MAX];
+  if (response->head > 0) {
+    iov[count++] = (struct iovec){response->buffer, response->head};
+  }
+  size_t buffered = response->length - response->head;
+  size_t body = buffered + extra_length;
+  if (body > 0 && response->chunked) {
+    int n = snprintf(size_line, sizeof(size_line), "%zx\r\n", body);
+    iov[count++] = (struct iovec){size_line, (size_t)n};
+  }
+  if (buffered > 0) {
+    iov[count++] =
+        (struct iovec){response->buffer + response->head, buffered};
+  }
+  if (extra_length > 0) {
+    iov[count++] = (struct iovec){(void *)extra, extra_length};
+  }
+  if (body > 0 && response->chunked) {
+    iov[count++] = (struct iovec){(void *)crlf.data, crlf.length};
+  }
+  // Nothing is buffered for HEAD, and no chunk may follow.
+  if (last && response->chunked && !response->head_only) {
+    iov[count++] = (struct iovec){(void *)last_chunk.data, last_chunk.length};
+  }
+
+  response->head = 0;
+  response->length = 0;
+  if (count > 0 && socket_writev_all(response->client, iov, count) != 0) {
+    response->failed = true;
+    return -1;
+  }
+  return 0;
+}
+
+int response_write(response_t *response, const void *data, size_t length) {
+  if (response->failed) {
+    return -1;
+  }
+  if (response->head_only) {
+    return 0;
+  }
+  const char *bytes = data;
+  size_t room = response->capacity - response->length;
+  if (length <= room) {
+    memcpy(response->buffer + response->length, bytes, length);
+    response->length += length;
+    return response->length == response->capacity
+               ? send_buffered(response, nullptr, 0, false)
+               : 0;
+  }
+
+  // Too big to buffer: top the buffer up and send the rest along with it as
+  // one chunk, without copying it.
+  memcpy(response->buffer + response->length, bytes, room);
+  response->length += room;
+  return send_buffered(response, bytes + room, length - room, false);
+}
+
+int response_flush(response_t *response) {
+  return send_buffered(response, nullptr, 0, false);
+}
+
+int response_end(response_t *response) {
+  return send_buffered(response, nullptr, 0, true);
+}
+
+int response_send(int client, const http_request_t *request,
+                  string_view_t status, string_view_t headers,
+                  const void *body, size_t length) {
+  char head[HEAD_MAX];
+  int head_length =
+      snprintf(head, sizeof(head), "%s %.*s\r\nContent-Length: %zu\r\n%.*s\r\n",
+               keeps_chunks(request) ? "HTTP/1.1" : "HTTP/1.0",
+               (int)status.length, status.data, length, (int)headers.length,
+               headers.data);
+  if (head_length < 0 || (size_t)head_length >= sizeof(head)) {
+    return -1;
+  }
+  struct iovec iov[2] = {
+      {head, (size_t)head_length},
+      {(void *)body, length},
+  };
+  bool head_only = request->method == HTTP_TOKEN(HEAD);
+  return socket_writev_all(client, iov, length > 0 && !head_only ? 2 : 1);
+}
@@ -0,0 +1,830 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "disk_io.h"
+#include "file.h"
+#include "log.h"
+#include "proxy.h"
+#include "router.h"
+#include "string_utils.h"
+
+enum {
+  CACHE_LINE = 64,
+  NODE_NONE = UINT32_MAX,
+};
+
+typedef struct {
+  uint32_t label; // Offset of the edge label in keys
+  uint16_t label_length;
+  uint16_t child_count;
+  uint32_t first_child; // Children are sorted by the first label byte
+  int32_t value;        // Route, or a path trie in the Host trie; -1 = none
+} trie_node_t;
+
+_Static_assert(sizeof(trie_node_t) == 16, "four nodes per cache line");
+
+struct route_table {
+  trie_node_t *nodes;
+  char *keys; // Hosts and prefixes, back to back
+  route_t *routes;
+  size_t route_count;
+  size_t node_count;
+  uint32_t hosts;    // Exact-match trie of the named hosts
+  uint32_t fallback; // Path trie of the "*" rules
+  char *source;      // The routes file; rules point into it
+};
+
+// Connections inside a table count themselves in its generation. The
+// counters outlive the tables, so a late reader that finds the generation
+// already replaced backs off without touching a freed table.
+typedef struct {
+  _Alignas(CACHE_LINE) _Atomic uint64_t readers;
+  route_table_t *table;
+} generation_t;
+
+struct router {
+  const server_config_t *config;
+  const string_t *root_dir;
+  proxy_t *proxy;
+  _Atomic uint64_t current;
+  generation_t generations[ROUTER_GENERATIONS];
+};
+
+typedef struct {
+  string_view_t host; // Lowercase, empty for "*"
+  string_view_t prefix;
+  int32_t route;
+} rule_t;
+
+typedef struct {
+  const char *data;
+  size_t length;
+  uint32_t offset; // Of the copy in keys
+  int32_t value;
+} trie_key_t;
+
+typedef struct {
+  char data[ROUTER_STORAGE_MAX];
+  size_t length;
+} storage_t;
+
+// Compile-time error context.
+typedef struct {
+  const char *file;
+  int line;
+} where_t;
+
+static void table_free(route_table_t *table) {
+  if (table == nullptr) {
+    return;
+  }
+  for (size_t i = 0; i < table->route_count; i++) {
+    free(table->routes[i].storage);
+  }
+  free(table->routes);
+  free(table->nodes);
+  free(table->keys);
+  free(table->source);
+  free(table);
+}
+
+[[gnu::format(printf, 3, 4)]]
+static int store(storage_t *storage, string_view_t *out, const char *format,
+                 ...) {
+  va_list args;
+  va_start(args, format);
+  size_t room = sizeof(storage->data) - storage->length;
+  int length = vsnprintf(storage->data + storage->length, room, format, args);
+  va_end(args);
+  if (length < 0 || (size_t)length >= room) {
+    return -1;
+  }
+  *out = (string_view_t){.data = storage->data + storage->length,
+                         .length = (size_t)length};
+  storage->length += (size_t)length + 1;
+  return 0;
+}
+
+static void rebase(const storage_t *from, const char *to, const char **data) {
+  if (*data >= from->data && *data < from->data + sizeof(from->data)) {
+    *data = to + (*data - from->data);
+  }
+}
+
+// Moves what the rule stored into memory of its own.
+static int keep_storage(route_t *route, const storage_t *storage) {
+  route->storage = malloc(storage->length + 1);
+  if (route->storage == nullptr) {
+    return -ENOMEM;
+  }
+  memcpy(route->storage, storage->data, storage->length);
+  rebase(storage, route->storage, &route->status.data);
+  rebase(storage, route->storage, &route->cache_control.data);
+  rebase(storage, route->storage, &route->headers.data);
+  const char *root = route->root.data;
+  rebase(storage, route->storage, &root);
+  route->root.data = (char *)root;
+  return 0;
+}
+
+static const char *reason(int code) {
+  switch (code) {
+  case 200:
+    return "OK";
+  case 204:
+    return "No Content";
+  case 301:
+    return "Moved Permanently";
+  case 302:
+    return "Found";
+  case 303:
+    return "See Other";
+  case 307:
+    return "Temporary Redirect";
+  case 308:
+    return "Permanent Redirect";
+  case 403:
+    return "Forbidden";
+  case 404:
+    return "Not Found";
+  case 410:
+    return "Gone";
+  case 429:
+    return "Too Many Requests";
+  case 503:
+    return "Service Unavailable";
+  default:
+    return "";
+  }
+}
+
+static int parse_status(const char *word, int low, int high, int *out) {
+  char *endptr;
+  long code = word != nullptr ? strtol(word, &endptr, 10) : 0;
+  if (word == nullptr || endptr == word || *endptr != '\0' || code < low ||
+      code > high) {
+    return -1;
+  }
+  *out = (int)code;
+  return 0;
+}
+
+static int set_status(route_t *route, storage_t *storage, int code) {
+  route->code = code;
+  const char *text = reason(code);
+  return store(storage, &route->status, "%d%s%s", code, text[0] ? " " : "",
+               text);
+}
+
+// Splits the next word off *cursor and NUL terminates it. nullptr at the
+// end of the line or at a comment.
+static char *next_word(char **cursor) {
+  char *at = *cursor + strspn(*cursor, " \t\r");
+  if (*at == '\0' || *at == '#') {
+    *cursor = at;
+    return nullptr;
+  }
+  char *end = at + strcspn(at, " \t\r");
+  if (*end != '\0') {
+    *end++ = '\0';
+  }
+  *cursor = end;
+  return at;
+}
+
+static int parse_static(const char *dir, char **cursor, route_t *route,
+                        storage_t *storage, where_t where) {
+  char resolved[PATH_MAX];
+  if (dir == nullptr || realpath(dir, resolved) == nullptr) {
+    log_error("%s:%d: Cannot resolve directory \"%s\"", where.file,
+              where.line, dir != nullptr ? dir : "");
+    return -1;
+  }
+  string_view_t root;
+  if (store(storage, &root, "%s", resolved) != 0) {
+    return -1;
+  }
+  route->root = (string_t){.data = (char *)root.data, .length = root.length};
+  if (get_path_type(&route->root) != PATH_DIR) {
+    log_error("%s:%d: \"%s\" is not a directory", where.file, where.line,
+              resolved);
+    return -1;
+  }
+
+  long max_age = -1;
+  char *policy;
+  while ((policy = next_word(cursor)) != nullptr) {
+    char *endptr;
+    if (strcmp(policy, "nocache") == 0) {
+      route->nocache = true;
+    } else if (strcmp(policy, "gzip") == 0) {
+      route->gzip = true;
+    } else if (strncmp(policy, "max-age=", 8) == 0 &&
+               (max_age = strtol(policy + 8, &endptr, 10)) >= 0 &&
+               endptr != policy + 8 && *endptr == '\0') {
+      continue;
+    } else {
+      log_error("%s:%d: Unknown policy \"%s\"", where.file, where.line,
+                policy);
+      return -1;
+    }
+  }
+
+  if (max_age >= 0 &&
+      store(storage, &route->cache_control, "max-age=%ld", max_age) != 0) {
+    return -1;
+  }
+  bool cached = route->cache_control.length > 0;
+  return store(storage, &route->headers, "%s%.*s%s%s",
+               cached ? "Cache-Control: " : "",
+               (int)route->cache_control.length,
+               cached ? route->cache_control.data : "",
+               cached ? "\r\n" : "",
+               route->gzip ? "Vary: Accept-Encoding\r\n" : "");
+}
+
+static int parse_rule(const router_t *router, char *line, route_t *route,
+                      rule_t *rule, where_t where) {
+  char *cursor = line;
+  char *host = next_word(&cursor);
+  if (host == nullptr) {
+    return 1;
+  }
+  char *prefix = next_word(&cursor);
+  char *action = next_word(&cursor);
+  if (prefix == nullptr || action == nullptr || prefix[0] != '/' ||
+      strlen(prefix) > UINT16_MAX || strlen(host) >= ROUTER_HOST_MAX) {
+    log_error("%s:%d: Expected HOST /PREFIX ACTION", where.file, where.line);
+    return -1;
+  }
+  if (strcmp(host, "*") == 0) {
+    host[0] = '\0';
+  }
+  for (char *c = host; *c != '\0'; c++) {
+    *c = (char)(*c >= 'A' && *c <= 'Z' ? *c - 'A' + 'a' : *c);
+  }
+  rule->host = sv_from_cstr(host);
+  rule->prefix = sv_from_cstr(prefix);
+
+  storage_t storage;
+  storage.length = 0;
+  *route = (route_t){};
+  int rc = -1;
+  if (strcmp(action, "static") == 0) {
+    route->action = ROUTE_STATIC;
+    rc = parse_static(next_word(&cursor), &cursor, route, &storage, where);
+  } else if (strcmp(action, "redirect") == 0) {
+    route->action = ROUTE_REDIRECT;
+    int code;
+    char *url;
+    if (parse_status(next_word(&cursor), 301, 308, &code) == 0 &&
+        code != 304 && code != 305 && code != 306 &&
+        (url = next_word(&cursor)) != nullptr &&
+        next_word(&cursor) == nullptr) {
+      route->location = sv_from_cstr(url);
+      if (set_status(route, &storage, code) == 0 &&
+          store(&storage, &route->headers, "Location: %s\r\n", url) == 0) {
+        rc = 0;
+      }
+    }
+  } else if (strcmp(action, "fixed") == 0) {
+    route->action = ROUTE_FIXED;
+    int code;
+    if (parse_status(next_word(&cursor), 200, 599, &code) == 0) {
+      // The body is the rest of the line as written.
+      cursor += strspn(cursor, " \t");
+      route->body = sv_trim(sv_from_cstr(cursor));
+      if (set_status(route, &storage, code) == 0 &&
+          store(&storage, &route->headers, "%s",
+                "Content-Type: text/plain\r\n") == 0) {
+        rc = 0;
+      }
+    }
+  } else if (strcmp(action, "proxy") == 0) {
+    route->action = ROUTE_PROXY;
+    char *name = next_word(&cursor);
+    route->upstream = name != nullptr
+                          ? proxy_find(router->proxy, sv_from_cstr(name))
+                          : nullptr;
+    if (route->upstream == nullptr || next_word(&cursor) != nullptr) {
+      log_error("%s:%d: No --proxy route \"%s\"", where.file, where.line,
+                name != nullptr ? name : "");
+      return -1;
+    }
+    rc = 0;
+  }
+  if (rc != 0) {
+    log_error("%s:%d: Invalid \"%s\" rule", where.file, where.line, action);
+    return -1;
+  }
+  return keep_storage(route, &storage);
+}
+
+static char *read_source(const char *path) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (fd == -1 || fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+    log_error("Cannot read routes \"%s\": %s", path, strerror(errno));
+    if (fd != -1) {
+      (void)close(fd);
+    }
+    return nullptr;
+  }
+  size_t length = (size_t)st.st_size;
+  char *source = malloc(length + 1);
+  if (source != nullptr && disk_io_read(nullptr, fd, source, length) != 0) {
+    log_error("Cannot read routes \"%s\"", path);
+    free(source);
+    source = nullptr;
+  }
+  (void)close(fd);
+  if (source != nullptr) {
+    source[length] = '\0';
+  }
+  return source;
+}
+
+static int parse_file(const router_t *router, route_table_t *table,
+                      rule_t **rules) {
+  const char *path = router->config->routes_file;
+  table->source = read_source(path);
+  if (table->source == nullptr) {
+    return -1;
+  }
+  size_t lines = 1;
+  for (const char *c = table->source; *c != '\0'; c++) {
+    lines += *c == '\n';
+  }
+  table->routes = calloc(lines, sizeof(route_t));
+  *rules = calloc(lines, sizeof(rule_t));
+  if (table->routes == nullptr || *rules == nullptr) {
+    return -ENOMEM;
+  }
+
+  char *line = table->source;
+  for (int number = 1; line != nullptr; number++) {
+    char *end = strchr(line, '\n');
+    if (end != nullptr) {
+      *end = '\0';
+    }
+    size_t at = table->route_count;
+    int rc = parse_rule(router, line, &table->routes[at], &(*rules)[at],
+                        (where_t){.file = path, .line = number});
+    if (rc < 0) {
+      return rc;
+    }
+    if (rc == 0) {
+      (*rules)[at].route = (int32_t)at;
+      table->route_count++;
+    }
+    line = end != nullptr ? end + 1 : nullptr;
+  }
+  return 0;
+}
+
+// Without a file: the root directory, and every --proxy route under its own
+// prefix.
+static int builtin_rules(const router_t *router, route_table_t *table,
+                         rule_t **rules) {
+  const server_config_t *config = router->config;
+  size_t count = 1 + (size_t)config->proxy_route_count;
+  table->routes = calloc(count, sizeof(route_t));
+  *rules = calloc(count, sizeof(rule_t));
+  if (table->routes == nullptr || *rules == nullptr) {
+    return -ENOMEM;
+  }
+
+  storage_t storage;
+  storage.length = 0;
+  route_t *route = &table->routes[0];
+  char no_policies[] = "";
+  char *cursor = no_policies;
+  if (parse_static(router->root_dir->data, &cursor, route, &storage,
+                   (where_t){.file = "(builtin)", .line = 1}) != 0 ||
+      keep_storage(route, &storage) != 0) {
+    return -1;
+  }
+  (*rules)[0] = (rule_t){.prefix = SV_LIT("/"), .route = 0};
+  table->route_count = 1;
+
+  for (int i = 0; i < config->proxy_route_count; i++) {
+    const char *spec = config->proxy_routes[i];
+    string_view_t prefix = {.data = spec,
+                            .length = strcspn(spec, "=")};
+    route = &table->routes[table->route_count];
+    *route = (route_t){.action = ROUTE_PROXY,
+                       .upstream = proxy_find(router->proxy, prefix)};
+    if (route->upstream == nullptr) {
+      return -1;
+    }
+    (*rules)[table->route_count] =
+        (rule_t){.prefix = prefix, .route = (int32_t)table->route_count};
+    table->route_count++;
+  }
+  return 0;
+}
+
+static int compare_bytes(string_view_t lhs, string_view_t rhs) {
+  size_t common = lhs.length < rhs.length ? lhs.length : rhs.length;
+  // The catch-all host is an empty key whose data may be null.
+  int order = common > 0 ? memcmp(lhs.data, rhs.data, common) : 0;
+  if (order != 0) {
+    return order;
+  }
+  return (lhs.length > rhs.length) - (lhs.length < rhs.length);
+}
+
+static int compare_keys(const void *a, const void *b) {
+  const trie_key_t *lhs = a;
+  const trie_key_t *rhs = b;
+  return compare_bytes((string_view_t){lhs->data, lhs->length},
+                       (string_view_t){rhs->data, rhs->length});
+}
+
+// By host, then prefix, so each host's rules are one run.
+static int compare_rules(const void *a, const void *b) {
+  const rule_t *lhs = a;
+  const rule_t *rhs = b;
+  int order = compare_bytes(lhs->host, rhs->host);
+  return order != 0 ? order : compare_bytes(lhs->prefix, rhs->prefix);
+}
+
+// keys holds count distinct keys in order, sharing their first depth bytes;
+// nodes[at] becomes their subtree. Siblings are reserved as one block before
+// any of them is filled, which keeps them adjacent.
+static void fill(route_table_t *table, uint32_t at, const trie_key_t *keys,
+                 size_t count, size_t depth) {
+  trie_node_t *node = &table->nodes[at];
+  node->value = -1;
+  if (count > 0 && keys[0].length == depth) {
+    node->value = keys[0].value;
+    keys++;
+    count--;
+  }
+
+  uint16_t children = 0;
+  for (size_t i = 0; i < count; i++) {
+    if (i == 0 || keys[i].data[depth] != keys[i - 1].data[depth]) {
+      children++;
+    }
+  }
+  node->child_count = children;
+  node->first_child = (uint32_t)table->node_count;
+  table->node_count += children;
+
+  uint32_t child = node->first_child;
+  size_t start = 0;
+  for (size_t i = 1; i <= count; i++) {
+    if (i < count && keys[i].data[depth] == keys[start].data[depth]) {
+      continue;
+    }
+    // Sorted, so what the first and last share, the whole group shares.
+    const trie_key_t *first = &keys[start];
+    const trie_key_t *last = &keys[i - 1];
+    size_t common = depth + 1;
+    while (common < first->length && common < last->length &&
+           first->data[common] == last->data[common]) {
+      common++;
+    }
+    table->nodes[child] = (trie_node_t){
+        .label = first->offset + (uint32_t)depth,
+        .label_length = (uint16_t)(common - depth),
+    };
+    fill(table, child, first, i - start, common);
+    child++;
+    start = i;
+  }
+}
+
+static uint32_t build_trie(route_table_t *table, trie_key_t *keys,
+                           size_t count) {
+  qsort(keys, count, sizeof(trie_key_t), compare_keys);
+  uint32_t root = (uint32_t)table->node_count++;
+  table->nodes[root] = (trie_node_t){};
+  fill(table, root, keys, count, 0);
+  return root;
+}
+
+static uint32_t copy_key(route_table_t *table, size_t *used,
+                         string_view_t key) {
+  uint32_t offset = (uint32_t)*used;
+  if (key.length > 0) {
+    memcpy(table->keys + offset, key.data, key.length);
+  }
+  *used += key.length;
+  return offset;
+}
+
+static int build(route_table_t *table, rule_t *rules) {
+  size_t count = table->route_count;
+  qsort(rules, count, sizeof(rule_t), compare_rules);
+
+  size_t bytes = 0;
+  for (size_t i = 0; i < count; i++) {
+    if (i > 0 && compare_rules(&rules[i - 1], &rules[i]) == 0) {
+      log_error("Duplicate route for \"%.*s%.*s\"",
+                (int)rules[i].host.length, rules[i].host.data,
+                (int)rules[i].prefix.length, rules[i].prefix.data);
+      return -EINVAL;
+    }
+    bytes += rules[i].host.length + rules[i].prefix.length;
+  }
+  if (bytes > UINT32_MAX) {
+    return -E2BIG;
+  }
+
+  // Every key adds at most one leaf and one branch; each trie has a root.
+  table->nodes = calloc(4 * count + 2, sizeof(trie_node_t));
+  table->keys = malloc(bytes + 1);
+  trie_key_t *keys = calloc(count + 1, sizeof(trie_key_t));
+  trie_key_t *hosts = calloc(count + 1, sizeof(trie_key_t));
+  if (table->nodes == nullptr || table->keys == nullptr || keys == nullptr ||
+      hosts == nullptr) {
+    free(keys);
+    free(hosts);
+    return -ENOMEM;
+  }
+
+  table->hosts = NODE_NONE;
+  table->fallback = NODE_NONE;
+  size_t used = 0;
+  size_t host_count = 0;
+  for (size_t start = 0; start < count;) {
+    string_view_t host = rules[start].host;
+    size_t end = start;
+    while (end < count && sv_equal(rules[end].host, host)) {
+      string_view_t prefix = rules[end].prefix;
+      keys[end - start] = (trie_key_t){
+          .data = prefix.data,
+          .length = prefix.length,
+          .offset = copy_key(table, &used, prefix),
+          .value = rules[end].route,
+      };
+      end++;
+    }
+    uint32_t root = build_trie(table, keys, end - start);
+    if (host.length == 0) {
+      table->fallback = root;
+    } else {
+      hosts[host_count++] = (trie_key_t){
+          .data = host.data,
+          .length = host.length,
+          .offset = copy_key(table, &used, host),
+          .value = (int32_t)root,
+      };
+    }
+    start = end;
+  }
+  if (host_count > 0) {
+    table->hosts = build_trie(table, hosts, host_count);
+  }
+
+  free(keys);
+  free(hosts);
+  return 0;
+}
+
+static int compile(const router_t *router, route_table_t **out) {
+  *out = nullptr;
+  route_table_t *table = calloc(1, sizeof(route_table_t));
+  if (table == nullptr) {
+    return -ENOMEM;
+  }
+  rule_t *rules = nullptr;
+  int rc = router->config->routes_file != nullptr
+               ? parse_file(router, table, &rules)
+               : builtin_rules(router, table, &rules);
+  if (rc == 0) {
+    rc = build(table, rules);
+  }
+  free(rules);
+  if (rc != 0) {
+    table_free(table);
+    return rc < 0 ? rc : -EINVAL;
+  }
+  *out = table;
+  return 0;
+}
+
+[[nodiscard]]
+int router_create(const server_config_t *config, const string_t *root_dir,
+                  proxy_t *proxy, router_t **out) {
+  *out = nullptr;
+  router_t *router = aligned_alloc(CACHE_LINE, sizeof(router_t));
+  if (router == nullptr) {
+    return -ENOMEM;
+  }
+  memset(router, 0, sizeof(*router));
+  router->config = config;
+  router->root_dir = root_dir;
+  router->proxy = proxy;
+
+  int rc = compile(router, &router->generations[0].table);
+  if (rc != 0) {
+    free(router);
+    return rc;
+  }
+  log_info("Routes: %zu rule(s), %zu trie nodes",
+           router->generations[0].table->route_count,
+           router->generations[0].table->node_count);
+  *out = router;
+  return 0;
+}
+
+void router_destroy(router_t *router) {
+  if (router == nullptr) {
+    return;
+  }
+  for (int i = 0; i < ROUTER_GENERATIONS; i++) {
+    table_free(router->generations[i].table);
+  }
+  free(router);
+}
+
+// Frees the replaced tables no connection holds any more.
+static void collect(router_t *router, uint64_t current) {
+  for (uint64_t i = 0; i < ROUTER_GENERATIONS; i++) {
+    generation_t *generation = &router->generations[i];
+    if (i != current % ROUTER_GENERATIONS && generation->table != nullptr &&
+        atomic_load(&generation->readers) == 0) {
+      table_free(generation->table);
+      generation->table = nullptr;
+    }
+  }
+}
+
+[[nodiscard]]
+int router_reload(router_t *router) {
+  if (router->config->routes_file == nullptr) {
+    log_info("No routes file to reload");
+    return 0;
+  }
+
+  uint64_t current = atomic_load(&router->current);
+  collect(router, current);
+  generation_t *next =
+      &router->generations[(current + 1) % ROUTER_GENERATIONS];
+  if (next->table != nullptr) {
+    log_warn("Routes not reloaded: older rules are still in use");
+    return -EBUSY;
+  }
+
+  route_table_t *table;
+  int rc = compile(router, &table);
+  if (rc != 0) {
+    log_error("Routes not reloaded, keeping the previous rules");
+    return rc;
+  }
+  next->table = table;
+  // A reader counted in the old generation after this sees the new number
+  // and backs off, so a zero count below is final.
+  atomic_store(&router->current, current + 1);
+  collect(router, current + 1);
+
+  log_info("Routes reloaded: %zu rule(s), %zu trie nodes", table->route_count,
+           table->node_count);
+  return 0;
+}
+
+const route_table_t *router_enter(router_t *router, uint64_t *pin) {
+  if (router == nullptr) {
+    return nullptr;
+  }
+  for (;;) {
+    uint64_t current = atomic_load(&router->current);
+    generation_t *generation =
+        &router->generations[current % ROUTER_GENERATIONS];
+    atomic_fetch_add(&generation->readers, 1);
+    if (atomic_load(&router->current) == current) {
+      *pin = current;
+      return generation->table;
+    }
+    atomic_fetch_sub(&generation->readers, 1);
+  }
+}
+
+void router_leave(router_t *router, uint64_t pin) {
+  if (router != nullptr) {
+    atomic_fetch_sub(&router->generations[pin % ROUTER_GENERATIONS].readers,
+                     1);
+  }
+}
+
+static uint32_t find_child(const route_table_t *table, const trie_node_t *node,
+                           unsigned char c) {
+  uint32_t low = node->first_child;
+  uint32_t high = low + node->child_count;
+  while (low < high) {
+    uint32_t middle = low + (high - low) / 2;
+    unsigned char first =
+        (unsigned char)table->keys[table->nodes[middle].label];
+    if (first == c) {
+      return middle;
+    }
+    if (first < c) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  return NODE_NONE;
+}
+
+// "/api" ends at a segment of "/api/v1" but not of "/apix".
+static bool at_boundary(string_view_t path, size_t at) {
+  return at == path.length || path.data[at] == '/' ||
+         (at > 0 && path.data[at - 1] == '/');
+}
+
+// The value of the longest key that is a prefix of key (ending at a path
+// boundary), or with exact set of key itself. -1 when there is none.
+static int32_t walk(const route_table_t *table, uint32_t index,
+                    string_view_t key, bool exact, size_t *matched) {
+  int32_t best = -1;
+  size_t at = 0;
+  for (;;) {
+    const trie_node_t *node = &table->nodes[index];
+    if (node->value >= 0 &&
+        (exact ? at == key.length : at_boundary(key, at))) {
+      best = node->value;
+      *matched = at;
+    }
+    if (at == key.length) {
+      break;
+    }
+    index = find_child(table, node, (unsigned char)key.data[at]);
+    if (index == NODE_NONE) {
+      break;
+    }
+    const trie_node_t *child = &table->nodes[index];
+    if (key.length - at < child->label_length ||
+        memcmp(table->keys + child->label, key.data + at,
+               child->label_length) != 0) {
+      break;
+    }
+    at += child->label_length;
+  }
+  return best;
+}
+
+// Lowercase, without the port. 0 when it cannot be a configured host.
+static size_t host_name(string_view_t host, char *out) {
+  host = sv_trim(host);
+  size_t end = host.length > 0 && host.data[0] == '['
+                   ? sv_find_char(host, ']')
+                   : sv_find_char(host, ':');
+  if (end != SV_NPOS) {
+    host.length = end + (host.data[0] == '[' ? 1 : 0);
+  }
+  if (host.length > 0 && host.data[host.length - 1] == '.') {
+    host.length--;
+  }
+  if (host.length >= ROUTER_HOST_MAX) {
+    return 0;
+  }
+  for (size_t i = 0; i < host.length; i++) {
+    char c = host.data[i];
+    out[i] = (char)(c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c);
+  }
+  return host.length;
+}
+
+const route_t *route_match(const route_table_t *table, string_view_t host,
+                           string_view_t path, string_view_t *rest) {
+  if (table == nullptr) {
+    return nullptr;
+  }
+
+  uint32_t root = table->fallback;
+  char name[ROUTER_HOST_MAX];
+  size_t length = table->hosts != NODE_NONE ? host_name(host, name) : 0;
+  size_t matched = 0;
+  if (length > 0) {
+    int32_t found = walk(table, table->hosts,
+                         (string_view_t){.data = name, .length = length},
+                         true, &matched);
+    if (found >= 0) {
+      root = (uint32_t)found;
+    }
+  }
+  if (root == NODE_NONE) {
+    return nullptr;
+  }
+
+  int32_t found = walk(table, root, path, false, &matched);
+  if (found < 0) {
+    return nullptr;
+  }
+  *rest = sv_slice(path, matched, path.length - matched);
+  return &table->routes[found];
+}
@@ -1,12 +1,26 @@
+#include <pthread.h>
+
 #include "sig.h"
 
 volatile sig_atomic_t server_running = 1;
+volatile sig_atomic_t upgrade_requested = 0;
+volatile sig_atomic_t reload_requested = 0;
 
 static void handle_signal(int signo) {
   (void)signo;
   server_running = 0;
 }
 
+static void handle_upgrade(int signo) {
+  (void)signo;
+  upgrade_requested = 1;
+}
+
+static void handle_reload(int signo) {
+  (void)signo;
+  reload_requested = 1;
+}
+
 void signal_init(void) {
   struct sigaction sa = {};
 
@@ -14,4 +28,24 @@ void signal_init(void) {
 
   sigaction(SIGINT, &sa, nullptr);
   sigaction(SIGTERM, &sa, nullptr);
+
+  sa.sa_handler = handle_upgrade;
+  sigaction(SIGUSR2, &sa, nullptr);
+
+  sa.sa_handler = handle_reload;
+  sigaction(SIGHUP, &sa, nullptr);
+
+  sa.sa_handler = SIG_IGN;
+  sigaction(SIGPIPE, &sa, nullptr);
+}
+
+void signal_block(sigset_t *previous) {
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGINT);
+  sigaddset(&set, SIGTERM);
+  sigaddset(&set, SIGUSR2);
+  sigaddset(&set, SIGHUP);
+  sigaddset(&set, SIGCHLD);
+  pthread_sigmask(SIG_BLOCK, &set, previous);
 }
@@ -1,23 +1,31 @@
 #include <errno.h>
+#include <fcntl.h>
 #include <netinet/in.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <unistd.h>
 
 #include "constants.h"
+#include "coro.h"
 #include "log.h"
 #include "socket.h"
 #include "string_utils.h"
 
-int open_socket(uint16_t port_number) {
+int open_socket(uint16_t port_number, bool reuse_port) {
   int sockfd;
   struct sockaddr_in serv_addr;
 
   // opens a socket connection
-  sockfd = socket(AF_INET, SOCK_STREAM, 0);
+  // Non-blocking so a listener shared with an upgraded process never parks
+  // accept() after poll() when the other side took the connection first.
+  sockfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
   if (sockfd < 0) {
     close(sockfd);
     log_error("While opening socket: %s", strerror(errno));
@@ -25,7 +33,9 @@ int open_socket(uint16_t port_number) {
   }
 
   int opt = 1;
-  if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt))) {
+  if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) ||
+      (reuse_port &&
+       setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)))) {
     log_warn("setsockopt error: %s", strerror(errno));
     close(sockfd);
     exit(EXIT_FAILURE);
@@ -52,14 +62,85 @@ int open_socket(uint16_t port_number) {
   return sockfd;
 }
 
-int get_client(int sockfd) {
+// Only a socket nobody answers on is removed.
+static void remove_stale(const struct sockaddr_un *addr, socklen_t length) {
+  struct stat st;
+  if (lstat(addr->sun_path, &st) != 0 || !S_ISSOCK(st.st_mode)) {
+    return;
+  }
+  int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (probe < 0) {
+    return;
+  }
+  if (connect(probe, (const struct sockaddr *)addr, length) != 0 &&
+      errno == ECONNREFUSED) {
+    (void)unlink(addr->sun_path);
+  }
+  close(probe);
+}
+
+int open_unix_socket(const char *path, unsigned mode) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  size_t length = strlen(path);
+  bool abstract = path[0] == '@';
+  if (length >= sizeof(addr.sun_path) || length == 0 ||
+      (abstract && length == 1)) {
+    log_error("Invalid Unix socket path \"%s\"", path);
+    exit(EXIT_FAILURE);
+  }
+  memcpy(addr.sun_path, path, length);
+  if (abstract) {
+    addr.sun_path[0] = '\0';
+  }
+  // Abstract names are exactly their bytes, with no terminator.
+  socklen_t addr_length =
+      (socklen_t)(offsetof(struct sockaddr_un, sun_path) + length + !abstract);
+
+  int sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (sockfd < 0) {
+    log_error("While opening Unix socket: %s", strerror(errno));
+    exit(errno);
+  }
+
+  if (!abstract) {
+    remove_stale(&addr, addr_length);
+    // bind() creates the node with the socket inode's mode, minus the umask,
+    // so there is no window where it is more open than asked for.
+    (void)fchmod(sockfd, (mode_t)mode);
+  }
+  if (bind(sockfd, (const struct sockaddr *)&addr, addr_length) < 0) {
+    close(sockfd);
+    log_error("While binding \"%s\": %s", path, strerror(errno));
+    exit(errno);
+  }
+  if (!abstract && chmod(path, (mode_t)mode) != 0) {
+    log_warn("chmod \"%s\": %s", path, strerror(errno));
+  }
+
+  if (listen(sockfd, BACKLOG) != 0) {
+    close(sockfd);
+    log_error("While listening: %s", strerror(errno));
+    exit(errno);
+  }
+
+  log_info("Listening on Unix socket %s", path);
+  return sockfd;
+}
+
+int get_client(int sockfd, struct sockaddr_storage *peer) {
   int newsockfd;
   socklen_t clilen;
-  struct sockaddr_in cli_addr;
+  struct sockaddr_storage cli_addr;
 
-  clilen = sizeof(cli_addr);
-  newsockfd = accept(sockfd, (struct sockaddr *)&cli_addr, &clilen);
+  if (peer == nullptr) {
+    peer = &cli_addr;
+  }
+  clilen = sizeof(*peer);
+  newsockfd = accept4(sockfd, (struct sockaddr *)peer, &clilen, SOCK_CLOEXEC);
   if (newsockfd < 0) {
+    if (errno == EINTR || errno == EAGAIN || errno == ECONNABORTED) {
+      return -1;
+    }
     close(sockfd);
     log_error("While accepting a connection: %s", strerror(errno));
     exit(errno);
@@ -68,6 +149,100 @@ int get_client(int sockfd) {
   return newsockfd;
 }
 
+[[nodiscard]]
+int socket_write_all(int fd, const void *data, size_t length) {
+  const char *cursor = (const char *)data;
+  while (length > 0) {
+    ssize_t written = coro_write(fd, cursor, length);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    cursor += written;
+    length -= (size_t)written;
+  }
+  return 0;
+}
+
+[[nodiscard]]
+int socket_writev_all(int fd, struct iovec *iov, int count) {
+  while (count > 0) {
+    ssize_t written = coro_writev(fd, iov, count);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+
+    size_t left = (size_t)written;
+    while (count > 0 && left >= iov->iov_len) {
+      left -= iov->iov_len;
+      iov++;
+      count--;
+    }
+    if (count > 0) {
+      iov->iov_base = (char *)iov->iov_base + left;
+      iov->iov_len -= left;
+    }
+  }
+  return 0;
+}
+
+[[nodiscard]]
+int socket_sendfile_all(int to, int from, off_t *offset, size_t length) {
+  while (length > 0) {
+    ssize_t sent = coro_sendfile(to, from, offset, length);
+    if (sent < 0 && errno == EINTR) {
+      continue;
+    }
+    // 0 means the file shrank, but its length is already on the wire.
+    if (sent <= 0) {
+      return -1;
+    }
+    length -= (size_t)sent;
+  }
+  return 0;
+}
+
+[[nodiscard]]
+ssize_t socket_splice(int from, int to, size_t length, const int pipe_fds[2]) {
+  constexpr size_t chunk = 1 << 20;
+  constexpr unsigned flags = SPLICE_F_MOVE | SPLICE_F_MORE;
+  size_t moved = 0;
+
+  while (moved < length) {
+    size_t want = length - moved < chunk ? length - moved : chunk;
+    ssize_t in = coro_splice(from, pipe_fds[1], want, flags, true);
+    if (in == 0) {
+      break;
+    }
+    if (in < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+
+    size_t pending = (size_t)in;
+    while (pending > 0) {
+      ssize_t out = coro_splice(pipe_fds[0], to, pending, flags, false);
+      if (out < 0 && errno == EINTR) {
+        continue;
+      }
+      if (out <= 0) {
+        return -1;
+      }
+      pending -= (size_t)out;
+    }
+    moved += (size_t)in;
+  }
+
+  return (ssize_t)moved;
+}
+
 [[nodiscard]]
 int parse_port(const char *str, uint16_t *out_port) {
   char *endptr;
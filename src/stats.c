@@ -0,0 +1,74 @@
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "log.h"
+#include "stats.h"
+
+enum {
+  CACHE_LINE = 64,
+};
+
+typedef struct {
+  _Alignas(CACHE_LINE) _Atomic uint64_t counters[STAT_COUNT];
+} stats_slot_t;
+
+struct stats {
+  size_t region_size;
+  int slot_count;
+  stats_slot_t slots[];
+};
+
+// Per process: forked children set their own after fork().
+static int current_slot;
+
+stats_t *stats_create(int slots) {
+  if (slots <= 0) {
+    return nullptr;
+  }
+  size_t region_size =
+      sizeof(stats_t) + (size_t)slots * sizeof(stats_slot_t);
+  void *region = mmap(nullptr, region_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (region == MAP_FAILED) {
+    log_error("Cannot map stats: %s", strerror(errno));
+    return nullptr;
+  }
+
+  // Fresh anonymous pages are zero, which is every counter's start.
+  stats_t *stats = region;
+  stats->region_size = region_size;
+  stats->slot_count = slots;
+  return stats;
+}
+
+void stats_destroy(stats_t *stats) {
+  if (stats != nullptr) {
+    (void)munmap(stats, stats->region_size);
+  }
+}
+
+void stats_attach(int slot) { current_slot = slot; }
+
+void stats_add(stats_t *stats, stat_t stat, uint64_t count) {
+  if (stats == nullptr || current_slot >= stats->slot_count) {
+    return;
+  }
+  atomic_fetch_add_explicit(&stats->slots[current_slot].counters[stat], count,
+                            memory_order_relaxed);
+}
+
+void stats_total(const stats_t *stats, uint64_t out[STAT_COUNT]) {
+  memset(out, 0, sizeof(uint64_t) * STAT_COUNT);
+  if (stats == nullptr) {
+    return;
+  }
+  for (int slot = 0; slot < stats->slot_count; slot++) {
+    for (int stat = 0; stat < STAT_COUNT; stat++) {
+      out[stat] += atomic_load_explicit(&stats->slots[slot].counters[stat],
+                                        memory_order_relaxed);
+    }
+  }
+}
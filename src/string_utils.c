@@ -134,3 +134,114 @@ bool string_starts_with_s(const string_t *str, const string_t *prefix) {
 
   return memcmp(str->data, prefix->data, prefix->length) == 0;
 }
+
+[[nodiscard]]
+string_view_t sv_from_cstr(const char *str) {
+  if (str == nullptr) {
+    return (string_view_t){.data = "", .length = 0};
+  }
+  return (string_view_t){.data = str, .length = strlen(str)};
+}
+
+[[nodiscard]]
+string_view_t sv_from_string(const string_t *str) {
+  if (str == nullptr) {
+    return (string_view_t){.data = "", .length = 0};
+  }
+  return (string_view_t){.data = str->data, .length = str->length};
+}
+
+[[nodiscard]]
+string_view_t sv_slice(string_view_t sv, size_t start, size_t length) {
+  if (start > sv.length) {
+    start = sv.length;
+  }
+  if (length > sv.length - start) {
+    length = sv.length - start;
+  }
+  // An empty view may have no data, and nullptr + 0 is undefined.
+  return (string_view_t){.data = start > 0 ? sv.data + start : sv.data,
+                         .length = length};
+}
+
+[[nodiscard]]
+bool sv_equal(string_view_t a, string_view_t b) {
+  // Empty views may have no data, which memcmp() must not be given.
+  return a.length == b.length &&
+         (a.length == 0 || memcmp(a.data, b.data, a.length) == 0);
+}
+
+static inline char ascii_lower(char c) {
+  return (c >= 'A' && c <= 'Z') ? (char)(c | 0x20) : c;
+}
+
+[[nodiscard]]
+bool sv_equal_nocase(string_view_t a, string_view_t b) {
+  if (a.length != b.length) {
+    return false;
+  }
+  for (size_t i = 0; i < a.length; i++) {
+    if (ascii_lower(a.data[i]) != ascii_lower(b.data[i])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+[[nodiscard]]
+bool sv_starts_with(string_view_t sv, string_view_t prefix) {
+  return prefix.length <= sv.length &&
+         (prefix.length == 0 ||
+          memcmp(sv.data, prefix.data, prefix.length) == 0);
+}
+
+[[nodiscard]]
+size_t sv_find_char(string_view_t sv, char c) {
+  if (sv.length == 0) {
+    return SV_NPOS;
+  }
+  const char *hit = memchr(sv.data, c, sv.length);
+  return hit == nullptr ? SV_NPOS : (size_t)(hit - sv.data);
+}
+
+[[nodiscard]]
+size_t sv_find(string_view_t sv, string_view_t needle) {
+  if (needle.length == 0) {
+    return 0;
+  }
+  if (sv.length == 0) {
+    return SV_NPOS;
+  }
+  const char *hit = memmem(sv.data, sv.length, needle.data, needle.length);
+  return hit == nullptr ? SV_NPOS : (size_t)(hit - sv.data);
+}
+
+bool sv_split(string_view_t *rest, char delim, string_view_t *token) {
+  if (rest->data == nullptr) {
+    return false;
+  }
+
+  size_t at = sv_find_char(*rest, delim);
+  if (at == SV_NPOS) {
+    *token = *rest;
+    *rest = (string_view_t){.data = nullptr, .length = 0};
+    return true;
+  }
+
+  *token = sv_slice(*rest, 0, at);
+  *rest = sv_slice(*rest, at + 1, SV_NPOS);
+  return true;
+}
+
+[[nodiscard]]
+string_view_t sv_trim(string_view_t sv) {
+  while (sv.length > 0 && (sv.data[0] == ' ' || sv.data[0] == '\t')) {
+    sv.data++;
+    sv.length--;
+  }
+  while (sv.length > 0 &&
+         (sv.data[sv.length - 1] == ' ' || sv.data[sv.length - 1] == '\t')) {
+    sv.length--;
+  }
+  return sv;
+}
@@ -1,7 +1,23 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
 #include "thread_pool.h"
-#include "arena.h"
+#include "coro.h"
 #include "handler.h"
 #include "log.h"
+#include "proxy.h"
+#include "worker_memory.h"
+
+enum {
+  NS_PER_MS = 1000000,
+};
 
 void thread_lock_callback(bool lock, void *udata) {
   pthread_mutex_t *LOCK = (pthread_mutex_t *)udata;
@@ -12,54 +28,423 @@ void thread_lock_callback(bool lock, void *udata) {
   }
 }
 
-static void *worker_entry(void *arg) {
-  worker_config_t *cfg = (worker_config_t *)arg;
-  arena_t *worker_memory = arena_create(ARENA_MAX_SIZE);
-  log_trace("Worker %d: Online", cfg->id);
+// "<quota> <period>" or "max <period>" from this process's cgroup.
+static unsigned cgroup_cpu_limit(void) {
+  char group[PATH_MAX] = "";
+  FILE *file = fopen("/proc/self/cgroup", "r");
+  if (file == nullptr) {
+    return 0;
+  }
+  char line[PATH_MAX];
+  while (fgets(line, sizeof(line), file) != nullptr) {
+    // The unified (v2) hierarchy is the "0::" line.
+    if (strncmp(line, "0::", 3) == 0) {
+      line[strcspn(line, "\n")] = '\0';
+      snprintf(group, sizeof(group), "%s", line + 3);
+      break;
+    }
+  }
+  fclose(file);
 
+  char path[PATH_MAX + 32];
+  snprintf(path, sizeof(path), "/sys/fs/cgroup%s/cpu.max", group);
+  file = fopen(path, "r");
+  if (file == nullptr) {
+    return 0;
+  }
+  char quota[32];
+  unsigned long period;
+  unsigned limit = 0;
+  if (fscanf(file, "%31s %lu", quota, &period) == 2 &&
+      strcmp(quota, "max") != 0 && period > 0) {
+    unsigned long micros = strtoul(quota, nullptr, 10);
+    limit = (unsigned)((micros + period - 1) / period);
+  }
+  fclose(file);
+  return limit;
+}
+
+unsigned thread_pool_cpu_budget(void) {
+  unsigned cpus = 1;
+  cpu_set_t allowed;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+    cpus = (unsigned)CPU_COUNT(&allowed);
+  }
+  unsigned limit = cgroup_cpu_limit();
+  if (limit > 0 && limit < cpus) {
+    cpus = limit;
+  }
+  return cpus > 0 ? cpus : 1;
+}
+
+// A connection handed to a coroutine, copied onto its stack.
+typedef struct {
+  worker_memory_t *memory;
+  const server_t *server;
+  int client;
+  job_info_t info;
+} job_t;
+
+static void run_job(void *arg) {
+  job_t *job = (job_t *)arg;
+  handle_client(job->memory, job->client, &job->info, job->server);
+}
+
+// One connection at a time, blocking in every read and write.
+static void serve_blocking(worker_config_t *cfg, worker_memory_t *memory) {
   while (true) {
-    int client_fd = queue_pop(cfg->queue);
+    job_info_t info;
+    int client_fd = queue_pop(cfg->queue, &info);
 
+    if (client_fd == QUEUE_RETIRE) {
+      log_debug("Worker %d: Retired", cfg->id);
+      break;
+    }
     if (client_fd == -1) {
       log_trace("Worker %d: Shutting down", cfg->id);
       break;
     }
 
-    handle_client(worker_memory, client_fd, cfg->root_dir);
-    arena_reset(worker_memory);
+    handle_client(memory, client_fd, &info, cfg->server);
+  }
+}
+
+// Up to --coroutines connections, each on a coroutine over a non-blocking
+// socket. A worker with nothing running blocks in queue_pop() like any
+// other, so retiring and shutdown work the same; a busy one takes new
+// connections between scheduler rounds.
+static void serve_coroutines(worker_config_t *cfg, worker_memory_t *memory) {
+  scheduler_t *scheduler = scheduler_create(
+      cfg->server->config->coroutines, cfg->queue->wake_fd);
+  if (scheduler == nullptr) {
+    serve_blocking(cfg, memory);
+    return;
+  }
+
+  bool stopping = false;
+  while (true) {
+    job_t job = {.memory = memory, .server = cfg->server};
+    if (scheduler_live(scheduler) == 0) {
+      job.client = queue_pop(cfg->queue, &job.info);
+      if (job.client == QUEUE_RETIRE) {
+        log_debug("Worker %d: Retired", cfg->id);
+        break;
+      }
+      if (job.client == -1) {
+        log_trace("Worker %d: Shutting down", cfg->id);
+        break;
+      }
+    } else if (!stopping) {
+      job.client = queue_try_pop(cfg->queue, &job.info);
+      stopping = job.client == -1;
+    } else {
+      job.client = -1;
+    }
+
+    if (job.client >= 0) {
+      int flags = fcntl(job.client, F_GETFL);
+      if (flags == -1 ||
+          fcntl(job.client, F_SETFL, flags | O_NONBLOCK) == -1 ||
+          scheduler_spawn(scheduler, run_job, &job, sizeof(job)) != 0) {
+        (void)close(job.client);
+      }
+      // Take whatever else is queued before running anything.
+      if (scheduler_live(scheduler) < cfg->server->config->coroutines) {
+        continue;
+      }
+    }
+    scheduler_run(scheduler, !stopping);
+  }
+
+  scheduler_destroy(scheduler);
+}
+
+static void *worker_entry(void *arg) {
+  worker_config_t *cfg = (worker_config_t *)arg;
+  atomic_store(&cfg->tid, gettid());
+  worker_memory_t *worker_memory =
+      worker_memory_create(cfg->id, cfg->server->config);
+  if (worker_memory == nullptr) {
+    log_error("Worker %d: no memory, not serving", cfg->id);
+    atomic_store(&cfg->state, WORKER_EXITED);
+    return nullptr;
+  }
+  log_trace("Worker %d: Online", cfg->id);
+
+  if (cfg->server->config->coroutines > 0) {
+    serve_coroutines(cfg, worker_memory);
+  } else {
+    serve_blocking(cfg, worker_memory);
+  }
+
+  proxy_thread_exit();
+  worker_memory_destroy(worker_memory);
+  atomic_store(&cfg->state, WORKER_EXITED);
+  return nullptr;
+}
+
+// Called with the lock held.
+static int spawn_worker(thread_pool_t *pool) {
+  for (unsigned i = 0; i < pool->max_workers; i++) {
+    worker_config_t *cfg = &pool->configs[i];
+    if (atomic_load(&cfg->state) != WORKER_FREE) {
+      continue;
+    }
+
+    cfg->id = (int)i;
+    cfg->queue = pool->queue;
+    cfg->server = pool->server;
+    atomic_store(&cfg->tid, 0);
+    atomic_store(&cfg->state, WORKER_RUNNING);
+    if (pthread_create(&pool->threads[i], nullptr, worker_entry, cfg) != 0) {
+      log_error("Failed to spawn thread %u", i);
+      atomic_store(&cfg->state, WORKER_FREE);
+      return -1;
+    }
+    pool->stats.workers++;
+    return 0;
+  }
+  return -1;
+}
+
+// Joins retired workers so their slots can be reused. Lock held.
+static void reap_workers(thread_pool_t *pool) {
+  for (unsigned i = 0; i < pool->max_workers; i++) {
+    if (atomic_load(&pool->configs[i].state) == WORKER_EXITED) {
+      pthread_join(pool->threads[i], nullptr);
+      atomic_store(&pool->configs[i].state, WORKER_FREE);
+    }
+  }
+}
+
+// Workers the kernel has asleep, waiting on I/O or a lock, rather than
+// running or ready to run. Busy workers in this state are what more threads
+// can help with. Lock held.
+static unsigned blocked_workers(thread_pool_t *pool) {
+  unsigned blocked = 0;
+  for (unsigned i = 0; i < pool->max_workers; i++) {
+    pid_t tid = atomic_load(&pool->configs[i].tid);
+    if (atomic_load(&pool->configs[i].state) != WORKER_RUNNING || tid == 0) {
+      continue;
+    }
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/self/task/%d/stat", (int)tid);
+    FILE *file = fopen(path, "r");
+    if (file == nullptr) {
+      continue;
+    }
+    // "<tid> (<name>) <state> ...", where the name may hold parentheses.
+    char line[256];
+    if (fgets(line, sizeof(line), file) != nullptr) {
+      char *end = strrchr(line, ')');
+      if (end != nullptr && (end[2] == 'S' || end[2] == 'D')) {
+        blocked++;
+      }
+    }
+    fclose(file);
   }
+  return blocked;
+}
+
+static void *controller_entry(void *arg) {
+  thread_pool_t *pool = (thread_pool_t *)arg;
+  unsigned idle_ticks = 0;
+  int spare = INT_MAX; // Fewest idle workers seen while counting idle_ticks
+
+  pthread_mutex_lock(&pool->lock);
+  while (!pool->stopping) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += (long)THREAD_POOL_TICK_MS * NS_PER_MS;
+    if (deadline.tv_nsec >= 1000000000) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000;
+    }
+    (void)pthread_cond_timedwait(&pool->wakeup, &pool->lock, &deadline);
+    if (pool->stopping) {
+      break;
+    }
 
-  arena_destroy(worker_memory);
+    reap_workers(pool);
+    queue_stats_t sample;
+    queue_sample(pool->queue, &sample);
+    pool->stats.last = sample;
+    unsigned before = pool->stats.workers;
+
+    // Waiting connections and nobody free to take them. More threads only
+    // help when workers are blocked rather than short of CPU, so grow by at
+    // most the blocked ones, and a quarter at a time.
+    bool starved =
+        sample.idle == 0 &&
+        sample.wait_max >= (uint64_t)THREAD_POOL_GROW_WAIT_MS * NS_PER_MS &&
+        before < pool->max_workers;
+    unsigned blocked = starved ? blocked_workers(pool) : 0;
+    if (blocked > 0) {
+      unsigned step = before / 4 + 1;
+      step = step < blocked ? step : blocked;
+      for (unsigned i = 0; i < step && pool->stats.workers < pool->max_workers;
+           i++) {
+        if (spawn_worker(pool) != 0) {
+          break;
+        }
+        pool->stats.grown++;
+      }
+      log_info("Thread pool %u -> %u workers: queued %.1f ms, depth %d, "
+               "%u blocked",
+               before, pool->stats.workers,
+               (double)sample.wait_max / NS_PER_MS, sample.depth, blocked);
+      idle_ticks = 0;
+      spare = INT_MAX;
+      continue;
+    }
+
+    if (sample.idle == 0 || before <= pool->min_workers) {
+      idle_ticks = 0;
+      spare = INT_MAX;
+      continue;
+    }
+    spare = sample.idle < spare ? sample.idle : spare;
+    if (++idle_ticks < THREAD_POOL_RETIRE_TICKS) {
+      continue;
+    }
+
+    // Retire half of what was never needed over the whole window.
+    unsigned retire = ((unsigned)spare + 1) / 2;
+    if (retire > before - pool->min_workers) {
+      retire = before - pool->min_workers;
+    }
+    queue_retire(pool->queue, (int)retire);
+    pool->stats.workers -= retire;
+    pool->stats.retired += retire;
+    log_info("Thread pool %u -> %u workers: %d idle for %u ms", before,
+             pool->stats.workers, spare,
+             THREAD_POOL_RETIRE_TICKS * THREAD_POOL_TICK_MS);
+    idle_ticks = 0;
+    spare = INT_MAX;
+  }
+  pthread_mutex_unlock(&pool->lock);
   return nullptr;
 }
 
+static unsigned min_workers(const server_config_t *config) {
+  return config->min_workers != 0 ? config->min_workers
+                                  : thread_pool_cpu_budget();
+}
+
+unsigned thread_pool_max_workers(const server_config_t *config) {
+  unsigned max = config->max_workers;
+  if (max == 0) {
+    max = min_workers(config) * THREAD_POOL_GROWTH;
+  }
+  return max < THREAD_POOL_HARD_MAX ? max : THREAD_POOL_HARD_MAX;
+}
+
 int thread_pool_init(thread_pool_t *pool, job_queue_t *queue,
-                     string_t *root_dir) {
+                     const server_t *server) {
   if (!pool || !queue) {
     return -1;
   }
 
-  for (int i = 0; i < THREAD_POOL_SIZE; i++) {
-    pool->configs[i].id = i;
-    pool->configs[i].queue = queue;
-    pool->configs[i].root_dir = root_dir;
+  unsigned min = min_workers(server->config);
+  unsigned max = thread_pool_max_workers(server->config);
+  if (min > max) {
+    min = max;
+  }
+
+  *pool = (thread_pool_t){
+      .queue = queue,
+      .server = server,
+      .min_workers = min,
+      .max_workers = max,
+      .threads = calloc(max, sizeof(pthread_t)),
+      .configs = calloc(max, sizeof(worker_config_t)),
+      .stopping = false,
+      .stats = {.min_workers = min, .max_workers = max},
+  };
+  if (pool->threads == nullptr || pool->configs == nullptr) {
+    log_error("OOM allocating the thread pool");
+    return -1;
+  }
+  pthread_mutex_init(&pool->lock, nullptr);
+  pthread_cond_init(&pool->wakeup, nullptr);
 
-    if (pthread_create(&pool->threads[i], nullptr, worker_entry,
-                       &pool->configs[i]) != 0) {
-      log_error("Failed to spawn thread %d", i);
+  pthread_mutex_lock(&pool->lock);
+  for (unsigned i = 0; i < min; i++) {
+    if (spawn_worker(pool) != 0) {
+      pthread_mutex_unlock(&pool->lock);
       return -1;
     }
   }
+  pthread_mutex_unlock(&pool->lock);
+
+  if (min < max &&
+      pthread_create(&pool->controller, nullptr, controller_entry, pool) !=
+          0) {
+    log_error("Failed to spawn the thread pool controller");
+    return -1;
+  }
 
-  log_info("Thread pool initialized with %d workers", THREAD_POOL_SIZE);
+  log_info("Thread pool initialized with %u workers (%u-%u)", min, min, max);
   return 0;
 }
 
+void thread_pool_stats(thread_pool_t *pool, thread_pool_stats_t *out) {
+  pthread_mutex_lock(&pool->lock);
+  *out = pool->stats;
+  pthread_mutex_unlock(&pool->lock);
+}
+
+static void stop_controller(thread_pool_t *pool) {
+  pthread_mutex_lock(&pool->lock);
+  pool->stopping = true;
+  pthread_cond_signal(&pool->wakeup);
+  pthread_mutex_unlock(&pool->lock);
+  if (pool->min_workers < pool->max_workers) {
+    pthread_join(pool->controller, nullptr);
+  }
+}
+
+static void release(thread_pool_t *pool) {
+  free(pool->threads);
+  free(pool->configs);
+  pthread_cond_destroy(&pool->wakeup);
+  pthread_mutex_destroy(&pool->lock);
+}
+
 void thread_pool_wait(thread_pool_t *pool) {
   if (!pool) {
     return;
   }
-  for (int i = 0; i < THREAD_POOL_SIZE; i++) {
-    pthread_join(pool->threads[i], nullptr);
+  stop_controller(pool);
+  for (unsigned i = 0; i < pool->max_workers; i++) {
+    if (atomic_load(&pool->configs[i].state) != WORKER_FREE) {
+      pthread_join(pool->threads[i], nullptr);
+    }
+  }
+  release(pool);
+}
+
+[[nodiscard]]
+int thread_pool_wait_for(thread_pool_t *pool, unsigned timeout_sec) {
+  if (!pool) {
+    return -1;
   }
+  stop_controller(pool);
+
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += (time_t)timeout_sec;
+
+  for (unsigned i = 0; i < pool->max_workers; i++) {
+    if (atomic_load(&pool->configs[i].state) == WORKER_FREE) {
+      continue;
+    }
+    if (pthread_timedjoin_np(pool->threads[i], nullptr, &deadline) != 0) {
+      log_warn("Worker %u still busy after %us drain deadline", i,
+               timeout_sec);
+      return -ETIMEDOUT;
+    }
+  }
+  release(pool);
+  return 0;
 }
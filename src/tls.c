@@ -0,0 +1,375 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "coro.h"
+#include "log.h"
+#include "socket.h"
+#include "thread_pool.h"
+#include "tls.h"
+
+enum {
+  ERROR_TEXT = 256,
+};
+
+struct tls {
+  SSL_CTX *ctx;
+  pthread_mutex_t lock;
+  pthread_cond_t drained;
+  int relays;              // Relay threads still running
+  int relay_max;           // Connections refused beyond this many relays
+  atomic_bool reported;    // Whether kTLS took has been logged
+};
+
+struct tls_session {
+  SSL *ssl;
+};
+
+// A connection encrypted in user space: client carries TLS, local is the
+// socket pair end the handler does not hold.
+typedef struct {
+  tls_t *tls;
+  SSL *ssl;
+  int client;
+  int local;
+} relay_t;
+
+static void log_ssl(const char *what) {
+  char text[ERROR_TEXT];
+  ERR_error_string_n(ERR_get_error(), text, sizeof(text));
+  log_error("%s: %s", what, text);
+  ERR_clear_error();
+}
+
+// Offers h2 when the client does, so the handler sees its preface.
+static int select_protocol(SSL *ssl, const unsigned char **out,
+                           unsigned char *out_length, const unsigned char *in,
+                           unsigned int in_length, void *arg) {
+  (void)ssl;
+  (void)arg;
+  static const unsigned char protocols[] = "\x02h2\x08http/1.1";
+  if (SSL_select_next_proto((unsigned char **)out, out_length, protocols,
+                            sizeof(protocols) - 1, in,
+                            in_length) != OPENSSL_NPN_NEGOTIATED) {
+    return SSL_TLSEXT_ERR_NOACK;
+  }
+  return SSL_TLSEXT_ERR_OK;
+}
+
+static SSL_CTX *context_create(const server_config_t *config) {
+  SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+  if (ctx == nullptr) {
+    log_ssl("Cannot create the TLS context");
+    return nullptr;
+  }
+
+  SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+  // Only AEAD suites the kernel can take over.
+  if (SSL_CTX_set_cipher_list(ctx, "ECDHE+AESGCM:ECDHE+CHACHA20") != 1 ||
+      SSL_CTX_use_certificate_chain_file(ctx, config->tls_cert) != 1 ||
+      SSL_CTX_use_PrivateKey_file(ctx, config->tls_key, SSL_FILETYPE_PEM) !=
+          1 ||
+      SSL_CTX_check_private_key(ctx) != 1) {
+    log_ssl("Cannot load the TLS certificate");
+    SSL_CTX_free(ctx);
+    return nullptr;
+  }
+
+  SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION |
+                               SSL_OP_CIPHER_SERVER_PREFERENCE);
+  SSL_CTX_set_mode(ctx, SSL_MODE_RELEASE_BUFFERS);
+  // Resumption is stateless: the ticket carries the session, encrypted under
+  // keys generated for this context, so no cache is shared between workers.
+  SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+  SSL_CTX_set_num_tickets(ctx, 1);
+  SSL_CTX_set_timeout(ctx, TLS_TICKET_LIFETIME);
+  SSL_CTX_set_alpn_select_cb(ctx, select_protocol, nullptr);
+  return ctx;
+}
+
+int tls_create(const server_config_t *config, tls_t **out) {
+  *out = nullptr;
+  if (config->tls_port == 0) {
+    return 0;
+  }
+  if (config->tls_cert == nullptr || config->tls_key == nullptr) {
+    log_error("--tls-port needs --tls-cert and --tls-key");
+    return -EINVAL;
+  }
+
+  tls_t *tls = calloc(1, sizeof(tls_t));
+  if (tls == nullptr) {
+    return -ENOMEM;
+  }
+  tls->ctx = context_create(config);
+  if (tls->ctx == nullptr) {
+    free(tls);
+    return -EINVAL;
+  }
+  tls->relay_max = (int)thread_pool_max_workers(config);
+  pthread_mutex_init(&tls->lock, nullptr);
+  pthread_cond_init(&tls->drained, nullptr);
+
+  log_info("HTTPS on port %u", config->tls_port);
+  *out = tls;
+  return 0;
+}
+
+void tls_destroy(tls_t *tls) {
+  if (tls == nullptr) {
+    return;
+  }
+  pthread_mutex_lock(&tls->lock);
+  while (tls->relays > 0) {
+    pthread_cond_wait(&tls->drained, &tls->lock);
+  }
+  pthread_mutex_unlock(&tls->lock);
+
+  pthread_cond_destroy(&tls->drained);
+  pthread_mutex_destroy(&tls->lock);
+  SSL_CTX_free(tls->ctx);
+  free(tls);
+}
+
+static bool kernel_owns_records(SSL *ssl) {
+#ifndef OPENSSL_NO_KTLS
+  return BIO_get_ktls_send(SSL_get_wbio(ssl)) &&
+         BIO_get_ktls_recv(SSL_get_rbio(ssl));
+#else
+  (void)ssl;
+  return false;
+#endif
+}
+
+// Client to handler bytes wait in inbound while the handler is not reading,
+// and the client is not read meanwhile, so neither side can wedge the other.
+static void relay_run(relay_t *relay) {
+  char inbound[TLS_RELAY_BUFFER];
+  char outbound[TLS_RELAY_BUFFER];
+  size_t pending = 0;
+  size_t offset = 0;
+  bool reading = true;
+  bool clean = false;
+
+  while (true) {
+    bool buffered = reading && pending == 0 && SSL_pending(relay->ssl) > 0;
+    struct pollfd fds[2] = {
+        {.fd = relay->local, .events = POLLIN | (pending > 0 ? POLLOUT : 0)},
+        {.fd = relay->client,
+         .events = reading && pending == 0 ? POLLIN : 0},
+    };
+    if (poll(fds, 2, buffered ? 0 : -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+
+    if (pending > 0 && (fds[0].revents & POLLOUT)) {
+      ssize_t sent = send(relay->local, inbound + offset, pending,
+                          MSG_DONTWAIT | MSG_NOSIGNAL);
+      if (sent < 0 && errno != EAGAIN && errno != EINTR) {
+        break;
+      }
+      if (sent > 0) {
+        offset += (size_t)sent;
+        pending -= (size_t)sent;
+      }
+    }
+
+    if (pending == 0 && (buffered || fds[1].revents != 0)) {
+      int got = SSL_read(relay->ssl, inbound, sizeof(inbound));
+      if (got > 0) {
+        pending = (size_t)got;
+        offset = 0;
+      } else if (SSL_get_error(relay->ssl, got) == SSL_ERROR_ZERO_RETURN) {
+        // close_notify: no more requests, but the response still goes out.
+        reading = false;
+        (void)shutdown(relay->local, SHUT_WR);
+      } else if (SSL_get_error(relay->ssl, got) != SSL_ERROR_WANT_READ) {
+        ERR_clear_error();
+        break;
+      }
+    }
+
+    if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+      ssize_t got = read(relay->local, outbound, sizeof(outbound));
+      if (got == 0) {
+        clean = true;
+        break;
+      }
+      if (got < 0) {
+        if (errno == EINTR || errno == EAGAIN) {
+          continue;
+        }
+        break;
+      }
+      if (SSL_write(relay->ssl, outbound, (int)got) <= 0) {
+        ERR_clear_error();
+        break;
+      }
+    }
+  }
+
+  if (clean) {
+    (void)SSL_shutdown(relay->ssl);
+  }
+}
+
+static void *relay_entry(void *arg) {
+  relay_t *relay = arg;
+  relay_run(relay);
+
+  SSL_free(relay->ssl);
+  (void)close(relay->client);
+  (void)close(relay->local);
+
+  tls_t *tls = relay->tls;
+  free(relay);
+  pthread_mutex_lock(&tls->lock);
+  if (--tls->relays == 0) {
+    pthread_cond_broadcast(&tls->drained);
+  }
+  pthread_mutex_unlock(&tls->lock);
+  return nullptr;
+}
+
+static int relay_start(tls_t *tls, SSL *ssl, int client, int *plain) {
+  // The relay thread blocks; a coroutine gets a non-blocking end instead.
+  int flags = fcntl(client, F_GETFL);
+  if (flags == -1 || fcntl(client, F_SETFL, flags & ~O_NONBLOCK) == -1) {
+    return -errno;
+  }
+  int pair[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) != 0) {
+    return -errno;
+  }
+  if ((flags & O_NONBLOCK) != 0) {
+    (void)fcntl(pair[1], F_SETFL, O_NONBLOCK);
+  }
+  relay_t *relay = malloc(sizeof(relay_t));
+  if (relay == nullptr) {
+    (void)close(pair[0]);
+    (void)close(pair[1]);
+    return -ENOMEM;
+  }
+  *relay = (relay_t){.tls = tls, .ssl = ssl, .client = client,
+                     .local = pair[0]};
+
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  pthread_mutex_lock(&tls->lock);
+  int rc = EAGAIN;
+  if (tls->relays < tls->relay_max) {
+    pthread_t thread;
+    rc = pthread_create(&thread, &attr, relay_entry, relay);
+  }
+  if (rc == 0) {
+    tls->relays++;
+  }
+  pthread_mutex_unlock(&tls->lock);
+  pthread_attr_destroy(&attr);
+  if (rc != 0) {
+    free(relay);
+    (void)close(pair[0]);
+    (void)close(pair[1]);
+    return -rc;
+  }
+
+  *plain = pair[1];
+  return 0;
+}
+
+// SSL_accept(), waiting on a coroutine's non-blocking socket as needed.
+static int handshake(SSL *ssl, int client) {
+  while (true) {
+    int rc = SSL_accept(ssl);
+    if (rc == 1 || !coro_active()) {
+      return rc;
+    }
+    int error = SSL_get_error(ssl, rc);
+    short events = error == SSL_ERROR_WANT_READ    ? POLLIN
+                   : error == SSL_ERROR_WANT_WRITE ? POLLOUT
+                                                   : 0;
+    if (events == 0 ||
+        coro_wait(client, events, TLS_IO_TIMEOUT * 1000) <= 0) {
+      return rc;
+    }
+  }
+}
+
+int tls_accept(tls_t *tls, int client, tls_session_t **out, int *plain) {
+  *out = nullptr;
+
+  // Bounds both the handshake and a client that stops reading later.
+  struct timeval timeout = {.tv_sec = TLS_IO_TIMEOUT};
+  (void)setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+                   sizeof(timeout));
+  (void)setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout,
+                   sizeof(timeout));
+
+  SSL *ssl = SSL_new(tls->ctx);
+  if (ssl == nullptr || SSL_set_fd(ssl, client) != 1) {
+    log_ssl("Cannot set up a TLS session");
+    SSL_free(ssl);
+    return -ENOMEM;
+  }
+  if (handshake(ssl, client) != 1) {
+    // Scanners and aborted handshakes are routine.
+    log_debug("TLS handshake failed");
+    ERR_clear_error();
+    SSL_free(ssl);
+    return -EPROTO;
+  }
+
+  bool offloaded = kernel_owns_records(ssl);
+  if (!atomic_exchange(&tls->reported, true)) {
+    if (offloaded) {
+      log_info("TLS records handled by the kernel");
+    } else {
+      log_warn("Kernel TLS unavailable, encrypting in user space");
+    }
+  }
+
+  if (offloaded) {
+    tls_session_t *session = malloc(sizeof(tls_session_t));
+    if (session == nullptr) {
+      SSL_free(ssl);
+      return -ENOMEM;
+    }
+    session->ssl = ssl;
+    *out = session;
+    *plain = client;
+    return 0;
+  }
+
+  int rc = relay_start(tls, ssl, client, plain);
+  if (rc != 0) {
+    log_warn("Cannot relay TLS connection: %s", strerror(-rc));
+    SSL_free(ssl);
+  }
+  return rc;
+}
+
+void tls_close(tls_session_t *session) {
+  if (session == nullptr) {
+    return;
+  }
+  // The kernel frames the alert; OpenSSL only decides to send it.
+  (void)SSL_shutdown(session->ssl);
+  ERR_clear_error();
+  SSL_free(session->ssl);
+  free(session);
+}
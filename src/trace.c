@@ -0,0 +1,213 @@
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#include "coro.h"
+#include "log.h"
+#include "response.h"
+#include "string_utils.h"
+#include "trace.h"
+
+enum {
+  LINE_MAX_LENGTH = 256,
+};
+
+typedef struct {
+  _Atomic uint64_t sequence; // Odd while being written, 0 before first use
+  trace_span_t span;
+} span_slot_t;
+
+struct trace {
+  size_t region_size;
+  unsigned sample;
+  _Atomic uint64_t next;
+  span_slot_t ring[TRACE_RING];
+};
+
+static thread_local unsigned unsampled;
+
+static const char *const phase_names[TRACE_PHASES] = {
+    "accept", "queue", "parse", "resolve", "open", "first", "close",
+};
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+trace_t *trace_create(unsigned sample) {
+  if (sample == 0) {
+    return nullptr;
+  }
+  void *region = mmap(nullptr, sizeof(trace_t), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (region == MAP_FAILED) {
+    log_error("Cannot map the span ring: %s", strerror(errno));
+    return nullptr;
+  }
+
+  trace_t *trace = region;
+  trace->region_size = sizeof(trace_t);
+  trace->sample = sample;
+  log_info("Tracing 1 in %u requests", sample);
+  return trace;
+}
+
+void trace_destroy(trace_t *trace) {
+  if (trace != nullptr) {
+    (void)munmap(trace, trace->region_size);
+  }
+}
+
+// Per coroutine, as several requests interleave on one worker thread.
+static void **current(void) {
+  return coro_local(CORO_LOCAL_TRACE);
+}
+
+void trace_begin(trace_t *trace, trace_span_t *span, uint64_t queued_at) {
+  *current() = nullptr;
+  if (trace == nullptr || ++unsampled < trace->sample) {
+    return;
+  }
+  unsampled = 0;
+  memset(span, 0, sizeof(*span));
+  span->at[TRACE_ACCEPT] = queued_at;
+  span->at[TRACE_DEQUEUE] = now_ns();
+  *current() = span;
+}
+
+void trace_mark(trace_phase_t phase) {
+  // Only the first time counts: later writes are not the first byte.
+  trace_span_t *span = *current();
+  if (span != nullptr && span->at[phase] == 0) {
+    span->at[phase] = now_ns();
+  }
+}
+
+void trace_set_path(string_view_t path) {
+  trace_span_t *span = *current();
+  if (span == nullptr) {
+    return;
+  }
+  size_t length = path.length < TRACE_PATH_MAX - 1 ? path.length
+                                                   : TRACE_PATH_MAX - 1;
+  memcpy(span->path, path.data, length);
+  span->path[length] = '\0';
+}
+
+void trace_end(trace_t *trace) {
+  trace_span_t *span = *current();
+  if (span == nullptr) {
+    return;
+  }
+  trace_mark(TRACE_CLOSE);
+  *current() = nullptr;
+
+  uint64_t index =
+      atomic_fetch_add_explicit(&trace->next, 1, memory_order_relaxed);
+  span_slot_t *slot = &trace->ring[index % TRACE_RING];
+  uint64_t sequence =
+      atomic_load_explicit(&slot->sequence, memory_order_relaxed);
+  // A writer lapped by a full ring is still in this slot; drop ours.
+  if ((sequence & 1) != 0 ||
+      !atomic_compare_exchange_strong_explicit(
+          &slot->sequence, &sequence, sequence + 1, memory_order_acquire,
+          memory_order_relaxed)) {
+    return;
+  }
+  atomic_thread_fence(memory_order_release);
+  slot->span = *span;
+  atomic_store_explicit(&slot->sequence, sequence + 2, memory_order_release);
+}
+
+static uint64_t total_ns(const trace_span_t *span) {
+  return span->at[TRACE_CLOSE] - span->at[TRACE_ACCEPT];
+}
+
+static int slowest_first(const void *a, const void *b) {
+  uint64_t lhs = total_ns(a);
+  uint64_t rhs = total_ns(b);
+  return (lhs < rhs) - (lhs > rhs);
+}
+
+static void write_line(response_t *response, const char *line, int length) {
+  if (length > 0) {
+    (void)response_write(response, line,
+                         (size_t)length < LINE_MAX_LENGTH ? (size_t)length
+                                                          : LINE_MAX_LENGTH);
+  }
+}
+
+int trace_dump(trace_t *trace, response_t *response) {
+  char line[LINE_MAX_LENGTH];
+  if (trace == nullptr) {
+    write_line(response, line,
+               snprintf(line, sizeof(line),
+                        "\nTracing is off, see --trace-sample\n"));
+    return 0;
+  }
+
+  trace_span_t *spans = malloc(sizeof(trace_span_t) * TRACE_RING);
+  if (spans == nullptr) {
+    return -ENOMEM;
+  }
+  size_t count = 0;
+  for (size_t i = 0; i < TRACE_RING; i++) {
+    span_slot_t *slot = &trace->ring[i];
+    uint64_t before =
+        atomic_load_explicit(&slot->sequence, memory_order_acquire);
+    if (before == 0 || (before & 1) != 0) {
+      continue;
+    }
+    spans[count] = slot->span;
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load_explicit(&slot->sequence, memory_order_relaxed) ==
+        before) {
+      count++;
+    }
+  }
+  qsort(spans, count, sizeof(trace_span_t), slowest_first);
+
+  size_t shown = count < TRACE_SLOWEST ? count : TRACE_SLOWEST;
+  write_line(response, line,
+             snprintf(line, sizeof(line),
+                      "\nSlowest %zu of %zu sampled requests, "
+                      "time spent before each phase in ms\n%9s",
+                      shown, count, "total"));
+  for (int phase = TRACE_DEQUEUE; phase < TRACE_PHASES; phase++) {
+    write_line(response, line,
+               snprintf(line, sizeof(line), " %8s", phase_names[phase]));
+  }
+  write_line(response, line, snprintf(line, sizeof(line), "  path\n"));
+
+  for (size_t i = 0; i < shown; i++) {
+    const trace_span_t *span = &spans[i];
+    write_line(response, line,
+               snprintf(line, sizeof(line), "%9.3f",
+                        (double)total_ns(span) / 1e6));
+    // Skipped phases show as "-" and their time goes to the next one.
+    uint64_t previous = span->at[TRACE_ACCEPT];
+    for (int phase = TRACE_DEQUEUE; phase < TRACE_PHASES; phase++) {
+      if (span->at[phase] == 0) {
+        write_line(response, line, snprintf(line, sizeof(line), " %8s", "-"));
+        continue;
+      }
+      write_line(response, line,
+                 snprintf(line, sizeof(line), " %8.3f",
+                          (double)(span->at[phase] - previous) / 1e6));
+      previous = span->at[phase];
+    }
+    write_line(response, line,
+               snprintf(line, sizeof(line), "  %s\n", span->path));
+  }
+
+  free(spans);
+  return 0;
+}
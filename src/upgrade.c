@@ -0,0 +1,228 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "upgrade.h"
+
+#define UPGRADE_ENV "HTTP_SERVER_UPGRADE_FD"
+
+static const char ready_byte = 'R';
+
+// Waits for a child whose channel is gone: it is already exiting, so this
+// does not block for long, and skipping it would leave a zombie.
+static void reap(pid_t pid) {
+  while (waitpid(pid, nullptr, 0) < 0 && errno == EINTR) {
+  }
+}
+
+static int send_fds(int channel, const int *fds, int count) {
+  uint32_t header = (uint32_t)count;
+  struct iovec iov = {.iov_base = &header, .iov_len = sizeof(header)};
+
+  union {
+    char buf[CMSG_SPACE(sizeof(int) * UPGRADE_MAX_FDS)];
+    struct cmsghdr align;
+  } control = {};
+
+  struct msghdr msg = {
+      .msg_iov = &iov,
+      .msg_iovlen = 1,
+      .msg_control = control.buf,
+      .msg_controllen = CMSG_SPACE(sizeof(int) * (size_t)count),
+  };
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int) * (size_t)count);
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * (size_t)count);
+
+  return sendmsg(channel, &msg, MSG_NOSIGNAL) < 0 ? -errno : 0;
+}
+
+static int recv_fds(int channel, int *fds, int max) {
+  uint32_t header = 0;
+  struct iovec iov = {.iov_base = &header, .iov_len = sizeof(header)};
+
+  union {
+    char buf[CMSG_SPACE(sizeof(int) * UPGRADE_MAX_FDS)];
+    struct cmsghdr align;
+  } control = {};
+
+  struct msghdr msg = {
+      .msg_iov = &iov,
+      .msg_iovlen = 1,
+      .msg_control = control.buf,
+      .msg_controllen = sizeof(control.buf),
+  };
+  if (recvmsg(channel, &msg, MSG_CMSG_CLOEXEC) != (ssize_t)sizeof(header)) {
+    return -EPROTO;
+  }
+
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  if (cmsg == nullptr || cmsg->cmsg_level != SOL_SOCKET ||
+      cmsg->cmsg_type != SCM_RIGHTS) {
+    return -EPROTO;
+  }
+
+  int count = (int)((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+  if (count != (int)header || count > max) {
+    return -EPROTO;
+  }
+  memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * (size_t)count);
+  return count;
+}
+
+// The environment of the new binary: ours with the channel's fd set. Built
+// before fork() since the child may only make async-signal-safe calls.
+static char **upgrade_environ(int channel, char *entry, size_t size) {
+  size_t count = 0;
+  while (environ[count] != nullptr) {
+    count++;
+  }
+  char **envp = calloc(count + 2, sizeof(char *));
+  if (envp == nullptr) {
+    return nullptr;
+  }
+
+  const size_t prefix = sizeof(UPGRADE_ENV "=") - 1;
+  size_t kept = 0;
+  for (size_t i = 0; i < count; i++) {
+    if (strncmp(environ[i], UPGRADE_ENV "=", prefix) != 0) {
+      envp[kept++] = environ[i];
+    }
+  }
+  (void)snprintf(entry, size, "%s=%d", UPGRADE_ENV, channel);
+  envp[kept] = entry;
+  return envp;
+}
+
+[[nodiscard]]
+int upgrade_begin(upgrade_t *upgrade, char *argv[], const int *fds,
+                  int count, const sigset_t *unblocked) {
+  if (upgrade->channel != -1) {
+    log_warn("Upgrade already in progress (pid %d)", upgrade->pid);
+    return -EBUSY;
+  }
+  if (count <= 0 || count > UPGRADE_MAX_FDS) {
+    return -EINVAL;
+  }
+
+  int pair[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) == -1) {
+    log_error("Upgrade socketpair failed: %s", strerror(errno));
+    return -errno;
+  }
+
+  char entry[sizeof(UPGRADE_ENV) + 16];
+  char **envp = upgrade_environ(pair[1], entry, sizeof(entry));
+  if (envp == nullptr) {
+    (void)close(pair[0]);
+    (void)close(pair[1]);
+    return -ENOMEM;
+  }
+
+  pid_t pid = fork();
+  if (pid == -1) {
+    int saved = errno;
+    log_error("Upgrade fork failed: %s", strerror(saved));
+    free(envp);
+    (void)close(pair[0]);
+    (void)close(pair[1]);
+    return -saved;
+  }
+
+  if (pid == 0) {
+    // exec keeps the signal mask: undo the accept thread's blocking, or the
+    // new binary would save it as its own unblocked mask. Only the channel
+    // crosses exec; listeners arrive through it.
+    (void)pthread_sigmask(SIG_SETMASK, unblocked, nullptr);
+    (void)fcntl(pair[1], F_SETFD, 0);
+    execvpe(argv[0], argv, envp);
+    _exit(127);
+  }
+
+  free(envp);
+  (void)close(pair[1]);
+  if (send_fds(pair[0], fds, count) != 0) {
+    log_error("Upgrade: cannot pass listeners to pid %d", pid);
+    (void)close(pair[0]);
+    reap(pid);
+    return -EIO;
+  }
+
+  upgrade->pid = pid;
+  upgrade->channel = pair[0];
+  log_info("Upgrade: spawned pid %d, waiting for it to warm up", pid);
+  return 0;
+}
+
+[[nodiscard]]
+int upgrade_finish(upgrade_t *upgrade) {
+  char byte = 0;
+  ssize_t got;
+  do {
+    got = read(upgrade->channel, &byte, 1);
+  } while (got < 0 && errno == EINTR);
+
+  (void)close(upgrade->channel);
+  upgrade->channel = -1;
+
+  if (got == 1 && byte == ready_byte) {
+    log_info("Upgrade: pid %d took over the listeners", upgrade->pid);
+    return 0;
+  }
+
+  log_error("Upgrade: pid %d exited before becoming ready", upgrade->pid);
+  reap(upgrade->pid);
+  return -ECHILD;
+}
+
+[[nodiscard]]
+int upgrade_inherit(int *fds, int max, int *channel) {
+  const char *value = getenv(UPGRADE_ENV);
+  *channel = -1;
+  if (value == nullptr) {
+    return 0;
+  }
+
+  char *endptr;
+  long fd = strtol(value, &endptr, 10);
+  if (endptr == value || *endptr != '\0' || fd < 0 || fd > INT32_MAX) {
+    log_error("Upgrade: bad %s=\"%s\"", UPGRADE_ENV, value);
+    (void)unsetenv(UPGRADE_ENV);
+    return -EINVAL;
+  }
+  (void)unsetenv(UPGRADE_ENV);
+
+  (void)fcntl((int)fd, F_SETFD, FD_CLOEXEC);
+  int count = recv_fds((int)fd, fds, max);
+  if (count <= 0) {
+    log_error("Upgrade: no listeners received from the old process");
+    (void)close((int)fd);
+    return count < 0 ? count : -EPROTO;
+  }
+
+  *channel = (int)fd;
+  log_info("Upgrade: inherited %d listener(s) from pid %d", count, getppid());
+  return count;
+}
+
+void upgrade_ready(int channel) {
+  if (channel < 0) {
+    return;
+  }
+  if (write(channel, &ready_byte, 1) != 1) {
+    log_warn("Upgrade: cannot signal readiness: %s", strerror(errno));
+  }
+  (void)close(channel);
+}
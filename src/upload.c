@@ -0,0 +1,428 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "coro.h"
+#include "file.h"
+#include "http.h"
+#include "log.h"
+#include "socket.h"
+#include "string_utils.h"
+#include "upload.h"
+#include "worker_memory.h"
+
+enum {
+  TEMP_NAME_MAX = 64,
+};
+
+struct upload_route {
+  string_view_t prefix;
+  int dir; // The target directory, everything is opened relative to it
+  size_t limit;
+};
+
+struct uploads {
+  upload_route_t routes[UPLOAD_MAX_ROUTES];
+  int route_count;
+};
+
+// The body being received. Bytes read past what was consumed stay in the
+// buffer and are written before anything is spliced.
+typedef struct {
+  int client;
+  int file;
+  char *buffer;
+  size_t start;
+  size_t end;
+  size_t capacity;
+  const int *pipe_fds;
+  bool pipe_dirty;
+} body_t;
+
+static const char created[] = "HTTP/1.0 201 CREATED\n\nCreated";
+static const char bad_request[] = "HTTP/1.0 400 BAD REQUEST\n\nBad Request";
+static const char forbidden[] = "HTTP/1.0 403 FORBIDDEN\n\nForbidden";
+static const char length_required[] =
+    "HTTP/1.0 411 LENGTH REQUIRED\n\nLength Required";
+static const char too_large[] =
+    "HTTP/1.0 413 PAYLOAD TOO LARGE\n\nPayload Too Large";
+static const char server_error[] =
+    "HTTP/1.0 500 INTERNAL SERVER ERROR\n\nInternal Server Error";
+static const char go_on[] = "HTTP/1.1 100 Continue\r\n\r\n";
+
+static thread_local unsigned temp_counter;
+
+int uploads_create(const server_config_t *config, uploads_t **out) {
+  *out = nullptr;
+  if (config->upload_route_count == 0) {
+    return 0;
+  }
+
+  uploads_t *uploads = calloc(1, sizeof(uploads_t));
+  if (uploads == nullptr) {
+    log_error("OOM allocating upload routes");
+    return -1;
+  }
+
+  for (int i = 0; i < config->upload_route_count; i++) {
+    const char *spec = config->upload_routes[i];
+    const char *equals = strchr(spec, '=');
+    if (equals == nullptr || equals == spec || spec[0] != '/') {
+      log_error("Invalid upload route \"%s\"", spec);
+      uploads_destroy(uploads);
+      return -1;
+    }
+
+    upload_route_t *route = &uploads->routes[uploads->route_count];
+    route->prefix = (string_view_t){.data = spec,
+                                    .length = (size_t)(equals - spec)};
+    route->limit = config->upload_limit;
+    route->dir = open(equals + 1, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (route->dir == -1) {
+      log_error("Cannot open upload directory \"%s\": %s", equals + 1,
+                strerror(errno));
+      uploads_destroy(uploads);
+      return -1;
+    }
+    uploads->route_count++;
+    log_info("Uploads to %.*s go to %s (at most %zu bytes)",
+             (int)route->prefix.length, route->prefix.data, equals + 1,
+             route->limit);
+  }
+
+  *out = uploads;
+  return 0;
+}
+
+void uploads_destroy(uploads_t *uploads) {
+  if (uploads == nullptr) {
+    return;
+  }
+  for (int i = 0; i < uploads->route_count; i++) {
+    (void)close(uploads->routes[i].dir);
+  }
+  free(uploads);
+}
+
+upload_route_t *upload_match(uploads_t *uploads, string_view_t path) {
+  if (uploads == nullptr) {
+    return nullptr;
+  }
+
+  upload_route_t *best = nullptr;
+  for (int i = 0; i < uploads->route_count; i++) {
+    upload_route_t *route = &uploads->routes[i];
+    string_view_t prefix = route->prefix;
+    if (!sv_starts_with(path, prefix)) {
+      continue;
+    }
+    // "/up" takes "/up/x" but not "/upx".
+    bool boundary = prefix.data[prefix.length - 1] == '/' ||
+                    path.length == prefix.length ||
+                    path.data[prefix.length] == '/';
+    if (boundary && (best == nullptr || prefix.length > best->prefix.length)) {
+      best = route;
+    }
+  }
+  return best;
+}
+
+static bool valid_segment(const char *segment) {
+  return segment[0] != '\0' && strcmp(segment, ".") != 0 &&
+         strcmp(segment, "..") != 0;
+}
+
+// Opens the directory that will hold name, creating missing ones. Every
+// component is opened relative to the previous one with O_NOFOLLOW, so
+// neither ".." nor a symlink planted in the tree leads outside of it.
+static int open_parent(int root, char *name, const char **leaf) {
+  // Split and check everything first, so a bad path creates nothing.
+  char *segment = name;
+  for (char *slash; (slash = strchr(segment, '/')) != nullptr;) {
+    *slash = '\0';
+    if (!valid_segment(segment)) {
+      return -1;
+    }
+    segment = slash + 1;
+  }
+  if (!valid_segment(segment)) {
+    return -1;
+  }
+  *leaf = segment;
+
+  int dir = openat(root, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  for (segment = name; dir != -1 && segment != *leaf;
+       segment += strlen(segment) + 1) {
+    int next = -1;
+    if (mkdirat(dir, segment, 0755) == 0 || errno == EEXIST) {
+      next = openat(dir, segment,
+                    O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    }
+    (void)close(dir);
+    dir = next;
+  }
+  return dir;
+}
+
+static int body_fill(body_t *body) {
+  if (body->start > 0) {
+    memmove(body->buffer, body->buffer + body->start,
+            body->end - body->start);
+    body->end -= body->start;
+    body->start = 0;
+  }
+  if (body->end == body->capacity) {
+    return -1; // A line longer than the whole buffer
+  }
+
+  ssize_t length;
+  do {
+    length = coro_read(body->client, body->buffer + body->end,
+                       body->capacity - body->end);
+  } while (length < 0 && errno == EINTR);
+  if (length <= 0) {
+    return -1;
+  }
+  body->end += (size_t)length;
+  return 0;
+}
+
+// The next line without its line ending.
+static int body_line(body_t *body, string_view_t *line) {
+  for (;;) {
+    const char *newline = memchr(body->buffer + body->start, '\n',
+                                 body->end - body->start);
+    if (newline != nullptr) {
+      size_t length = (size_t)(newline - (body->buffer + body->start));
+      *line = (string_view_t){body->buffer + body->start, length};
+      if (length > 0 && line->data[length - 1] == '\r') {
+        line->length--;
+      }
+      body->start += length + 1;
+      return 0;
+    }
+    if (body_fill(body) != 0) {
+      return -1;
+    }
+  }
+}
+
+// Moves length body bytes to the file: buffered ones with write(), the rest
+// straight from the socket with splice().
+static int body_store(body_t *body, size_t length) {
+  size_t buffered = body->end - body->start;
+  if (buffered > length) {
+    buffered = length;
+  }
+  if (buffered > 0 &&
+      socket_write_all(body->file, body->buffer + body->start, buffered) !=
+          0) {
+    return -1;
+  }
+  body->start += buffered;
+  length -= buffered;
+  if (length == 0) {
+    return 0;
+  }
+
+  ssize_t moved = socket_splice(body->client, body->file, length,
+                                body->pipe_fds);
+  if (moved < 0) {
+    body->pipe_dirty = true;
+  }
+  return moved == (ssize_t)length ? 0 : -1;
+}
+
+static int parse_chunk_size(string_view_t line, size_t *out) {
+  size_t size = 0;
+  size_t digits = 0;
+  for (; digits < line.length; digits++) {
+    char c = line.data[digits];
+    unsigned value;
+    if (c >= '0' && c <= '9') {
+      value = (unsigned)(c - '0');
+    } else if (c >= 'a' && c <= 'f') {
+      value = (unsigned)(c - 'a' + 10);
+    } else if (c >= 'A' && c <= 'F') {
+      value = (unsigned)(c - 'A' + 10);
+    } else {
+      break;
+    }
+    if (size > (SIZE_MAX >> 4)) {
+      return -1;
+    }
+    size = size << 4 | value;
+  }
+  // Chunk extensions after ';' are allowed and ignored.
+  if (digits == 0 ||
+      (digits < line.length && line.data[digits] != ';' &&
+       line.data[digits] != ' ' && line.data[digits] != '\t')) {
+    return -1;
+  }
+  *out = size;
+  return 0;
+}
+
+static int receive_chunked(body_t *body, size_t limit, const char **reply) {
+  size_t total = 0;
+  string_view_t line;
+  for (;;) {
+    size_t size;
+    if (body_line(body, &line) != 0 || parse_chunk_size(line, &size) != 0) {
+      *reply = bad_request;
+      return -1;
+    }
+    if (size == 0) {
+      break;
+    }
+    if (size > limit - total) {
+      *reply = too_large;
+      return -1;
+    }
+    total += size;
+    if (body_store(body, size) != 0) {
+      return -1;
+    }
+    if (body_line(body, &line) != 0 || line.length != 0) {
+      *reply = bad_request;
+      return -1;
+    }
+  }
+
+  // Trailer fields are read and dropped.
+  do {
+    if (body_line(body, &line) != 0) {
+      *reply = bad_request;
+      return -1;
+    }
+  } while (line.length > 0);
+  return 0;
+}
+
+static int receive(body_t *body, const http_request_t *request,
+                   bool chunked, size_t length, size_t limit,
+                   const char **reply) {
+  // Only ask for the body once it is certain to be accepted.
+  bool more = chunked || length > body->end - body->start;
+  if (more && http_find_header(request, HTTP_TOKEN(EXPECT)) != nullptr &&
+      socket_write_all(body->client, go_on, sizeof(go_on) - 1) != 0) {
+    return -1;
+  }
+
+  if (chunked) {
+    return receive_chunked(body, limit, reply);
+  }
+  // Best effort: fewer extents for large artifacts, no effect elsewhere.
+  if (length > 0) {
+    (void)posix_fallocate(body->file, 0, (off_t)length);
+  }
+  return body_store(body, length);
+}
+
+int upload_receive(upload_route_t *route, worker_memory_t *worker, int client,
+                   const http_request_t *request, string_view_t received) {
+  bool chunked = http_headers_chunked(request->headers, request->header_count);
+  size_t length = 0;
+  int framing = chunked ? 0
+                        : http_headers_content_length(request->headers,
+                                                      request->header_count,
+                                                      &length);
+  const char *reply = nullptr;
+  if (framing < 0) {
+    reply = bad_request;
+  } else if (framing > 0) {
+    reply = length_required;
+  } else if (length > route->limit) {
+    reply = too_large;
+  }
+
+  string_view_t relative =
+      sv_slice(request->path, route->prefix.length, SV_NPOS);
+  while (relative.length > 0 && relative.data[0] == '/') {
+    relative = sv_slice(relative, 1, SV_NPOS);
+  }
+  char name[UPLOAD_NAME_MAX];
+  const char *leaf = nullptr;
+  int dir = -1;
+  if (reply == nullptr &&
+      (relative.length == 0 ||
+       path_decode(relative, name, sizeof(name)) != 0 ||
+       (dir = open_parent(route->dir, name, &leaf)) == -1)) {
+    reply = forbidden;
+  }
+
+  char temp[TEMP_NAME_MAX];
+  int file = -1;
+  if (reply == nullptr) {
+    (void)snprintf(temp, sizeof(temp), ".upload.%d.%lx.%u", (int)getpid(),
+                   (unsigned long)pthread_self(), temp_counter++);
+    file = openat(dir, temp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (file == -1) {
+      log_error("Cannot create an upload file: %s", strerror(errno));
+      reply = server_error;
+    }
+  }
+
+  char *buffer = reply == nullptr ? worker_memory_buffer_get(worker) : nullptr;
+  int *pipe_fds = buffer != nullptr ? worker_memory_pipe_get(worker) : nullptr;
+  if (reply == nullptr && pipe_fds == nullptr) {
+    reply = server_error;
+  }
+
+  int rc = -1;
+  body_t body = {.client = client,
+                 .file = file,
+                 .buffer = buffer,
+                 .capacity = WORKER_BUFFER_SIZE,
+                 .pipe_fds = pipe_fds};
+  if (reply == nullptr) {
+    // A client that stops sending must not hold the worker forever.
+    struct timeval timeout = {.tv_sec = UPLOAD_IO_TIMEOUT};
+    (void)setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+                     sizeof(timeout));
+
+    string_view_t early =
+        sv_slice(received, request->header_length, SV_NPOS);
+    memcpy(buffer, early.data, early.length);
+    body.end = early.length;
+    rc = receive(&body, request, chunked, length, route->limit, &reply);
+    if (rc == 0 && renameat(dir, temp, dir, leaf) != 0) {
+      log_error("Cannot store upload \"%.*s\": %s", (int)relative.length,
+                relative.data, strerror(errno));
+      rc = -1;
+    }
+    if (rc != 0) {
+      (void)unlinkat(dir, temp, 0);
+    } else {
+      log_debug("Stored upload \"%.*s\"", (int)relative.length,
+                relative.data);
+    }
+  }
+
+  if (rc == 0) {
+    reply = created;
+  } else if (reply == nullptr) {
+    reply = server_error;
+  }
+  (void)socket_write_all(client, reply, strlen(reply));
+
+  if (file != -1) {
+    (void)close(file);
+  }
+  if (dir != -1) {
+    (void)close(dir);
+  }
+  if (pipe_fds != nullptr) {
+    worker_memory_pipe_put(worker, pipe_fds, !body.pipe_dirty);
+  }
+  worker_memory_buffer_put(worker, buffer);
+  return rc;
+}
@@ -0,0 +1,279 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "file_cache.h"
+#include "log.h"
+#include "string_utils.h"
+#include "warmup.h"
+
+enum {
+  WARMUP_MAX_THREADS = 64,
+  WARMUP_MAX_DEPTH = 32,
+};
+
+typedef struct {
+  char *path; // Relative to the root
+  size_t size;
+  uint64_t hits;
+} warm_file_t;
+
+typedef struct {
+  warm_file_t *items;
+  size_t count;
+  size_t capacity;
+} warm_list_t;
+
+struct warmup {
+  file_cache_t *cache;
+  const string_t *root;
+  warm_list_t files;
+  _Atomic size_t next;
+  _Atomic size_t loaded;
+  struct timespec started;
+  int thread_count;
+  pthread_t threads[WARMUP_MAX_THREADS];
+};
+
+static int list_push(warm_list_t *list, const char *path, size_t size) {
+  if (list->count == list->capacity) {
+    size_t capacity = list->capacity == 0 ? 256 : list->capacity * 2;
+    warm_file_t *items = realloc(list->items, capacity * sizeof(warm_file_t));
+    if (items == nullptr) {
+      return -ENOMEM;
+    }
+    list->items = items;
+    list->capacity = capacity;
+  }
+
+  char *copy = strdup(path);
+  if (copy == nullptr) {
+    return -ENOMEM;
+  }
+  list->items[list->count++] = (warm_file_t){.path = copy, .size = size};
+  return 0;
+}
+
+static void list_free(warm_list_t *list) {
+  for (size_t i = 0; i < list->count; i++) {
+    free(list->items[i].path);
+  }
+  free(list->items);
+  *list = (warm_list_t){};
+}
+
+// Symlinks are not followed, so every collected path is already canonical.
+static int walk(warm_list_t *list, int dir_fd, char *rel, size_t rel_len,
+                int depth) {
+  if (depth > WARMUP_MAX_DEPTH) {
+    (void)close(dir_fd);
+    return 0;
+  }
+
+  DIR *dir = fdopendir(dir_fd);
+  if (dir == nullptr) {
+    (void)close(dir_fd);
+    return -errno;
+  }
+
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != nullptr) {
+    const char *name = entry->d_name;
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+      continue;
+    }
+
+    size_t name_len = strlen(name);
+    size_t sep = rel_len > 0 ? 1 : 0;
+    if (rel_len + sep + name_len >= PATH_MAX) {
+      continue;
+    }
+    if (sep) {
+      rel[rel_len] = '/';
+    }
+    memcpy(rel + rel_len + sep, name, name_len + 1);
+
+    struct stat st;
+    if (fstatat(dirfd(dir), name, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+      continue;
+    }
+    if (S_ISREG(st.st_mode)) {
+      if (list_push(list, rel, (size_t)st.st_size) != 0) {
+        (void)closedir(dir);
+        return -ENOMEM;
+      }
+    } else if (S_ISDIR(st.st_mode)) {
+      int child = openat(dirfd(dir), name,
+                         O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+      if (child != -1) {
+        (void)walk(list, child, rel, rel_len + sep + name_len, depth + 1);
+      }
+    }
+  }
+  rel[rel_len] = '\0';
+
+  (void)closedir(dir);
+  return 0;
+}
+
+static int compare_path(const void *a, const void *b) {
+  return strcmp(((const warm_file_t *)a)->path,
+                ((const warm_file_t *)b)->path);
+}
+
+// Hottest first; among equally hot files the small ones, to fit more of them.
+static int compare_priority(const void *a, const void *b) {
+  const warm_file_t *lhs = a;
+  const warm_file_t *rhs = b;
+  if (lhs->hits != rhs->hits) {
+    return lhs->hits < rhs->hits ? 1 : -1;
+  }
+  return (lhs->size > rhs->size) - (lhs->size < rhs->size);
+}
+
+static void apply_snapshot(warm_list_t *list, const char *snapshot_path) {
+  if (snapshot_path == nullptr) {
+    return;
+  }
+  FILE *file = fopen(snapshot_path, "r");
+  if (file == nullptr) {
+    log_info("No hot snapshot at \"%s\": %s", snapshot_path, strerror(errno));
+    return;
+  }
+
+  qsort(list->items, list->count, sizeof(warm_file_t), compare_path);
+
+  char line[PATH_MAX + 32];
+  size_t matched = 0;
+  while (fgets(line, sizeof(line), file) != nullptr) {
+    char *endptr;
+    unsigned long long hits = strtoull(line, &endptr, 10);
+    if (endptr == line || *endptr != '\t') {
+      continue;
+    }
+    char *path = endptr + 1;
+    path[strcspn(path, "\n")] = '\0';
+
+    warm_file_t key = {.path = path};
+    warm_file_t *found = bsearch(&key, list->items, list->count,
+                                 sizeof(warm_file_t), compare_path);
+    if (found != nullptr) {
+      found->hits = hits;
+      matched++;
+    }
+  }
+  (void)fclose(file);
+
+  log_info("Hot snapshot: %zu known files", matched);
+}
+
+static void *warmup_entry(void *arg) {
+  warmup_t *warmup = (warmup_t *)arg;
+  char path[PATH_MAX];
+
+  while (true) {
+    size_t i = atomic_fetch_add(&warmup->next, 1);
+    if (i >= warmup->files.count) {
+      break;
+    }
+
+    // Past the budget smaller files further down may still fit, keep going.
+    const warm_file_t *file = &warmup->files.items[i];
+    if (file->size >= file_cache_available(warmup->cache)) {
+      continue;
+    }
+    int n = snprintf(path, sizeof(path), "%s/%s", warmup->root->data,
+                     file->path);
+    if (n < 0 || (size_t)n >= sizeof(path)) {
+      continue;
+    }
+
+    string_t key = {.data = path, .length = (size_t)n};
+    uint64_t pin = file_cache_enter(warmup->cache);
+    if (file_cache_load(warmup->cache, nullptr, &key, nullptr) == 0) {
+      atomic_fetch_add(&warmup->loaded, 1);
+    }
+    file_cache_leave(warmup->cache, pin);
+  }
+
+  return nullptr;
+}
+
+[[nodiscard]]
+warmup_t *warmup_start(file_cache_t *cache, const string_t *root,
+                       const char *snapshot_path, int threads) {
+  if (cache == nullptr || root == nullptr) {
+    return nullptr;
+  }
+
+  warmup_t *warmup = calloc(1, sizeof(warmup_t));
+  if (warmup == nullptr) {
+    return nullptr;
+  }
+  warmup->cache = cache;
+  warmup->root = root;
+  (void)clock_gettime(CLOCK_MONOTONIC, &warmup->started);
+
+  int root_fd = open(root->data, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  char rel[PATH_MAX] = "";
+  if (root_fd == -1 || walk(&warmup->files, root_fd, rel, 0, 0) != 0) {
+    log_error("Warm-up cannot walk \"%s\": %s", root->data, strerror(errno));
+    list_free(&warmup->files);
+    free(warmup);
+    return nullptr;
+  }
+
+  apply_snapshot(&warmup->files, snapshot_path);
+  qsort(warmup->files.items, warmup->files.count, sizeof(warm_file_t),
+        compare_priority);
+
+  if (threads < 1) {
+    threads = 1;
+  } else if (threads > WARMUP_MAX_THREADS) {
+    threads = WARMUP_MAX_THREADS;
+  }
+  for (int i = 0; i < threads; i++) {
+    if (pthread_create(&warmup->threads[i], nullptr, warmup_entry, warmup) !=
+        0) {
+      log_warn("Warm-up: failed to spawn loader %d", i);
+      break;
+    }
+    warmup->thread_count++;
+  }
+  if (warmup->thread_count == 0) {
+    (void)warmup_entry(warmup);
+  }
+
+  log_info("Warm-up: %zu files found, loading with %d threads",
+           warmup->files.count, warmup->thread_count);
+  return warmup;
+}
+
+void warmup_wait(warmup_t *warmup) {
+  if (warmup == nullptr) {
+    return;
+  }
+  for (int i = 0; i < warmup->thread_count; i++) {
+    pthread_join(warmup->threads[i], nullptr);
+  }
+
+  struct timespec now;
+  (void)clock_gettime(CLOCK_MONOTONIC, &now);
+  double elapsed = (double)(now.tv_sec - warmup->started.tv_sec) +
+                   (double)(now.tv_nsec - warmup->started.tv_nsec) / 1e9;
+  log_info("Warm-up: %zu files, %zu bytes cached in %.3fs",
+           atomic_load(&warmup->loaded), file_cache_used(warmup->cache),
+           elapsed);
+
+  list_free(&warmup->files);
+  free(warmup);
+}
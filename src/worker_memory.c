@@ -0,0 +1,271 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/mempolicy.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "config.h"
+#include "log.h"
+#include "worker_memory.h"
+
+enum {
+  CACHE_LINE = 64,
+  HUGE_PAGE_SIZE = 2 * 1024 * 1024,
+  MAX_NUMA_NODES = 1024,
+};
+
+// The pool arrays follow the struct in the same mapping.
+struct worker_memory {
+  size_t region_size;
+  int cpu;
+  int node;
+  int arena_count;
+  int pipe_count;
+  arena_t *arenas;
+  arena_t **free_arenas;
+  int free_arena_count;
+  char *free_buffers; // Intrusive list, next pointer in the first bytes
+  int (*pipes)[2];
+  int **free_pipes;
+  int free_pipe_count;
+  unsigned char *arena_base;
+  unsigned char *buffer_base;
+};
+
+static size_t align_to(size_t size, size_t align) {
+  return (size + align - 1) & ~(align - 1);
+}
+
+// Worker n gets the n-th CPU this process may run on.
+static int pin_current_thread(int worker_id) {
+  cpu_set_t allowed;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+    return -1;
+  }
+
+  int count = CPU_COUNT(&allowed);
+  if (count == 0) {
+    return -1;
+  }
+
+  int wanted = worker_id % count;
+  for (size_t cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (!CPU_ISSET(cpu, &allowed) || wanted-- != 0) {
+      continue;
+    }
+    cpu_set_t one;
+    CPU_ZERO(&one);
+    CPU_SET(cpu, &one);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(one), &one) != 0) {
+      return -1;
+    }
+    return (int)cpu;
+  }
+  return -1;
+}
+
+static void *map_region(size_t *size, huge_pages_t huge_pages) {
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+
+  if (huge_pages != HUGE_PAGES_NONE) {
+    *size = align_to(*size, HUGE_PAGE_SIZE);
+  }
+  if (huge_pages == HUGE_PAGES_EXPLICIT) {
+    void *region = mmap(nullptr, *size, PROT_READ | PROT_WRITE,
+                        flags | MAP_HUGETLB, -1, 0);
+    if (region != MAP_FAILED) {
+      return region;
+    }
+    log_warn("MAP_HUGETLB failed (%s), using regular pages", strerror(errno));
+  }
+
+  void *region = mmap(nullptr, *size, PROT_READ | PROT_WRITE, flags, -1, 0);
+  if (region == MAP_FAILED) {
+    return nullptr;
+  }
+  if (huge_pages == HUGE_PAGES_THP) {
+    (void)madvise(region, *size, MADV_HUGEPAGE);
+  }
+  return region;
+}
+
+// Binding is a preference: if the node is full the kernel falls back.
+static void bind_to_node(void *region, size_t size, int node) {
+  unsigned long mask[MAX_NUMA_NODES / 64] = {};
+  if (node < 0 || (size_t)node >= sizeof(mask) * 8) {
+    return;
+  }
+  mask[node / 64] = 1UL << (node % 64);
+  if (syscall(SYS_mbind, region, size, MPOL_PREFERRED, mask,
+              sizeof(mask) * 8, 0) != 0) {
+    log_debug("mbind to node %d failed: %s", node, strerror(errno));
+  }
+}
+
+[[nodiscard]]
+worker_memory_t *worker_memory_create(int worker_id,
+                                      const server_config_t *config) {
+  int cpu = config->pin_workers ? pin_current_thread(worker_id) : -1;
+  unsigned current_cpu = 0;
+  unsigned node = 0;
+  if (getcpu(&current_cpu, &node) != 0) {
+    node = 0;
+  }
+
+  // Each coroutine may hold an arena, two buffers and a pipe at once.
+  int coroutines = (int)config->coroutines;
+  int arena_count = coroutines > WORKER_ARENAS ? coroutines : WORKER_ARENAS;
+  int buffer_count =
+      2 * coroutines > WORKER_BUFFERS ? 2 * coroutines : WORKER_BUFFERS;
+  int pipe_count = coroutines > WORKER_PIPES ? coroutines : WORKER_PIPES;
+
+  size_t header = align_to(
+      sizeof(worker_memory_t) +
+          (size_t)arena_count * (sizeof(arena_t) + sizeof(arena_t *)) +
+          (size_t)pipe_count * (sizeof(int[2]) + sizeof(int *)),
+      CACHE_LINE);
+  size_t arena_size = align_to(ARENA_MAX_SIZE, CACHE_LINE);
+  size_t size = header + (size_t)arena_count * arena_size +
+                (size_t)buffer_count * WORKER_BUFFER_SIZE;
+
+  void *region = map_region(&size, config->huge_pages);
+  if (region == nullptr) {
+    log_error("Worker %d: cannot map %zu bytes: %s", worker_id, size,
+              strerror(errno));
+    return nullptr;
+  }
+  if (cpu >= 0) {
+    bind_to_node(region, size, (int)node);
+  }
+  // First touch after pinning and binding places every page now, not under
+  // the first request.
+  memset(region, 0, size);
+
+  worker_memory_t *memory = (worker_memory_t *)region;
+  memory->region_size = size;
+  memory->cpu = cpu;
+  memory->node = (int)node;
+  memory->arena_count = arena_count;
+  memory->pipe_count = pipe_count;
+  memory->arenas = (arena_t *)(memory + 1);
+  memory->free_arenas = (arena_t **)(memory->arenas + arena_count);
+  memory->pipes = (int(*)[2])(memory->free_arenas + arena_count);
+  memory->free_pipes = (int **)(memory->pipes + pipe_count);
+  memory->arena_base = (unsigned char *)region + header;
+  memory->buffer_base = memory->arena_base + (size_t)arena_count * arena_size;
+
+  for (int i = 0; i < arena_count; i++) {
+    arena_init(&memory->arenas[i], memory->arena_base + (size_t)i * arena_size,
+               ARENA_MAX_SIZE);
+    memory->free_arenas[i] = &memory->arenas[i];
+  }
+  memory->free_arena_count = arena_count;
+
+  memory->free_buffers = nullptr;
+  for (int i = buffer_count - 1; i >= 0; i--) {
+    char *buffer =
+        (char *)memory->buffer_base + (size_t)i * WORKER_BUFFER_SIZE;
+    worker_memory_buffer_put(memory, buffer);
+  }
+
+  for (int i = 0; i < pipe_count; i++) {
+    memory->pipes[i][0] = -1;
+    memory->pipes[i][1] = -1;
+    memory->free_pipes[i] = memory->pipes[i];
+  }
+  memory->free_pipe_count = pipe_count;
+
+  log_info("Worker %d: cpu %d, node %d, %zu bytes of local memory", worker_id,
+           cpu, memory->node, size);
+  return memory;
+}
+
+void worker_memory_destroy(worker_memory_t *memory) {
+  if (memory == nullptr) {
+    return;
+  }
+  for (int i = 0; i < memory->pipe_count; i++) {
+    if (memory->pipes[i][0] != -1) {
+      (void)close(memory->pipes[i][0]);
+      (void)close(memory->pipes[i][1]);
+    }
+  }
+  (void)munmap(memory, memory->region_size);
+}
+
+[[nodiscard]]
+arena_t *worker_memory_arena_get(worker_memory_t *memory) {
+  if (memory->free_arena_count == 0) {
+    log_warn("Worker arena pool exhausted");
+    return nullptr;
+  }
+  return memory->free_arenas[--memory->free_arena_count];
+}
+
+void worker_memory_arena_put(worker_memory_t *memory, arena_t *arena) {
+  if (arena == nullptr) {
+    return;
+  }
+  arena_reset(arena);
+  memory->free_arenas[memory->free_arena_count++] = arena;
+}
+
+[[nodiscard]]
+char *worker_memory_buffer_get(worker_memory_t *memory) {
+  char *buffer = memory->free_buffers;
+  if (buffer == nullptr) {
+    log_warn("Worker buffer pool exhausted");
+    return nullptr;
+  }
+  memcpy(&memory->free_buffers, buffer, sizeof(char *));
+  return buffer;
+}
+
+void worker_memory_buffer_put(worker_memory_t *memory, char *buffer) {
+  if (buffer == nullptr) {
+    return;
+  }
+  memcpy(buffer, &memory->free_buffers, sizeof(char *));
+  memory->free_buffers = buffer;
+}
+
+[[nodiscard]]
+int *worker_memory_pipe_get(worker_memory_t *memory) {
+  if (memory->free_pipe_count == 0) {
+    log_warn("Worker pipe pool exhausted");
+    return nullptr;
+  }
+
+  int *pipe_fds = memory->free_pipes[memory->free_pipe_count - 1];
+  if (pipe_fds[0] == -1) {
+    if (pipe2(pipe_fds, O_CLOEXEC) == -1) {
+      log_error("Cannot create pipe: %s", strerror(errno));
+      return nullptr;
+    }
+    // A larger pipe moves more per splice() pair; the default is 64 KiB.
+    (void)fcntl(pipe_fds[1], F_SETPIPE_SZ, WORKER_PIPE_SIZE);
+  }
+  memory->free_pipe_count--;
+  return pipe_fds;
+}
+
+void worker_memory_pipe_put(worker_memory_t *memory, int *pipe_fds,
+                            bool clean) {
+  if (pipe_fds == nullptr) {
+    return;
+  }
+  if (!clean) {
+    (void)close(pipe_fds[0]);
+    (void)close(pipe_fds[1]);
+    pipe_fds[0] = -1;
+    pipe_fds[1] = -1;
+  }
+  memory->free_pipes[memory->free_pipe_count++] = pipe_fds;
+}
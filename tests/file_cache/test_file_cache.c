@@ -0,0 +1,242 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "file.h"
+#include "file_cache.h"
+#include "string_utils.h"
+#include "unity.h"
+
+enum {
+  BUDGET = 16 * 1024,
+  FILE_SIZE = 3000, // Five fit in BUDGET, six do not
+  FILE_COUNT = 6,
+};
+
+static char directory[] = "/tmp/test_file_cache.XXXXXX";
+static char paths[FILE_COUNT][128];
+static string_t names[FILE_COUNT];
+static file_cache_t *cache;
+static uint64_t pin;
+
+// Fills paths[i] with size bytes of fill.
+static void write_file(int i, char fill, size_t size) {
+  char *data = malloc(size);
+  memset(data, fill, size);
+  FILE *file = fopen(paths[i], "wb");
+  TEST_ASSERT_NOT_NULL(file);
+  TEST_ASSERT_EQUAL_size_t(size, fwrite(data, 1, size, file));
+  TEST_ASSERT_EQUAL_INT(0, fclose(file));
+  free(data);
+}
+
+void setUp(void) {
+  TEST_ASSERT_NOT_NULL(
+      mkdtemp(strcpy(directory, "/tmp/test_file_cache.XXXXXX")));
+  for (int i = 0; i < FILE_COUNT; i++) {
+    (void)snprintf(paths[i], sizeof(paths[i]), "%s/file%d", directory, i);
+    names[i] = (string_t){.data = paths[i], .length = strlen(paths[i])};
+    write_file(i, (char)('a' + i), FILE_SIZE);
+  }
+  cache = file_cache_create(BUDGET, false);
+  TEST_ASSERT_NOT_NULL(cache);
+  pin = file_cache_enter(cache);
+}
+
+static int remove_entry(const char *path, const struct stat *info, int type,
+                        struct FTW *walk) {
+  (void)info;
+  (void)type;
+  (void)walk;
+  return remove(path);
+}
+
+void tearDown(void) {
+  file_cache_leave(cache, pin);
+  file_cache_destroy(cache);
+  (void)nftw(directory, remove_entry, 8, FTW_DEPTH | FTW_PHYS);
+}
+
+// Whether file holds size bytes of fill.
+static bool holds(file_t file, char fill, size_t size) {
+  if (file.length != size) {
+    return false;
+  }
+  for (size_t i = 0; i < size; i++) {
+    if (file.data[i] != (uint8_t)fill) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static void test_disabled(void) {
+  TEST_ASSERT_NULL(file_cache_create(0, false));
+  file_t file;
+  TEST_ASSERT_FALSE(file_cache_get(nullptr, &names[0], &file));
+  TEST_ASSERT_EQUAL_INT(-EINVAL,
+                        file_cache_load(nullptr, nullptr, &names[0], &file));
+  TEST_ASSERT_EQUAL_UINT64(0, file_cache_enter(nullptr));
+  file_cache_leave(nullptr, 0);
+  TEST_ASSERT_EQUAL_size_t(0, file_cache_available(nullptr));
+}
+
+static void test_load_and_get(void) {
+  file_t file;
+  TEST_ASSERT_FALSE(file_cache_get(cache, &names[0], &file));
+  TEST_ASSERT_EQUAL_size_t(BUDGET, file_cache_available(cache));
+
+  TEST_ASSERT_EQUAL_INT(0, file_cache_load(cache, nullptr, &names[0], &file));
+  TEST_ASSERT_TRUE(holds(file, 'a', FILE_SIZE));
+  // The data is NUL terminated, after the path.
+  TEST_ASSERT_EQUAL_UINT(0, file.data[FILE_SIZE]);
+  size_t used = file_cache_used(cache);
+  TEST_ASSERT_GREATER_OR_EQUAL(FILE_SIZE + names[0].length + 2, used);
+  TEST_ASSERT_EQUAL_size_t(BUDGET - used, file_cache_available(cache));
+
+  file_t again;
+  TEST_ASSERT_TRUE(file_cache_get(cache, &names[0], &again));
+  TEST_ASSERT_EQUAL_PTR(file.data, again.data);
+  TEST_ASSERT_EQUAL_INT(-EEXIST,
+                        file_cache_load(cache, nullptr, &names[0], &file));
+  TEST_ASSERT_EQUAL_size_t(used, file_cache_used(cache));
+
+  // A path is its own key, however similar.
+  string_t prefix = {.data = paths[0], .length = names[0].length - 1};
+  TEST_ASSERT_FALSE(file_cache_get(cache, &prefix, &file));
+}
+
+static void test_load_refused(void) {
+  file_t file;
+  char missing[160];
+  (void)snprintf(missing, sizeof(missing), "%s/missing", directory);
+  string_t missing_name = {.data = missing, .length = strlen(missing)};
+  TEST_ASSERT_EQUAL_INT(
+      -ENOENT, file_cache_load(cache, nullptr, &missing_name, &file));
+
+  string_t dir_name = {.data = directory, .length = strlen(directory)};
+  TEST_ASSERT_EQUAL_INT(-EINVAL,
+                        file_cache_load(cache, nullptr, &dir_name, &file));
+
+  for (int i = 0; i < FILE_COUNT - 1; i++) {
+    TEST_ASSERT_EQUAL_INT(0,
+                          file_cache_load(cache, nullptr, &names[i], &file));
+  }
+  TEST_ASSERT_EQUAL_INT(
+      -ENOSPC, file_cache_load(cache, nullptr, &names[FILE_COUNT - 1], &file));
+  TEST_ASSERT_TRUE(file_cache_used(cache) <= BUDGET);
+}
+
+static void test_stale(void) {
+  file_t file;
+  for (int i = 0; i < 3; i++) {
+    TEST_ASSERT_EQUAL_INT(0,
+                          file_cache_load(cache, nullptr, &names[i], &file));
+  }
+
+  // A new size.
+  write_file(0, 'x', FILE_SIZE / 2);
+  TEST_ASSERT_FALSE(file_cache_get(cache, &names[0], &file));
+  TEST_ASSERT_EQUAL_INT(0, file_cache_load(cache, nullptr, &names[0], &file));
+  TEST_ASSERT_TRUE(holds(file, 'x', FILE_SIZE / 2));
+  TEST_ASSERT_TRUE(file_cache_get(cache, &names[0], &file));
+  TEST_ASSERT_TRUE(holds(file, 'x', FILE_SIZE / 2));
+
+  // The same size with a new modification time.
+  write_file(1, 'y', FILE_SIZE);
+  struct timespec times[2] = {{.tv_nsec = UTIME_OMIT}, {.tv_sec = 12345}};
+  TEST_ASSERT_EQUAL_INT(0, utimensat(AT_FDCWD, paths[1], times, 0));
+  TEST_ASSERT_FALSE(file_cache_get(cache, &names[1], &file));
+
+  // Replaced by another file of the same size and time.
+  TEST_ASSERT_EQUAL_INT(0, utimensat(AT_FDCWD, paths[2], times, 0));
+  TEST_ASSERT_EQUAL_INT(0, file_cache_load(cache, nullptr, &names[1], &file));
+  TEST_ASSERT_EQUAL_INT(0, rename(paths[2], paths[1]));
+  TEST_ASSERT_FALSE(file_cache_get(cache, &names[1], &file));
+
+  // Removed.
+  TEST_ASSERT_FALSE(file_cache_get(cache, &names[2], &file));
+}
+
+static void test_compaction(void) {
+  file_t file;
+  for (int i = 0; i < FILE_COUNT - 1; i++) {
+    TEST_ASSERT_EQUAL_INT(0,
+                          file_cache_load(cache, nullptr, &names[i], &file));
+  }
+  size_t full = file_cache_used(cache);
+  file_t held;
+  TEST_ASSERT_TRUE(file_cache_get(cache, &names[4], &held));
+
+  // Two stale entries are over a quarter of the heap, so running out of
+  // space starts a compaction.
+  write_file(0, 'x', 1);
+  write_file(1, 'x', 1);
+  TEST_ASSERT_FALSE(file_cache_get(cache, &names[0], &file));
+  TEST_ASSERT_FALSE(file_cache_get(cache, &names[1], &file));
+  TEST_ASSERT_EQUAL_INT(
+      -ENOSPC, file_cache_load(cache, nullptr, &names[FILE_COUNT - 1], &file));
+
+  // It waits for the pin: entries are unreachable but stay in place.
+  TEST_ASSERT_FALSE(file_cache_get(cache, &names[2], &file));
+  TEST_ASSERT_EQUAL_INT(-EBUSY,
+                        file_cache_load(cache, nullptr, &names[0], &file));
+  TEST_ASSERT_EQUAL_size_t(full, file_cache_used(cache));
+  TEST_ASSERT_TRUE(holds(held, 'e', FILE_SIZE));
+
+  file_cache_leave(cache, pin);
+  pin = file_cache_enter(cache);
+  TEST_ASSERT_LESS_THAN(full, file_cache_used(cache));
+
+  // The live entries moved, and the freed room takes new ones.
+  for (int i = 2; i < FILE_COUNT - 1; i++) {
+    TEST_ASSERT_TRUE(file_cache_get(cache, &names[i], &file));
+    TEST_ASSERT_TRUE(holds(file, (char)('a' + i), FILE_SIZE));
+  }
+  TEST_ASSERT_EQUAL_INT(
+      0, file_cache_load(cache, nullptr, &names[FILE_COUNT - 1], &file));
+  TEST_ASSERT_TRUE(holds(file, 'f', FILE_SIZE));
+  TEST_ASSERT_EQUAL_INT(0, file_cache_load(cache, nullptr, &names[0], &file));
+  TEST_ASSERT_TRUE(holds(file, 'x', 1));
+}
+
+static void test_snapshot(void) {
+  file_t file;
+  for (int i = 0; i < 3; i++) {
+    TEST_ASSERT_EQUAL_INT(0,
+                          file_cache_load(cache, nullptr, &names[i], &file));
+  }
+  // Loading counts as a hit.
+  for (int i = 0; i < 4; i++) {
+    TEST_ASSERT_TRUE(file_cache_get(cache, &names[1], &file));
+  }
+  TEST_ASSERT_TRUE(file_cache_get(cache, &names[2], &file));
+
+  char snapshot[160];
+  (void)snprintf(snapshot, sizeof(snapshot), "%s/hot", directory);
+  string_t root = {.data = directory, .length = strlen(directory)};
+  TEST_ASSERT_EQUAL_INT(0, file_cache_snapshot_write(cache, &root, snapshot));
+
+  char contents[128] = {};
+  FILE *in = fopen(snapshot, "r");
+  TEST_ASSERT_NOT_NULL(in);
+  (void)fread(contents, 1, sizeof(contents) - 1, in);
+  (void)fclose(in);
+  TEST_ASSERT_EQUAL_STRING("5\tfile1\n2\tfile2\n1\tfile0\n", contents);
+}
+
+int main(void) {
+  UNITY_BEGIN();
+  RUN_TEST(test_disabled);
+  RUN_TEST(test_load_and_get);
+  RUN_TEST(test_load_refused);
+  RUN_TEST(test_stale);
+  RUN_TEST(test_compaction);
+  RUN_TEST(test_snapshot);
+  return UNITY_END();
+}
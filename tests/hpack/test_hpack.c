@@ -0,0 +1,228 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "hpack.h"
+#include "string_utils.h"
+#include "unity.h"
+
+enum { MAX_FIELDS = 16 };
+
+static hpack_table_t table;
+static char scratch[1024];
+static hpack_header_t fields[MAX_FIELDS];
+
+void setUp(void) { hpack_table_init(&table); }
+void tearDown(void) {}
+
+static int decode(const uint8_t *block, size_t length) {
+  return hpack_decode(&table, block, length, scratch, sizeof(scratch), fields,
+                      MAX_FIELDS);
+}
+
+static void assert_field(size_t i, const char *name, const char *value) {
+  TEST_ASSERT_TRUE(sv_equal(fields[i].name, sv_from_cstr(name)));
+  TEST_ASSERT_TRUE(sv_equal(fields[i].value, sv_from_cstr(value)));
+}
+
+// Entry i of the dynamic table counted from the newest, as index 62 + i.
+static void assert_entry(size_t i, const char *name, const char *value) {
+  TEST_ASSERT_LESS_THAN(table.count, i);
+  const hpack_entry_t *entry = &table.entries[table.count - 1 - i];
+  TEST_ASSERT_EQUAL_size_t(strlen(name), entry->name_length);
+  TEST_ASSERT_EQUAL_size_t(strlen(value), entry->value_length);
+  TEST_ASSERT_EQUAL_MEMORY(name, table.storage + entry->offset,
+                           entry->name_length);
+  TEST_ASSERT_EQUAL_MEMORY(value,
+                           table.storage + entry->offset + entry->name_length,
+                           entry->value_length);
+}
+
+// RFC 7541, C.3.1: a request without Huffman coding.
+static void test_decode_literal(void) {
+  static const uint8_t block[] = {0x82, 0x86, 0x84, 0x41, 0x0f, 0x77, 0x77,
+                                  0x77, 0x2e, 0x65, 0x78, 0x61, 0x6d, 0x70,
+                                  0x6c, 0x65, 0x2e, 0x63, 0x6f, 0x6d};
+  TEST_ASSERT_EQUAL_INT(4, decode(block, sizeof(block)));
+  assert_field(0, ":method", "GET");
+  assert_field(1, ":scheme", "http");
+  assert_field(2, ":path", "/");
+  assert_field(3, ":authority", "www.example.com");
+  TEST_ASSERT_EQUAL_size_t(1, table.count);
+  TEST_ASSERT_EQUAL_size_t(57, table.size);
+}
+
+// RFC 7541, C.4: three requests with Huffman coding on one connection.
+static void test_decode_huffman_requests(void) {
+  static const uint8_t first[] = {0x82, 0x86, 0x84, 0x41, 0x8c, 0xf1, 0xe3,
+                                  0xc2, 0xe5, 0xf2, 0x3a, 0x6b, 0xa0, 0xab,
+                                  0x90, 0xf4, 0xff};
+  TEST_ASSERT_EQUAL_INT(4, decode(first, sizeof(first)));
+  assert_field(3, ":authority", "www.example.com");
+  TEST_ASSERT_EQUAL_size_t(57, table.size);
+
+  static const uint8_t second[] = {0x82, 0x86, 0x84, 0xbe, 0x58, 0x86,
+                                   0xa8, 0xeb, 0x10, 0x64, 0x9c, 0xbf};
+  TEST_ASSERT_EQUAL_INT(5, decode(second, sizeof(second)));
+  assert_field(3, ":authority", "www.example.com");
+  assert_field(4, "cache-control", "no-cache");
+  TEST_ASSERT_EQUAL_size_t(2, table.count);
+  TEST_ASSERT_EQUAL_size_t(110, table.size);
+
+  static const uint8_t third[] = {
+      0x82, 0x87, 0x85, 0xbf, 0x40, 0x88, 0x25, 0xa8, 0x49, 0xe9,
+      0x5b, 0xa9, 0x7d, 0x7f, 0x89, 0x25, 0xa8, 0x49, 0xe9, 0x5b,
+      0xb8, 0xe8, 0xb4, 0xbf};
+  TEST_ASSERT_EQUAL_INT(5, decode(third, sizeof(third)));
+  assert_field(1, ":scheme", "https");
+  assert_field(2, ":path", "/index.html");
+  assert_field(3, ":authority", "www.example.com");
+  assert_field(4, "custom-key", "custom-value");
+  TEST_ASSERT_EQUAL_size_t(3, table.count);
+  TEST_ASSERT_EQUAL_size_t(164, table.size);
+  assert_entry(0, "custom-key", "custom-value");
+  assert_entry(1, "cache-control", "no-cache");
+  assert_entry(2, ":authority", "www.example.com");
+}
+
+// RFC 7541, C.6: responses into a 256 byte table, evicting as they go.
+static void test_decode_huffman_eviction(void) {
+  table.max_size = 256;
+
+  static const uint8_t first[] = {
+      0x48, 0x82, 0x64, 0x02, 0x58, 0x85, 0xae, 0xc3, 0x77, 0x1a, 0x4b,
+      0x61, 0x96, 0xd0, 0x7a, 0xbe, 0x94, 0x10, 0x54, 0xd4, 0x44, 0xa8,
+      0x20, 0x05, 0x95, 0x04, 0x0b, 0x81, 0x66, 0xe0, 0x82, 0xa6, 0x2d,
+      0x1b, 0xff, 0x6e, 0x91, 0x9d, 0x29, 0xad, 0x17, 0x18, 0x63, 0xc7,
+      0x8f, 0x0b, 0x97, 0xc8, 0xe9, 0xae, 0x82, 0xae, 0x43, 0xd3};
+  TEST_ASSERT_EQUAL_INT(4, decode(first, sizeof(first)));
+  assert_field(0, ":status", "302");
+  assert_field(1, "cache-control", "private");
+  assert_field(2, "date", "Mon, 21 Oct 2013 20:13:21 GMT");
+  assert_field(3, "location", "https://www.example.com");
+  TEST_ASSERT_EQUAL_size_t(4, table.count);
+  TEST_ASSERT_EQUAL_size_t(222, table.size);
+
+  // ":status: 307" pushes ":status: 302" out.
+  static const uint8_t second[] = {0x48, 0x83, 0x64, 0x0e, 0xff,
+                                   0xc1, 0xc0, 0xbf};
+  TEST_ASSERT_EQUAL_INT(4, decode(second, sizeof(second)));
+  assert_field(0, ":status", "307");
+  assert_field(1, "cache-control", "private");
+  assert_field(2, "date", "Mon, 21 Oct 2013 20:13:21 GMT");
+  assert_field(3, "location", "https://www.example.com");
+  TEST_ASSERT_EQUAL_size_t(4, table.count);
+  TEST_ASSERT_EQUAL_size_t(222, table.size);
+  assert_entry(0, ":status", "307");
+  assert_entry(3, "cache-control", "private");
+
+  static const uint8_t third[] = {
+      0x88, 0xc1, 0x61, 0x96, 0xd0, 0x7a, 0xbe, 0x94, 0x10, 0x54, 0xd4,
+      0x44, 0xa8, 0x20, 0x05, 0x95, 0x04, 0x0b, 0x81, 0x66, 0xe0, 0x84,
+      0xa6, 0x2d, 0x1b, 0xff, 0xc0, 0x5a, 0x83, 0x9b, 0xd9, 0xab, 0x77,
+      0xad, 0x94, 0xe7, 0x82, 0x1d, 0xd7, 0xf2, 0xe6, 0xc7, 0xb3, 0x35,
+      0xdf, 0xdf, 0xcd, 0x5b, 0x39, 0x60, 0xd5, 0xaf, 0x27, 0x08, 0x7f,
+      0x36, 0x72, 0xc1, 0xab, 0x27, 0x0f, 0xb5, 0x29, 0x1f, 0x95, 0x87,
+      0x31, 0x60, 0x65, 0xc0, 0x03, 0xed, 0x4e, 0xe5, 0xb1, 0x06, 0x3d,
+      0x50, 0x07};
+  TEST_ASSERT_EQUAL_INT(6, decode(third, sizeof(third)));
+  assert_field(0, ":status", "200");
+  assert_field(1, "cache-control", "private");
+  assert_field(2, "date", "Mon, 21 Oct 2013 20:13:22 GMT");
+  assert_field(3, "location", "https://www.example.com");
+  assert_field(4, "content-encoding", "gzip");
+  assert_field(5, "set-cookie",
+               "foo=ASDJKHQKBZXOQWEOPIUAXQWEOIU; max-age=3600; version=1");
+  TEST_ASSERT_EQUAL_size_t(3, table.count);
+  TEST_ASSERT_EQUAL_size_t(215, table.size);
+  assert_entry(0, "set-cookie",
+               "foo=ASDJKHQKBZXOQWEOPIUAXQWEOIU; max-age=3600; version=1");
+  assert_entry(1, "content-encoding", "gzip");
+  assert_entry(2, "date", "Mon, 21 Oct 2013 20:13:22 GMT");
+}
+
+static void test_size_update(void) {
+  static const uint8_t first[] = {0x82, 0x86, 0x84, 0x41, 0x0f, 0x77, 0x77,
+                                  0x77, 0x2e, 0x65, 0x78, 0x61, 0x6d, 0x70,
+                                  0x6c, 0x65, 0x2e, 0x63, 0x6f, 0x6d};
+  TEST_ASSERT_EQUAL_INT(4, decode(first, sizeof(first)));
+
+  // Size 0 empties the table; the entry is gone for good.
+  static const uint8_t zero[] = {0x20, 0x82};
+  TEST_ASSERT_EQUAL_INT(1, decode(zero, sizeof(zero)));
+  TEST_ASSERT_EQUAL_size_t(0, table.count);
+  TEST_ASSERT_EQUAL_size_t(0, table.size);
+  static const uint8_t dynamic[] = {0xbe};
+  TEST_ASSERT_EQUAL_INT(-1, decode(dynamic, sizeof(dynamic)));
+
+  // Entries larger than the table are dropped, not an error.
+  hpack_table_init(&table);
+  static const uint8_t small[] = {0x3f, 0x0b}; // 42
+  TEST_ASSERT_EQUAL_INT(0, decode(small, sizeof(small)));
+  TEST_ASSERT_EQUAL_size_t(42, table.max_size);
+  TEST_ASSERT_EQUAL_INT(4, decode(first, sizeof(first)));
+  TEST_ASSERT_EQUAL_size_t(0, table.count);
+
+  // Raising it above SETTINGS_HEADER_TABLE_SIZE is a compression error.
+  static const uint8_t large[] = {0x3f, 0xe2, 0x1f}; // 4097
+  TEST_ASSERT_EQUAL_INT(-1, decode(large, sizeof(large)));
+}
+
+static void test_decode_errors(void) {
+  // Index 0 and indices past the tables.
+  static const uint8_t zero[] = {0x80};
+  TEST_ASSERT_EQUAL_INT(-1, decode(zero, sizeof(zero)));
+  static const uint8_t past[] = {0xbe};
+  TEST_ASSERT_EQUAL_INT(-1, decode(past, sizeof(past)));
+  // A size update after the first field.
+  static const uint8_t late[] = {0x82, 0x20};
+  TEST_ASSERT_EQUAL_INT(-1, decode(late, sizeof(late)));
+  // An integer and a string cut short.
+  static const uint8_t integer[] = {0xff, 0x80};
+  TEST_ASSERT_EQUAL_INT(-1, decode(integer, sizeof(integer)));
+  static const uint8_t string[] = {0x04, 0x03, 'a', 'b'};
+  TEST_ASSERT_EQUAL_INT(-1, decode(string, sizeof(string)));
+  // Huffman padding must be the EOS prefix: all ones, under 8 bits.
+  static const uint8_t padding[] = {0x04, 0x81, 0x00};
+  TEST_ASSERT_EQUAL_INT(-1, decode(padding, sizeof(padding)));
+  static const uint8_t long_padding[] = {0x04, 0x82, 0x1f, 0xff};
+  TEST_ASSERT_EQUAL_INT(-1, decode(long_padding, sizeof(long_padding)));
+  // More fields than the caller has room for.
+  static const uint8_t many[MAX_FIELDS + 1] = {
+      0x82, 0x82, 0x82, 0x82, 0x82, 0x82, 0x82, 0x82, 0x82,
+      0x82, 0x82, 0x82, 0x82, 0x82, 0x82, 0x82, 0x82};
+  TEST_ASSERT_EQUAL_INT(-1, decode(many, sizeof(many)));
+}
+
+static void test_encode_round_trip(void) {
+  uint8_t data[64];
+  hpack_block_t block = {.data = data, .capacity = sizeof(data)};
+  TEST_ASSERT_EQUAL_INT(0, hpack_encode_status(&block, 200));
+  TEST_ASSERT_EQUAL_size_t(1, block.length);
+  TEST_ASSERT_EQUAL_UINT(0x88, data[0]);
+  TEST_ASSERT_EQUAL_INT(0, hpack_encode_status(&block, 302));
+  TEST_ASSERT_EQUAL_INT(
+      0, hpack_encode_header(&block, HPACK_CONTENT_TYPE, SV_LIT("text/html")));
+  TEST_ASSERT_EQUAL_INT(-1, hpack_encode_status(&block, 1000));
+
+  TEST_ASSERT_EQUAL_INT(3, decode(data, block.length));
+  assert_field(0, ":status", "200");
+  assert_field(1, ":status", "302");
+  assert_field(2, "content-type", "text/html");
+  TEST_ASSERT_EQUAL_size_t(0, table.count);
+
+  // A full block fails instead of overrunning.
+  block = (hpack_block_t){.data = data, .capacity = 4};
+  TEST_ASSERT_EQUAL_INT(
+      -1, hpack_encode_header(&block, HPACK_CONTENT_TYPE, SV_LIT("text/html")));
+}
+
+int main(void) {
+  UNITY_BEGIN();
+  RUN_TEST(test_decode_literal);
+  RUN_TEST(test_decode_huffman_requests);
+  RUN_TEST(test_decode_huffman_eviction);
+  RUN_TEST(test_size_update);
+  RUN_TEST(test_decode_errors);
+  RUN_TEST(test_encode_round_trip);
+  return UNITY_END();
+}
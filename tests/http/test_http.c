@@ -0,0 +1,216 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "http.h"
+#include "string_utils.h"
+#include "unity.h"
+
+void setUp(void) {}
+void tearDown(void) {}
+
+static bool view_is(string_view_t view, const char *expected) {
+  return sv_equal(view, sv_from_cstr(expected));
+}
+
+static void test_parse_request(void) {
+  static const char raw[] = "GET /docs/a.html?x=1 HTTP/1.1\r\n"
+                            "Host: example.com\r\n"
+                            "Accept-Encoding:  gzip, br \r\n"
+                            "X-Custom: yes\r\n"
+                            "\r\n"
+                            "body";
+  http_request_t request;
+  TEST_ASSERT_EQUAL_INT(0, parse_http(SV_LIT(raw), &request));
+
+  TEST_ASSERT_EQUAL_PTR(HTTP_TOKEN(GET), request.method);
+  TEST_ASSERT_TRUE(view_is(request.uri, "/docs/a.html?x=1"));
+  TEST_ASSERT_TRUE(view_is(request.path, "/docs/a.html"));
+  TEST_ASSERT_TRUE(view_is(request.query, "x=1"));
+  TEST_ASSERT_TRUE(view_is(request.version, "HTTP/1.1"));
+  TEST_ASSERT_EQUAL_size_t(3, request.header_count);
+  TEST_ASSERT_EQUAL_size_t(sizeof(raw) - 1 - 4, request.header_length);
+
+  const http_header_t *host = http_find_header(&request, HTTP_TOKEN(HOST));
+  TEST_ASSERT_NOT_NULL(host);
+  TEST_ASSERT_TRUE(view_is(host->value, "example.com"));
+  const http_header_t *coding =
+      http_find_header(&request, HTTP_TOKEN(ACCEPT_ENCODING));
+  TEST_ASSERT_NOT_NULL(coding);
+  TEST_ASSERT_TRUE(view_is(coding->value, "gzip, br"));
+  TEST_ASSERT_NULL(request.headers[2].token);
+}
+
+static void test_parse_request_bare_newlines(void) {
+  static const char raw[] = "HEAD / HTTP/1.0\nhost: a\n\n";
+  http_request_t request;
+  TEST_ASSERT_EQUAL_INT(0, parse_http(SV_LIT(raw), &request));
+  TEST_ASSERT_EQUAL_PTR(HTTP_TOKEN(HEAD), request.method);
+  TEST_ASSERT_EQUAL_size_t(0, request.query.length);
+  TEST_ASSERT_EQUAL_size_t(sizeof(raw) - 1, request.header_length);
+  // Names are interned case-insensitively.
+  TEST_ASSERT_EQUAL_PTR(HTTP_TOKEN(HOST), request.headers[0].token);
+}
+
+static void test_parse_request_unknown_method(void) {
+  http_request_t request;
+  TEST_ASSERT_EQUAL_INT(0,
+                        parse_http(SV_LIT("BREW /pot HTTP/1.1\r\n\r\n"),
+                                   &request));
+  TEST_ASSERT_NULL(request.method);
+  TEST_ASSERT_TRUE(view_is(request.method_name, "BREW"));
+}
+
+static void test_parse_request_malformed(void) {
+  http_request_t request;
+  // No header terminator yet.
+  TEST_ASSERT_EQUAL_INT(
+      -1, parse_http(SV_LIT("GET / HTTP/1.1\r\nHost: a\r\n"), &request));
+  // No URI.
+  TEST_ASSERT_EQUAL_INT(-1, parse_http(SV_LIT("GET\r\n\r\n"), &request));
+  // A header line without a name.
+  TEST_ASSERT_EQUAL_INT(
+      -1, parse_http(SV_LIT("GET / HTTP/1.1\r\n: a\r\n\r\n"), &request));
+  // A CR not followed by LF.
+  TEST_ASSERT_EQUAL_INT(-1,
+                        parse_http(SV_LIT("GET / HTTP/1.1\rX\n\n"), &request));
+  TEST_ASSERT_EQUAL_INT(-1, parse_http((string_view_t){}, &request));
+}
+
+// A request with count "X-N: N" headers.
+static size_t many_headers(char *buffer, size_t capacity, int count) {
+  size_t length = (size_t)snprintf(buffer, capacity, "GET / HTTP/1.1\r\n");
+  for (int i = 0; i < count; i++) {
+    length += (size_t)snprintf(buffer + length, capacity - length,
+                               "X-%d: %d\r\n", i, i);
+  }
+  length += (size_t)snprintf(buffer + length, capacity - length, "\r\n");
+  return length;
+}
+
+static void test_parse_request_header_limit(void) {
+  char buffer[2048];
+  http_request_t request;
+
+  size_t length = many_headers(buffer, sizeof(buffer), MAX_HEADERS);
+  TEST_ASSERT_EQUAL_INT(
+      0, parse_http((string_view_t){buffer, length}, &request));
+  TEST_ASSERT_EQUAL_size_t(MAX_HEADERS, request.header_count);
+
+  length = many_headers(buffer, sizeof(buffer), MAX_HEADERS + 1);
+  TEST_ASSERT_EQUAL_INT(
+      -E2BIG, parse_http((string_view_t){buffer, length}, &request));
+}
+
+static void test_parse_response(void) {
+  static const char raw[] = "HTTP/1.1 404 Not Found\r\n"
+                            "Content-Length: 9\r\n"
+                            "Transfer-Encoding: gzip, Chunked\r\n"
+                            "Connection: keep-alive, Upgrade\r\n"
+                            "\r\n"
+                            "Not Found";
+  http_response_t response;
+  TEST_ASSERT_EQUAL_INT(0, parse_http_response(SV_LIT(raw), &response));
+  TEST_ASSERT_EQUAL_INT(404, response.status);
+  TEST_ASSERT_TRUE(view_is(response.version, "HTTP/1.1"));
+  TEST_ASSERT_TRUE(view_is(response.status_line, "HTTP/1.1 404 Not Found"));
+  TEST_ASSERT_EQUAL_size_t(3, response.header_count);
+  TEST_ASSERT_EQUAL_size_t(sizeof(raw) - 1 - 9, response.header_length);
+
+  size_t length = 0;
+  TEST_ASSERT_EQUAL_INT(0, http_headers_content_length(
+                               response.headers, response.header_count,
+                               &length));
+  TEST_ASSERT_EQUAL_size_t(9, length);
+  TEST_ASSERT_TRUE(
+      http_headers_chunked(response.headers, response.header_count));
+  TEST_ASSERT_TRUE(http_headers_connection_has(
+      response.headers, response.header_count, SV_LIT("upgrade")));
+  TEST_ASSERT_FALSE(http_headers_connection_has(
+      response.headers, response.header_count, SV_LIT("close")));
+}
+
+static void test_parse_response_malformed(void) {
+  http_response_t response;
+  TEST_ASSERT_EQUAL_INT(
+      -1, parse_http_response(SV_LIT("HTTP/1.1 20 OK\r\n\r\n"), &response));
+  TEST_ASSERT_EQUAL_INT(
+      -1, parse_http_response(SV_LIT("HTTP/1.1 2x0 OK\r\n\r\n"), &response));
+  TEST_ASSERT_EQUAL_INT(
+      -1, parse_http_response(SV_LIT("ICY 200 OK\r\n\r\n"), &response));
+  TEST_ASSERT_EQUAL_INT(
+      -1, parse_http_response(SV_LIT("HTTP/1.1 200 OK\r\n"), &response));
+
+  char buffer[2048];
+  size_t length = (size_t)snprintf(buffer, sizeof(buffer),
+                                   "HTTP/1.1 200 OK\r\n");
+  for (int i = 0; i <= MAX_HEADERS; i++) {
+    length += (size_t)snprintf(buffer + length, sizeof(buffer) - length,
+                               "X-%d: %d\r\n", i, i);
+  }
+  length += (size_t)snprintf(buffer + length, sizeof(buffer) - length, "\r\n");
+  TEST_ASSERT_EQUAL_INT(-E2BIG, parse_http_response(
+                                    (string_view_t){buffer, length},
+                                    &response));
+}
+
+static void test_content_length(void) {
+  http_header_t header = {.name = SV_LIT("Content-Length"),
+                          .token = HTTP_TOKEN(CONTENT_LENGTH)};
+  size_t length = 0;
+
+  TEST_ASSERT_EQUAL_INT(1, http_headers_content_length(&header, 0, &length));
+  header.value = SV_LIT("12x");
+  TEST_ASSERT_EQUAL_INT(-1, http_headers_content_length(&header, 1, &length));
+  header.value = (string_view_t){};
+  TEST_ASSERT_EQUAL_INT(-1, http_headers_content_length(&header, 1, &length));
+  header.value = SV_LIT("1048576");
+  TEST_ASSERT_EQUAL_INT(0, http_headers_content_length(&header, 1, &length));
+  TEST_ASSERT_EQUAL_size_t(1048576, length);
+}
+
+static void test_accepts_coding(void) {
+  string_view_t gzip = SV_LIT("gzip");
+  TEST_ASSERT_TRUE(http_accepts_coding(SV_LIT("gzip"), gzip));
+  TEST_ASSERT_TRUE(http_accepts_coding(SV_LIT("br, GZIP"), gzip));
+  TEST_ASSERT_TRUE(http_accepts_coding(SV_LIT("deflate, gzip;q=0.5"), gzip));
+  TEST_ASSERT_TRUE(http_accepts_coding(SV_LIT("gzip;q=1"), gzip));
+  TEST_ASSERT_TRUE(http_accepts_coding(SV_LIT("gzip; q=0.001"), gzip));
+
+  TEST_ASSERT_FALSE(http_accepts_coding(SV_LIT("gzip;q=0"), gzip));
+  TEST_ASSERT_FALSE(http_accepts_coding(SV_LIT("gzip; q=0.000"), gzip));
+  TEST_ASSERT_FALSE(http_accepts_coding(SV_LIT("br, gzip;q=0 , x"), gzip));
+  TEST_ASSERT_FALSE(http_accepts_coding(SV_LIT("x-gzip, br"), gzip));
+  TEST_ASSERT_FALSE(http_accepts_coding(SV_LIT("gzipped"), gzip));
+  TEST_ASSERT_FALSE(http_accepts_coding(SV_LIT(""), gzip));
+  TEST_ASSERT_FALSE(http_accepts_coding((string_view_t){}, gzip));
+}
+
+static void test_empty_views(void) {
+  string_view_t empty = {};
+  TEST_ASSERT_TRUE(sv_equal(empty, SV_LIT("")));
+  TEST_ASSERT_TRUE(sv_equal_nocase(empty, empty));
+  TEST_ASSERT_TRUE(sv_starts_with(SV_LIT("abc"), empty));
+  TEST_ASSERT_TRUE(sv_starts_with(empty, empty));
+  TEST_ASSERT_EQUAL_size_t(SV_NPOS, sv_find_char(empty, 'a'));
+  TEST_ASSERT_EQUAL_size_t(SV_NPOS, sv_find(empty, SV_LIT("a")));
+  TEST_ASSERT_EQUAL_size_t(0, sv_trim(empty).length);
+  TEST_ASSERT_EQUAL_size_t(0, sv_slice(empty, 3, 4).length);
+  TEST_ASSERT_NULL(http_intern_header(empty));
+  TEST_ASSERT_NULL(http_intern_method(empty));
+}
+
+int main(void) {
+  UNITY_BEGIN();
+  RUN_TEST(test_parse_request);
+  RUN_TEST(test_parse_request_bare_newlines);
+  RUN_TEST(test_parse_request_unknown_method);
+  RUN_TEST(test_parse_request_malformed);
+  RUN_TEST(test_parse_request_header_limit);
+  RUN_TEST(test_parse_response);
+  RUN_TEST(test_parse_response_malformed);
+  RUN_TEST(test_content_length);
+  RUN_TEST(test_accepts_coding);
+  RUN_TEST(test_empty_views);
+  return UNITY_END();
+}
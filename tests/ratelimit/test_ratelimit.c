@@ -0,0 +1,149 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+
+#include "ratelimit.h"
+#include "unity.h"
+
+enum {
+  // Four times the table, so every probe window fills and evicts.
+  FLOOD = 4 * RATELIMIT_SHARDS * RATELIMIT_SHARD_SLOTS,
+};
+
+static ratelimit_t *limiter;
+
+void setUp(void) { limiter = nullptr; }
+void tearDown(void) { ratelimit_destroy(limiter); }
+
+static struct sockaddr_storage ipv4(uint32_t address) {
+  struct sockaddr_storage peer = {};
+  struct sockaddr_in *in = (struct sockaddr_in *)&peer;
+  in->sin_family = AF_INET;
+  in->sin_addr.s_addr = htonl(address);
+  return peer;
+}
+
+static struct sockaddr_storage ipv6(const char *text) {
+  struct sockaddr_storage peer = {};
+  struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)&peer;
+  in6->sin6_family = AF_INET6;
+  TEST_ASSERT_EQUAL_INT(1, inet_pton(AF_INET6, text, &in6->sin6_addr));
+  return peer;
+}
+
+static void sleep_ms(long ms) {
+  struct timespec delay = {.tv_sec = ms / 1000,
+                           .tv_nsec = ms % 1000 * 1000000};
+  (void)nanosleep(&delay, nullptr);
+}
+
+// How many of count attempts in a row are allowed.
+static int allowed(const struct sockaddr_storage *peer, int count) {
+  int total = 0;
+  for (int i = 0; i < count; i++) {
+    total += ratelimit_allow(limiter, peer);
+  }
+  return total;
+}
+
+static void test_invalid(void) {
+  TEST_ASSERT_NULL(ratelimit_create(0, 1, false));
+  TEST_ASSERT_NULL(ratelimit_create(1, 0, false));
+  TEST_ASSERT_NULL(ratelimit_create(1, UINT32_MAX, false));
+
+  // No limiter, no limit.
+  struct sockaddr_storage peer = ipv4(0x0a000001);
+  TEST_ASSERT_TRUE(ratelimit_allow(nullptr, &peer));
+}
+
+static void test_burst(void) {
+  limiter = ratelimit_create(1, 5, false);
+  TEST_ASSERT_NOT_NULL(limiter);
+  struct sockaddr_storage peer = ipv4(0x0a000001);
+  TEST_ASSERT_EQUAL_INT(5, allowed(&peer, 10));
+
+  // Buckets are per client.
+  struct sockaddr_storage other = ipv4(0x0a000002);
+  TEST_ASSERT_EQUAL_INT(5, allowed(&other, 10));
+}
+
+static void test_refill(void) {
+  // A token every 50 ms.
+  limiter = ratelimit_create(20, 2, false);
+  TEST_ASSERT_NOT_NULL(limiter);
+  struct sockaddr_storage peer = ipv4(0xc0a80001);
+  TEST_ASSERT_EQUAL_INT(2, allowed(&peer, 3));
+
+  sleep_ms(75);
+  TEST_ASSERT_EQUAL_INT(1, allowed(&peer, 2));
+
+  // Idle time beyond the burst is not saved up.
+  sleep_ms(500);
+  TEST_ASSERT_EQUAL_INT(2, allowed(&peer, 4));
+}
+
+static void test_keys(void) {
+  limiter = ratelimit_create(1, 1, false);
+  TEST_ASSERT_NOT_NULL(limiter);
+
+  // A v4-mapped address is the IPv4 client.
+  struct sockaddr_storage v4 = ipv4(0xc0000201);
+  struct sockaddr_storage mapped = ipv6("::ffff:192.0.2.1");
+  TEST_ASSERT_TRUE(ratelimit_allow(limiter, &v4));
+  TEST_ASSERT_FALSE(ratelimit_allow(limiter, &mapped));
+
+  // IPv6 clients share their /64.
+  struct sockaddr_storage first = ipv6("2001:db8:1:2::1");
+  struct sockaddr_storage same = ipv6("2001:db8:1:2:ffff::9");
+  struct sockaddr_storage next = ipv6("2001:db8:1:3::1");
+  TEST_ASSERT_TRUE(ratelimit_allow(limiter, &first));
+  TEST_ASSERT_FALSE(ratelimit_allow(limiter, &same));
+  TEST_ASSERT_TRUE(ratelimit_allow(limiter, &next));
+
+  // The all-zero /64 still gets a bucket.
+  struct sockaddr_storage loopback = ipv6("::1");
+  TEST_ASSERT_EQUAL_INT(1, allowed(&loopback, 3));
+
+  // Unix sockets are never limited.
+  struct sockaddr_storage local = {.ss_family = AF_UNIX};
+  TEST_ASSERT_EQUAL_INT(3, allowed(&local, 3));
+}
+
+static void test_eviction(void) {
+  limiter = ratelimit_create(1, 1, false);
+  TEST_ASSERT_NOT_NULL(limiter);
+  struct sockaddr_storage victim = ipv4(0x0a000001);
+  TEST_ASSERT_TRUE(ratelimit_allow(limiter, &victim));
+  TEST_ASSERT_FALSE(ratelimit_allow(limiter, &victim));
+
+  // Many more clients than slots: each new one starts with a full bucket,
+  // and the longest idle entry, the victim, makes room for them.
+  sleep_ms(20);
+  for (uint32_t i = 0; i < FLOOD; i++) {
+    struct sockaddr_storage peer = ipv4(0x64000000 + i);
+    TEST_ASSERT_TRUE(ratelimit_allow(limiter, &peer));
+  }
+  TEST_ASSERT_TRUE(ratelimit_allow(limiter, &victim));
+}
+
+static void test_shared(void) {
+  limiter = ratelimit_create(1, 3, true);
+  TEST_ASSERT_NOT_NULL(limiter);
+  struct sockaddr_storage peer = ipv4(0x0a000001);
+  TEST_ASSERT_EQUAL_INT(3, allowed(&peer, 5));
+}
+
+int main(void) {
+  UNITY_BEGIN();
+  RUN_TEST(test_invalid);
+  RUN_TEST(test_burst);
+  RUN_TEST(test_refill);
+  RUN_TEST(test_keys);
+  RUN_TEST(test_eviction);
+  RUN_TEST(test_shared);
+  return UNITY_END();
+}
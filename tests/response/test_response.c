@@ -0,0 +1,162 @@
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "http.h"
+#include "response.h"
+#include "string_utils.h"
+#include "unity.h"
+
+enum {
+  CAPACITY = 256, // Small, so writes overflow it
+  OUTPUT_MAX = 8192,
+};
+
+static int fds[2];
+static char buffer[CAPACITY];
+static char output[OUTPUT_MAX];
+
+void setUp(void) {
+  TEST_ASSERT_EQUAL_INT(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+}
+
+void tearDown(void) {
+  if (fds[0] != -1) {
+    (void)close(fds[0]);
+  }
+  (void)close(fds[1]);
+}
+
+// Closes the server side and reads everything it sent.
+static string_view_t sent(void) {
+  (void)close(fds[0]);
+  fds[0] = -1;
+  size_t length = 0;
+  ssize_t got;
+  while ((got = read(fds[1], output + length, sizeof(output) - length)) > 0) {
+    length += (size_t)got;
+  }
+  return (string_view_t){output, length};
+}
+
+static http_request_t request_for(string_view_t raw) {
+  http_request_t request;
+  TEST_ASSERT_EQUAL_INT(0, parse_http(raw, &request));
+  return request;
+}
+
+static void test_chunked(void) {
+  http_request_t request =
+      request_for(SV_LIT("GET /gen HTTP/1.1\r\nHost: a\r\n\r\n"));
+  response_t response;
+  TEST_ASSERT_EQUAL_INT(
+      0, response_begin(&response, fds[0], &request, buffer, sizeof(buffer),
+                        SV_LIT("200 OK"), SV_LIT("X-A: b\r\n")));
+  TEST_ASSERT_TRUE(response.chunked);
+  TEST_ASSERT_EQUAL_INT(0, response_write(&response, "hello ", 6));
+  TEST_ASSERT_EQUAL_INT(0, response_write(&response, "world", 5));
+  TEST_ASSERT_EQUAL_INT(0, response_flush(&response));
+  // Flushing with nothing buffered sends no empty chunk, which would end
+  // the body.
+  TEST_ASSERT_EQUAL_INT(0, response_flush(&response));
+  TEST_ASSERT_EQUAL_INT(0, response_write(&response, "!", 1));
+  TEST_ASSERT_EQUAL_INT(0, response_end(&response));
+
+  TEST_ASSERT_TRUE(sv_equal(sent(), SV_LIT("HTTP/1.1 200 OK\r\n"
+                                           "Transfer-Encoding: chunked\r\n"
+                                           "Connection: close\r\n"
+                                           "X-A: b\r\n"
+                                           "\r\n"
+                                           "b\r\nhello world\r\n"
+                                           "1\r\n!\r\n"
+                                           "0\r\n\r\n")));
+}
+
+static void test_chunked_large_writes(void) {
+  http_request_t request =
+      request_for(SV_LIT("GET /gen HTTP/1.1\r\nHost: a\r\n\r\n"));
+  response_t response;
+  TEST_ASSERT_EQUAL_INT(
+      0, response_begin(&response, fds[0], &request, buffer, sizeof(buffer),
+                        SV_LIT("200 OK"), (string_view_t){}));
+
+  // Larger than the buffer: sent as one chunk with what was buffered.
+  char large[1000];
+  memset(large, 'x', sizeof(large));
+  TEST_ASSERT_EQUAL_INT(0, response_write(&response, "ab", 2));
+  TEST_ASSERT_EQUAL_INT(0, response_write(&response, large, sizeof(large)));
+  TEST_ASSERT_EQUAL_INT(0, response_end(&response));
+
+  string_view_t out = sent();
+  size_t body = sv_find(out, SV_LIT("\r\n\r\n")) + 4;
+  string_view_t rest = sv_slice(out, body, SV_NPOS);
+  TEST_ASSERT_TRUE(sv_starts_with(rest, SV_LIT("3ea\r\nab")));
+  rest = sv_slice(rest, 5 + 2 + sizeof(large), SV_NPOS);
+  TEST_ASSERT_TRUE(sv_equal(rest, SV_LIT("\r\n0\r\n\r\n")));
+}
+
+static void test_http10_unframed(void) {
+  http_request_t request = request_for(SV_LIT("GET /gen HTTP/1.0\r\n\r\n"));
+  response_t response;
+  TEST_ASSERT_EQUAL_INT(
+      0, response_begin(&response, fds[0], &request, buffer, sizeof(buffer),
+                        SV_LIT("200 OK"), (string_view_t){}));
+  TEST_ASSERT_FALSE(response.chunked);
+  TEST_ASSERT_EQUAL_INT(0, response_write(&response, "abc", 3));
+  TEST_ASSERT_EQUAL_INT(0, response_end(&response));
+
+  TEST_ASSERT_TRUE(sv_equal(sent(), SV_LIT("HTTP/1.0 200 OK\r\n\r\nabc")));
+}
+
+static void test_head_has_no_body(void) {
+  http_request_t request =
+      request_for(SV_LIT("HEAD /gen HTTP/1.1\r\nHost: a\r\n\r\n"));
+  response_t response;
+  TEST_ASSERT_EQUAL_INT(
+      0, response_begin(&response, fds[0], &request, buffer, sizeof(buffer),
+                        SV_LIT("200 OK"), (string_view_t){}));
+  TEST_ASSERT_EQUAL_INT(0, response_write(&response, "abc", 3));
+  TEST_ASSERT_EQUAL_INT(0, response_end(&response));
+
+  TEST_ASSERT_TRUE(sv_equal(sent(), SV_LIT("HTTP/1.1 200 OK\r\n"
+                                           "Transfer-Encoding: chunked\r\n"
+                                           "Connection: close\r\n"
+                                           "\r\n")));
+}
+
+static void test_head_too_large(void) {
+  http_request_t request =
+      request_for(SV_LIT("GET /gen HTTP/1.1\r\nHost: a\r\n\r\n"));
+  char headers[CAPACITY];
+  memset(headers, 'h', sizeof(headers));
+  response_t response;
+  TEST_ASSERT_EQUAL_INT(
+      -1, response_begin(&response, fds[0], &request, buffer, sizeof(buffer),
+                         SV_LIT("200 OK"),
+                         (string_view_t){headers, sizeof(headers)}));
+  TEST_ASSERT_EQUAL_INT(-1, response_write(&response, "abc", 3));
+  TEST_ASSERT_EQUAL_INT(-1, response_end(&response));
+}
+
+static void test_send_fixed_length(void) {
+  http_request_t request =
+      request_for(SV_LIT("GET /x HTTP/1.1\r\nHost: a\r\n\r\n"));
+  TEST_ASSERT_EQUAL_INT(
+      0, response_send(fds[0], &request, SV_LIT("404 Not Found"),
+                       (string_view_t){}, "gone", 4));
+  TEST_ASSERT_TRUE(sv_equal(sent(), SV_LIT("HTTP/1.1 404 Not Found\r\n"
+                                           "Content-Length: 4\r\n"
+                                           "\r\n"
+                                           "gone")));
+}
+
+int main(void) {
+  UNITY_BEGIN();
+  RUN_TEST(test_chunked);
+  RUN_TEST(test_chunked_large_writes);
+  RUN_TEST(test_http10_unframed);
+  RUN_TEST(test_head_has_no_body);
+  RUN_TEST(test_head_too_large);
+  RUN_TEST(test_send_fixed_length);
+  return UNITY_END();
+}
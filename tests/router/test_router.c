@@ -0,0 +1,257 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "router.h"
+#include "string_utils.h"
+#include "unity.h"
+
+static char directory[] = "/tmp/test_router.XXXXXX";
+static char routes_path[128];
+static string_t root;
+static server_config_t config;
+static router_t *router;
+
+static void write_routes(const char *rules) {
+  FILE *file = fopen(routes_path, "w");
+  TEST_ASSERT_NOT_NULL(file);
+  TEST_ASSERT_EQUAL_INT(0, fputs(rules, file) < 0);
+  TEST_ASSERT_EQUAL_INT(0, fclose(file));
+}
+
+void setUp(void) {
+  TEST_ASSERT_NOT_NULL(mkdtemp(strcpy(directory, "/tmp/test_router.XXXXXX")));
+  (void)snprintf(routes_path, sizeof(routes_path), "%s/routes", directory);
+  root = (string_t){.data = directory, .length = strlen(directory)};
+  config = (server_config_t){};
+  router = nullptr;
+}
+
+void tearDown(void) {
+  router_destroy(router);
+  (void)unlink(routes_path);
+  (void)rmdir(directory);
+}
+
+// The route for host and path in the current table, nullptr for none.
+static const route_t *match(const char *host, const char *path,
+                            string_view_t *rest) {
+  uint64_t pin;
+  const route_table_t *table = router_enter(router, &pin);
+  const route_t *route =
+      route_match(table, sv_from_cstr(host), sv_from_cstr(path), rest);
+  router_leave(router, pin);
+  return route;
+}
+
+static void create_from(const char *rules) {
+  write_routes(rules);
+  config.routes_file = routes_path;
+  TEST_ASSERT_EQUAL_INT(0, router_create(&config, &root, nullptr, &router));
+}
+
+static void test_builtin(void) {
+  TEST_ASSERT_EQUAL_INT(0, router_create(&config, &root, nullptr, &router));
+  string_view_t rest;
+  const route_t *route = match("any.host", "/a/b.html", &rest);
+  TEST_ASSERT_NOT_NULL(route);
+  TEST_ASSERT_EQUAL_INT(ROUTE_STATIC, route->action);
+  TEST_ASSERT_EQUAL_STRING(directory, route->root.data);
+  TEST_ASSERT_TRUE(sv_equal(rest, SV_LIT("a/b.html")));
+  // Without a file there is nothing to reload.
+  TEST_ASSERT_EQUAL_INT(0, router_reload(router));
+}
+
+static void test_longest_prefix(void) {
+  create_from("# Comments and blank lines are skipped\n"
+              "\n"
+              "*  /        fixed 200 root\n"
+              "*  /api     fixed 200 api\n"
+              "*  /api/v2  fixed 200 v2\n"
+              "*  /a       fixed 200 a\n"
+              "*  /docs/   fixed 200 docs\n");
+  string_view_t rest;
+  const route_t *route = match("", "/api/v2/users", &rest);
+  TEST_ASSERT_NOT_NULL(route);
+  TEST_ASSERT_TRUE(sv_equal(route->body, SV_LIT("v2")));
+  TEST_ASSERT_TRUE(sv_equal(rest, SV_LIT("/users")));
+
+  route = match("", "/api/v1", &rest);
+  TEST_ASSERT_TRUE(sv_equal(route->body, SV_LIT("api")));
+  route = match("", "/api", &rest);
+  TEST_ASSERT_TRUE(sv_equal(route->body, SV_LIT("api")));
+  TEST_ASSERT_EQUAL_size_t(0, rest.length);
+
+  // Prefixes end at a '/': "/api" does not take "/apix", nor "/a" "/api2".
+  route = match("", "/apix", &rest);
+  TEST_ASSERT_TRUE(sv_equal(route->body, SV_LIT("root")));
+  route = match("", "/api2", &rest);
+  TEST_ASSERT_TRUE(sv_equal(route->body, SV_LIT("root")));
+  route = match("", "/a/x", &rest);
+  TEST_ASSERT_TRUE(sv_equal(route->body, SV_LIT("a")));
+
+  // A prefix ending in '/' takes everything below it.
+  route = match("", "/docs/x", &rest);
+  TEST_ASSERT_TRUE(sv_equal(route->body, SV_LIT("docs")));
+  TEST_ASSERT_TRUE(sv_equal(rest, SV_LIT("x")));
+  route = match("", "/docs", &rest);
+  TEST_ASSERT_TRUE(sv_equal(route->body, SV_LIT("root")));
+}
+
+static void test_actions(void) {
+  create_from("* /old redirect 301 https://example.com/new\n"
+              "* /health fixed 503 down for   maintenance \n");
+  string_view_t rest;
+  const route_t *route = match("", "/old/page", &rest);
+  TEST_ASSERT_NOT_NULL(route);
+  TEST_ASSERT_EQUAL_INT(ROUTE_REDIRECT, route->action);
+  TEST_ASSERT_EQUAL_INT(301, route->code);
+  TEST_ASSERT_TRUE(sv_starts_with(route->status, SV_LIT("301 ")));
+  TEST_ASSERT_TRUE(
+      sv_equal(route->location, SV_LIT("https://example.com/new")));
+  TEST_ASSERT_TRUE(sv_equal(route->headers,
+                            SV_LIT("Location: https://example.com/new\r\n")));
+
+  route = match("", "/health", &rest);
+  TEST_ASSERT_EQUAL_INT(ROUTE_FIXED, route->action);
+  TEST_ASSERT_EQUAL_INT(503, route->code);
+  TEST_ASSERT_TRUE(sv_equal(route->body, SV_LIT("down for   maintenance")));
+
+  // Nothing matches outside the rules.
+  TEST_ASSERT_NULL(match("", "/other", &rest));
+}
+
+static void test_static_policies(void) {
+  char rules[256];
+  (void)snprintf(rules, sizeof(rules),
+                 "* / static %s\n"
+                 "* /assets static %s nocache gzip max-age=60\n",
+                 directory, directory);
+  create_from(rules);
+  string_view_t rest;
+  const route_t *route = match("", "/index.html", &rest);
+  TEST_ASSERT_FALSE(route->nocache);
+  TEST_ASSERT_FALSE(route->gzip);
+  TEST_ASSERT_EQUAL_size_t(0, route->cache_control.length);
+
+  route = match("", "/assets/app.js", &rest);
+  TEST_ASSERT_EQUAL_INT(ROUTE_STATIC, route->action);
+  TEST_ASSERT_TRUE(route->nocache);
+  TEST_ASSERT_TRUE(route->gzip);
+  TEST_ASSERT_TRUE(sv_equal(route->cache_control, SV_LIT("max-age=60")));
+  TEST_ASSERT_TRUE(sv_equal(rest, SV_LIT("/app.js")));
+}
+
+static void test_hosts(void) {
+  create_from("*            /     fixed 200 any\n"
+              "*            /api  fixed 200 any-api\n"
+              "Example.COM  /     fixed 200 example\n"
+              "example.com  /app  fixed 200 example-app\n"
+              "other.org    /app  fixed 200 other-app\n");
+  string_view_t rest;
+  const route_t *route = match("example.com", "/app/x", &rest);
+  TEST_ASSERT_TRUE(sv_equal(route->body, SV_LIT("example-app")));
+  // Case, the port and a trailing dot do not matter.
+  route = match(" EXAMPLE.com.:8080", "/index.html", &rest);
+  TEST_ASSERT_TRUE(sv_equal(route->body, SV_LIT("example")));
+
+  // A Host with rules never falls back to the "*" ones.
+  route = match("example.com", "/api", &rest);
+  TEST_ASSERT_TRUE(sv_equal(route->body, SV_LIT("example")));
+  TEST_ASSERT_NULL(match("other.org", "/api", &rest));
+
+  // Unknown, missing and partial hosts take the "*" rules.
+  route = match("unknown.net", "/api/v1", &rest);
+  TEST_ASSERT_TRUE(sv_equal(route->body, SV_LIT("any-api")));
+  route = match("", "/x", &rest);
+  TEST_ASSERT_TRUE(sv_equal(route->body, SV_LIT("any")));
+  route = match("example.co", "/app", &rest);
+  TEST_ASSERT_TRUE(sv_equal(route->body, SV_LIT("any")));
+  route = match("www.example.com", "/app", &rest);
+  TEST_ASSERT_TRUE(sv_equal(route->body, SV_LIT("any")));
+}
+
+static void test_invalid_rules(void) {
+  static const char *const invalid[] = {
+      "* api fixed 200 x\n",             // Prefix without '/'
+      "* /x\n",                          // No action
+      "* /x teleport\n",                 // Unknown action
+      "* /x redirect 200 https://a/\n",  // Not a redirect status
+      "* /x redirect 301\n",             // No target
+      "* /x fixed 600\n",                // Not a status
+      "* /x proxy api\n",                // No such --proxy route
+      "* /x static /does/not/exist\n",   // No such directory
+  };
+  config.routes_file = routes_path;
+  for (size_t i = 0; i < sizeof(invalid) / sizeof(invalid[0]); i++) {
+    write_routes(invalid[i]);
+    TEST_ASSERT_NOT_EQUAL(0,
+                          router_create(&config, &root, nullptr, &router));
+    TEST_ASSERT_NULL(router);
+  }
+}
+
+static void test_reload(void) {
+  create_from("* / fixed 200 first\n");
+  string_view_t rest;
+
+  // A connection keeps the rules it started with.
+  uint64_t pin;
+  const route_table_t *held = router_enter(router, &pin);
+
+  write_routes("* / fixed 200 second\n* /new fixed 200 new\n");
+  TEST_ASSERT_EQUAL_INT(0, router_reload(router));
+  TEST_ASSERT_TRUE(sv_equal(match("", "/new", &rest)->body, SV_LIT("new")));
+  TEST_ASSERT_TRUE(
+      sv_equal(match("", "/x", &rest)->body, SV_LIT("second")));
+  TEST_ASSERT_TRUE(sv_equal(
+      route_match(held, SV_LIT(""), SV_LIT("/new"), &rest)->body,
+      SV_LIT("first")));
+  router_leave(router, pin);
+
+  // A broken file keeps the current rules.
+  write_routes("* / fixed 999\n");
+  TEST_ASSERT_NOT_EQUAL(0, router_reload(router));
+  TEST_ASSERT_TRUE(sv_equal(match("", "/new", &rest)->body, SV_LIT("new")));
+
+  // The released table is collected, so reloads go on indefinitely.
+  write_routes("* / fixed 200 third\n");
+  for (int i = 0; i < 2 * ROUTER_GENERATIONS; i++) {
+    TEST_ASSERT_EQUAL_INT(0, router_reload(router));
+  }
+  TEST_ASSERT_TRUE(sv_equal(match("", "/new", &rest)->body, SV_LIT("third")));
+}
+
+static void test_reload_busy(void) {
+  create_from("* / fixed 200 first\n");
+  uint64_t pins[ROUTER_GENERATIONS];
+  for (int i = 0; i < ROUTER_GENERATIONS - 1; i++) {
+    (void)router_enter(router, &pins[i]);
+    TEST_ASSERT_EQUAL_INT(0, router_reload(router));
+  }
+  (void)router_enter(router, &pins[ROUTER_GENERATIONS - 1]);
+  // Every generation is held: nowhere to put another table.
+  TEST_ASSERT_EQUAL_INT(-EBUSY, router_reload(router));
+
+  router_leave(router, pins[0]);
+  TEST_ASSERT_EQUAL_INT(0, router_reload(router));
+  for (int i = 1; i < ROUTER_GENERATIONS; i++) {
+    router_leave(router, pins[i]);
+  }
+}
+
+int main(void) {
+  UNITY_BEGIN();
+  RUN_TEST(test_builtin);
+  RUN_TEST(test_longest_prefix);
+  RUN_TEST(test_actions);
+  RUN_TEST(test_static_policies);
+  RUN_TEST(test_hosts);
+  RUN_TEST(test_invalid_rules);
+  RUN_TEST(test_reload);
+  RUN_TEST(test_reload_busy);
+  return UNITY_END();
+}
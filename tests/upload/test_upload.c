@@ -0,0 +1,236 @@
+#include <dirent.h>
+#include <ftw.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "http.h"
+#include "string_utils.h"
+#include "unity.h"
+#include "upload.h"
+#include "worker_memory.h"
+
+enum {
+  LIMIT = 64 * 1024,
+  LARGE = 3 * WORKER_BUFFER_SIZE, // Spliced, not buffered
+  REPLY_MAX = 256,
+};
+
+static char directory[] = "/tmp/test_upload.XXXXXX";
+static char route_spec[64];
+static server_config_t config;
+static uploads_t *uploads;
+static worker_memory_t *worker;
+static char reply[REPLY_MAX];
+
+void setUp(void) {
+  TEST_ASSERT_NOT_NULL(mkdtemp(strcpy(directory, "/tmp/test_upload.XXXXXX")));
+  (void)snprintf(route_spec, sizeof(route_spec), "/up=%s", directory);
+  config = (server_config_t){.upload_routes = {route_spec},
+                             .upload_route_count = 1,
+                             .upload_limit = LIMIT};
+  TEST_ASSERT_EQUAL_INT(0, uploads_create(&config, &uploads));
+  worker = worker_memory_create(0, &config);
+  TEST_ASSERT_NOT_NULL(worker);
+}
+
+static int remove_entry(const char *path, const struct stat *info, int type,
+                        struct FTW *walk) {
+  (void)info;
+  (void)type;
+  (void)walk;
+  return remove(path);
+}
+
+void tearDown(void) {
+  worker_memory_destroy(worker);
+  uploads_destroy(uploads);
+  (void)nftw(directory, remove_entry, 8, FTW_DEPTH | FTW_PHYS);
+}
+
+// Sends head and the first part of the body as already received, the rest
+// through a fresh socket, then ends the stream. Returns upload_receive()'s
+// result; the reply lands in reply.
+static int upload(const char *head, const char *early, const char *rest,
+                  size_t rest_length) {
+  char received[1024];
+  int length = snprintf(received, sizeof(received), "%s%s", head, early);
+  TEST_ASSERT_LESS_THAN((int)sizeof(received), length);
+
+  http_request_t request;
+  TEST_ASSERT_EQUAL_INT(
+      0, parse_http((string_view_t){received, (size_t)length}, &request));
+  upload_route_t *route = upload_match(uploads, request.path);
+  TEST_ASSERT_NOT_NULL(route);
+
+  int fds[2];
+  TEST_ASSERT_EQUAL_INT(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+  TEST_ASSERT_EQUAL_INT((ssize_t)rest_length,
+                        write(fds[1], rest, rest_length));
+  TEST_ASSERT_EQUAL_INT(0, shutdown(fds[1], SHUT_WR));
+  int rc = upload_receive(route, worker, fds[0], &request,
+                          (string_view_t){received, (size_t)length});
+
+  ssize_t got = read(fds[1], reply, sizeof(reply) - 1);
+  reply[got > 0 ? got : 0] = '\0';
+  (void)close(fds[0]);
+  (void)close(fds[1]);
+  return rc;
+}
+
+static bool replied(const char *status) {
+  return strncmp(reply, status, strlen(status)) == 0;
+}
+
+// Whether directory/name holds exactly expected.
+static bool stored(const char *name, const char *expected, size_t length) {
+  char path[256];
+  (void)snprintf(path, sizeof(path), "%s/%s", directory, name);
+  FILE *file = fopen(path, "rb");
+  if (file == nullptr) {
+    return false;
+  }
+  char *data = malloc(length + 1);
+  size_t got = fread(data, 1, length + 1, file);
+  bool same = got == length && memcmp(data, expected, length) == 0;
+  free(data);
+  (void)fclose(file);
+  return same;
+}
+
+// Whether the directory holds nothing, temporary files included.
+static bool directory_empty(void) {
+  DIR *dir = opendir(directory);
+  TEST_ASSERT_NOT_NULL(dir);
+  size_t entries = 0;
+  for (struct dirent *entry; (entry = readdir(dir)) != nullptr;) {
+    entries += strcmp(entry->d_name, ".") != 0 &&
+               strcmp(entry->d_name, "..") != 0;
+  }
+  (void)closedir(dir);
+  return entries == 0;
+}
+
+static void test_match(void) {
+  TEST_ASSERT_NOT_NULL(upload_match(uploads, SV_LIT("/up")));
+  TEST_ASSERT_NOT_NULL(upload_match(uploads, SV_LIT("/up/a/b")));
+  TEST_ASSERT_NULL(upload_match(uploads, SV_LIT("/upx")));
+  TEST_ASSERT_NULL(upload_match(uploads, SV_LIT("/")));
+  TEST_ASSERT_NULL(upload_match(nullptr, SV_LIT("/up/a")));
+}
+
+static void test_content_length(void) {
+  static char body[LARGE];
+  memset(body, 'c', sizeof(body));
+  memcpy(body, "early", 5);
+  char head[128];
+  (void)snprintf(head, sizeof(head),
+                 "PUT /up/dir/file.bin HTTP/1.1\r\n"
+                 "Content-Length: %d\r\n\r\n",
+                 LARGE);
+
+  TEST_ASSERT_EQUAL_INT(0, upload(head, "early", body + 5, LARGE - 5));
+  TEST_ASSERT_TRUE(replied("HTTP/1.0 201"));
+  TEST_ASSERT_TRUE(stored("dir/file.bin", body, sizeof(body)));
+}
+
+static void test_chunked(void) {
+  static char rest[LARGE + 256];
+  static char expected[LARGE + 16];
+  memset(expected, 'x', sizeof(expected));
+  memcpy(expected, "hello world", 11);
+
+  // The first chunk arrives with the head, a size line is cut in two, and
+  // the large chunk is spliced. Extensions and trailers are dropped.
+  int length = snprintf(rest, sizeof(rest), "\r\nworld\r\n%X;ext=1\r\n",
+                        (unsigned)(sizeof(expected) - 11));
+  memset(rest + length, 'x', sizeof(expected) - 11);
+  length += (int)(sizeof(expected) - 11);
+  length += snprintf(rest + length, sizeof(rest) - (size_t)length,
+                     "\r\n0\r\nX-Trailer: yes\r\n\r\n");
+
+  TEST_ASSERT_EQUAL_INT(0, upload("POST /up/chunked HTTP/1.1\r\n"
+                                  "Transfer-Encoding: chunked\r\n\r\n",
+                                  "6\r\nhello \r\n5", rest, (size_t)length));
+  TEST_ASSERT_TRUE(replied("HTTP/1.0 201"));
+  TEST_ASSERT_TRUE(stored("chunked", expected, sizeof(expected)));
+}
+
+static void test_chunked_empty(void) {
+  static const char rest[] = "0\r\n\r\n";
+  TEST_ASSERT_EQUAL_INT(0, upload("PUT /up/empty HTTP/1.1\r\n"
+                                  "Transfer-Encoding: chunked\r\n\r\n",
+                                  "", rest, sizeof(rest) - 1));
+  TEST_ASSERT_TRUE(replied("HTTP/1.0 201"));
+  TEST_ASSERT_TRUE(stored("empty", "", 0));
+}
+
+static void test_chunked_malformed(void) {
+  static const char rest[] = "zz\r\nabc\r\n0\r\n\r\n";
+  TEST_ASSERT_EQUAL_INT(-1, upload("PUT /up/bad HTTP/1.1\r\n"
+                                   "Transfer-Encoding: chunked\r\n\r\n",
+                                   "", rest, sizeof(rest) - 1));
+  TEST_ASSERT_TRUE(replied("HTTP/1.0 400"));
+  TEST_ASSERT_TRUE(directory_empty());
+
+  // Chunk data must be followed by its line ending.
+  static const char unterminated[] = "3\r\nabcd\r\n0\r\n\r\n";
+  TEST_ASSERT_EQUAL_INT(-1, upload("PUT /up/bad HTTP/1.1\r\n"
+                                   "Transfer-Encoding: chunked\r\n\r\n",
+                                   "", unterminated,
+                                   sizeof(unterminated) - 1));
+  TEST_ASSERT_TRUE(replied("HTTP/1.0 400"));
+  TEST_ASSERT_TRUE(directory_empty());
+}
+
+static void test_chunked_truncated(void) {
+  static const char rest[] = "10\r\nabc";
+  TEST_ASSERT_EQUAL_INT(-1, upload("PUT /up/cut HTTP/1.1\r\n"
+                                   "Transfer-Encoding: chunked\r\n\r\n",
+                                   "", rest, sizeof(rest) - 1));
+  TEST_ASSERT_FALSE(replied("HTTP/1.0 201"));
+  TEST_ASSERT_TRUE(directory_empty());
+}
+
+static void test_chunked_over_limit(void) {
+  char rest[64];
+  int length = snprintf(rest, sizeof(rest), "%X\r\n", LIMIT + 1);
+  TEST_ASSERT_EQUAL_INT(-1, upload("PUT /up/big HTTP/1.1\r\n"
+                                   "Transfer-Encoding: chunked\r\n\r\n",
+                                   "", rest, (size_t)length));
+  TEST_ASSERT_TRUE(replied("HTTP/1.0 413"));
+  TEST_ASSERT_TRUE(directory_empty());
+}
+
+static void test_refused(void) {
+  TEST_ASSERT_EQUAL_INT(-1, upload("PUT /up/x HTTP/1.1\r\n\r\n", "", "", 0));
+  TEST_ASSERT_TRUE(replied("HTTP/1.0 411"));
+
+  TEST_ASSERT_EQUAL_INT(-1, upload("PUT /up/x HTTP/1.1\r\n"
+                                   "Content-Length: 999999999\r\n\r\n",
+                                   "", "", 0));
+  TEST_ASSERT_TRUE(replied("HTTP/1.0 413"));
+
+  TEST_ASSERT_EQUAL_INT(-1, upload("PUT /up/a/../../x HTTP/1.1\r\n"
+                                   "Content-Length: 0\r\n\r\n",
+                                   "", "", 0));
+  TEST_ASSERT_TRUE(replied("HTTP/1.0 403"));
+  TEST_ASSERT_TRUE(directory_empty());
+}
+
+int main(void) {
+  UNITY_BEGIN();
+  RUN_TEST(test_match);
+  RUN_TEST(test_content_length);
+  RUN_TEST(test_chunked);
+  RUN_TEST(test_chunked_empty);
+  RUN_TEST(test_chunked_malformed);
+  RUN_TEST(test_chunked_truncated);
+  RUN_TEST(test_chunked_over_limit);
+  RUN_TEST(test_refused);
+  return UNITY_END();
+}